@@ -88,6 +88,11 @@ public:
                          uint8_t *buf, size_t bufLen);
     static void randomBytes(uint8_t *buf, size_t bufSize);
     
+    // Returns the current time in the same time base as the now
+    // parameter of timer callbacks
+    inline static EmiTimeInterval now() {
+        return [NSDate timeIntervalSinceReferenceDate];
+    }
     inline static Timer *makeTimer(dispatch_queue_t timerCookie) {
         return new Timer(timerCookie);
     }
@@ -115,6 +120,23 @@ public:
                                          __strong NSError*& err);
     static void extractLocalAddress(GCDAsyncUdpSocket *socket, sockaddr_storage& address);
     static void sendData(GCDAsyncUdpSocket *socket, const sockaddr_storage& address, const uint8_t *data, size_t size);
+    
+    // GCDAsyncUdpSocket does not expose IP_PKTINFO, so EmiUdpSocket
+    // opens one socket per network interface. The packet info
+    // functions are never called.
+    inline static bool packetInfoEnabled(dispatch_queue_t socketCookie) {
+        return false;
+    }
+    inline static void extractInboundAddress(GCDAsyncUdpSocket *socket, sockaddr_storage& address) {
+        extractLocalAddress(socket, address);
+    }
+    inline static void sendDataFrom(GCDAsyncUdpSocket *socket,
+                                    const sockaddr_storage& fromAddress,
+                                    const sockaddr_storage& toAddress,
+                                    const uint8_t *data,
+                                    size_t size) {
+        sendData(socket, toAddress, data, size);
+    }
 };
 
 #endif
@@ -26,6 +26,8 @@ template<class SockDelegate, class ConnDelegate>
 class EmiSock;
 template<class SockDelegate, class ConnDelegate>
 class EmiConn;
+template<class Binding>
+class EmiCongestionControl;
 template<class SockDelegate>
 class EmiConnParams;
 template<class Binding>
@@ -41,6 +43,7 @@ public:
     
     typedef EmiBinding Binding;
     typedef EmiConnectionOpenedBlockWrapper *__strong ConnectionOpenedCallbackCookie;
+    typedef EmiCongestionControl<EmiBinding> CongestionControl;
     
     EmiSockDelegate(EmiSocket *socket);
     virtual ~EmiSockDelegate();
@@ -65,6 +68,9 @@ public:
     
     // This method will always be called from the socketqueue
     dispatch_queue_t getSocketCookie();
+    dispatch_queue_t getTimerCookie();
+    // Connections might run on their own queues
+    inline bool connectionsShareThread() const { return false; }
 };
 
 #endif
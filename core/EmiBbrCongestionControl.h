@@ -0,0 +1,584 @@
+//
+//  EmiBbrCongestionControl.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2026-10-18.
+//  Copyright (c) 2026 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiBbrCongestionControl_h
+#define eminet_EmiBbrCongestionControl_h
+
+#include "EmiTypes.h"
+#include "EmiCongestionFeedback.h"
+#include "EmiPacketHeader.h"
+#include "EmiNetUtil.h"
+#include "EmiNetRandom.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+// The pacing and congestion window gain of the startup phase, 2/ln(2),
+// which doubles the sending rate each round trip
+#define EMI_BBR_HIGH_GAIN          (2.885f)
+// The gain of the congestion window after the startup phase
+#define EMI_BBR_CWND_GAIN          (2.0f)
+// The time a min RTT estimate is valid before it is probed again
+#define EMI_BBR_MIN_RTT_WINDOW     (10.0)
+// The time the congestion window is kept at its minimum when the
+// min RTT is probed
+#define EMI_BBR_PROBE_RTT_DURATION (0.2)
+// The bandwidth must grow by this factor for the pipe to be
+// considered not yet full during the startup phase
+#define EMI_BBR_FULL_BANDWIDTH_GROWTH (1.25f)
+// The startup phase ends when more than this fraction of the bytes
+// of a round trip are NAKed, and there are at least
+// EMI_BBR_STARTUP_FULL_LOSS_COUNT NAKs in the round trip
+#define EMI_BBR_STARTUP_LOSS_THRESHOLD (0.02f)
+#define EMI_BBR_STARTUP_FULL_LOSS_COUNT 8
+
+// This class implements a congestion control algorithm that is
+// modeled on BBR. Unlike EmiCongestionControl, it does not treat
+// loss as a sign of congestion, which makes it hold up on links
+// with random loss, like cellular links.
+//
+// It estimates the bottleneck bandwidth as the maximal delivery
+// rate of the last BANDWIDTH_FILTER_ROUNDS round trips, and the
+// round trip propagation time as the minimal RTT of the last
+// EMI_BBR_MIN_RTT_WINDOW seconds. The sending rate is the
+// bottleneck bandwidth times a pacing gain, and the data in flight
+// is limited to a multiple of the estimated bandwidth-delay product.
+//
+// The connection goes through the phases of BBR: The startup phase
+// doubles the sending rate each round trip until the bandwidth stops
+// growing, the drain phase then empties the queue that the startup
+// phase built up, and the connection then stays in the probe
+// bandwidth phase, where the pacing gain cycles through
+// GAIN_CYCLE_LENGTH phases of one min RTT each to probe for more
+// bandwidth. When the min RTT estimate gets too old, the congestion
+// window is cut to its minimum for EMI_BBR_PROBE_RTT_DURATION to
+// measure a new one.
+//
+// The delivery rate is measured with the packet ACKs. A packet ACK
+// is the newest packet that the other host has received, and ACKs
+// are sent at most once per tick, so the packets before the acked
+// one are counted as delivered too. If one of them is NAKed later,
+// it is moved from the delivered bytes to the lost bytes. NAKs of
+// packets in flight count them as lost, and a high loss rate ends
+// the startup phase. The packets that are in flight on an RTO
+// timeout are counted as lost too.
+//
+// The sending rate is enforced by EmiSendQueue, which averages the
+// tick allowance over a number of ticks. Bursts are bounded by the
+// congestion window.
+template<class Binding>
+class EmiBbrCongestionControl {
+    // The number of sent packets that are remembered. Packets that
+    // are sent when more than this many packets are in flight are
+    // counted as lost, but the ACKs are still processed correctly.
+    static const size_t NUM_PACKETS = 4096;
+    static const size_t BANDWIDTH_FILTER_ROUNDS = 10;
+    static const size_t GAIN_CYCLE_LENGTH = 8;
+    // The number of rounds without bandwidth growth after which the
+    // startup phase is done
+    static const size_t FULL_BANDWIDTH_ROUNDS = 3;
+    
+    typedef enum {
+        STATE_STARTUP,
+        STATE_DRAIN,
+        STATE_PROBE_BW,
+        STATE_PROBE_RTT
+    } State;
+    
+    struct Packet {
+        // -1 if the slot is unused, or if the packet has been acked,
+        // NAKed or counted as lost
+        EmiPacketSequenceNumber sequenceNumber;
+        // True if a newer packet has been acked. The packet is then
+        // counted as delivered, unless it is NAKed later.
+        bool                    skipped;
+        size_t                  size;
+        EmiTimeInterval         sendTime;
+        // The values of _delivered and _deliveredTime when the
+        // packet was sent
+        uint64_t                delivered;
+        EmiTimeInterval         deliveredTime;
+    };
+    
+    // Private copy constructor and assignment operator
+    inline EmiBbrCongestionControl(const EmiBbrCongestionControl& other);
+    inline EmiBbrCongestionControl& operator=(const EmiBbrCongestionControl& other);
+    
+    EmiCongestionFeedback _feedback;
+    
+    // Allocated when the first packet is sent
+    Packet *_packets;
+    
+    // The total number of bytes that have been sent, delivered and
+    // lost. The bytes in flight are the difference.
+    uint64_t _sent;
+    uint64_t _delivered;
+    uint64_t _lost;
+    // The number of bytes and packets that have been NAKed in the
+    // current round trip, and the number of bytes that had been
+    // delivered when the round trip started
+    uint64_t _roundNakedBytes;
+    size_t _roundNaks;
+    uint64_t _roundStartDelivered;
+    // The time of the most recent delivery
+    EmiTimeInterval _deliveredTime;
+    
+    EmiPacketSequenceNumber _newestSentSN;
+    EmiPacketSequenceNumber _newestAckSN;
+    
+    // A round trip ends when a packet that was sent after the
+    // previous round trip ended is acked
+    uint64_t _roundCount;
+    uint64_t _nextRoundDelivered;
+    
+    // The maximal delivery rate of each of the recent rounds, in
+    // bytes per second, indexed by round count
+    float _bandwidthSamples[BANDWIDTH_FILTER_ROUNDS];
+    // The maximum of _bandwidthSamples. 0 if it is not known yet.
+    float _bandwidth;
+    
+    // -1 if it is not known yet
+    EmiTimeInterval _minRtt;
+    EmiTimeInterval _minRttTime;
+    
+    State _state;
+    float _pacingGain;
+    float _cwndGain;
+    size_t _congestionWindow;
+    // The congestion window from before an RTO timeout, which is
+    // restored when the first ACK after the timeout arrives. 0 when
+    // there has been no timeout since the last ACK.
+    size_t _priorCongestionWindow;
+    
+    // State of the startup phase
+    bool _filledPipe;
+    float _fullBandwidth;
+    size_t _fullBandwidthRounds;
+    
+    // State of the probe bandwidth phase
+    size_t _cycleIndex;
+    EmiTimeInterval _cycleStartTime;
+    
+    // State of the probe RTT phase. -1 until the data in flight
+    // has been drained to the minimal congestion window.
+    EmiTimeInterval _probeRttDoneTime;
+    
+    inline Packet& packet(EmiPacketSequenceNumber sequenceNumber) const {
+        return _packets[sequenceNumber & (NUM_PACKETS-1)];
+    }
+    
+    inline static size_t minCongestionWindow() {
+        return 4*EMI_MINIMAL_MTU;
+    }
+    
+    inline static size_t initialCongestionWindow() {
+        return 10*EMI_MINIMAL_MTU;
+    }
+    
+    static float cycleGain(size_t cycleIndex) {
+        switch (cycleIndex) {
+            case 0:  return 1.25f;
+            case 1:  return 0.75f;
+            default: return 1.0f;
+        }
+    }
+    
+    inline uint64_t bytesInFlight() const {
+        return _sent-_delivered-_lost;
+    }
+    
+    // The bandwidth-delay product times gain
+    uint64_t targetWindow(float gain) const {
+        if (0 == _bandwidth || -1 == _minRtt) {
+            return initialCongestionWindow();
+        }
+        
+        // The packets are sent once per tick, so the window must be
+        // large enough to keep a few ticks' worth of packets in flight
+        // on top of the bandwidth-delay product.
+        float quantum = std::max(_bandwidth*(float)EMI_TICK_TIME, (float)EMI_MINIMAL_MTU);
+        return (uint64_t)(gain*_bandwidth*_minRtt + 3*quantum);
+    }
+    
+    void enterStartup() {
+        _state = STATE_STARTUP;
+        _pacingGain = EMI_BBR_HIGH_GAIN;
+        _cwndGain = EMI_BBR_HIGH_GAIN;
+    }
+    
+    void enterProbeBandwidth(EmiTimeInterval now) {
+        _state = STATE_PROBE_BW;
+        _cwndGain = EMI_BBR_CWND_GAIN;
+        
+        // Start in a random phase other than the one that drains
+        // the queue, which follows the probing phase
+        _cycleIndex = GAIN_CYCLE_LENGTH-1-EmiNetRandom<Binding>::randomUniform(GAIN_CYCLE_LENGTH-1);
+        _cycleStartTime = now;
+        _pacingGain = cycleGain(_cycleIndex);
+    }
+    
+    // An expired min RTT is replaced by the next sample, so that
+    // the estimate follows path changes
+    void updateMinRtt(EmiTimeInterval now, EmiTimeInterval rtt, bool expired) {
+        if (-1 == _minRtt || rtt <= _minRtt || expired) {
+            _minRtt = rtt;
+            _minRttTime = now;
+        }
+    }
+    
+    // Ends the startup phase if too many of the packets of the round
+    // trip that just ended were NAKed. Random loss below the threshold
+    // doesn't end it, but congestion that overflows the queue of the
+    // bottleneck does, even when the bandwidth still seems to grow.
+    void checkStartupLoss() {
+        uint64_t roundDelivered = _delivered-_roundStartDelivered;
+        uint64_t roundBytes = roundDelivered+_roundNakedBytes;
+        
+        if (!_filledPipe &&
+            _roundNaks >= EMI_BBR_STARTUP_FULL_LOSS_COUNT &&
+            _roundNakedBytes > EMI_BBR_STARTUP_LOSS_THRESHOLD*roundBytes) {
+            _filledPipe = true;
+        }
+        
+        _roundNakedBytes = 0;
+        _roundNaks = 0;
+        _roundStartDelivered = _delivered;
+    }
+    
+    void updateBandwidth(EmiTimeInterval now, const Packet& acked) {
+        bool roundStart = false;
+        if (acked.delivered >= _nextRoundDelivered) {
+            _nextRoundDelivered = _delivered;
+            _roundCount++;
+            roundStart = true;
+            _bandwidthSamples[_roundCount % BANDWIDTH_FILTER_ROUNDS] = 0;
+            checkStartupLoss();
+        }
+        
+        // Samples that span less than the min RTT are not trusted;
+        // ACKs that arrive in a burst would make the rate too high.
+        // NAKs can make _delivered smaller than it was when the
+        // packet was sent.
+        EmiTimeInterval interval = now-acked.deliveredTime;
+        if (interval > 0 && (-1 == _minRtt || interval >= _minRtt) &&
+            _delivered > acked.delivered) {
+            float rate = (_delivered-acked.delivered)/interval;
+            float& sample(_bandwidthSamples[_roundCount % BANDWIDTH_FILTER_ROUNDS]);
+            sample = std::max(sample, rate);
+        }
+        
+        _bandwidth = *std::max_element(_bandwidthSamples, _bandwidthSamples+BANDWIDTH_FILTER_ROUNDS);
+        
+        if (roundStart && !_filledPipe && 0 != _bandwidth) {
+            if (_bandwidth >= _fullBandwidth*EMI_BBR_FULL_BANDWIDTH_GROWTH) {
+                _fullBandwidth = _bandwidth;
+                _fullBandwidthRounds = 0;
+            }
+            else if (++_fullBandwidthRounds >= FULL_BANDWIDTH_ROUNDS) {
+                _filledPipe = true;
+            }
+        }
+    }
+    
+    void updateState(EmiTimeInterval now, bool minRttExpired) {
+        if (STATE_STARTUP == _state && _filledPipe) {
+            _state = STATE_DRAIN;
+            _pacingGain = 1/EMI_BBR_HIGH_GAIN;
+            _cwndGain = EMI_BBR_HIGH_GAIN;
+        }
+        
+        if (STATE_DRAIN == _state && bytesInFlight() <= targetWindow(1)) {
+            enterProbeBandwidth(now);
+        }
+        
+        if (STATE_PROBE_BW == _state) {
+            // A phase lasts one min RTT, but the phase that drains
+            // the queue ends as soon as the queue is empty
+            bool advance = (now-_cycleStartTime > _minRtt ||
+                            (_pacingGain < 1 && bytesInFlight() <= targetWindow(1)));
+            if (advance) {
+                _cycleIndex = (_cycleIndex+1) % GAIN_CYCLE_LENGTH;
+                _cycleStartTime = now;
+                _pacingGain = cycleGain(_cycleIndex);
+            }
+        }
+        
+        if (STATE_PROBE_RTT != _state && minRttExpired) {
+            _state = STATE_PROBE_RTT;
+            _pacingGain = 1;
+            _cwndGain = 1;
+            _probeRttDoneTime = -1;
+        }
+        
+        if (STATE_PROBE_RTT == _state) {
+            if (-1 == _probeRttDoneTime) {
+                if (bytesInFlight() <= minCongestionWindow()) {
+                    _probeRttDoneTime = now+EMI_BBR_PROBE_RTT_DURATION;
+                }
+            }
+            else if (now >= _probeRttDoneTime) {
+                // The min RTT samples of the probe are fresh
+                _minRttTime = now;
+                
+                if (_filledPipe) {
+                    enterProbeBandwidth(now);
+                }
+                else {
+                    enterStartup();
+                }
+            }
+        }
+    }
+    
+    void updateCongestionWindow(uint64_t ackedBytes) {
+        uint64_t cwnd = _congestionWindow;
+        uint64_t target = targetWindow(_cwndGain);
+        
+        if (_filledPipe) {
+            cwnd = std::min(cwnd+ackedBytes, target);
+        }
+        else if (cwnd < target || _delivered < initialCongestionWindow()) {
+            cwnd += ackedBytes;
+        }
+        
+        cwnd = std::max(cwnd, (uint64_t)minCongestionWindow());
+        if (STATE_PROBE_RTT == _state) {
+            cwnd = std::min(cwnd, (uint64_t)minCongestionWindow());
+        }
+        
+        _congestionWindow = (size_t)std::min(cwnd, (uint64_t)EMI_MAX_CONGESTION_WINDOW);
+    }
+    
+    void onNak(EmiPacketSequenceNumber nak, EmiPacketSequenceNumber largestSNSoFar) {
+        if (!_packets ||
+            EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(nak, largestSNSoFar) > 0) {
+            // The NAK is for a packet that has not been sent
+            return;
+        }
+        
+        Packet& p(packet(nak));
+        if (nak != p.sequenceNumber) {
+            // The packet has been acked, NAKed or counted as lost
+            // already
+            return;
+        }
+        
+        if (p.skipped) {
+            // The packet was counted as delivered when a newer
+            // packet was acked
+            _delivered -= p.size;
+        }
+        _lost += p.size;
+        p.sequenceNumber = -1;
+        
+        _roundNakedBytes += p.size;
+        _roundNaks++;
+    }
+    
+    void onAck(EmiTimeInterval now, EmiPacketSequenceNumber ack) {
+        if (-1 == _newestSentSN ||
+            EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(ack, _newestAckSN) <= 0 ||
+            EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(ack, _newestSentSN) > 0) {
+            // The ACK is old, or bogus
+            return;
+        }
+        
+        // Mark the packets up to and including the acked one as
+        // delivered. The packets before the acked one are kept in
+        // the ring, so that they can be NAKed. Only the last
+        // NUM_PACKETS can be in the ring.
+        int32_t numAcked = EmiNetUtil::cyclicDifference<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(ack, _newestAckSN);
+        EmiPacketSequenceNumber sn = _newestAckSN;
+        if (numAcked > (int32_t)NUM_PACKETS) {
+            sn = (ack-NUM_PACKETS) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        }
+        
+        uint64_t deliveredBefore = _delivered;
+        while (sn != ack) {
+            sn = (sn+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            
+            Packet& p(packet(sn));
+            if (sn == p.sequenceNumber && !p.skipped) {
+                _delivered += p.size;
+                p.skipped = true;
+            }
+        }
+        _newestAckSN = ack;
+        
+        Packet& p(packet(ack));
+        if (ack != p.sequenceNumber) {
+            // The acked packet was counted as lost
+            return;
+        }
+        Packet acked(p);
+        p.sequenceNumber = -1;
+        _deliveredTime = now;
+        
+        bool minRttExpired = (-1 != _minRtt && now-_minRttTime > EMI_BBR_MIN_RTT_WINDOW);
+        updateMinRtt(now, now-acked.sendTime, minRttExpired);
+        updateBandwidth(now, acked);
+        updateState(now, minRttExpired);
+        updateCongestionWindow(_delivered-deliveredBefore);
+        
+        // The ACK shows that the path works again. The timeout was
+        // not necessarily caused by congestion, since BBR does not
+        // treat loss as a sign of it, so the window that the model
+        // had before is restored.
+        if (0 != _priorCongestionWindow && STATE_PROBE_RTT != _state) {
+            _congestionWindow = std::max(_congestionWindow, _priorCongestionWindow);
+        }
+        _priorCongestionWindow = 0;
+    }
+    
+public:
+    EmiBbrCongestionControl() :
+    _feedback(),
+    _packets(NULL),
+    _sent(0),
+    _delivered(0),
+    _lost(0),
+    _roundNakedBytes(0),
+    _roundNaks(0),
+    _roundStartDelivered(0),
+    _deliveredTime(-1),
+    _newestSentSN(-1),
+    _newestAckSN(-1),
+    _roundCount(0),
+    _nextRoundDelivered(0),
+    _bandwidth(0),
+    _minRtt(-1),
+    _minRttTime(0),
+    _state(STATE_STARTUP),
+    _pacingGain(EMI_BBR_HIGH_GAIN),
+    _cwndGain(EMI_BBR_HIGH_GAIN),
+    _congestionWindow(initialCongestionWindow()),
+    _priorCongestionWindow(0),
+    _filledPipe(false),
+    _fullBandwidth(0),
+    _fullBandwidthRounds(0),
+    _cycleIndex(0),
+    _cycleStartTime(0),
+    _probeRttDoneTime(-1) {
+        std::fill(_bandwidthSamples, _bandwidthSamples+BANDWIDTH_FILTER_ROUNDS, 0.0f);
+    }
+    
+    virtual ~EmiBbrCongestionControl() {
+        delete [] _packets;
+    }
+    
+    // The smoothed RTT is not used; the min RTT is measured with the
+    // send times of the acked packets instead, since it must not
+    // include queuing delay.
+    void gotPacket(EmiTimeInterval now, EmiTimeInterval,
+                   EmiPacketSequenceNumber largestSNSoFar,
+                   const EmiPacketHeader& packetHeader, size_t packetLength) {
+        _feedback.gotPacket(now, packetHeader, packetLength);
+        
+        if (packetHeader.flags & EMI_ACK_PACKET_FLAG) {
+            onAck(now, packetHeader.ack);
+        }
+        
+        if (packetHeader.flags & EMI_NAK_PACKET_FLAG) {
+            onNak(packetHeader.nak, largestSNSoFar);
+        }
+    }
+    
+    void onRto() {
+        // Count the packets in flight as lost, and start over from
+        // the minimal congestion window
+        if (_packets && -1 != _newestSentSN) {
+            EmiPacketSequenceNumber sn = _newestAckSN;
+            if (EmiNetUtil::cyclicDifference<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(_newestSentSN, sn) > (int32_t)NUM_PACKETS) {
+                sn = (_newestSentSN-NUM_PACKETS) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            }
+            while (sn != _newestSentSN) {
+                sn = (sn+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+                
+                Packet& p(packet(sn));
+                if (sn == p.sequenceNumber) {
+                    _lost += p.size;
+                    p.sequenceNumber = -1;
+                }
+            }
+        }
+        
+        _priorCongestionWindow = std::max(_priorCongestionWindow, _congestionWindow);
+        _congestionWindow = minCongestionWindow();
+    }
+    
+    void onDataSent(EmiPacketSequenceNumber sequenceNumber, size_t size) {
+        EmiTimeInterval now = Binding::now();
+        
+        if (!_packets) {
+            _packets = new Packet[NUM_PACKETS];
+            for (size_t i=0; i<NUM_PACKETS; i++) {
+                _packets[i].sequenceNumber = -1;
+            }
+        }
+        
+        if (-1 == _newestSentSN) {
+            _newestAckSN = ((sequenceNumber-1) & EMI_PACKET_SEQUENCE_NUMBER_MASK);
+        }
+        _newestSentSN = sequenceNumber;
+        
+        if (0 == bytesInFlight()) {
+            // Don't count the idle time as part of the delivery
+            // intervals
+            _deliveredTime = now;
+        }
+        
+        Packet& p(packet(sequenceNumber));
+        if (-1 != p.sequenceNumber && !p.skipped) {
+            // The slot is reused while its packet is in flight
+            _lost += p.size;
+        }
+        p.sequenceNumber = sequenceNumber;
+        p.skipped = false;
+        p.size = size;
+        p.sendTime = now;
+        p.delivered = _delivered;
+        p.deliveredTime = _deliveredTime;
+        
+        _sent += size;
+    }
+    
+    inline EmiPacketSequenceNumber ack() {
+        return _feedback.ack();
+    }
+    
+    inline float linkCapacity() const {
+        return _feedback.linkCapacity();
+    }
+    
+    inline float dataArrivalRate() const {
+        return _feedback.dataArrivalRate();
+    }
+    
+    // Returns the number of bytes we are allowed to send per tick.
+    size_t tickAllowance() const {
+        uint64_t inFlight = bytesInFlight();
+        if (inFlight >= _congestionWindow) {
+            return 0;
+        }
+        
+        size_t cwndAllowance = (size_t)(_congestionWindow-inFlight);
+        if (0 == _bandwidth) {
+            // We don't know the bandwidth yet, so only the
+            // congestion window limits the sending
+            return cwndAllowance;
+        }
+        
+        // The congestion window is not part of the allowance, since
+        // EmiSendQueue averages the allowance over several ticks. It
+        // is enforced by returning 0 above instead.
+        size_t rateAllowance = (size_t)(_pacingGain*_bandwidth*EMI_TICK_TIME);
+        return std::max(rateAllowance, (size_t)1);
+    }
+};
+
+#endif
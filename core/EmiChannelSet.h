@@ -0,0 +1,72 @@
+//
+//  EmiChannelSet.h
+//  eminet
+//
+
+#ifndef eminet_EmiChannelSet_h
+#define eminet_EmiChannelSet_h
+
+#include "EmiTypes.h"
+
+#include <stdint.h>
+#include <cstring>
+
+// A set of channel qualifiers, stored as a bitmask with one bit
+// for each possible EmiChannelQualifier.
+class EmiChannelSet {
+    static const size_t NUM_CHANNELS = 1 << (8*sizeof(EmiChannelQualifier));
+    static const size_t BITS_PER_WORD = 64;
+    static const size_t NUM_WORDS = NUM_CHANNELS/BITS_PER_WORD;
+    
+    uint64_t _words[NUM_WORDS];
+    
+public:
+    EmiChannelSet() {
+        clear();
+    }
+    
+    inline void clear() {
+        memset(_words, 0, sizeof(_words));
+    }
+    
+    inline bool empty() const {
+        for (size_t i=0; i<NUM_WORDS; i++) {
+            if (_words[i]) return false;
+        }
+        return true;
+    }
+    
+    inline bool contains(EmiChannelQualifier cq) const {
+        return (_words[cq/BITS_PER_WORD] >> (cq%BITS_PER_WORD)) & 1;
+    }
+    
+    inline void insert(EmiChannelQualifier cq) {
+        _words[cq/BITS_PER_WORD] |= 1ULL << (cq%BITS_PER_WORD);
+    }
+    
+    inline void erase(EmiChannelQualifier cq) {
+        _words[cq/BITS_PER_WORD] &= ~(1ULL << (cq%BITS_PER_WORD));
+    }
+    
+    // Returns the smallest channel qualifier in the set that is
+    // >= cq, or -1 if there is none. This makes it possible to
+    // iterate over the set with
+    //
+    //   for (int32_t cq = set.next(0); -1 != cq; cq = set.next(cq+1))
+    //
+    // which also works when cq is erased from the set in the loop.
+    inline int32_t next(int32_t cq) const {
+        for (size_t i=cq/BITS_PER_WORD; i<NUM_WORDS; i++) {
+            uint64_t word = _words[i];
+            if (i == cq/BITS_PER_WORD) {
+                word &= ~0ULL << (cq%BITS_PER_WORD);
+            }
+            if (word) {
+                return i*BITS_PER_WORD + __builtin_ctzll(word);
+            }
+        }
+        return -1;
+    }
+};
+
+#endif
@@ -9,8 +9,7 @@
 #ifndef eminet_EmiCongestionControl_h
 #define eminet_EmiCongestionControl_h
 
-#include "EmiLinkCapacity.h"
-#include "EmiDataArrivalRate.h"
+#include "EmiCongestionFeedback.h"
 #include "EmiPacketHeader.h"
 #include "EmiNetUtil.h"
 #include "EmiNetRandom.h"
@@ -27,8 +26,33 @@
 
 class EmiPacketHeader;
 
-// This class implements the main congestion control algorithm.
+// This class implements the default congestion control algorithm.
 // It is based on the design of UDT.
+//
+// The congestion control algorithm of a connection is chosen with
+// the SockDelegate::CongestionControl typedef; this class is what
+// the bindings use by default, and EmiBbrCongestionControl is an
+// alternative, which the POSIX binding uses when it is built with
+// EMI_POSIX_BBR.
+// A congestion control class must be default constructible and
+// implement these methods:
+//
+//   // Invoked for each packet that is received. rtt is the smoothed
+//   // RTT, or -1 if it is not known yet. largestSNSoFar is the
+//   // sequence number of the newest packet sent by this host.
+//   void gotPacket(EmiTimeInterval now, EmiTimeInterval rtt,
+//                  EmiPacketSequenceNumber largestSNSoFar,
+//                  const EmiPacketHeader& packetHeader, size_t packetLength);
+//   // Invoked on RTO timeouts
+//   void onRto();
+//   // Invoked for each packet that is sent
+//   void onDataSent(EmiPacketSequenceNumber sequenceNumber, size_t size);
+//   // The number of bytes that may be sent per tick
+//   size_t tickAllowance() const;
+//
+// It must also provide the ack, linkCapacity and dataArrivalRate
+// methods of EmiCongestionFeedback, which tell the other host about
+// the packets that this host receives.
 template<class Binding>
 class EmiCongestionControl {
     
@@ -37,8 +61,7 @@ class EmiCongestionControl {
     float  _sendingRate;
     size_t _totalDataSentInSlowStart;
     
-    EmiLinkCapacity    _linkCapacity;
-    EmiDataArrivalRate _dataArrivalRate;
+    EmiCongestionFeedback _feedback;
     
     float _avgPacketSize;
     
@@ -54,13 +77,17 @@ class EmiCongestionControl {
     // packet sending rate is decreased. Initially -1
     EmiPacketSequenceNumber _lastDecSeq;
     
+    // The NAK that caused the most recent rate decrease, or -1, and
+    // the state from before that decrease. If the other host reports
+    // the NAK as spurious, the decrease is undone.
+    EmiPacketSequenceNumber _undoNak;
+    float _undoSendingRate;
+    int _undoDecCount;
+    EmiPacketSequenceNumber _undoLastDecSeq;
+    
     EmiPacketSequenceNumber _newestSentSN;
     EmiPacketSequenceNumber _newestSeenAckSN;
     
-    // State for knowing which ACKs to send and when
-    EmiPacketSequenceNumber _newestSeenSN;
-    EmiPacketSequenceNumber _newestSentAckSN;
-    
     float _remoteLinkCapacity;
     float _remoteDataArrivalRate;
     
@@ -100,6 +127,13 @@ class EmiCongestionControl {
         }
     }
     
+    void saveUndoState(EmiPacketSequenceNumber nak) {
+        _undoNak = nak;
+        _undoSendingRate = _sendingRate;
+        _undoDecCount = _decCount;
+        _undoLastDecSeq = _lastDecSeq;
+    }
+    
     void onNak(EmiPacketSequenceNumber nak,
                EmiPacketSequenceNumber largestSNSoFar) {
         if (0 == _sendingRate) {
@@ -123,6 +157,7 @@ class EmiCongestionControl {
             if (nak > _lastDecSeq) {
                 // This NAK starts a new congestion period
                 
+                saveUndoState(nak);
                 _sendingRate /= SENDING_RATE_DECREASE;
                 
                 static const float SMOOTH = 0.125;
@@ -138,6 +173,7 @@ class EmiCongestionControl {
                     // The _decCount <= 5 ensures that the sending rate is not
                     // decreased by more than 50% per congestion period (1.125^6≈2)
                     
+                    saveUndoState(nak);
                     _sendingRate /= SENDING_RATE_DECREASE;
                     _decCount++;
                     _lastDecSeq = largestSNSoFar;
@@ -148,14 +184,26 @@ class EmiCongestionControl {
         }
     }
     
+    void onSpuriousNak(EmiPacketSequenceNumber nak) {
+        if (-1 == _undoNak || nak != _undoNak) {
+            // The NAK did not decrease the rate, or the decrease
+            // has already been superseded by a later one
+            return;
+        }
+        
+        _sendingRate = std::max(_sendingRate, _undoSendingRate);
+        _decCount = _undoDecCount;
+        _lastDecSeq = _undoLastDecSeq;
+        _undoNak = -1;
+    }
+    
 public:
     EmiCongestionControl() :
     _congestionWindow(EMI_MIN_CONGESTION_WINDOW),
     _sendingRate(0),
     _totalDataSentInSlowStart(0),
     
-    _linkCapacity(),
-    _dataArrivalRate(),
+    _feedback(),
     
     _avgPacketSize(-1),
     
@@ -165,12 +213,14 @@ public:
     _decCount(1),
     _lastDecSeq(-1),
     
+    _undoNak(-1),
+    _undoSendingRate(0),
+    _undoDecCount(0),
+    _undoLastDecSeq(-1),
+    
     _newestSentSN(-1),
     _newestSeenAckSN(-1),
     
-    _newestSeenSN(-1),
-    _newestSentAckSN(-1),
-    
     _remoteLinkCapacity(-1),
     _remoteDataArrivalRate(-1) {}
     
@@ -179,8 +229,7 @@ public:
                    const EmiPacketHeader& packetHeader, size_t packetLength) {
         static const float SMOOTH = 0.125;
         
-        _linkCapacity.gotPacket(now, packetHeader.sequenceNumber, packetLength);
-        _dataArrivalRate.gotPacket(now, packetLength);
+        _feedback.gotPacket(now, packetHeader, packetLength);
         
         if (packetHeader.flags & EMI_LINK_CAPACITY_PACKET_FLAG &&
             // Make sure we don't save bogus data
@@ -223,16 +272,8 @@ public:
             onNak(packetHeader.nak, largestSNSoFar);
         }
         
-        if (packetHeader.flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG) {
-            if (-1 == _newestSeenSN ||
-                EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(packetHeader.sequenceNumber, _newestSeenSN) > 0) {
-#if EMI_DEBUG_SEQUENCE_NUMBERS
-                ASSERT(-1 == _newestSeenSN ||
-                       EmiNetUtil::cyclicDifference24Signed(packetHeader.sequenceNumber,
-                                                            _newestSeenSN) < 100);
-#endif
-                _newestSeenSN = packetHeader.sequenceNumber;
-            }
+        if (packetHeader.extraFlags & EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG) {
+            onSpuriousNak(packetHeader.spuriousNak);
         }
     }
     
@@ -260,25 +301,16 @@ public:
         }
     }
     
-    // This method is intended to be called once per tick. It returns
-    // the newest seen sequence number, or -1 if no sequence number
-    // has been seen or if the newest sequence number seen has already
-    // been returned once by this method.
-    EmiPacketSequenceNumber ack() {
-        if (_newestSeenSN == _newestSentAckSN) {
-            return -1;
-        }
-        
-        _newestSentAckSN = _newestSeenSN;
-        return _newestSeenSN;
+    inline EmiPacketSequenceNumber ack() {
+        return _feedback.ack();
     }
     
     inline float linkCapacity() const {
-        return _linkCapacity.calculate();
+        return _feedback.linkCapacity();
     }
     
     inline float dataArrivalRate() const {
-        return _dataArrivalRate.calculate();
+        return _feedback.dataArrivalRate();
     }
     
     // Returns the number of bytes we are allowed to send per tick.
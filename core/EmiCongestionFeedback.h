@@ -0,0 +1,89 @@
+//
+//  EmiCongestionFeedback.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2026-10-18.
+//  Copyright (c) 2026 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiCongestionFeedback_h
+#define eminet_EmiCongestionFeedback_h
+
+#include "EmiTypes.h"
+#include "EmiLinkCapacity.h"
+#include "EmiDataArrivalRate.h"
+#include "EmiPacketHeader.h"
+#include "EmiNetUtil.h"
+
+#include <cstddef>
+
+// This class implements the receiver side of congestion control:
+// It measures the link capacity and the data arrival rate of the
+// packets that this host receives, and it keeps track of which
+// packet ACKs to send. The other host's congestion control uses
+// this information, regardless of which congestion control policy
+// this host uses.
+class EmiCongestionFeedback {
+    
+    EmiLinkCapacity    _linkCapacity;
+    EmiDataArrivalRate _dataArrivalRate;
+    
+    // State for knowing which ACKs to send and when
+    EmiPacketSequenceNumber _newestSeenSN;
+    EmiPacketSequenceNumber _newestSentAckSN;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiCongestionFeedback(const EmiCongestionFeedback& other);
+    inline EmiCongestionFeedback& operator=(const EmiCongestionFeedback& other);
+    
+public:
+    EmiCongestionFeedback() :
+    _linkCapacity(),
+    _dataArrivalRate(),
+    _newestSeenSN(-1),
+    _newestSentAckSN(-1) {}
+    
+    virtual ~EmiCongestionFeedback() {}
+    
+    void gotPacket(EmiTimeInterval now,
+                   const EmiPacketHeader& packetHeader, size_t packetLength) {
+        _linkCapacity.gotPacket(now, packetHeader.sequenceNumber, packetLength);
+        _dataArrivalRate.gotPacket(now, packetLength);
+        
+        if (packetHeader.flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG) {
+            if (-1 == _newestSeenSN ||
+                EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(packetHeader.sequenceNumber, _newestSeenSN) > 0) {
+#if EMI_DEBUG_SEQUENCE_NUMBERS
+                ASSERT(-1 == _newestSeenSN ||
+                       EmiNetUtil::cyclicDifference24Signed(packetHeader.sequenceNumber,
+                                                            _newestSeenSN) < 100);
+#endif
+                _newestSeenSN = packetHeader.sequenceNumber;
+            }
+        }
+    }
+    
+    // This method is intended to be called once per tick. It returns
+    // the newest seen sequence number, or -1 if no sequence number
+    // has been seen or if the newest sequence number seen has already
+    // been returned once by this method.
+    EmiPacketSequenceNumber ack() {
+        if (_newestSeenSN == _newestSentAckSN) {
+            return -1;
+        }
+        
+        _newestSentAckSN = _newestSeenSN;
+        return _newestSeenSN;
+    }
+    
+    inline float linkCapacity() const {
+        return _linkCapacity.calculate();
+    }
+    
+    inline float dataArrivalRate() const {
+        return _dataArrivalRate.calculate();
+    }
+};
+
+#endif
@@ -15,9 +15,13 @@
 #include "EmiSendQueue.h"
 #include "EmiLogicalConnection.h"
 #include "EmiMessage.h"
+#include "EmiMessagePool.h"
 #include "EmiCongestionControl.h"
+#include "EmiBbrCongestionControl.h"
+#include "EmiPathMtu.h"
 #include "EmiP2PData.h"
 #include "EmiConnTimers.h"
+#include "EmiTimerWheel.h"
 #include "EmiConnTime.h"
 #include "EmiConnParams.h"
 #include "EmiUdpSocket.h"
@@ -31,8 +35,10 @@ class EmiMessageHeader;
 template<class SockDelegate, class ConnDelegate>
 class EmiConn {
     typedef typename SockDelegate::Binding   Binding;
+    // The congestion control algorithm of the connection. See
+    // EmiCongestionControl for what it must implement.
+    typedef typename SockDelegate::CongestionControl CongestionControl;
     typedef typename Binding::Error          Error;
-    typedef typename Binding::TimerCookie    TimerCookie;
     typedef typename Binding::PersistentData PersistentData;
     typedef typename Binding::TemporaryData  TemporaryData;
     
@@ -43,6 +49,8 @@ class EmiConn {
     typedef EmiReceiverBuffer<SockDelegate, EmiConn>     ERB;
     typedef EmiSendQueue<SockDelegate, ConnDelegate>     ESQ;
     typedef EmiConnTimers<Binding, EmiConn>              ECT;
+    typedef EmiTimerWheel<Binding>                       TimerWheel;
+    typedef EmiWheelTimer<Binding>                       Timer;
     typedef EmiMessageHandler<EmiConn, EmiConn, Binding> EMH;
     typedef EmiLogicalConnection<SockDelegate, ConnDelegate, ERB> ELC;
     
@@ -64,16 +72,29 @@ class EmiConn {
     
     EmiP2PData        _p2p;
     EmiConnectionType _type;
+    // True if the other host has set EMI_EXTENSIONS_FLAG in its
+    // SYN or SYN-RST message
+    bool              _otherHostSupportsExtensions;
     
     ELC *_conn;
+    // Must be declared before _senderBuffer and _sendQueue, which
+    // hold messages from the pool until they are destroyed.
+    EmiMessagePool<Binding> _messagePool;
     EmiSenderBuffer<Binding> _senderBuffer;
     ERB _receiverBuffer;
+    // Must be declared before _sendQueue, which is initialized
+    // with its maximal MTU.
+    EmiPathMtu _pathMtu;
     ESQ _sendQueue;
     
-    EmiCongestionControl<Binding> _congestionControl;
+    CongestionControl _congestionControl;
     
-    ECT _timers;
-    typename Binding::Timer *_forceCloseTimer;
+    // The wheel is shared with the other connections of the EmiSock
+    // when the binding allows it. It must be declared before the
+    // timers, because they are initialized with it.
+    TimerWheel *_timerWheel;
+    ECT   _timers;
+    Timer _forceCloseTimer;
         
 private:
     // Private copy constructor and assignment operator
@@ -105,13 +126,20 @@ private:
         return _conn->enqueueCloseMessage(now, err);
     }
     
-    static void forceCloseTimeoutCallback(EmiTimeInterval now, typename Binding::Timer *timer, void *data) {
+    static void forceCloseTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiConn *conn = (EmiConn *)data;
-        Binding::freeTimer(timer);
-        conn->_forceCloseTimer = NULL;
         conn->forceClose(EMI_REASON_THIS_HOST_CLOSED);
     }
     
+    static TimerWheel *acquireTimerWheel(const EmiConnParams<Binding>& params, ConnDelegate& delegate) {
+        if (params.timerWheel) {
+            params.timerWheel->retain();
+            return params.timerWheel;
+        }
+        
+        return new TimerWheel(delegate.getTimerCookie());
+    }
+    
     inline bool shouldArtificiallyDropPacket() const {
         if (0 == config.fabricatedPacketDropRate) return false;
         
@@ -177,22 +205,25 @@ public:
     _socket(params.socket),
     _type(params.type),
     _p2p(params.p2p),
+    _otherHostSupportsExtensions(false),
     _senderBuffer(config_.senderBufferSize),
     _receiverBuffer(config_.receiverBufferSize, *this),
-    _sendQueue(*this, config_.mtu),
+    _pathMtu(config_.mtu, config_.maxMtu),
+    _sendQueue(*this, config_.mtu, _pathMtu.maxMtu()),
     _congestionControl(),
-    _timers(config_, _delegate.getTimerCookie(), *this),
-    _forceCloseTimer(NULL),
+    _timerWheel(acquireTimerWheel(params, _delegate)),
+    _timers(config_, *_timerWheel, *this),
+    _forceCloseTimer(*_timerWheel),
     config(config_) {
         EmiNetUtil::anyAddr(0, AF_INET, &_localAddress);
     }
     
     virtual ~EmiConn() {
-        if (_forceCloseTimer) {
-            Binding::freeTimer(_forceCloseTimer);
-        }
-        
         deleteELC(_conn);
+        
+        // The timers have references of their own to the wheel,
+        // so it stays alive until they have been destroyed.
+        _timerWheel->release();
     }
     
     // Invoked by EmiReceiverBuffer
@@ -270,15 +301,39 @@ public:
         }
         
         _timers.gotPacket(packetHeader, now);
-        _congestionControl.gotPacket(now, _timers.getTime().getRtt(),
-                                     _sendQueue.lastSentSequenceNumber(),
-                                     packetHeader, packetLength);
+        
+        // The congestion control doesn't get to see NAKs of path MTU
+        // probes, since they are lost when they are too large
+        bool probeWasNaked = (packetHeader.flags & EMI_NAK_PACKET_FLAG &&
+                              _pathMtu.isProbe(packetHeader.nak));
+        if (probeWasNaked) {
+            EmiPacketHeader headerWithoutNak(packetHeader);
+            headerWithoutNak.flags &= ~EMI_NAK_PACKET_FLAG;
+            _congestionControl.gotPacket(now, _timers.getTime().getRtt(),
+                                         _sendQueue.lastSentSequenceNumber(),
+                                         headerWithoutNak, packetLength);
+        }
+        else {
+            _congestionControl.gotPacket(now, _timers.getTime().getRtt(),
+                                         _sendQueue.lastSentSequenceNumber(),
+                                         packetHeader, packetLength);
+        }
         
         if (packetHeader.flags & EMI_RTT_REQUEST_PACKET_FLAG) {
             _sendQueue.enqueueRttResponse(packetHeader.sequenceNumber, now);
             _timers.ensureTickTimeout();
         }
         
+        if (packetHeader.flags & EMI_NAK_PACKET_FLAG && !probeWasNaked) {
+            // Retransmit the reliable messages of the lost packet
+            // right away instead of waiting for the RTO timeout
+            _sendQueue.packetLost(now, packetHeader.nak, *this);
+        }
+        
+        if (_pathMtu.gotPacket(packetHeader)) {
+            _sendQueue.setMtu(_pathMtu.mtu());
+        }
+        
         return true;
     }
     
@@ -289,6 +344,21 @@ public:
         }
     }
     
+    // Delegates to EmiSendQueue
+    void enqueueSack(EmiChannelQualifier channelQualifier) {
+        if (!_otherHostSupportsExtensions) {
+            return;
+        }
+        
+        _sendQueue.enqueueSack(channelQualifier);
+        _timers.ensureTickTimeout();
+    }
+    
+    // Delegates to EmiReceiverBuffer
+    inline size_t writeSackBlocks(EmiChannelQualifier channelQualifier, uint8_t *buf) const {
+        return _receiverBuffer.writeSackBlocks(channelQualifier, buf);
+    }
+    
     // Delegates to EmiSenderBuffer
     //
     // channelQualifier is int32_t to be able to contain -1, which
@@ -297,6 +367,20 @@ public:
                                     int32_t channelQualifier,
                                     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
         _senderBuffer.deregisterReliableMessages(channelQualifier, nonWrappingSequenceNumber);
+        deregisteredReliableMessages(now);
+    }
+    
+    // Delegates to EmiSenderBuffer. Used for selective acks.
+    void deregisterReliableMessages(EmiTimeInterval now,
+                                    int32_t channelQualifier,
+                                    EmiNonWrappingSequenceNumber first,
+                                    EmiNonWrappingSequenceNumber last) {
+        _senderBuffer.deregisterReliableMessages(channelQualifier, first, last);
+        deregisteredReliableMessages(now);
+    }
+    
+    void deregisteredReliableMessages(EmiTimeInterval now) {
+        _pathMtu.gotAck();
         
         // This will clear the rto timeout if the sender buffer is empty
         _timers.updateRtoTimeout();
@@ -372,12 +456,11 @@ public:
         // Set to 1 to stress test message split code. For maximum effect,
         // make sure to also disallow multiple messages per packet.
 #if 0
-        static const size_t MAX_MESSAGE_LENGTH = 1;
+        const size_t MAX_MESSAGE_LENGTH = 1;
 #else
-        static const size_t MAX_MESSAGE_LENGTH = (EMI_MINIMAL_MTU -
-                                                  EMI_UDP_HEADER_SIZE -
-                                                  EMI_PACKET_HEADER_MAX_LENGTH -
-                                                  EmiMessage<Binding>::maximalHeaderSize());
+        // The split size is based on the base MTU of the connection,
+        // so that the messages fit even if the path MTU shrinks
+        const size_t MAX_MESSAGE_LENGTH = _sendQueue.maximalMessageLength();
 #endif
         
         bool hasOwnershipOfDataObject = true;
@@ -403,24 +486,34 @@ public:
             return 0;
         }
         
+        // The message that holds the data object. The other
+        // fragments of a split message refer to its data.
+        EmiMessage<Binding> *dataOwner = NULL;
+        
         for (int i=0; i<numMessages; i++) {
-            EmiMessage<Binding> *msg;
+            EmiMessage<Binding> *msg = _messagePool.acquire();
             
-            if (data && 1 == numMessages) {
-                // Avoid copying data if we're not splitting the message
-                hasOwnershipOfDataObject = false;
-                msg = new EmiMessage<Binding>(*data);
+            size_t offset = i*MAX_MESSAGE_LENGTH;
+            size_t length = (i == numMessages-1 ? dataLength-offset : MAX_MESSAGE_LENGTH);
+            
+            if (!data) {
+                // There are no message contents
             }
-            else if (data) {
-                // We're splitting the message
-                size_t offset = i*MAX_MESSAGE_LENGTH;
-                PersistentData dataObj(Binding::makePersistentData(rawData + offset,
-                                                                   (i == numMessages-1 ? dataLength-offset : MAX_MESSAGE_LENGTH)));
-                msg = new EmiMessage<Binding>(dataObj);
+            else if (length <= EMI_MESSAGE_INLINE_DATA_SIZE) {
+                // Small messages are copied into the message object
+                msg->copyData(rawData + offset, length);
+            }
+            else if (!dataOwner) {
+                // Avoid copying the data; this message takes over
+                // the data object
+                hasOwnershipOfDataObject = false;
+                msg->setData(*data, offset, length);
+                dataOwner = msg;
             }
             else {
-                // There are no message contents to split
-                msg = new EmiMessage<Binding>;
+                // We're splitting the message. The fragment is a
+                // view into the data object.
+                msg->setDataView(dataOwner, offset, length);
             }
             
             msg->priority = priority;
@@ -452,10 +545,14 @@ public:
     
     // The first time this methods is called, it opens the EmiConnection and returns true.
     // Subsequent times it just resends the init message and returns false.
-    bool opened(const sockaddr_storage& inboundAddress, EmiTimeInterval now, EmiSequenceNumber otherHostInitialSequenceNumber) {
+    bool opened(const sockaddr_storage& inboundAddress,
+                EmiTimeInterval now,
+                EmiSequenceNumber otherHostInitialSequenceNumber,
+                bool otherHostSupportsExtensions) {
         ASSERT(EMI_CONNECTION_TYPE_SERVER == _type);
         
         _localAddress = inboundAddress;
+        _otherHostSupportsExtensions = otherHostSupportsExtensions;
         
         if (_conn) {
             // sendInitMessage should not fail, because it can only
@@ -535,10 +632,26 @@ public:
         // it is already in the sender buffer and shouldn't be reinserted anyway
         enqueueUnreliableMessage(now, msg);
     }
+    // Invoked by EmiConnTimers
+    inline void tailLossProbe(EmiTimeInterval now) {
+        _senderBuffer.retransmitNewestMessage(now, *this);
+    }
+    // Invoked by EmiSendQueue::packetLost
+    inline void lostMessage(EmiTimeInterval now,
+                            int32_t channelQualifier,
+                            EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
+        _senderBuffer.retransmitMessage(now, channelQualifier, nonWrappingSequenceNumber, *this);
+    }
     void rtoTimeout(EmiTimeInterval now, EmiTimeInterval rtoWhenRtoTimerWasScheduled) {
         _congestionControl.onRto();
+        _sendQueue.onRto(now);
+        
+        if (_pathMtu.onRto()) {
+            _sendQueue.setMtu(_pathMtu.mtu());
+        }
         
-        _senderBuffer.eachCurrentMessage(now, rtoWhenRtoTimerWasScheduled, *this);
+        _senderBuffer.eachCurrentMessage(now, rtoWhenRtoTimerWasScheduled,
+                                         _timers.getTime().getRtt(), *this);
     }
     inline void enqueueHeartbeat() {
         _sendQueue.enqueueHeartbeat();
@@ -546,6 +659,11 @@ public:
     inline void enqueueNak(EmiPacketSequenceNumber nak) {
         _sendQueue.enqueueNak(nak);
     }
+    inline void enqueueSpuriousNak(EmiPacketSequenceNumber nak) {
+        if (_otherHostSupportsExtensions) {
+            _sendQueue.enqueueSpuriousNak(nak);
+        }
+    }
     inline bool senderBufferIsEmpty() const {
         return _senderBuffer.empty();
     }
@@ -569,7 +687,7 @@ public:
     }
     inline void gotPrxRstSynAck(EmiTimeInterval now, const uint8_t *data, size_t len) {
         if (_conn) {
-            _conn->gotPrxRstSynAck(now, _delegate.getTimerCookie(), data, len);
+            _conn->gotPrxRstSynAck(now, *_timerWheel, data, len);
         }
     }
     inline void gotPrxSyn(const sockaddr_storage& remoteAddr,
@@ -602,8 +720,10 @@ public:
     // Delegates to EmiLogicalConnection
     bool gotSynRst(EmiTimeInterval now,
                    const sockaddr_storage& inboundAddr,
-                   EmiSequenceNumber otherHostInitialSequenceNumber) {
+                   EmiSequenceNumber otherHostInitialSequenceNumber,
+                   bool otherHostSupportsExtensions) {
         _localAddress = inboundAddr;
+        _otherHostSupportsExtensions = otherHostSupportsExtensions;
         return _conn && _conn->gotSynRst(now, inboundAddr, otherHostInitialSequenceNumber);
     }
     // Delegates to EmiLogicalConnection
@@ -674,18 +794,34 @@ public:
         // immediately, we schedule a timer that will invoke forceClose later
         // on. This guarantees that we don't deallocate this object while
         // there are references to it left on the stack.
-        if (!_forceCloseTimer) {
-            _forceCloseTimer = Binding::makeTimer(_delegate.getTimerCookie());
-            Binding::scheduleTimer(_forceCloseTimer, forceCloseTimeoutCallback,
-                                   this, /*time:*/0,
-                                   /*repeating:*/false, /*reschedule:*/true);
-        }
+        _forceCloseTimer.schedule(forceCloseTimeoutCallback,
+                                  this, /*time:*/0,
+                                  /*repeating:*/false, /*reschedule:*/false);
     }
     
     // Delegates to EmiSendQueue
     // Returns true if something has been sent since the last tick
     bool tick(EmiTimeInterval now) {
-        return _sendQueue.tick(_congestionControl, _timers.getTime(), now);
+        bool sentPacket = _sendQueue.tick(_congestionControl, _timers.getTime(), now);
+        
+        if (_sendQueue.hasPendingData()) {
+            // Ticks are only scheduled when something happens, so
+            // data that the congestion control algorithm holds back
+            // would otherwise be stuck until the next packet arrives
+            _timers.ensureTickTimeout();
+        }
+        
+        if (isOpen()) {
+            size_t probeSize = _pathMtu.probeSize(now, _timers.getTime().getRto());
+            if (probeSize) {
+                EmiPacketSequenceNumber sequenceNumber = _sendQueue.sendPathMtuProbe(_congestionControl, probeSize);
+                if (-1 != sequenceNumber) {
+                    _pathMtu.sentProbe(now, sequenceNumber, probeSize);
+                }
+            }
+        }
+        
+        return sentPacket;
     }
     
     // Delegates to EmiLogicalConnection
@@ -762,6 +898,11 @@ public:
         sendDatagram(getRemoteAddress(), data, size);
     }
     
+    /// Invoked by EmiSendQueue
+    inline void sentReliableMessages() {
+        _timers.sentReliableMessages();
+    }
+    
     /// Invoked by EmiNatPunchthrough (via EmiLogicalConnection);
     /// EmiNatPunchthrough needs the ability to send packets to
     /// other addresses than the current _remoteAddress
@@ -12,6 +12,7 @@
 #include "EmiP2PData.h"
 #include "EmiUdpSocket.h"
 #include "EmiNetUtil.h"
+#include "EmiTimerWheel.h"
 
 #include <netinet/in.h>
 
@@ -24,22 +25,28 @@
 template<class Binding>
 class EmiConnParams {
 public:
-    inline EmiConnParams(EmiUdpSocket<Binding> *socket_, const sockaddr_storage& address_, uint16_t inboundPort_) :
+    inline EmiConnParams(EmiTimerWheel<Binding> *timerWheel_,
+                         EmiUdpSocket<Binding> *socket_, const sockaddr_storage& address_, uint16_t inboundPort_) :
+    timerWheel(timerWheel_),
     socket(socket_),
     address(address_),
     inboundPort(inboundPort_),
     type(EMI_CONNECTION_TYPE_SERVER),
     p2p() {}
     
-    inline EmiConnParams(const sockaddr_storage& address_,
+    inline EmiConnParams(EmiTimerWheel<Binding> *timerWheel_,
+                         const sockaddr_storage& address_,
                          const uint8_t *p2pCookie_, size_t p2pCookieLength_,
                          const uint8_t *sharedSecret_, size_t sharedSecretLength_) :
+    timerWheel(timerWheel_),
     socket(NULL),
     address(address_),
     inboundPort(0),
     type(p2pCookie_ && sharedSecret_ ? EMI_CONNECTION_TYPE_P2P : EMI_CONNECTION_TYPE_CLIENT),
     p2p(p2pCookie_, p2pCookieLength_, sharedSecret_, sharedSecretLength_) {}
     
+    // If this is NULL, the connection creates a timer wheel of its own
+    EmiTimerWheel<Binding>* const timerWheel;
     EmiUdpSocket<Binding>* const socket;
     const sockaddr_storage address;
     const uint16_t inboundPort; // This is set if socket != NULL
@@ -32,11 +32,29 @@ void EmiConnTime::gotRttResponse(EmiTimeInterval rtt) {
     _rto = _srtt + K*_rttvar;
 }
 
+void EmiConnTime::updateBaseRtt(EmiTimeInterval now, EmiTimeInterval rtt) {
+    _latestRtt = rtt;
+    
+    if (now-_baseRttIntervalStart > EMI_BASE_RTT_INTERVAL) {
+        _previousBaseRtt = _baseRtt;
+        _baseRtt = -1;
+        _baseRttIntervalStart = now;
+    }
+    
+    if (-1 == _baseRtt || rtt < _baseRtt) {
+        _baseRtt = rtt;
+    }
+}
+
 EmiConnTime::EmiConnTime() :
 _rto(EMI_INIT_RTO), _srtt(-1),
 _rttvar(-1), _expCount(0),
 _rttRequestSequenceNumber(-1),
-_rttRequestTime(-1) {}
+_rttRequestTime(-1),
+_latestRtt(-1),
+_baseRtt(-1),
+_previousBaseRtt(-1),
+_baseRttIntervalStart(0) {}
 
 void EmiConnTime::swap(EmiConnTime& other) {
     EmiConnTime tmp(*this);
@@ -61,6 +79,7 @@ void EmiConnTime::gotPacket(const EmiPacketHeader& header, EmiTimeInterval now)
         }
         
         gotRttResponse(rtt);
+        updateBaseRtt(now, rtt);
     }
 }
 
@@ -111,3 +130,16 @@ EmiTimeInterval EmiConnTime::getNak() const {
         return 4*_srtt + _rttvar + EMI_TICK_TIME;
     }
 }
+
+EmiTimeInterval EmiConnTime::getQueuingDelay() const {
+    if (-1 == _latestRtt) {
+        return -1;
+    }
+    
+    EmiTimeInterval baseRtt = _baseRtt;
+    if (-1 != _previousBaseRtt) {
+        baseRtt = std::min(baseRtt, _previousBaseRtt);
+    }
+    
+    return _latestRtt-baseRtt;
+}
@@ -29,7 +29,16 @@ class EmiConnTime {
     EmiPacketSequenceNumber _rttRequestSequenceNumber;
     EmiTimeInterval         _rttRequestTime;
     
+    // State for estimating the queuing delay. The base RTT is the
+    // minimal RTT of the current and the previous
+    // EMI_BASE_RTT_INTERVAL, so that it follows route changes.
+    EmiTimeInterval _latestRtt; // -1 if not set
+    EmiTimeInterval _baseRtt; // -1 if not set
+    EmiTimeInterval _previousBaseRtt; // -1 if not set
+    EmiTimeInterval _baseRttIntervalStart;
+    
     void gotRttResponse(EmiTimeInterval rtt);
+    void updateBaseRtt(EmiTimeInterval now, EmiTimeInterval rtt);
     
 public:
     EmiConnTime();
@@ -53,6 +62,11 @@ public:
     
     EmiTimeInterval getRto() const;
     EmiTimeInterval getNak() const;
+    
+    // Returns the difference between the latest RTT sample and the
+    // base RTT, or -1 if no RTT sample has been taken yet. Unlike
+    // getRtt, this is not smoothed.
+    EmiTimeInterval getQueuingDelay() const;
 };
 
 #endif
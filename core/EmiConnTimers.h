@@ -14,13 +14,16 @@
 #include "EmiRtoTimer.h"
 #include "EmiLossList.h"
 
+#include <algorithm>
+
 template<class Binding, class Delegate>
 class EmiConnTimers {
     
     friend class EmiRtoTimer<Binding, EmiConnTimers>;
     
-    typedef typename Binding::TimerCookie TimerCookie;
-    typedef typename Binding::Timer       Timer;
+    typedef EmiWheelTimer<Binding> Timer;
+    typedef EmiTimerWheel<Binding> TimerWheel;
+    typedef EmiWheelTick<Binding> Tick;
     typedef EmiRtoTimer<Binding, EmiConnTimers> ERT;
     
     bool _sentDataSinceLastHeartbeat;
@@ -30,10 +33,16 @@ class EmiConnTimers {
     EmiConnTime _time;
     EmiLossList _lossList;
     
-    Timer *_nakTimer;
-    Timer *_tickTimer;
-    Timer *_heartbeatTimer;
-    ERT    _rtoTimer;
+    TimerWheel& _timerWheel;
+    Timer _nakTimer;
+    Tick  _tick;
+    Timer _heartbeatTimer;
+    ERT   _rtoTimer;
+    Timer _tailLossProbeTimer;
+    // At most one probe is sent for each RTO period, since the probe
+    // pushes the RTO timer back. This is reset when the RTO timer
+    // fires or when all reliable messages have been acked.
+    bool  _sentTailLossProbe;
 
 private:
     // Private copy constructor and assignment operator
@@ -47,7 +56,9 @@ private:
     static void nakTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiConnTimers *timers = (EmiConnTimers *)data;
         
-        EmiPacketSequenceNumber nak = timers->_lossList.calculateNak(now, timers->_time.getRto());
+        EmiPacketSequenceNumber nak = timers->_lossList.calculateNak(now,
+                                                                     timers->_time.getRto(),
+                                                                     timers->_time.getRtt());
         
         if (-1 != nak) {
             timers->_delegate.enqueueNak(nak);
@@ -56,7 +67,7 @@ private:
         timers->ensureNakTimeout();
     }
     
-    static void tickTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
+    static void tickCallback(EmiTimeInterval now, void *data) {
         EmiConnTimers *timers = (EmiConnTimers *)data;
         
         // Tick returns true if a packet has been sent since the last tick
@@ -65,6 +76,51 @@ private:
         }
     }
     
+    static void tailLossProbeCallback(EmiTimeInterval now, Timer *timer, void *data) {
+        EmiConnTimers *timers = (EmiConnTimers *)data;
+        
+        // The timer is not rescheduled here. Only one probe is sent
+        // for each RTO period; if it doesn't help, the RTO timer takes
+        // over.
+        timers->_sentTailLossProbe = true;
+        timers->_delegate.tailLossProbe(now);
+        
+        // Give the probe time to be acked before the RTO timer
+        // retransmits everything
+        timers->_rtoTimer.forceResetRtoTimer();
+    }
+    
+    // The tail loss probe timer fires when no reliable message has
+    // been sent or acked for 2*SRTT, while there are unacked messages.
+    // Other packets, like heartbeats and acks, don't push it back. The probe retransmits the newest unacked
+    // message, which makes the other host see a packet after the lost
+    // ones. That results in a NAK or SACK, and the lost messages are
+    // retransmitted without waiting for the RTO.
+    void updateTailLossProbeTimeout() {
+        if (_delegate.senderBufferIsEmpty()) {
+            _sentTailLossProbe = false;
+            _tailLossProbeTimer.deschedule();
+            return;
+        }
+        
+        if (_sentTailLossProbe) {
+            _tailLossProbeTimer.deschedule();
+            return;
+        }
+        
+        // The tick time is added to account for the time it takes
+        // the other host to send the ack. The probe is never later
+        // than the RTO, since the RTO timer is pushed back when the
+        // probe is sent.
+        EmiTimeInterval srtt = _time.getRtt();
+        EmiTimeInterval pto = (-1 == srtt ? EMI_INIT_PTO : 2*srtt + EMI_TICK_TIME);
+        pto = std::min(pto, _time.getRto());
+        
+        _tailLossProbeTimer.schedule(tailLossProbeCallback,
+                                     this, pto,
+                                     /*repeating:*/false, /*reschedule:*/true);
+    }
+    
     static void heartbeatTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiConnTimers *timers = (EmiConnTimers *)data;
         
@@ -82,6 +138,7 @@ private:
     
     // Invoked by EmiRtoTimer
     inline void rtoTimeout(EmiTimeInterval now, EmiTimeInterval rtoWhenRtoTimerWasScheduled) {
+        _sentTailLossProbe = false;
         _delegate.rtoTimeout(now, rtoWhenRtoTimerWasScheduled);
     }
     
@@ -102,43 +159,57 @@ private:
 
 public:
     EmiConnTimers(const EmiSockConfig& config,
-                  const TimerCookie& timerCookie,
+                  TimerWheel& timerWheel,
                   Delegate& delegate) :
     _delegate(delegate),
     _time(),
     _lossList(),
     _sentDataSinceLastHeartbeat(false),
-    _nakTimer(Binding::makeTimer(timerCookie)),
-    _tickTimer(Binding::makeTimer(timerCookie)),
-    _heartbeatTimer(Binding::makeTimer(timerCookie)),
+    _timerWheel(timerWheel),
+    _nakTimer(timerWheel),
+    _tick(tickCallback, this),
+    _heartbeatTimer(timerWheel),
     _rtoTimer(timeBeforeConnectionWarning(config),
               config.connectionTimeout,
               config.initialConnectionTimeout,
               _time,
-              timerCookie,
-              *this) {}
+              timerWheel,
+              *this),
+    _tailLossProbeTimer(timerWheel),
+    _sentTailLossProbe(false) {}
     
-    virtual ~EmiConnTimers() {
-        Binding::freeTimer(_nakTimer);
-        Binding::freeTimer(_tickTimer);
-        Binding::freeTimer(_heartbeatTimer);
-    }
+    virtual ~EmiConnTimers() {}
     
     void deschedule() {
         _rtoTimer.deschedule();
-        Binding::descheduleTimer(_nakTimer);
-        Binding::descheduleTimer(_tickTimer);
-        Binding::descheduleTimer(_heartbeatTimer);
+        _nakTimer.deschedule();
+        _tick.deschedule();
+        _heartbeatTimer.deschedule();
+        _tailLossProbeTimer.deschedule();
     }
     
     void sentPacket() {
         _sentDataSinceLastHeartbeat = true;
     }
     
+    // Should be called when a packet with reliable messages is sent
+    inline void sentReliableMessages() {
+        updateTailLossProbeTimeout();
+    }
+    
     void gotPacket(const EmiPacketHeader& header, EmiTimeInterval now) {
         _time.gotPacket(header, now);
-        _lossList.gotPacket(now, header.sequenceNumber);
         _rtoTimer.gotPacket();
+        
+        if (header.flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG) {
+            EmiPacketSequenceNumber spuriousNak = _lossList.gotPacket(now, header.sequenceNumber);
+            if (-1 != spuriousNak) {
+                // Let the other host undo the rate decrease it made
+                // because of the NAK
+                _delegate.enqueueSpuriousNak(spuriousNak);
+                ensureTickTimeout();
+            }
+        }
     }
     
     void resetHeartbeatTimeout() {
@@ -146,30 +217,33 @@ public:
         
         // Don't send heartbeats until we've got a response from the remote host
         if (!_delegate.isOpening()) {
-            Binding::scheduleTimer(_heartbeatTimer, heartbeatTimeoutCallback,
-                                   this, 1/_delegate.config.heartbeatFrequency,
-                                   /*repeating:*/false, /*reschedule:*/true);
+            _heartbeatTimer.schedule(heartbeatTimeoutCallback,
+                                     this, 1/_delegate.config.heartbeatFrequency,
+                                     /*repeating:*/false, /*reschedule:*/true);
         }
     }
     
     void ensureNakTimeout() {
         // Don't send NAKs until we've got a response from the remote host
         if (!_delegate.isOpening()) {
-            Binding::scheduleTimer(_nakTimer, nakTimeoutCallback,
-                                   this, _time.getNak(),
-                                   /*repeating:*/false, /*reschedule:*/false);
+            _nakTimer.schedule(nakTimeoutCallback,
+                               this, _time.getNak(),
+                               /*repeating:*/false, /*reschedule:*/false);
         }
     }
     
     void ensureTickTimeout() {
-        Binding::scheduleTimer(_tickTimer, tickTimeoutCallback, this,
-                               EMI_TICK_TIME,
-                               /*repeating:*/false, /*reschedule:*/false);
+        // The ticks of all connections that share the wheel are
+        // coalesced, so that their packets go out together
+        _timerWheel.scheduleTick(&_tick);
         ensureNakTimeout();
     }
     
+    // Should be called when reliable messages are registered or
+    // deregistered. Also updates the tail loss probe timer.
     inline void updateRtoTimeout() {
         _rtoTimer.updateRtoTimeout();
+        updateTailLossProbeTimeout();
     }
     
     inline void forceResetRtoTimer() {
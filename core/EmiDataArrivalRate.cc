@@ -9,7 +9,9 @@
 #include "EmiDataArrivalRate.h"
 
 EmiDataArrivalRate::EmiDataArrivalRate() :
-_lastPacketTime(-1),
+_lastBatchTime(-1),
+_batchTime(-1),
+_batchBytes(0),
 _medianFilter(1) {}
 
 EmiDataArrivalRate::~EmiDataArrivalRate() {}
@@ -17,7 +17,12 @@
 // algorithm.
 class EmiDataArrivalRate {
     
-    EmiTimeInterval        _lastPacketTime;
+    // Packets that are received in the same batch get the same
+    // receive time. The bytes of a batch are counted together over
+    // the interval since the previous batch.
+    EmiTimeInterval        _lastBatchTime;
+    EmiTimeInterval        _batchTime;
+    size_t                 _batchBytes;
     // The values this filter handles are in the unit of
     // bytes per second
     EmiMedianFilter<float> _medianFilter;
@@ -30,10 +35,17 @@ public:
     // Call this when a packet has been received. This
     // method is fast.
     inline void gotPacket(EmiTimeInterval now, size_t packetLength) {
-        if (-1 != _lastPacketTime) {
-            _medianFilter.pushValue(packetLength/(now-_lastPacketTime));
+        if (now == _batchTime) {
+            _batchBytes += packetLength;
+            return;
         }
-        _lastPacketTime = now;
+        
+        if (-1 != _lastBatchTime) {
+            _medianFilter.pushValue(_batchBytes/(_batchTime-_lastBatchTime));
+        }
+        _lastBatchTime = _batchTime;
+        _batchTime = now;
+        _batchBytes = packetLength;
     }
     
     // Calculates the current data arrival rate, in
@@ -0,0 +1,65 @@
+//
+//  EmiEndpointKey.h
+//  eminet
+//
+
+#ifndef eminet_EmiEndpointKey_h
+#define eminet_EmiEndpointKey_h
+
+#include "EmiFlatHashMap.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <cstring>
+
+// A compact (20 byte) representation of an IPv4 or IPv6 endpoint,
+// for use as an EmiFlatHashMap key. Two keys are equal iff
+// EmiAddressCmp::compare considers the addresses equal.
+class EmiEndpointKey {
+    uint16_t _family;
+    // In network byte order
+    uint16_t _port;
+    // IPv4 addresses use the first 4 bytes; the rest is zero
+    uint8_t  _ip[16];
+
+public:
+    EmiEndpointKey() :
+    _family(AF_UNSPEC),
+    _port(0) {
+        memset(_ip, 0, sizeof(_ip));
+    }
+
+    explicit EmiEndpointKey(const sockaddr_storage& address) :
+    _family(address.ss_family) {
+        memset(_ip, 0, sizeof(_ip));
+
+        if (AF_INET == address.ss_family) {
+            const sockaddr_in& in((const sockaddr_in&)address);
+            _port = in.sin_port;
+            memcpy(_ip, &in.sin_addr, sizeof(in.sin_addr));
+        }
+        else { // Assume AF_INET6
+            const sockaddr_in6& in6((const sockaddr_in6&)address);
+            _port = in6.sin6_port;
+            memcpy(_ip, &in6.sin6_addr, sizeof(in6.sin6_addr));
+        }
+    }
+
+    inline bool operator==(const EmiEndpointKey& other) const {
+        return (_family == other._family &&
+                _port == other._port &&
+                0 == memcmp(_ip, other._ip, sizeof(_ip)));
+    }
+
+    inline uint64_t hash(uint64_t seed) const {
+        uint64_t a, b;
+        memcpy(&a, _ip, sizeof(a));
+        memcpy(&b, _ip+sizeof(a), sizeof(b));
+
+        uint64_t h = EmiHash::combine(seed, ((uint64_t)_family << 16) | _port);
+        h = EmiHash::combine(h, a);
+        return EmiHash::combine(h, b);
+    }
+};
+
+#endif
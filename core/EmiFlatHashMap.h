@@ -0,0 +1,228 @@
+//
+//  EmiFlatHashMap.h
+//  eminet
+//
+
+#ifndef eminet_EmiFlatHashMap_h
+#define eminet_EmiFlatHashMap_h
+
+#include "EmiNetUtil.h"
+
+#include <stdint.h>
+#include <cstddef>
+
+// Helpers for the hash functions of the keys of EmiFlatHashMap
+class EmiHash {
+public:
+    // The finalizer of MurmurHash3
+    inline static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    inline static uint64_t combine(uint64_t h, uint64_t word) {
+        return mix(h ^ (word * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+// A hash map with open addressing and linear probing, stored in one
+// flat array, for the lookups that are done for every packet.
+//
+// Key must be default constructible and copyable, and it must have
+// operator== and a method uint64_t hash(uint64_t seed) const. The
+// seed makes it hard for remote hosts to pick keys that collide, so
+// it should be random when the keys are controlled by the network.
+//
+// Inserting or erasing an entry invalidates all iterators and
+// pointers to values in the map.
+template<class Key, class Value>
+class EmiFlatHashMap {
+    static const size_t MIN_CAPACITY = 16;
+
+    struct Entry {
+        // 0 means that the entry is empty
+        uint64_t hash;
+        Key      key;
+        Value    value;
+
+        Entry() : hash(0), key(), value() {}
+    };
+
+    // Private copy constructor and assignment operator
+    inline EmiFlatHashMap(const EmiFlatHashMap& other);
+    inline EmiFlatHashMap& operator=(const EmiFlatHashMap& other);
+
+    uint64_t _seed;
+    Entry   *_entries;
+    // Always a power of two, or 0
+    size_t   _capacity;
+    size_t   _size;
+
+    inline uint64_t hashKey(const Key& key) const {
+        uint64_t hash = key.hash(_seed);
+        return hash ? hash : 1;
+    }
+
+    // Returns the index of the entry with key, or of the empty
+    // entry where key would be inserted.
+    size_t probe(const Key& key, uint64_t hash) const {
+        size_t mask = _capacity-1;
+        size_t idx = hash & mask;
+        while (_entries[idx].hash &&
+               !(_entries[idx].hash == hash && _entries[idx].key == key)) {
+            idx = (idx+1) & mask;
+        }
+        return idx;
+    }
+
+    void grow() {
+        Entry *oldEntries = _entries;
+        size_t oldCapacity = _capacity;
+
+        _capacity = (oldCapacity ? oldCapacity*2 : MIN_CAPACITY);
+        _entries = new Entry[_capacity];
+
+        for (size_t i=0; i<oldCapacity; i++) {
+            Entry& entry(oldEntries[i]);
+            if (entry.hash) {
+                _entries[probe(entry.key, entry.hash)] = entry;
+            }
+        }
+
+        delete [] oldEntries;
+    }
+
+public:
+
+    class iterator {
+        friend class EmiFlatHashMap;
+
+        Entry *_cur;
+        Entry *_end;
+
+        iterator(Entry *cur, Entry *end) : _cur(cur), _end(end) {
+            skipEmpty();
+        }
+
+        inline void skipEmpty() {
+            while (_cur != _end && !_cur->hash) {
+                _cur++;
+            }
+        }
+
+    public:
+        inline const Key& key() const { return _cur->key; }
+        inline Value& value() const { return _cur->value; }
+
+        inline iterator& operator++() {
+            _cur++;
+            skipEmpty();
+            return *this;
+        }
+
+        inline bool operator==(const iterator& other) const { return _cur == other._cur; }
+        inline bool operator!=(const iterator& other) const { return _cur != other._cur; }
+    };
+
+    explicit EmiFlatHashMap(uint64_t seed = 0) :
+    _seed(seed),
+    _entries(NULL),
+    _capacity(0),
+    _size(0) {}
+
+    virtual ~EmiFlatHashMap() {
+        delete [] _entries;
+    }
+
+    inline size_t size() const {
+        return _size;
+    }
+
+    inline bool empty() const {
+        return 0 == _size;
+    }
+
+    inline iterator begin() {
+        return iterator(_entries, _entries+_capacity);
+    }
+
+    inline iterator end() {
+        return iterator(_entries+_capacity, _entries+_capacity);
+    }
+
+    // Returns NULL if there is no entry for key
+    Value *find(const Key& key) {
+        if (0 == _size) {
+            return NULL;
+        }
+
+        Entry& entry(_entries[probe(key, hashKey(key))]);
+        return entry.hash ? &entry.value : NULL;
+    }
+
+    inline bool contains(const Key& key) {
+        return !!find(key);
+    }
+
+    // Returns false, and leaves the map unchanged, if there
+    // already is an entry for key
+    bool insert(const Key& key, const Value& value) {
+        // Keep the load factor at or below 3/4
+        if (4*(_size+1) > 3*_capacity) {
+            grow();
+        }
+
+        uint64_t hash = hashKey(key);
+        Entry& entry(_entries[probe(key, hash)]);
+        if (entry.hash) {
+            return false;
+        }
+
+        entry.hash = hash;
+        entry.key = key;
+        entry.value = value;
+        _size++;
+        return true;
+    }
+
+    // Returns false if there was no entry for key
+    bool erase(const Key& key) {
+        if (0 == _size) {
+            return false;
+        }
+
+        size_t mask = _capacity-1;
+        size_t hole = probe(key, hashKey(key));
+        if (!_entries[hole].hash) {
+            return false;
+        }
+
+        // Shift the entries that follow the erased one back, so
+        // that no tombstones are needed. An entry can fill the hole
+        // if the hole lies between its home slot and its slot.
+        size_t idx = hole;
+        for (;;) {
+            idx = (idx+1) & mask;
+            Entry& entry(_entries[idx]);
+            if (!entry.hash) {
+                break;
+            }
+
+            size_t home = entry.hash & mask;
+            if (((idx-home) & mask) >= ((idx-hole) & mask)) {
+                _entries[hole] = entry;
+                hole = idx;
+            }
+        }
+
+        _entries[hole] = Entry();
+        _size--;
+        return true;
+    }
+};
+
+#endif
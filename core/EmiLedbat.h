@@ -0,0 +1,120 @@
+//
+//  EmiLedbat.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2026-10-18.
+//  Copyright (c) 2026 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiLedbat_h
+#define eminet_EmiLedbat_h
+
+#include "EmiTypes.h"
+
+#include <algorithm>
+#include <cstddef>
+
+// This class decides how much background priority data a connection
+// may send. It implements a rate based variant of LEDBAT (RFC 6817):
+// The rate grows while the queuing delay is below
+// EMI_LEDBAT_TARGET_DELAY and shrinks when it is above it, so that
+// background transfers yield to the other messages of the connection
+// and to other flows that share the bottleneck link.
+//
+// The background data is also subject to the congestion control of
+// the connection; this class only makes it back off sooner.
+class EmiLedbat {
+    // In bytes per second
+    float _rate;
+    // The number of bytes that may be sent before the next tick. It
+    // can be negative, since a message that is sent is allowed to
+    // exceed it.
+    float _budget;
+    // True if background data was held back since the last tick
+    bool _limited;
+    // The RTT of the most recent tick, -1 if not known
+    EmiTimeInterval _rtt;
+    EmiTimeInterval _lastDecreaseTime;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiLedbat(const EmiLedbat& other);
+    inline EmiLedbat& operator=(const EmiLedbat& other);
+    
+public:
+    EmiLedbat() :
+    _rate(EMI_LEDBAT_INITIAL_RATE),
+    _budget(0),
+    _limited(false),
+    _rtt(-1),
+    _lastDecreaseTime(-1) {}
+    
+    virtual ~EmiLedbat() {}
+    
+    // This method is intended to be called once per tick.
+    // queuingDelay and rtt may be -1 if they are not known yet.
+    void tick(EmiTimeInterval now, EmiTimeInterval queuingDelay, EmiTimeInterval rtt) {
+        _rtt = rtt;
+        
+        if (-1 != queuingDelay && -1 != rtt) {
+            // The ticks make up the time base, so a shorter RTT
+            // would make the rate change faster than it can be
+            // measured
+            EmiTimeInterval effectiveRtt = std::max(rtt, (EmiTimeInterval)EMI_TICK_TIME);
+            float offTarget = (EMI_LEDBAT_TARGET_DELAY-queuingDelay)/EMI_LEDBAT_TARGET_DELAY;
+            
+            if (offTarget < 0) {
+                // Like LEDBAT++, decrease multiplicatively in
+                // proportion to how far above the target the delay
+                // is, but by at most half per RTT. LEDBAT's linear
+                // decrease is too slow to make room for other
+                // traffic when the rate is high.
+                float decrease = std::min(-offTarget, 0.5f);
+                _rate -= _rate*decrease*EMI_TICK_TIME/effectiveRtt;
+            }
+            else if (_limited) {
+                // This corresponds to LEDBAT's window update of
+                // GAIN*offTarget packets per RTT
+                _rate += EMI_LEDBAT_GAIN*offTarget*EMI_MINIMAL_MTU*EMI_TICK_TIME/(effectiveRtt*effectiveRtt);
+            }
+            
+            _rate = std::max(_rate, (float)EMI_LEDBAT_MIN_RATE);
+        }
+        
+        float tickAllowance = _rate*EMI_TICK_TIME;
+        _budget = std::min(_budget+tickAllowance, tickAllowance);
+        _limited = false;
+    }
+    
+    // Halves the rate, at most once per RTT
+    void onLoss(EmiTimeInterval now) {
+        if (-1 != _lastDecreaseTime && now-_lastDecreaseTime < _rtt) {
+            return;
+        }
+        
+        _lastDecreaseTime = now;
+        _rate = std::max(_rate/2, (float)EMI_LEDBAT_MIN_RATE);
+    }
+    
+    // Returns true if a background message may be sent now
+    inline bool canSend() const {
+        return _budget > 0;
+    }
+    
+    // Should be called when a background message was held back
+    // because canSend returned false. The rate only grows when it
+    // is what limits the sending.
+    inline void markLimited() {
+        _limited = true;
+    }
+    
+    inline void sentData(size_t size) {
+        _budget -= size;
+    }
+    
+    inline float rate() const {
+        return _rate;
+    }
+};
+
+#endif
@@ -0,0 +1,50 @@
+//
+//  EmiListLink.h
+//  eminet
+//
+
+#ifndef eminet_EmiListLink_h
+#define eminet_EmiListLink_h
+
+#include "EmiNetUtil.h"
+
+// Node in a circular doubly linked list. The head of each list is
+// a sentinel node, which means that a node can be unlinked without
+// knowing which list it is in.
+struct EmiListLink {
+    EmiListLink *prev;
+    EmiListLink *next;
+
+    inline EmiListLink() : prev(this), next(this) {}
+
+    inline bool isEmpty() const {
+        return next == this;
+    }
+
+    inline void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+
+    inline void pushBack(EmiListLink *node) {
+        node->prev = prev;
+        node->next = this;
+        prev->next = node;
+        prev = node;
+    }
+
+    // Moves all nodes of this list to the (empty) list other
+    inline void moveTo(EmiListLink& other) {
+        ASSERT(other.isEmpty());
+        if (isEmpty()) return;
+
+        other.next = next;
+        other.prev = prev;
+        next->prev = &other;
+        prev->next = &other;
+        prev = next = this;
+    }
+};
+
+#endif
@@ -16,7 +16,7 @@
 #include "EmiMessageHeader.h"
 #include "EmiP2PEndpoints.h"
 
-#include <map>
+#include <algorithm>
 
 template<class Data>
 class EmiMessage;
@@ -29,7 +29,6 @@ class EmiLogicalConnection {
     typedef typename Binding::Error          Error;
     typedef typename Binding::PersistentData PersistentData;
     typedef typename Binding::TemporaryData  TemporaryData;
-    typedef typename Binding::TimerCookie    TimerCookie;
     typedef typename SockDelegate::ConnectionOpenedCallbackCookie ConnectionOpenedCallbackCookie;
     typedef EmiMessage<Binding>                 EM;
     typedef EmiConn<SockDelegate, ConnDelegate> EC;
@@ -37,7 +36,7 @@ class EmiLogicalConnection {
     
     friend class EmiNatPunchthrough<Binding, EmiLogicalConnection>;
     
-    typedef std::map<EmiChannelQualifier, EmiNonWrappingSequenceNumber> EmiNonWrappingSequenceNumberMemo;
+    static const size_t NUM_CHANNELS = 1 << (8*sizeof(EmiChannelQualifier));
     
     ReceiverBuffer &_receiverBuffer;
     
@@ -50,13 +49,11 @@ class EmiLogicalConnection {
     ConnectionOpenedCallbackCookie _connectionOpenedCallbackCookie;
     bool _sendingSyn;
     
-    // _sequenceMemo is a map that contains the sequence number that
-    // the next message in each channel should have. If the map has
-    // no value for a particular channel, it means that the sequence
-    // number for the next message on that channel is
-    // _initialSequenceNumber.
-    EmiNonWrappingSequenceNumberMemo _sequenceMemo;
-    EmiNonWrappingSequenceNumberMemo _reliableSequencedBuffer;
+    // _sequenceMemo contains the sequence number that the next
+    // message in each channel should have, indexed by channel
+    // qualifier. It is initialized to _initialSequenceNumber.
+    EmiNonWrappingSequenceNumber _sequenceMemo[NUM_CHANNELS];
+    EmiNonWrappingSequenceNumber _reliableSequencedBuffer[NUM_CHANNELS];
     
     // This contains the sequence number of these messages before
     // they have been acknowledged (then this var is set back to
@@ -108,13 +105,14 @@ private:
     }
     
     inline EmiNonWrappingSequenceNumber sequenceMemoForChannelQualifier(EmiChannelQualifier cq) {
-        EmiNonWrappingSequenceNumberMemo::iterator cur = _sequenceMemo.find(cq);
-        return (_sequenceMemo.end() == cur ? _initialSequenceNumber : (*cur).second);
+        return _sequenceMemo[cq];
     }
     
     // Helper for the constructors
     void commonInit() {
         _initialSequenceNumber = EmiLogicalConnection::generateSequenceNumber();
+        std::fill(_sequenceMemo, _sequenceMemo+NUM_CHANNELS, _initialSequenceNumber);
+        std::fill(_reliableSequencedBuffer, _reliableSequencedBuffer+NUM_CHANNELS, 0);
         
         _reliableHandshakeMsgSn = -1;
         
@@ -217,7 +215,7 @@ public:
         
         if (!_conn->enqueueControlMessage(now,
                                           _initialSequenceNumber,
-                                          (_sendingSyn ? EMI_SYN_FLAG : EMI_SYN_FLAG | EMI_RST_FLAG),
+                                          EMI_EXTENSIONS_FLAG | (_sendingSyn ? EMI_SYN_FLAG : EMI_SYN_FLAG | EMI_RST_FLAG),
                                           data,
                                           dataLen,
                                           /*reliable:*/_sendingSyn,
@@ -272,7 +270,7 @@ public:
                           EMI_REASON_OTHER_HOST_CLOSED);
     }
     
-    void gotPrxRstSynAck(EmiTimeInterval now, const TimerCookie& timerCookie,
+    void gotPrxRstSynAck(EmiTimeInterval now, EmiTimerWheel<Binding>& timerWheel,
                          const uint8_t *data, size_t len) {
         
         /// Parse the incoming data
@@ -307,7 +305,7 @@ public:
             
             _natPunchthrough = new ENP(_conn->config.connectionTimeout,
                                        *this,
-                                       timerCookie,
+                                       timerWheel,
                                        _initialSequenceNumber,
                                        _conn->getRemoteAddress(),
                                        _conn->getP2PData(),
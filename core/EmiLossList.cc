@@ -10,14 +10,122 @@
 
 #include "EmiNetUtil.h"
 
+#include <algorithm>
+#include <cstring>
+
 EmiLossList::EmiLossList() :
 _newestSequenceNumber(-1),
 _newestSequenceNumberTime(0),
-_lossSet() {}
+_base(0),
+_feedback(NULL),
+_reorderingThreshold(MIN_REORDERING_THRESHOLD),
+_reorderingDelay(0),
+_packetsSinceReordering(0) {
+    memset(_lost, 0, sizeof(_lost));
+    memset(_naked, 0, sizeof(_naked));
+}
 
-EmiLossList::~EmiLossList() {}
+EmiLossList::~EmiLossList() {
+    delete [] _feedback;
+}
 
-void EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrappedSequenceNumber) {
+void EmiLossList::setLost(EmiNonWrappingPacketSequenceNumber first,
+                          EmiNonWrappingPacketSequenceNumber last,
+                          bool lost) {
+    while (first <= last) {
+        size_t bit = first % BITS_PER_WORD;
+        size_t numBits = std::min((EmiNonWrappingPacketSequenceNumber)(BITS_PER_WORD-bit), last-first+1);
+        uint64_t mask = (BITS_PER_WORD == numBits ? ~0ULL : (1ULL << numBits)-1) << bit;
+        
+        if (lost) {
+            word(first) |= mask;
+        }
+        else {
+            word(first) &= ~mask;
+        }
+        
+        first += numBits;
+    }
+}
+
+EmiNonWrappingPacketSequenceNumber EmiLossList::newestLostAtOrBefore(EmiNonWrappingPacketSequenceNumber sn) {
+    while (sn >= _base) {
+        size_t bit = sn % BITS_PER_WORD;
+        // The bits of sn and all older packets in sn's word
+        uint64_t lost = word(sn) & ((2ULL << bit)-1);
+        if (lost) {
+            EmiNonWrappingPacketSequenceNumber found = sn-bit + (BITS_PER_WORD-1) - __builtin_clzll(lost);
+            return found >= _base ? found : -1;
+        }
+        sn -= bit+1;
+    }
+    
+    return -1;
+}
+
+EmiNonWrappingPacketSequenceNumber EmiLossList::rangeStart(EmiNonWrappingPacketSequenceNumber sn) {
+    while (sn >= _base) {
+        size_t bit = sn % BITS_PER_WORD;
+        uint64_t received = ~word(sn) & ((2ULL << bit)-1);
+        if (received) {
+            EmiNonWrappingPacketSequenceNumber found = sn-bit + (BITS_PER_WORD-1) - __builtin_clzll(received);
+            return std::max(found+1, _base);
+        }
+        sn -= bit+1;
+    }
+    
+    return _base;
+}
+
+void EmiLossList::slide(EmiNonWrappingPacketSequenceNumber newBase) {
+    if (newBase <= _base) {
+        return;
+    }
+    
+    // If a lost range straddles the new base, its feedback state
+    // must move to the range's new first packet.
+    if (isLost(newBase)) {
+        EmiNonWrappingPacketSequenceNumber start = rangeStart(newBase);
+        if (start != newBase) {
+            feedback(newBase) = feedback(start);
+        }
+    }
+    
+    EmiNonWrappingPacketSequenceNumber last = std::min(newBase-1, _newestSequenceNumber);
+    setLost(_base, last, false);
+    
+    // Forget about the NAKs of the packets that leave the window
+    if (last-_base+1 >= (EmiNonWrappingPacketSequenceNumber)WINDOW_SIZE) {
+        memset(_naked, 0, sizeof(_naked));
+    }
+    else {
+        for (EmiNonWrappingPacketSequenceNumber sn = _base; sn <= last; sn++) {
+            nakedWord(sn) &= ~nakedBit(sn);
+        }
+    }
+    
+    _base = newBase;
+}
+
+void EmiLossList::gotReorderedPacket(EmiNonWrappingPacketSequenceNumber distance,
+                                     EmiTimeInterval delay) {
+    _packetsSinceReordering = 0;
+    
+    // A threshold of distance+1 packets would have been enough to
+    // not consider this packet lost
+    if (distance+1 > _reorderingThreshold) {
+        _reorderingThreshold = distance+1;
+        if (_reorderingThreshold > MAX_REORDERING_THRESHOLD) {
+            _reorderingThreshold = MAX_REORDERING_THRESHOLD;
+        }
+    }
+    
+    if (delay > _reorderingDelay) {
+        _reorderingDelay = delay;
+    }
+}
+
+EmiPacketSequenceNumber EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrappedSequenceNumber) {
     
     EmiNonWrappingPacketSequenceNumber expectedSn = _newestSequenceNumber+1;
     
@@ -38,93 +146,131 @@ void EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrapped
         }
     }
     
-    if (-1 == _newestSequenceNumber ||
-        expectedSn == guessedNonWrappedSequenceNumber) {
-        // We received the expected sequence number.
-        // No need to do anything with the loss set.
+    if (-1 == _newestSequenceNumber) {
+        // This is the first packet we receive
+        _base = guessedNonWrappedSequenceNumber;
     }
-    else if (_newestSequenceNumber > guessedNonWrappedSequenceNumber) {
+    else if (_newestSequenceNumber >= guessedNonWrappedSequenceNumber) {
         // We received an old sequence number, which presumably
-        // arrived out of order. Remove it from the loss set if
+        // arrived out of order. Remove it from the loss list if
         // it's present.
+        //
+        // This does not change the newest sequence number; the
+        // packets between this one and the newest one are still
+        // lost.
         
-        LossSetIter iter = _lossSet.lower_bound(LostPacketRange(0, 0, guessedNonWrappedSequenceNumber));
-        
-        if (_lossSet.end() == iter) {
-            // We did not find any matching LostPacketRange
-            return;
+        if (guessedNonWrappedSequenceNumber < _base) {
+            return -1;
         }
         
-        const LostPacketRange& lpr(*iter);
+        EmiNonWrappingPacketSequenceNumber distance = _newestSequenceNumber-guessedNonWrappedSequenceNumber;
         
-        if (lpr.oldestSequenceNumber > guessedNonWrappedSequenceNumber) {
-            // The LostPacketRange we found doesn't contain this sequence number
-            return;
+        uint64_t& naked(nakedWord(guessedNonWrappedSequenceNumber));
+        uint64_t bit = nakedBit(guessedNonWrappedSequenceNumber);
+        if (naked & bit) {
+            // We have NAKed this packet, and the NAK was spurious
+            naked &= ~bit;
+            gotReorderedPacket(distance, now-feedback(guessedNonWrappedSequenceNumber).lossTime);
+            return guessedNonWrappedSequenceNumber & EMI_PACKET_SEQUENCE_NUMBER_MASK;
         }
         
-        // We only have a reference to lp, so we must use it before
-        // we erase it from _lossSet.
-        LostPacketRange lowerBound(lpr);
-        lowerBound.newestSequenceNumber = guessedNonWrappedSequenceNumber-1;
-        LostPacketRange upperBound(lpr);
-        upperBound.oldestSequenceNumber = guessedNonWrappedSequenceNumber+1;
-        upperBound.numFeedbacks = 0;
+        if (!isLost(guessedNonWrappedSequenceNumber)) {
+            return -1;
+        }
         
-        // To make sure that we don't get problems with duplicates in the set,
-        // we must erase lp before we insert the split versions of it.
-        _lossSet.erase(iter);
+        EmiNonWrappingPacketSequenceNumber start = rangeStart(guessedNonWrappedSequenceNumber);
+        const Feedback& fb(feedback(start));
+        gotReorderedPacket(distance, now-fb.lossTime);
+        setLost(guessedNonWrappedSequenceNumber, guessedNonWrappedSequenceNumber, false);
         
-        if (lowerBound.oldestSequenceNumber <= lowerBound.newestSequenceNumber) {
-            _lossSet.insert(lowerBound);
-        }
-        if (upperBound.oldestSequenceNumber <= upperBound.newestSequenceNumber) {
-            _lossSet.insert(upperBound);
+        // The packets after this one become a range of their own,
+        // that hasn't been fed back yet
+        if (isLost(guessedNonWrappedSequenceNumber+1)) {
+            Feedback& upper(feedback(guessedNonWrappedSequenceNumber+1));
+            upper.lastFeedbackTime = fb.lastFeedbackTime;
+            upper.numFeedbacks = 0;
+            upper.lossTime = fb.lossTime;
         }
+        
+        return -1;
     }
-    else if (guessedNonWrappedSequenceNumber - _newestSequenceNumber > 1) {
-        // We received a newer sequence number than what we
-        // expected. Add the lost range to the loss set.
+    else {
+        slide(guessedNonWrappedSequenceNumber - (WINDOW_SIZE-1));
         
-        LostPacketRange lpr(now, 
-                            _newestSequenceNumber+1,
-                            guessedNonWrappedSequenceNumber-1);
-        _lossSet.insert(lpr);
+        if (++_packetsSinceReordering >= REORDERING_DECAY_PACKETS) {
+            _packetsSinceReordering = 0;
+            
+            _reorderingThreshold = _reorderingThreshold*7/8;
+            if (_reorderingThreshold < MIN_REORDERING_THRESHOLD) {
+                _reorderingThreshold = MIN_REORDERING_THRESHOLD;
+            }
+            _reorderingDelay *= 7.0/8;
+        }
+        
+        EmiNonWrappingPacketSequenceNumber first = std::max(_newestSequenceNumber+1, _base);
+        EmiNonWrappingPacketSequenceNumber last = guessedNonWrappedSequenceNumber-1;
+        if (first <= last) {
+            // We received a newer sequence number than what we
+            // expected. Add the lost range to the loss list.
+            
+            if (!_feedback) {
+                _feedback = new Feedback[WINDOW_SIZE];
+            }
+            
+            setLost(first, last, true);
+            Feedback& fb(feedback(first));
+            fb.lastFeedbackTime = now;
+            fb.numFeedbacks = 0;
+            fb.lossTime = now;
+        }
     }
     
     _newestSequenceNumber = guessedNonWrappedSequenceNumber;
     _newestSequenceNumberTime = now;
+    
+    return -1;
 }
 
-EmiPacketSequenceNumber EmiLossList::calculateNak(EmiTimeInterval now, EmiTimeInterval rtt) {
-    LossSetRIter iter = _lossSet.rbegin();
-    LossSetRIter end  = _lossSet.rend();
+EmiPacketSequenceNumber EmiLossList::calculateNak(EmiTimeInterval now, EmiTimeInterval rtt, EmiTimeInterval srtt) {
+    // The reordering delay is at least a quarter of an RTT, but never
+    // more than a full RTT
+    EmiTimeInterval reorderingRtt = (-1 == srtt ? rtt : srtt);
+    EmiTimeInterval reorderingDelay = std::min(std::max(reorderingRtt/4, _reorderingDelay), reorderingRtt);
+    
+    EmiNonWrappingPacketSequenceNumber sn = newestLostAtOrBefore(_newestSequenceNumber);
     
-    while (iter != end) {
-        const LostPacketRange& lpr(*iter);
+    while (-1 != sn) {
+        EmiNonWrappingPacketSequenceNumber start = rangeStart(sn);
+        const Feedback& fb(feedback(start));
         
-        if (lpr.lastFeedbackTime + rtt*(2+lpr.numFeedbacks) > now) {
-            // Bingo! We found the LostPacket we wanted.
-            LostPacketRange newLpr(lpr);
-            newLpr.numFeedbacks++;
-            newLpr.oldestSequenceNumber = newLpr.oldestSequenceNumber+1;
-            newLpr.lastFeedbackTime = now;
-            EmiNonWrappingPacketSequenceNumber nak = lpr.oldestSequenceNumber;
+        if (0 == fb.numFeedbacks &&
+            _newestSequenceNumber-start < _reorderingThreshold &&
+            now-fb.lossTime < reorderingDelay) {
+            // The packets might just be reordered. Don't NAK them yet.
+        }
+        else if (fb.lastFeedbackTime + rtt*(2+fb.numFeedbacks) > now) {
+            // Bingo! We found the range we wanted.
+            Feedback newFb;
+            newFb.lastFeedbackTime = now;
+            newFb.numFeedbacks = fb.numFeedbacks+1;
+            newFb.lossTime = fb.lossTime;
             
-            // Remove all LostPackets that are older or as old as lpr in _lossSet
-            _lossSet.erase(_lossSet.begin(), ++_lossSet.find(*iter));
+            // Remove the NAKed packet and all lost packets that
+            // are older than it
+            setLost(_base, start, false);
+            nakedWord(start) |= nakedBit(start);
             
-            // Replace lp with a new object with incremented
-            // numFeedbacks and oldestSequenceNumber, and updated
+            // The rest of the range, if any, starts at the next
+            // packet, with incremented numFeedbacks and updated
             // lastFeedbackTime
-            if (newLpr.oldestSequenceNumber <= newLpr.newestSequenceNumber) {
-                _lossSet.insert(newLpr);
+            if (isLost(start+1)) {
+                feedback(start+1) = newFb;
             }
             
-            // Exit the loop early and return the sequence number we found
-            return nak & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            return start & EMI_PACKET_SEQUENCE_NUMBER_MASK;
         }
         
-        ++iter;
+        sn = newestLostAtOrBefore(start-1);
     }
     
     // We did not find any applicable packet.
@@ -12,7 +12,7 @@
 #include "EmiTypes.h"
 #include "EmiNetUtil.h"
 
-#include <set>
+#include <stdint.h>
 
 // This class implements the logic required to know which NAKs to
 // send out, if any.
@@ -26,59 +26,122 @@
 // Also, once a NAK has been sent, we will never send an older
 // sequence number as a NAK. This allows EmiLossList to prune old
 // lost packets.
+//
+// The lost packets are stored as a bitmap over the WINDOW_SIZE
+// packets up to and including the newest received packet; losses
+// that fall out of the window are forgotten. A lost packet range
+// is a run of set bits, and its feedback state is stored at the
+// index of its first packet. All sequence numbers are non-wrapping,
+// so the bitmap is unaffected by 24 bit wraparound.
+//
+// Packets that arrive out of order should not be NAKed, so a lost
+// packet is not NAKed until packets that are at least the reordering
+// threshold newer have arrived, or until the reordering delay has
+// passed since the loss was detected. Both adapt to the reordering
+// that is observed: they grow to cover each packet that arrives late,
+// and shrink slowly while packets arrive in order.
+//
+// NAKed packets are remembered, so that if one of them arrives after
+// all, the NAK can be reported as spurious to the other host.
 class EmiLossList {
+    static const size_t WINDOW_SIZE = 4096;
+    static const size_t BITS_PER_WORD = 64;
+    static const size_t NUM_WORDS = WINDOW_SIZE/BITS_PER_WORD;
     
-    struct LostPacketRange {
-        LostPacketRange(EmiTimeInterval lastFeedbackTime_,
-                        EmiNonWrappingPacketSequenceNumber oldestSequenceNumber_,
-                        EmiNonWrappingPacketSequenceNumber newestSequenceNumber_) :
-        oldestSequenceNumber(oldestSequenceNumber_),
-        newestSequenceNumber(newestSequenceNumber_),
-        lastFeedbackTime(lastFeedbackTime_),
-        numFeedbacks(0) {}
-        
-        EmiNonWrappingPacketSequenceNumber oldestSequenceNumber;
-        EmiNonWrappingPacketSequenceNumber newestSequenceNumber;
-        EmiTimeInterval                    lastFeedbackTime;
-        uint32_t                           numFeedbacks;
-        
-        inline bool operator<(const LostPacketRange& other) const {
-            // TODO What happens here when the sequence number has wrapped?
-            return newestSequenceNumber < other.newestSequenceNumber;
-        }
+    static const EmiNonWrappingPacketSequenceNumber MIN_REORDERING_THRESHOLD = 3;
+    static const EmiNonWrappingPacketSequenceNumber MAX_REORDERING_THRESHOLD = WINDOW_SIZE/16;
+    // The reordering threshold and delay shrink by 1/8 each time this
+    // many packets have been received without any reordering
+    static const size_t REORDERING_DECAY_PACKETS = 1024;
+    
+    struct Feedback {
+        EmiTimeInterval lastFeedbackTime;
+        uint32_t        numFeedbacks;
+        // The time when the packets were detected to be lost
+        EmiTimeInterval lossTime;
     };
     
-    typedef std::set<LostPacketRange> LossSet;
-    typedef LossSet::iterator         LossSetIter;
-    typedef LossSet::reverse_iterator LossSetRIter;
+    // Private copy constructor and assignment operator
+    inline EmiLossList(const EmiLossList& other);
+    inline EmiLossList& operator=(const EmiLossList& other);
     
     EmiNonWrappingPacketSequenceNumber _newestSequenceNumber;
     EmiTimeInterval _newestSequenceNumberTime;
-    // EmiLossList maintains the invariant that any oldestSequenceNumber
-    // of a LostPacketRange in the set is greater than the previous
-    // LostPacketRange's newestSequenceNumber.
-    LossSet _lossSet;
+    // The oldest sequence number in the window. The bits of all
+    // sequence numbers outside of [_base, _newestSequenceNumber]
+    // are always cleared.
+    EmiNonWrappingPacketSequenceNumber _base;
+    // Bit n & (WINDOW_SIZE-1) is set if packet n is lost
+    uint64_t _lost[NUM_WORDS];
+    // Indexed like _lost. Bit n & (WINDOW_SIZE-1) is set if packet n
+    // has been NAKed and has not arrived since.
+    uint64_t _naked[NUM_WORDS];
+    // Indexed like _lost. Allocated when the first loss is recorded.
+    Feedback *_feedback;
+    
+    EmiNonWrappingPacketSequenceNumber _reorderingThreshold;
+    // 0 until reordering has been observed
+    EmiTimeInterval _reorderingDelay;
+    size_t _packetsSinceReordering;
+    
+    inline uint64_t& word(EmiNonWrappingPacketSequenceNumber sn) {
+        return _lost[(sn/BITS_PER_WORD) & (NUM_WORDS-1)];
+    }
+    inline uint64_t& nakedWord(EmiNonWrappingPacketSequenceNumber sn) {
+        return _naked[(sn/BITS_PER_WORD) & (NUM_WORDS-1)];
+    }
+    inline uint64_t nakedBit(EmiNonWrappingPacketSequenceNumber sn) const {
+        return 1ULL << (sn % BITS_PER_WORD);
+    }
+    inline Feedback& feedback(EmiNonWrappingPacketSequenceNumber sn) {
+        return _feedback[sn & (WINDOW_SIZE-1)];
+    }
+    inline bool isLost(EmiNonWrappingPacketSequenceNumber sn) {
+        return sn >= _base && sn <= _newestSequenceNumber &&
+            (word(sn) >> (sn % BITS_PER_WORD)) & 1;
+    }
+    
+    // Sets or clears the bits of [first, last]
+    void setLost(EmiNonWrappingPacketSequenceNumber first,
+                 EmiNonWrappingPacketSequenceNumber last,
+                 bool lost);
+    // Returns the newest lost packet in [_base, sn], or -1
+    EmiNonWrappingPacketSequenceNumber newestLostAtOrBefore(EmiNonWrappingPacketSequenceNumber sn);
+    // Returns the first packet of the lost range that contains sn
+    EmiNonWrappingPacketSequenceNumber rangeStart(EmiNonWrappingPacketSequenceNumber sn);
+    // Moves the window forward so that it starts at newBase
+    void slide(EmiNonWrappingPacketSequenceNumber newBase);
+    // Widens the reordering threshold and delay to cover a packet
+    // that arrived distance packets and delay seconds late
+    void gotReorderedPacket(EmiNonWrappingPacketSequenceNumber distance,
+                            EmiTimeInterval delay);
     
 public:
     EmiLossList();
     virtual ~EmiLossList();
     
-    // Amortized complexity of this method is at worst O(log n) where
-    // n is the size of _lossSet. When all packets arrive exactly once
-    // and in order, complexity is O(1).
-    void gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber);
+    // Complexity of this method is O(1), except when the window
+    // slides past lost packets, which costs O(WINDOW_SIZE/64).
+    //
+    // Returns the sequence number of the packet if it has been NAKed,
+    // which means that the NAK was spurious. Otherwise returns -1.
+    EmiPacketSequenceNumber gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber);
     
     // Should be called on NAK timeouts. Calculates the current value
     // to send as NAK. Returns -1 if no NAK should be sent.
     //
-    // This method is potentially rather slow. It's intended to be
-    // invoked exactly once per NAK timeout.
+    // rtt is the base of the interval between repeated NAKs of a lost
+    // range. srtt is used to bound the reordering delay, and can be
+    // -1 if it is not known yet.
+    //
+    // The lost ranges are found by scanning the bitmap a word at a
+    // time, so this is O(WINDOW_SIZE/64) in the number of words plus
+    // the number of ranges that are not eligible for a NAK.
     //
     // Note that this method is not free of side effects; it increases
-    // the numFeedbacks field of the LostPacketRange object in question.
-    // It also prunes LostPacketRanges that are older than the one
-    // returned.
-    EmiPacketSequenceNumber calculateNak(EmiTimeInterval now, EmiTimeInterval rtt);
+    // the numFeedbacks of the lost range in question. It also prunes
+    // the lost ranges that are older than the one returned.
+    EmiPacketSequenceNumber calculateNak(EmiTimeInterval now, EmiTimeInterval rtt, EmiTimeInterval srtt);
 };
 
 #endif
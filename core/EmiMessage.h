@@ -13,13 +13,32 @@
 #include "EmiConnTime.h"
 #include "EmiNetUtil.h"
 #include "EmiPacketHeader.h"
+#include "EmiListLink.h"
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 
+// Messages with at most this many bytes of data store the data in
+// the EmiMessage object itself
+#define EMI_MESSAGE_INLINE_DATA_SIZE (64)
+
+template<class Binding>
+class EmiSenderBuffer;
+template<class Binding>
+class EmiMessagePool;
+
 // A message, as it is represented in the sender side of the pipeline
+//
+// Messages are allocated from, and recycled into, an EmiMessagePool.
+// Reliable messages are linked into the retransmission list of the
+// EmiSenderBuffer that they are registered in; free messages are
+// linked into the free list of their pool.
 template<class Binding>
-class EmiMessage {
+class EmiMessage : private EmiListLink {
+    friend class EmiSenderBuffer<Binding>;
+    friend class EmiMessagePool<Binding>;
+    
 private:
     typedef typename Binding::PersistentData PersistentData;
     
@@ -27,10 +46,28 @@ private:
     inline EmiMessage(const EmiMessage& other);
     inline EmiMessage& operator=(const EmiMessage& other);
     
+    EmiMessagePool<Binding> *_pool;
     size_t _refCount;
     
+    // The data of the message is the _dataLength bytes at
+    // _dataOffset of either _data (if _hasPersistentData), the _data
+    // of _dataOwner (if it is not NULL) or _inlineData.
+    //
+    // The fragments of a split message are views into the data of
+    // the first fragment, which they retain.
+    bool           _hasPersistentData;
+    PersistentData _data;
+    EmiMessage    *_dataOwner;
+    size_t         _dataOffset;
+    size_t         _dataLength;
+    uint8_t        _inlineData[EMI_MESSAGE_INLINE_DATA_SIZE];
+    
     inline void commonInit() {
         _refCount = 1;
+        _hasPersistentData = false;
+        _dataOwner = NULL;
+        _dataOffset = 0;
+        _dataLength = 0;
         registrationTime = 0;
         channelQualifier = EMI_CHANNEL_QUALIFIER_DEFAULT;
         nonWrappingSequenceNumber = 0;
@@ -38,6 +75,29 @@ private:
         priority = EMI_PRIORITY_DEFAULT;
     }
     
+    inline void releaseData() {
+        if (_hasPersistentData) {
+            Binding::releasePersistentData(_data);
+            _data = PersistentData();
+            _hasPersistentData = false;
+        }
+        if (_dataOwner) {
+            _dataOwner->release();
+            _dataOwner = NULL;
+        }
+        _dataOffset = 0;
+        _dataLength = 0;
+    }
+    
+    // Only EmiMessagePool creates and destroys messages
+    EmiMessage() : _pool(NULL), _data() {
+        commonInit();
+    }
+    
+    ~EmiMessage() {
+        releaseData();
+    }
+    
 public:
     
     // The caller is responsible for releasing the returned object
@@ -58,26 +118,72 @@ public:
         return endpointLen;
     }
     
+    inline void retain() {
+        _refCount++;
+    }
+    
+    inline void release() {
+        _refCount--;
+        if (0 == _refCount) {
+            releaseData();
+            _pool->recycle(this);
+        }
+    }
+    
+    // Sets the data of the message to length bytes at offset of data.
+    // EmiMessage assumes ownership of the PersistentData object.
+    inline void setData(const PersistentData& data, size_t offset, size_t length) {
+        ASSERT(!hasData());
+        ASSERT(offset+length <= Binding::extractLength(data));
+        _data = data;
+        _hasPersistentData = true;
+        _dataOffset = offset;
+        _dataLength = length;
+    }
+    
     // EmiMessage assumes ownership of the PersistentData object
-    explicit EmiMessage(PersistentData data_) : data(data_) {
-        commonInit();
+    inline void setData(const PersistentData& data) {
+        setData(data, 0, Binding::extractLength(data));
     }
     
-    EmiMessage() : data() {
-        commonInit();
+    // Sets the data of the message to length bytes at offset of the
+    // PersistentData of owner, without copying it. owner is retained
+    // until this message is released.
+    inline void setDataView(EmiMessage *owner, size_t offset, size_t length) {
+        ASSERT(!hasData() && owner->_hasPersistentData);
+        ASSERT(offset+length <= Binding::extractLength(owner->_data));
+        owner->retain();
+        _dataOwner = owner;
+        _dataOffset = offset;
+        _dataLength = length;
     }
     
-    ~EmiMessage() {
-        Binding::releasePersistentData(data);
+    // Copies the data into the message. length must not be greater
+    // than EMI_MESSAGE_INLINE_DATA_SIZE.
+    inline void copyData(const uint8_t *data, size_t length) {
+        ASSERT(!hasData() && length <= EMI_MESSAGE_INLINE_DATA_SIZE);
+        memcpy(_inlineData, data, length);
+        _dataLength = length;
     }
     
-    inline void retain() {
-        _refCount++;
+    inline bool hasData() const {
+        return _hasPersistentData || _dataOwner || 0 != _dataLength;
     }
     
-    inline void release() {
-        _refCount--;
-        if (0 == _refCount) delete this;
+    inline const uint8_t *getData() const {
+        if (_hasPersistentData) {
+            return Binding::extractData(_data)+_dataOffset;
+        }
+        else if (_dataOwner) {
+            return Binding::extractData(_dataOwner->_data)+_dataOffset;
+        }
+        else {
+            return _inlineData;
+        }
+    }
+    
+    inline size_t getDataLength() const {
+        return _dataLength;
     }
     
     static inline const size_t maximalHeaderSize() {
@@ -90,7 +196,7 @@ public:
     // on the wire. Note that EmiSendQueue relies on this method to
     // always return the same value given the same message.
     size_t approximateSize() const {
-        return maximalHeaderSize() + Binding::extractLength(data);
+        return maximalHeaderSize() + getDataLength();
     }
     
     // THIS FIELD IS INTENDED TO BE USED ONLY BY EmiSenderBuffer!
@@ -104,7 +210,6 @@ public:
     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber;
     EmiMessageFlags flags;
     EmiPriority priority;
-    const PersistentData data;
     
     // Returns 0 if buffer was not big enough to accomodate the message
     static size_t writeMsg(uint8_t *buf,
@@ -191,7 +191,8 @@ private:
                     conn = _delegate.makeServerConnection(remoteAddress, inboundPort);
                 }
                 
-                conn->opened(inboundAddress, now, header.sequenceNumber);
+                conn->opened(inboundAddress, now, header.sequenceNumber,
+                             !!(header.flags & EMI_EXTENSIONS_FLAG));
             }
         }
         else if (synFlag && rstFlag) {
@@ -221,7 +222,8 @@ private:
                 ENSURE_CONN("SYN-RST");
                 ENSURE(conn->isOpening(), "Got SYN-RST message for open connection");
                 
-                if (!conn->gotSynRst(now, inboundAddress, header.sequenceNumber)) {
+                if (!conn->gotSynRst(now, inboundAddress, header.sequenceNumber,
+                                     !!(header.flags & EMI_EXTENSIONS_FLAG))) {
                     err = "Failed to process SYN-RST message";
                     return false;
                 }
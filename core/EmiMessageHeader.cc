@@ -69,7 +69,6 @@ bool EmiMessageHeader::parseNextMessage(const uint8_t *buf, size_t bufSize,
         }
         
         *offset += header->headerLength+header->length;
-        if (header->flags & EMI_SACK_FLAG) return false;
         
         return true;
     }
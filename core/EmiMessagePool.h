@@ -0,0 +1,77 @@
+//
+//  EmiMessagePool.h
+//  eminet
+//
+
+#ifndef eminet_EmiMessagePool_h
+#define eminet_EmiMessagePool_h
+
+#include "EmiMessage.h"
+#include "EmiListLink.h"
+#include "EmiNetUtil.h"
+
+#include <vector>
+
+// Allocates EmiMessage objects in blocks, and keeps the messages
+// that have been released in a free list for reuse. Once the pool
+// has grown to the number of messages that a connection has in
+// flight, sending a message does not allocate.
+//
+// The pool must outlive all messages that are allocated from it.
+template<class Binding>
+class EmiMessagePool {
+    typedef EmiMessage<Binding> EM;
+    
+    static const size_t BLOCK_SIZE = 32;
+    
+    // Private copy constructor and assignment operator
+    inline EmiMessagePool(const EmiMessagePool& other);
+    inline EmiMessagePool& operator=(const EmiMessagePool& other);
+    
+    std::vector<EM *> _blocks;
+    EmiListLink _free;
+    
+    void grow() {
+        EM *block = new EM[BLOCK_SIZE];
+        _blocks.push_back(block);
+        
+        for (size_t i=0; i<BLOCK_SIZE; i++) {
+            block[i]._pool = this;
+            _free.pushBack(&block[i]);
+        }
+    }
+    
+public:
+    EmiMessagePool() {}
+    
+    virtual ~EmiMessagePool() {
+        typename std::vector<EM *>::iterator iter = _blocks.begin();
+        typename std::vector<EM *>::iterator end  = _blocks.end();
+        while (iter != end) {
+            delete [] *iter;
+            ++iter;
+        }
+    }
+    
+    // The caller is responsible for releasing the returned message
+    EM *acquire() {
+        if (_free.isEmpty()) {
+            grow();
+        }
+        
+        // Reuse the most recently released message, which is the
+        // most likely to still be in the cache
+        EM *msg = static_cast<EM *>(_free.prev);
+        msg->EmiListLink::unlink();
+        msg->commonInit();
+        return msg;
+    }
+    
+    // Invoked by EmiMessage::release
+    inline void recycle(EM *msg) {
+        ASSERT(this == msg->_pool);
+        _free.pushBack(msg);
+    }
+};
+
+#endif
@@ -28,7 +28,7 @@ template<class Binding, class Delegate>
 class EmiNatPunchthrough {
     
     typedef EmiRtoTimer<Binding, EmiNatPunchthrough> ERT;
-    typedef typename Binding::TimerCookie TimerCookie;
+    typedef EmiTimerWheel<Binding> TimerWheel;
     
     friend class EmiRtoTimer<Binding, EmiNatPunchthrough>;
     
@@ -148,7 +148,7 @@ public:
     
     EmiNatPunchthrough(EmiTimeInterval connectionTimeout,
                        Delegate& delegate,
-                       const TimerCookie& timerCookie,
+                       TimerWheel& timerWheel,
                        EmiSequenceNumber initialSequenceNumber,
                        const sockaddr_storage& mediatorAddress,
                        const EmiP2PData& p2p,
@@ -162,7 +162,7 @@ public:
     _time(),
     _rtoTimer(/*disable connection warning:*/-1, connectionTimeout,
               /*initialConnectionTimeout:*/connectionTimeout, _time,
-              timerCookie, *this),
+              timerWheel, *this),
     _isInProxyTeardownPhase(false),
     _endpoints(endpoints),
     _peerInnerAddr(peerInnerAddr),
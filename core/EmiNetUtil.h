@@ -33,15 +33,17 @@ private:
     
 public:
     
+    // The numbers wrap at 2^(8*NUM_BYTES), so for example the
+    // difference between 0 and 0xffffff is 1 when NUM_BYTES is 3
     template<int NUM_BYTES>
     inline static int32_t cyclicDifference(int32_t a, int32_t b) {
-        return (a>=b ? a-b : ((1 << (8*NUM_BYTES))-1)-b+a) & ((1 << (8*NUM_BYTES))-1);
+        return (a-b) & ((1 << (8*NUM_BYTES))-1);
     }
     
     template<int NUM_BYTES>
     inline static int32_t cyclicDifferenceSigned(int32_t a, int32_t b) {
         int32_t res = cyclicDifference<NUM_BYTES>(a, b);
-        return res > ((1 << (8*NUM_BYTES))-1)/2 ? res-((1 << (8*NUM_BYTES))-1) : res;
+        return res >= (1 << (8*NUM_BYTES-1)) ? res-(1 << (8*NUM_BYTES)) : res;
     }
     
     template<int NUM_BYTES>
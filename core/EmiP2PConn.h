@@ -15,8 +15,11 @@
 #include "EmiMessage.h"
 #include "EmiRtoTimer.h"
 #include "EmiAddressCmp.h"
+#include "EmiFlatHashMap.h"
 #include "EmiUdpSocket.h"
 
+#include <algorithm>
+
 template<class Binding, class Delegate, int EMI_P2P_RAND_NUM_SIZE>
 class EmiP2PConn {
 public:
@@ -25,6 +28,10 @@ public:
     public:
         uint8_t randNum[EMI_P2P_RAND_NUM_SIZE];
         
+        ConnCookieRandNum() {
+            memset(randNum, 0, sizeof(randNum));
+        }
+        
         ConnCookieRandNum(const uint8_t *cookie_, size_t cookieLength) {
             ASSERT(cookieLength >= EMI_P2P_RAND_NUM_SIZE);
             memcpy(randNum, cookie_, sizeof(randNum));
@@ -35,6 +42,21 @@ public:
         }
         inline ConnCookieRandNum& operator=(const ConnCookieRandNum& other) {
             memcpy(randNum, other.randNum, sizeof(randNum));
+            return *this;
+        }
+        
+        inline bool operator==(const ConnCookieRandNum& rhs) const {
+            return 0 == memcmp(randNum, rhs.randNum, sizeof(randNum));
+        }
+        
+        inline uint64_t hash(uint64_t seed) const {
+            uint64_t h = seed;
+            for (size_t i=0; i<sizeof(randNum); i+=sizeof(uint64_t)) {
+                uint64_t word = 0;
+                memcpy(&word, randNum+i, std::min(sizeof(word), sizeof(randNum)-i));
+                h = EmiHash::combine(h, word);
+            }
+            return h;
         }
         
         inline bool operator<(const ConnCookieRandNum& rhs) const {
@@ -46,8 +68,8 @@ private:
     
     typedef typename Binding::SocketHandle    SocketHandle;
     typedef typename Binding::TemporaryData   TemporaryData;
-    typedef typename Binding::Timer           Timer;
-    typedef typename Binding::TimerCookie     TimerCookie;
+    typedef EmiWheelTimer<Binding>            Timer;
+    typedef EmiTimerWheel<Binding>            TimerWheel;
     
     typedef EmiRtoTimer<Binding, EmiP2PConn> ERT;
     
@@ -80,7 +102,7 @@ private:
     
     ERT                    _rtoTimer0;
     ERT                    _rtoTimer1;
-    Timer                 *_rateLimitTimer;
+    Timer                  _rateLimitTimer;
     
     // Returns -1 on error
     int addressIndex(const sockaddr_storage& address) const {
@@ -143,7 +165,7 @@ public:
     const ConnCookieRandNum cookie;
     
     EmiP2PConn(Delegate& delegate,
-               const TimerCookie& timerCookie,
+               TimerWheel& timerWheel,
                EmiSequenceNumber initialSequenceNumber,
                const ConnCookieRandNum &cookie_,
                bool firstPeerHadComplementaryCookie,
@@ -159,9 +181,9 @@ public:
     _times(),
     _rateLimit(rateLimit),
     _bytesSentSinceRateLimitTimeout(0),
-    _rtoTimer0(/*timeBeforeConnectionWarning:*/-1, connectionTimeout, initialConnectionTimeout, _times[0], timerCookie, *this),
-    _rtoTimer1(/*timeBeforeConnectionWarning:*/-1, connectionTimeout, initialConnectionTimeout, _times[1], timerCookie, *this),
-    _rateLimitTimer(rateLimit ? Binding::makeTimer(timerCookie) : NULL) {
+    _rtoTimer0(/*timeBeforeConnectionWarning:*/-1, connectionTimeout, initialConnectionTimeout, _times[0], timerWheel, *this),
+    _rtoTimer1(/*timeBeforeConnectionWarning:*/-1, connectionTimeout, initialConnectionTimeout, _times[1], timerWheel, *this),
+    _rateLimitTimer(timerWheel) {
         int family = firstPeer.ss_family;
         
         _peers[0] = firstPeer;
@@ -177,17 +199,12 @@ public:
         EmiNetUtil::fillNilAddress(family, _synRstInboundAddr);
         
         if (rateLimit) {
-            Binding::scheduleTimer(_rateLimitTimer, rateLimitTimeoutCallback,
-                                   this, 1, /*repeating:*/true, /*reschedule:*/true);
+            _rateLimitTimer.schedule(rateLimitTimeoutCallback,
+                                     this, 1, /*repeating:*/true, /*reschedule:*/true);
         }
     }
     
-    virtual ~EmiP2PConn() {
-        // _rateLimitTimer is never created if 0 == _rateLimit
-        if (_rateLimitTimer) {
-            Binding::freeTimer(_rateLimitTimer);
-        }
-    }
+    virtual ~EmiP2PConn() {}
     
     void gotPacket(const sockaddr_storage& address,
                    const EmiPacketHeader& packetHeader,
@@ -15,14 +15,15 @@
 #include "EmiP2PConn.h"
 #include "EmiMessageHeader.h"
 #include "EmiMessage.h"
-#include "EmiAddressCmp.h"
+#include "EmiEndpointKey.h"
+#include "EmiFlatHashMap.h"
 #include "EmiUdpSocket.h"
 #include "EmiPacketHeader.h"
 #include "EmiNetRandom.h"
+#include "EmiTimerWheel.h"
 
 #include <algorithm>
 #include <cmath>
-#include <map>
 #include <utility>
 
 static const EmiTimeInterval EMI_P2P_COOKIE_RESOLUTION  = 5*60; // In seconds
@@ -41,23 +42,23 @@ protected:
     typedef typename Binding::TemporaryData TemporaryData;
     typedef typename Binding::Error         Error;
     typedef typename Binding::TimerCookie   TimerCookie;
+    typedef EmiTimerWheel<Binding>          TimerWheel;
     
     typedef EmiP2PConn<Binding, EmiP2PSock, EMI_P2P_RAND_NUM_SIZE> Conn;
     typedef EmiUdpSocket<Binding> EUS;
     
     typedef EmiP2PSockConfig                                 SockConfig;
     typedef typename Conn::ConnCookieRandNum                 ConnCookieRandNum;
-    typedef std::map<sockaddr_storage, Conn*, EmiAddressCmp> ConnMap;
-    typedef typename ConnMap::iterator                       ConnMapIter;
-    typedef std::map<ConnCookieRandNum, Conn*>               ConnCookieMap;
-    typedef typename ConnCookieMap::iterator                 ConnCookieMapIter;
+    typedef EmiFlatHashMap<EmiEndpointKey, Conn*>            ConnMap;
+    typedef EmiFlatHashMap<ConnCookieRandNum, Conn*>         ConnCookieMap;
     
 private:
     // Private copy constructor and assignment operator
     inline EmiP2PSock(const EmiP2PSock& other);
     inline EmiP2PSock& operator=(const EmiP2PSock& other);
     
-    TimerCookie _timerCookie;
+    // All timers of the connections are driven by this wheel
+    TimerWheel *_timerWheel;
     
     sockaddr_storage _address;
     
@@ -142,8 +143,8 @@ private:
     }
     
     Conn *findConn(const sockaddr_storage& address) {
-        ConnMapIter cur = _conns.find(address);
-        return _conns.end() == cur ? NULL : (*cur).second;
+        Conn **conn = _conns.find(EmiEndpointKey(address));
+        return conn ? *conn : NULL;
     }
     
     void gotConnectionOpen(EmiTimeInterval now,
@@ -177,12 +178,12 @@ private:
             // Check to see if we have a connection with this cookie
             ConnCookieRandNum cc(cookie, cookieLength);
             
-            ConnCookieMapIter cur = _connCookies.find(cc);
+            Conn **cookieConn = _connCookies.find(cc);
             
-            if (_connCookies.end() != cur) {
+            if (cookieConn) {
                 // There was a connection open with this cookie
                 
-                conn = (*cur).second;
+                conn = *cookieConn;
                 
                 if (conn->firstPeerHadComplementaryCookie() == cookieIsComplementary) {
                     // This happens if we get a SYN message with the same cookie data
@@ -197,24 +198,24 @@ private:
                 }
                 
                 // We don't need to save the cookie anymore
-                _connCookies.erase(cur);
+                _connCookies.erase(cc);
                 
                 conn->gotOtherAddress(inboundAddress, remoteAddress, initialSequenceNumber);
             }
             else {
                 // There was no connection open with this cookie. Open a new one
                 
-                conn = new Conn(*this, _timerCookie,
+                conn = new Conn(*this, *_timerWheel,
                                 initialSequenceNumber,
                                 cc, cookieIsComplementary,
                                 sock, remoteAddress,
                                 config.connectionTimeout,
                                 config.initialConnectionTimeout,
                                 config.rateLimit);
-                _connCookies.insert(std::make_pair(cc, conn));
+                _connCookies.insert(cc, conn);
             }
             
-            _conns.insert(std::make_pair(remoteAddress, conn));
+            _conns.insert(EmiEndpointKey(remoteAddress), conn);
         }
         
         // Regardless of whether we had an EmiP2PConn object set up
@@ -271,8 +272,8 @@ public:
     // conn might be NULL. In that case, this is a no-op
     void removeConnection(Conn *conn) {
         if (conn) {
-            _conns.erase(conn->getFirstAddress());
-            _conns.erase(conn->getOtherAddress());
+            _conns.erase(EmiEndpointKey(conn->getFirstAddress()));
+            _conns.erase(EmiEndpointKey(conn->getOtherAddress()));
             _connCookies.erase(conn->cookie);
             
             delete conn;
@@ -282,7 +283,10 @@ public:
     const SockConfig config;
     
     EmiP2PSock(const SockConfig& config_, const TimerCookie& timerCookie) :
-    _timerCookie(timerCookie), _socket(NULL), config(config_) {
+    _timerWheel(new TimerWheel(timerCookie)), _socket(NULL),
+    _conns(EmiNetRandom<Binding>::random()),
+    _connCookies(EmiNetRandom<Binding>::random()),
+    config(config_) {
         Binding::randomBytes(_serverSecret, sizeof(_serverSecret));
     }
     virtual ~EmiP2PSock() {
@@ -291,12 +295,13 @@ public:
             _socket = NULL;
         }
         
-        ConnMapIter iter = _conns.begin();
-        ConnMapIter end  = _conns.end();
-        while (iter != end) {
-            delete (*iter).second;
-            ++iter;
+        // Each conn can have two entries in _conns, so they
+        // can't just be deleted while iterating over the map
+        while (!_conns.empty()) {
+            removeConnection(_conns.begin().value());
         }
+        
+        _timerWheel->release();
     }
     
     bool isOpen() const {
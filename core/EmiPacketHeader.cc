@@ -22,6 +22,7 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
                                        bool *hasArrivalRate, 
                                        bool *hasRttRequest,
                                        bool *hasRttResponse,
+                                       bool *hasSpuriousNak,
                                        size_t *fillerSizePtr, // Can be NULL
                                        size_t *expectedSize) {
     size_t fillerSize = 0;
@@ -34,6 +35,7 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     *hasRttRequest     = !!(flags & EMI_RTT_REQUEST_PACKET_FLAG);
     *hasRttResponse    = !!(flags & EMI_RTT_RESPONSE_PACKET_FLAG);
     bool hasExtraFlags = !!(flags & EMI_EXTRA_FLAGS_PACKET_FLAG);
+    *hasSpuriousNak    = hasExtraFlags && !!(extraFlags & EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG);
     
     // 1 for the flags byte
     *expectedSize = sizeof(EmiPacketFlags);
@@ -41,10 +43,10 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     if (hasExtraFlags) {
         *expectedSize += 1; // The packet extra flags byte
         
-        if (flags & EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG) {
+        if (extraFlags & EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG) {
             fillerSize = 1;
         }
-        else if (flags & EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG) {
+        else if (extraFlags & EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG) {
             fillerSize = 2;
         }
         else {
@@ -64,17 +66,20 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     *expectedSize += (*hasLinkCapacity   ? sizeof(float) : 0);
     *expectedSize += (*hasArrivalRate    ? sizeof(float) : 0);
     *expectedSize += (*hasRttResponse    ? EMI_PACKET_SEQUENCE_NUMBER_LENGTH+sizeof(uint8_t) : 0);
+    *expectedSize += (*hasSpuriousNak    ? EMI_PACKET_SEQUENCE_NUMBER_LENGTH : 0);
 }
 
 EmiPacketHeader::EmiPacketHeader() :
 flags(0),
+extraFlags(0),
 sequenceNumber(0),
 ack(0),
 nak(0),
 linkCapacity(0),
 arrivalRate(0),
 rttResponse(0),
-rttResponseDelay(0) {}
+rttResponseDelay(0),
+spuriousNak(0) {}
 
 EmiPacketHeader::~EmiPacketHeader() {}
 
@@ -86,12 +91,12 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     EmiPacketFlags flags = buf[0];
     
     EmiPacketExtraFlags extraFlags = (EmiPacketExtraFlags) 0;
-    if (bufSize >= 1) {
+    if (bufSize >= 2) {
         extraFlags = (EmiPacketExtraFlags) buf[1];
     }
     
     bool hasSequenceNumber, hasAck, hasNak, hasLinkCapacity;
-    bool hasArrivalRate, hasRttRequest, hasRttResponse;
+    bool hasArrivalRate, hasRttRequest, hasRttResponse, hasSpuriousNak;
     size_t expectedSize, fillerSize;
     extractFlagsAndSize(flags,
                         extraFlags,
@@ -102,6 +107,7 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
                         &hasArrivalRate, 
                         &hasRttRequest,
                         &hasRttResponse,
+                        &hasSpuriousNak,
                         &fillerSize,
                         &expectedSize);
     
@@ -121,6 +127,7 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     }
     
     header->flags = flags;
+    header->extraFlags = 0;
     header->sequenceNumber = 0;
     header->ack = 0;
     header->nak = 0;
@@ -128,10 +135,13 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     header->arrivalRate = 0.0f;
     header->rttResponse = 0;
     header->rttResponseDelay = 0;
+    header->spuriousNak = 0;
     
     const uint8_t *bufCur = buf+sizeof(header->flags);
     
     if (flags & EMI_EXTRA_FLAGS_PACKET_FLAG) {
+        header->extraFlags = extraFlags & ~(EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG |
+                                            EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG);
         bufCur += 1; // The packet extra flags byte
         bufCur += fillerSize;
     }
@@ -152,14 +162,20 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     }
     
     if (hasLinkCapacity) {
-        uint32_t linkCapacityInt = ntohl(*reinterpret_cast<const uint32_t *>(bufCur));
-        header->linkCapacity = *reinterpret_cast<float *>(&linkCapacityInt);
+        // memcpy, because the float is neither aligned nor allowed to
+        // be read through a uint32_t pointer
+        uint32_t linkCapacityInt;
+        memcpy(&linkCapacityInt, bufCur, sizeof(linkCapacityInt));
+        linkCapacityInt = ntohl(linkCapacityInt);
+        memcpy(&header->linkCapacity, &linkCapacityInt, sizeof(header->linkCapacity));
         bufCur += sizeof(header->linkCapacity);
     }
     
     if (hasArrivalRate) {
-        uint32_t arrivalRateInt = ntohl(*reinterpret_cast<const uint32_t *>(bufCur));
-        header->arrivalRate = *reinterpret_cast<float *>(&arrivalRateInt);
+        uint32_t arrivalRateInt;
+        memcpy(&arrivalRateInt, bufCur, sizeof(arrivalRateInt));
+        arrivalRateInt = ntohl(arrivalRateInt);
+        memcpy(&header->arrivalRate, &arrivalRateInt, sizeof(header->arrivalRate));
         bufCur += sizeof(header->arrivalRate);
     }
     
@@ -171,6 +187,11 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
         bufCur += sizeof(header->rttResponseDelay);
     }
     
+    if (hasSpuriousNak) {
+        header->spuriousNak = EmiNetUtil::read24(bufCur);
+        bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
+    }
+    
     if (headerLength) {
         *headerLength = expectedSize;
     }
@@ -184,10 +205,19 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
     }
     
     bool hasSequenceNumber, hasAck, hasNak, hasLinkCapacity;
-    bool hasArrivalRate, hasRttRequest, hasRttResponse;
+    bool hasArrivalRate, hasRttRequest, hasRttResponse, hasSpuriousNak;
     size_t expectedSize;
-    extractFlagsAndSize(header.flags,
-                        (EmiPacketExtraFlags)0,
+    
+    ASSERT(!(header.extraFlags & (EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG |
+                                  EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG)));
+    
+    EmiPacketFlags flags = header.flags & ~EMI_EXTRA_FLAGS_PACKET_FLAG;
+    if (header.extraFlags) {
+        flags |= EMI_EXTRA_FLAGS_PACKET_FLAG;
+    }
+    
+    extractFlagsAndSize(flags,
+                        (EmiPacketExtraFlags)header.extraFlags,
                         &hasSequenceNumber,
                         &hasAck,
                         &hasNak,
@@ -195,6 +225,7 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
                         &hasArrivalRate, 
                         &hasRttRequest,
                         &hasRttResponse,
+                        &hasSpuriousNak,
                         /*fillerSize:*/NULL,
                         &expectedSize);
     
@@ -203,10 +234,15 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
     }
     
     memset(buf, 0, expectedSize);
-    buf[0] = header.flags;
+    buf[0] = flags;
     
     uint8_t *bufCur = buf+sizeof(EmiPacketFlags);
     
+    if (flags & EMI_EXTRA_FLAGS_PACKET_FLAG) {
+        *bufCur = header.extraFlags;
+        bufCur += 1;
+    }
+    
     if (hasSequenceNumber) {
         EmiNetUtil::write24(bufCur, header.sequenceNumber);
         bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
@@ -223,12 +259,18 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
     }
     
     if (hasLinkCapacity) {
-        *((int32_t *)bufCur) = htonl(*reinterpret_cast<const uint32_t *>(&header.linkCapacity));
+        uint32_t linkCapacityInt;
+        memcpy(&linkCapacityInt, &header.linkCapacity, sizeof(linkCapacityInt));
+        linkCapacityInt = htonl(linkCapacityInt);
+        memcpy(bufCur, &linkCapacityInt, sizeof(linkCapacityInt));
         bufCur += sizeof(header.linkCapacity);
     }
     
     if (hasArrivalRate) {
-        *((int32_t *)bufCur) = htonl(*reinterpret_cast<const uint32_t *>(&header.arrivalRate));
+        uint32_t arrivalRateInt;
+        memcpy(&arrivalRateInt, &header.arrivalRate, sizeof(arrivalRateInt));
+        arrivalRateInt = htonl(arrivalRateInt);
+        memcpy(bufCur, &arrivalRateInt, sizeof(arrivalRateInt));
         bufCur += sizeof(header.arrivalRate);
     }
     
@@ -240,6 +282,11 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
         bufCur += sizeof(header.rttResponseDelay);
     }
     
+    if (hasSpuriousNak) {
+        EmiNetUtil::write24(bufCur, header.spuriousNak);
+        bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
+    }
+    
     if (headerLength) {
         *headerLength = expectedSize;
     }
@@ -266,8 +313,10 @@ void EmiPacketHeader::addFillerBytes(uint8_t *buf, size_t packetSize, uint16_t f
         return;
     }
     
-    // Move the packet data
-    std::copy_backward(buf+1, buf+packetSize, buf+packetSize+fillerSize);
+    // Move the packet data, which starts after the extra flags
+    // byte if there is one
+    size_t dataOffset = (buf[0] & EMI_EXTRA_FLAGS_PACKET_FLAG) ? 2 : 1;
+    std::copy_backward(buf+dataOffset, buf+packetSize, buf+packetSize+fillerSize);
     
     // Make sure we have the extra flags byte
     if (!(buf[0] & EMI_EXTRA_FLAGS_PACKET_FLAG)) {
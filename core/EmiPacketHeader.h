@@ -25,6 +25,10 @@ public:
     virtual ~EmiPacketHeader();
     
     EmiPacketFlags flags;
+    // EMI_EXTRA_FLAGS_PACKET_FLAG is set in flags when this is non-zero.
+    // The filler flags are never set in this field; filler is added with
+    // addFillerBytes.
+    uint8_t extraFlags;
     EmiPacketSequenceNumber sequenceNumber; // Set if (flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG)
     EmiPacketSequenceNumber ack; // Set if (flags & EMI_ACK_PACKET_FLAG)
     EmiPacketSequenceNumber nak; // Set if (flags & EMI_NAK_PACKET_FLAG)
@@ -38,6 +42,10 @@ public:
     // is 10 ms.
     uint8_t rttResponseDelay; // Set if (flags & EMI_RTT_RESPONSE_PACKET_FLAG)
     
+    // A NAK that this host has sent earlier, for a packet that has
+    // arrived after all
+    EmiPacketSequenceNumber spuriousNak; // Set if (extraFlags & EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG)
+    
     // Returns true if the parse was successful
     //
     // Note that this method does not check that the entire
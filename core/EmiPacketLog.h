@@ -0,0 +1,142 @@
+//
+//  EmiPacketLog.h
+//  eminet
+//
+
+#ifndef eminet_EmiPacketLog_h
+#define eminet_EmiPacketLog_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+
+#include <stdint.h>
+
+// Remembers which reliable messages were sent in each of the most
+// recently sent packets, so that the messages of a packet that the
+// other host reports as lost can be retransmitted right away.
+//
+// Packets are stored in a ring of NUM_PACKETS slots indexed by
+// their sequence number, and the messages of the packets are
+// appended to a ring of NUM_ENTRIES entries. The information about
+// a packet is forgotten when its slot is reused or when its entries
+// are overwritten; those messages are then left to be retransmitted
+// on RTO timeout.
+//
+// The rings are allocated when the first message is logged.
+class EmiPacketLog {
+    static const size_t NUM_PACKETS = 1024;
+    static const size_t NUM_ENTRIES = 4096;
+    
+    struct Packet {
+        // -1 if the slot is unused
+        EmiPacketSequenceNumber sequenceNumber;
+        // Index of the first entry of the packet, counted from the
+        // first entry that was ever logged
+        uint64_t                firstEntry;
+        size_t                  numEntries;
+    };
+    
+    struct Entry {
+        int32_t                      channelQualifier;
+        EmiNonWrappingSequenceNumber sequenceNumber;
+    };
+    
+    // Private copy constructor and assignment operator
+    inline EmiPacketLog(const EmiPacketLog& other);
+    inline EmiPacketLog& operator=(const EmiPacketLog& other);
+    
+    Packet  *_packets;
+    Entry   *_entries;
+    // The total number of entries that have been logged
+    uint64_t _numEntries;
+    // The packet that messages are logged to, or NULL
+    Packet  *_currentPacket;
+    
+    inline Packet& packet(EmiPacketSequenceNumber sequenceNumber) const {
+        return _packets[sequenceNumber & (NUM_PACKETS-1)];
+    }
+    
+    inline Entry& entry(uint64_t index) const {
+        return _entries[index & (NUM_ENTRIES-1)];
+    }
+    
+public:
+    EmiPacketLog() :
+    _packets(NULL),
+    _entries(NULL),
+    _numEntries(0),
+    _currentPacket(NULL) {}
+    
+    virtual ~EmiPacketLog() {
+        delete [] _packets;
+        delete [] _entries;
+    }
+    
+    // Should be called before the messages of a packet are logged.
+    // If the packet turns out not to be sent, it is fine to begin
+    // another packet with the same sequence number.
+    void beginPacket(EmiPacketSequenceNumber sequenceNumber) {
+        if (!_packets) {
+            _currentPacket = NULL;
+            return;
+        }
+        
+        _currentPacket = &packet(sequenceNumber);
+        _currentPacket->sequenceNumber = sequenceNumber;
+        _currentPacket->firstEntry = _numEntries;
+        _currentPacket->numEntries = 0;
+    }
+    
+    // Logs a reliable message as sent in the packet that was
+    // begun most recently
+    void logMessage(EmiPacketSequenceNumber sequenceNumber,
+                    int32_t channelQualifier,
+                    EmiNonWrappingSequenceNumber messageSequenceNumber) {
+        if (!_packets) {
+            _packets = new Packet[NUM_PACKETS];
+            _entries = new Entry[NUM_ENTRIES];
+            for (size_t i=0; i<NUM_PACKETS; i++) {
+                _packets[i].sequenceNumber = -1;
+            }
+            beginPacket(sequenceNumber);
+        }
+        
+        ASSERT(_currentPacket && sequenceNumber == _currentPacket->sequenceNumber);
+        
+        Entry& e(entry(_numEntries++));
+        e.channelQualifier = channelQualifier;
+        e.sequenceNumber = messageSequenceNumber;
+        _currentPacket->numEntries++;
+    }
+    
+    // Invokes delegate.lostMessage(now, channelQualifier, sequenceNumber)
+    // for each message that was logged for the packet, and forgets
+    // about the packet, so that the messages are reported only
+    // once. Does nothing if the packet is not known.
+    template<class Delegate>
+    void packetLost(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, Delegate& delegate) {
+        if (!_packets) {
+            return;
+        }
+        
+        Packet& p(packet(sequenceNumber));
+        if (sequenceNumber != p.sequenceNumber ||
+            _numEntries-p.firstEntry > NUM_ENTRIES) {
+            // The packet was never logged, or its entries have
+            // been overwritten
+            return;
+        }
+        
+        p.sequenceNumber = -1;
+        if (&p == _currentPacket) {
+            _currentPacket = NULL;
+        }
+        
+        for (size_t i=0; i<p.numEntries; i++) {
+            const Entry& e(entry(p.firstEntry+i));
+            delegate.lostMessage(now, e.channelQualifier, e.sequenceNumber);
+        }
+    }
+};
+
+#endif
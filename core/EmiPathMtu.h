@@ -0,0 +1,194 @@
+//
+//  EmiPathMtu.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2026-10-18.
+//  Copyright (c) 2026 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiPathMtu_h
+#define eminet_EmiPathMtu_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+#include "EmiPacketHeader.h"
+
+#include <cstddef>
+
+// The time between finishing a path MTU search and starting over,
+// to see if the path MTU has grown
+#define EMI_PATH_MTU_RAISE_INTERVAL (600)
+
+// This class implements the sender side logic of packetization
+// layer path MTU discovery (RFC 4821) for one connection.
+//
+// The connection starts out with the configured (and presumably
+// safe) base MTU. It then sends probe packets that are padded to
+// the size to try, and that carry an RTT request. The RTT response
+// of the other host shows that the probe got through, and the MTU
+// is raised to the probe size. A size is given up on when
+// MAX_PROBES probes of that size in a row have gone unanswered for
+// an RTO. The search starts with the maximal MTU, and then bisects
+// the range between the MTU and the smallest size that failed.
+//
+// To detect black holes, the MTU falls back to the base MTU after
+// MAX_RTOS consecutive RTO timeouts without any acked messages.
+//
+// For the probes to tell anything, the packets must be sent with
+// the IP don't fragment bit set.
+class EmiPathMtu {
+    // The number of unanswered probes before a size is given up on
+    static const unsigned MAX_PROBES = 3;
+    // The number of consecutive RTO timeouts before the MTU falls
+    // back to the base MTU
+    static const unsigned MAX_RTOS = 2;
+    // The search is done when the largest size that might work is
+    // within this many bytes of the MTU
+    static const size_t SEARCH_PRECISION = 16;
+
+    const size_t _baseMtu;
+    const size_t _maxMtu;
+
+    size_t _mtu;
+    // The largest size that hasn't been ruled out yet
+    size_t _ceiling;
+
+    // 0 if there is no outstanding probe
+    size_t                  _probeSize;
+    EmiPacketSequenceNumber _probeSequenceNumber;
+    EmiTimeInterval         _probeTime;
+    unsigned                _failedProbes;
+    // The sequence number of the most recent probe, also after it
+    // has been answered or given up on. -1 if no probe has been sent.
+    EmiPacketSequenceNumber _lastProbeSequenceNumber;
+
+    // -1 while a search is in progress
+    EmiTimeInterval _searchDoneTime;
+    unsigned        _rtoCount;
+
+    inline bool searchIsDone() const {
+        return _ceiling < _mtu+SEARCH_PRECISION;
+    }
+
+    inline size_t nextProbeSize() const {
+        // Try the largest size first, because it is the one that
+        // usually works. After that, bisect.
+        return (_ceiling == _maxMtu ? _maxMtu : (_mtu+_ceiling+1)/2);
+    }
+
+    void restartSearch() {
+        _ceiling = _maxMtu;
+        _probeSize = 0;
+        _probeSequenceNumber = -1;
+        _failedProbes = 0;
+        _searchDoneTime = -1;
+    }
+
+public:
+    EmiPathMtu(size_t baseMtu, size_t maxMtu) :
+    _baseMtu(baseMtu),
+    _maxMtu(maxMtu < baseMtu ? baseMtu : maxMtu),
+    _mtu(baseMtu),
+    _lastProbeSequenceNumber(-1),
+    _rtoCount(0) {
+        restartSearch();
+    }
+
+    inline size_t mtu() const {
+        return _mtu;
+    }
+
+    inline size_t maxMtu() const {
+        return _maxMtu;
+    }
+
+    // Returns the size of the probe packet to send now, or 0 if no
+    // probe should be sent. If a probe is sent, sentProbe must be
+    // invoked.
+    size_t probeSize(EmiTimeInterval now, EmiTimeInterval rto) {
+        if (_probeSize) {
+            if (now-_probeTime < rto) {
+                // The probe is still outstanding
+                return 0;
+            }
+
+            // The probe was lost
+            _probeSize = 0;
+            _probeSequenceNumber = -1;
+            _failedProbes++;
+
+            if (_failedProbes >= MAX_PROBES) {
+                _ceiling = nextProbeSize()-1;
+                _failedProbes = 0;
+            }
+        }
+
+        if (searchIsDone()) {
+            if (-1 == _searchDoneTime) {
+                _searchDoneTime = now;
+            }
+            else if (now-_searchDoneTime > EMI_PATH_MTU_RAISE_INTERVAL) {
+                restartSearch();
+            }
+
+            if (searchIsDone()) {
+                return 0;
+            }
+        }
+
+        return nextProbeSize();
+    }
+
+    void sentProbe(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size) {
+        _probeSize = size;
+        _probeSequenceNumber = sequenceNumber;
+        _lastProbeSequenceNumber = sequenceNumber;
+        _probeTime = now;
+    }
+
+    // A probe that is too large is expected to be lost, so a NAK of
+    // it says nothing about congestion, and the probe has no
+    // messages to retransmit. Such NAKs should be ignored.
+    inline bool isProbe(EmiPacketSequenceNumber sequenceNumber) const {
+        return -1 != sequenceNumber && sequenceNumber == _lastProbeSequenceNumber;
+    }
+
+    // Returns true if the MTU changed
+    bool gotPacket(const EmiPacketHeader& header) {
+        if (_probeSize &&
+            header.flags & EMI_RTT_RESPONSE_PACKET_FLAG &&
+            header.rttResponse == _probeSequenceNumber) {
+            // The probe got through
+            _mtu = _probeSize;
+            _probeSize = 0;
+            _probeSequenceNumber = -1;
+            _failedProbes = 0;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Should be called when reliable messages are acked
+    inline void gotAck() {
+        _rtoCount = 0;
+    }
+
+    // Returns true if the MTU changed
+    bool onRto() {
+        _rtoCount++;
+
+        if (_rtoCount >= MAX_RTOS && _mtu != _baseMtu) {
+            // The path MTU has probably shrunk; packets of the
+            // current MTU don't get through anymore.
+            _mtu = _baseMtu;
+            _rtoCount = 0;
+            restartSearch();
+            return true;
+        }
+
+        return false;
+    }
+};
+
+#endif
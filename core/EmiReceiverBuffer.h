@@ -11,9 +11,11 @@
 
 #include "EmiNetUtil.h"
 #include "EmiMessageHeader.h"
+#include "EmiSequenceRing.h"
+#include "EmiChannelSet.h"
+
+#include <sys/types.h>
 
-#include <set>
-#include <map>
 #include <vector>
 
 template<class SockDelegate, class Receiver>
@@ -22,8 +24,7 @@ class EmiReceiverBuffer {
     typedef typename Binding::PersistentData PersistentData;
     typedef typename Binding::TemporaryData  TemporaryData;
     
-    typedef std::map<EmiChannelQualifier, EmiNonWrappingSequenceNumber> EmiNonWrappingSequenceNumberMemo;
-    
+public:
     // The purpose of this class is to encapsulate an efficient
     // algorithm for handling split messages.
     //
@@ -31,128 +32,156 @@ class EmiReceiverBuffer {
     // that arrives is the last one in the split, so we can reconstruct
     // the message and emit it.
     //
-    // See http://avdongre.wordpress.com/2011/12/06/disjoint-set-data-structure-c/
-    // and http://en.wikipedia.org/wiki/Disjoint-set_data_structure
+    // The parts of a split message have contiguous sequence numbers,
+    // so for each channel the class keeps a sorted array of runs of
+    // received parts. Each run knows whether it contains the first
+    // and the last part of a split, and the total size of its parts.
+    // A part that is not the last one of its split is linked to the
+    // sequence number after it, so a run that contains both the
+    // first and the last part of a split contains all of it.
     //
-    // In addition to the conventional disjoint set data structure,
-    // this class keeps track of whether the first and last messages
-    // are present in the set.
-    //
-    // This extra data is required to quickly be able to determine
-    // whether a disjoint set contains all messages in a split.
-    class DisjointMessageSets {
+    // Parts almost always arrive at the end of the newest run, and
+    // old runs are removed from the front, so the common operations
+    // don't move any other runs and don't allocate.
+    class SplitMessageSets {
         
         enum {
-            DISJOINT_SET_HAS_FIRST_MESSAGE = 0x1,
-            DISJOINT_SET_HAS_LAST_MESSAGE  = 0x2
-        } DisjointSetFlags;
-        
-        struct DisjointSet {
-            EmiNonWrappingSequenceNumber parent;
-            unsigned rank;
-            int flags;
-            EmiNonWrappingSequenceNumber firstMessage; // The smallest sequence number in this set
-            EmiNonWrappingSequenceNumber lastMessage;  // The largest  sequence number in this set
-            size_t size; // The total size, in bytes, of the messages in this set
-            
-            DisjointSet(EmiNonWrappingSequenceNumber i) :
-            parent(i),
-            rank(0),
-            flags(0),
-            firstMessage(EMI_NON_WRAPPING_SEQUENCE_NUMBER_MAX),
-            lastMessage(0),
-            size(0) { }
+            RUN_HAS_FIRST_MESSAGE = 0x1,
+            RUN_HAS_LAST_MESSAGE  = 0x2,
+            // The last message of the run is not the last one in
+            // its split, so the run continues with the next message
+            RUN_LINKS_FORWARD     = 0x4
         };
         
-        typedef std::pair<EmiChannelQualifier, EmiNonWrappingSequenceNumber> ForestKey;
-        
-        struct ForestCmp {
-            inline bool operator()(const ForestKey& a, const ForestKey& b) const {
-                return (a.first  != b.first ?
-                        a.first  <  b.first :
-                        a.second <  b.second);
+        struct Run {
+            EmiNonWrappingSequenceNumber firstMessage; // The smallest sequence number in this run
+            EmiNonWrappingSequenceNumber lastMessage;  // The largest  sequence number in this run
+            size_t size; // The total size, in bytes, of the messages in this run
+            int flags;
+            
+            // Returns true if sn is in this run, or if it's the
+            // message that this run is linked forward to
+            inline bool covers(EmiNonWrappingSequenceNumber sn) const {
+                return (sn >= firstMessage &&
+                        (sn <= lastMessage ||
+                         (sn == lastMessage+1 && (flags & RUN_LINKS_FORWARD))));
             }
         };
         
-        typedef std::map<ForestKey, DisjointSet, ForestCmp> ForestMap;
-        typedef typename ForestMap::iterator ForestIter;
-        
-        ForestMap _forest;
-        
-        typedef std::pair<ForestKey, DisjointSet*> FindResult;
-        
-        FindResult find(EmiChannelQualifier cq,
-                        EmiNonWrappingSequenceNumber sn,
-                        bool createIfMissing = true) {
-            ForestKey key(cq, sn);
+        // The runs of one channel, sorted by sequence number. The
+        // runs before _head have been removed.
+        class RunList {
+            // Private copy constructor and assignment operator
+            inline RunList(const RunList& other);
+            inline RunList& operator=(const RunList& other);
+            
+            std::vector<Run> _runs;
+            size_t _head;
             
-            ForestIter iter = _forest.find(key);
-            ForestIter end  = _forest.end();
-            if (iter == end) {
-                if (!createIfMissing) {
-                    return std::make_pair(key, (DisjointSet *)NULL);
+        public:
+            RunList() : _runs(), _head(0) {}
+            
+            // Returns the index of the last run whose firstMessage is
+            // <= sn, or -1 if there is none
+            ssize_t findIndex(EmiNonWrappingSequenceNumber sn) const {
+                size_t lo = _head;
+                size_t hi = _runs.size();
+                
+                // Fast path for the newest run
+                if (lo != hi && _runs[hi-1].firstMessage <= sn) {
+                    return hi-1;
                 }
                 
-                // If there is no entry for this sequence number and
-                // channel qualifier, create one.
-                iter = _forest.insert(make_pair(key, DisjointSet(sn))).first;
+                while (lo < hi) {
+                    size_t mid = lo + (hi-lo)/2;
+                    if (_runs[mid].firstMessage <= sn) {
+                        lo = mid+1;
+                    }
+                    else {
+                        hi = mid;
+                    }
+                }
+                
+                return (lo == _head ? -1 : (ssize_t)lo-1);
             }
             
-            DisjointSet& ds = (*iter).second;
-            
-            if (ds.parent == sn) {
-                return std::make_pair(key, &ds);
+            inline Run *find(EmiNonWrappingSequenceNumber sn) {
+                ssize_t idx = findIndex(sn);
+                return (-1 != idx && _runs[idx].covers(sn)) ? &_runs[idx] : NULL;
             }
-            else {
-                FindResult result = find(cq, ds.parent);
-                ds.parent = result.first.second;
-                return result;
-            }
-        }
-        
-        // Returns the new root
-        FindResult merge(EmiChannelQualifier cq,
-                         EmiNonWrappingSequenceNumber i,
-                         EmiNonWrappingSequenceNumber j) {
-            FindResult findIResult = find(cq, i);
-            FindResult findJResult = find(cq, j);
             
-            EmiNonWrappingSequenceNumber rootISn = findIResult.first.second;
-            EmiNonWrappingSequenceNumber rootJSn = findJResult.first.second;
+            inline Run& at(size_t idx) {
+                return _runs[idx];
+            }
             
-            DisjointSet& rootI = *(findIResult.second);
-            DisjointSet& rootJ = *(findJResult.second);
+            inline bool isValidIndex(ssize_t idx) const {
+                return idx >= (ssize_t)_head && idx < (ssize_t)_runs.size();
+            }
             
-            if (rootISn != rootJSn) {
-                bool iIsTheNewRoot = rootI.rank > rootJ.rank;
-                
-                EmiNonWrappingSequenceNumber newRootSn = (iIsTheNewRoot ? rootISn : rootJSn);
-                
-                DisjointSet& newRoot = (iIsTheNewRoot ? rootI : rootJ);
-                DisjointSet& nonRoot = (iIsTheNewRoot ? rootJ : rootI);
+            // Inserts run after the run at index after (-1 means
+            // first), and returns the index of the inserted run
+            size_t insert(ssize_t after, const Run& run) {
+                size_t idx = (-1 == after ? _head : after+1);
                 
-                if (rootI.rank == rootJ.rank) {
-                    newRoot.rank += 1;
+                if (idx == _head && _head > 0) {
+                    _runs[--_head] = run;
+                    return _head;
                 }
                 
-                nonRoot.parent = newRootSn;
-                newRoot.flags |= nonRoot.flags;
-                newRoot.firstMessage = std::min(newRoot.firstMessage,
-                                                nonRoot.firstMessage);
-                newRoot.lastMessage  = std::max(newRoot.lastMessage,
-                                                nonRoot.lastMessage);
-                newRoot.size += nonRoot.size;
-                
-                return (iIsTheNewRoot ? findIResult : findJResult);
+                _runs.insert(_runs.begin()+idx, run);
+                return idx;
             }
-            else {
-                return findIResult;
+            
+            inline void erase(size_t idx) {
+                _runs.erase(_runs.begin()+idx);
             }
+            
+            // Removes all runs whose messages are all <= sn
+            void removeUpTo(EmiNonWrappingSequenceNumber sn) {
+                while (_head < _runs.size() && _runs[_head].lastMessage <= sn) {
+                    _head++;
+                }
+                
+                if (_head == _runs.size()) {
+                    _runs.clear();
+                    _head = 0;
+                }
+                else if (_head > 32 && _head*2 > _runs.size()) {
+                    // Compact once the removed runs dominate
+                    _runs.erase(_runs.begin(), _runs.begin()+_head);
+                    _head = 0;
+                }
+            }
+        };
+        
+        static const size_t NUM_CHANNELS = 1 << (8*sizeof(EmiChannelQualifier));
+        
+        // Private copy constructor and assignment operator
+        inline SplitMessageSets(const SplitMessageSets& other);
+        inline SplitMessageSets& operator=(const SplitMessageSets& other);
+        
+        // The lists are allocated when a channel first gets a split message
+        RunList *_channels[NUM_CHANNELS];
+        
+        inline Run *find(EmiChannelQualifier cq, EmiNonWrappingSequenceNumber i) {
+            return _channels[cq] ? _channels[cq]->find(i) : NULL;
         }
         
     public:
         typedef std::pair<bool, std::pair<EmiNonWrappingSequenceNumber, size_t> > MessageData;
         
+        SplitMessageSets() {
+            for (size_t i=0; i<NUM_CHANNELS; i++) {
+                _channels[i] = NULL;
+            }
+        }
+        
+        virtual ~SplitMessageSets() {
+            for (size_t i=0; i<NUM_CHANNELS; i++) {
+                delete _channels[i];
+            }
+        }
+        
         // This method must be called exactly once per message,
         // otherwise the message size data will get messed up.
         void gotMessage(EmiChannelQualifier cq,
@@ -165,23 +194,55 @@ class EmiReceiverBuffer {
             
             if (first && last) {
                 // This is a non-split message; there's no need to store
-                // it in the forest since we already know that it is
-                // complete.
+                // it since we already know that it is complete.
                 return;
             }
             
-            // Merge the message with sequence number i with the following
-            // message, but only for messages that are not last in a split.
-            DisjointSet& root = *(last ?
-                                  find(cq, i).second :
-                                  merge(cq, i, i+1).second);
+            RunList *&list(_channels[cq]);
+            if (!list) {
+                list = new RunList;
+            }
+            
+            int flags = ((first ? RUN_HAS_FIRST_MESSAGE : 0) |
+                         (last  ? RUN_HAS_LAST_MESSAGE  : 0));
+            
+            ssize_t idx = list->findIndex(i);
+            if (-1 != idx && list->at(idx).lastMessage >= i) {
+                // We already have this message
+                return;
+            }
             
-            if (first) root.flags |= DISJOINT_SET_HAS_FIRST_MESSAGE;
-            if (last)  root.flags |= DISJOINT_SET_HAS_LAST_MESSAGE;
+            if (-1 != idx && list->at(idx).covers(i)) {
+                // Extend the previous run, which is linked to this message
+                Run& run(list->at(idx));
+                run.lastMessage = i;
+                run.size += messageSize;
+                run.flags = (run.flags & ~RUN_LINKS_FORWARD) | flags;
+            }
+            else {
+                Run run;
+                run.firstMessage = run.lastMessage = i;
+                run.size = messageSize;
+                run.flags = flags;
+                
+                idx = list->insert(idx, run);
+            }
             
-            root.firstMessage = std::min(i, root.firstMessage);
-            root.lastMessage  = std::max(i, root.lastMessage);
-            root.size += messageSize;
+            Run& run(list->at(idx));
+            if (!last) {
+                run.flags |= RUN_LINKS_FORWARD;
+                
+                // Merge with the following run, if it starts with
+                // the message that this one is linked to
+                if (list->isValidIndex(idx+1) &&
+                    list->at(idx+1).firstMessage == i+1) {
+                    Run& next(list->at(idx+1));
+                    run.lastMessage = next.lastMessage;
+                    run.size += next.size;
+                    run.flags = (run.flags & ~RUN_LINKS_FORWARD) | next.flags;
+                    list->erase(idx+1);
+                }
+            }
         }
         
         // This method returns a pair of (whether a full set of split messages
@@ -195,56 +256,55 @@ class EmiReceiverBuffer {
             if (!(messageFlags & EMI_SPLIT_NOT_FIRST_FLAG) &&
                 !(messageFlags & EMI_SPLIT_NOT_LAST_FLAG)) {
                 // This is a non-split message; there's no need to store
-                // it in the forest since we already know that it is
-                // complete.
+                // it since we already know that it is complete.
                 return std::make_pair(true, std::make_pair(i, messageSize));
             }
             else {
-                DisjointSet& root = *(find(cq, i).second);
+                Run *run = find(cq, i);
+                ASSERT(run);
                 
-                return std::make_pair(((root.flags & DISJOINT_SET_HAS_FIRST_MESSAGE) &&
-                                       (root.flags & DISJOINT_SET_HAS_LAST_MESSAGE)),
-                                      std::make_pair(root.lastMessage,
-                                                     root.size));
+                return std::make_pair(((run->flags & RUN_HAS_FIRST_MESSAGE) &&
+                                       (run->flags & RUN_HAS_LAST_MESSAGE)),
+                                      std::make_pair(run->lastMessage,
+                                                     run->size));
             }
         }
         
-        // Removes a message from the disjoint sets data structure.
-        // Also removes all older messages than the specified message.
-        // The sequence number parameter can be the sequence number
-        // of any message that is in the split group to be removed.
+        // Removes a message from the data structure. Also removes
+        // all older messages than the specified message. The sequence
+        // number parameter can be the sequence number of any message
+        // that is in the split group to be removed.
         //
         // Note: This method must only be used for messages that are
         // complete, that is, all parts of the split group have been
         // registered.
         void removeMessageAndOlderMessages(EmiChannelQualifier cq, EmiNonWrappingSequenceNumber i) {
-            DisjointSet *root = find(cq, i, /*createIfMissing:*/false).second;
+            RunList *list = _channels[cq];
+            if (!list) return;
             
-            ASSERT(!root ||
-                   ((root->flags & DISJOINT_SET_HAS_FIRST_MESSAGE) &&
-                    (root->flags & DISJOINT_SET_HAS_LAST_MESSAGE)));
+            Run *run = list->find(i);
             
-            _forest.erase(_forest.lower_bound(ForestKey(cq, 0)),
-                          _forest.upper_bound(ForestKey(cq, root ? root->lastMessage : i)));
+            ASSERT(!run ||
+                   ((run->flags & RUN_HAS_FIRST_MESSAGE) &&
+                    (run->flags & RUN_HAS_LAST_MESSAGE)));
+            
+            list->removeUpTo(run ? run->lastMessage : i);
         }
         
         EmiNonWrappingSequenceNumber getLastSequenceNumberInSet(EmiChannelQualifier cq,
                                                                 EmiNonWrappingSequenceNumber i) {
-            FindResult findResult(find(cq, i, /*createIfMissing:*/false));
-            return (findResult.second ?
-                    findResult.second->lastMessage :
-                    i);
+            Run *run = find(cq, i);
+            return run ? run->lastMessage : i;
         }
         
         EmiNonWrappingSequenceNumber getFirstSequenceNumberInSet(EmiChannelQualifier cq,
                                                                  EmiNonWrappingSequenceNumber i) {
-            FindResult findResult(find(cq, i, /*createIfMissing:*/false));
-            return (findResult.second ?
-                    findResult.second->firstMessage :
-                    i);
+            Run *run = find(cq, i);
+            return run ? run->firstMessage : i;
         }
     };
     
+private:
     class Entry {
     private:
         // Private copy constructor and assignment operator
@@ -252,45 +312,77 @@ class EmiReceiverBuffer {
         inline Entry& operator=(const Entry& other);
         
     public:
-        Entry(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber_,
-              const EmiMessageHeader& header_,
-              const TemporaryData &data_,
-              size_t offset,
-              size_t length) :
-        guessedNonWrappedSequenceNumber(guessedNonWrappedSequenceNumber_),
-        header(header_),
-        data(Binding::makePersistentData(Binding::extractData(data_)+offset, length)) {}
-        
         Entry() :
-        guessedNonWrappedSequenceNumber(0) {}
-        
-        ~Entry() {
-            Binding::releasePersistentData(data);
-        }
+        guessedNonWrappedSequenceNumber(0),
+        data(),
+        nextFree(NULL) {}
         
         EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber;
         EmiMessageHeader header;
         PersistentData data;
+        // Used by EntryArena while the entry is not in use
+        Entry *nextFree;
     };
     
-    struct BufferTreeCmp {
-        inline bool operator()(Entry *a, Entry *b) const {
-            EmiChannelQualifier acq = a->header.channelQualifier;
-            EmiChannelQualifier bcq = b->header.channelQualifier;
+    // Entries are allocated in blocks and reused, so that buffering
+    // a message doesn't allocate anything other than the copy of
+    // its data.
+    class EntryArena {
+        static const size_t ENTRIES_PER_BLOCK = 64;
+        
+        // Private copy constructor and assignment operator
+        inline EntryArena(const EntryArena& other);
+        inline EntryArena& operator=(const EntryArena& other);
+        
+        std::vector<Entry *> _blocks;
+        Entry *_freeList;
+        
+    public:
+        EntryArena() : _blocks(), _freeList(NULL) {}
+        
+        virtual ~EntryArena() {
+            for (size_t i=0; i<_blocks.size(); i++) {
+                delete [] _blocks[i];
+            }
+        }
+        
+        Entry *alloc() {
+            if (!_freeList) {
+                Entry *block = new Entry[ENTRIES_PER_BLOCK];
+                _blocks.push_back(block);
+                
+                for (size_t i=0; i<ENTRIES_PER_BLOCK; i++) {
+                    block[i].nextFree = _freeList;
+                    _freeList = &block[i];
+                }
+            }
             
-            return (acq != bcq ?
-                    acq < bcq :
-                    a->guessedNonWrappedSequenceNumber < b->guessedNonWrappedSequenceNumber);
+            Entry *entry = _freeList;
+            _freeList = entry->nextFree;
+            entry->nextFree = NULL;
+            return entry;
+        }
+        
+        void free(Entry *entry) {
+            entry->nextFree = _freeList;
+            _freeList = entry;
         }
     };
     
-    typedef std::set<Entry *, BufferTreeCmp> BufferTree;
-    typedef typename BufferTree::iterator    BufferTreeIter;
+    // The buffered messages of one channel, indexed by their
+    // guessed non-wrapped sequence numbers
+    typedef EmiSequenceRing<Entry> ReorderRing;
+    
+    static const size_t NUM_CHANNELS = 1 << (8*sizeof(EmiChannelQualifier));
+    
     // Buffer max size
     size_t _size;
     
-    DisjointMessageSets _messageSets;
-    BufferTree _tree;
+    SplitMessageSets _messageSets;
+    EntryArena _arena;
+    // The rings are allocated when a channel first has to buffer
+    // a message
+    ReorderRing *_channels[NUM_CHANNELS];
     size_t _bufferSize;
     
     // This is a map that contains the next message's expected
@@ -316,7 +408,10 @@ class EmiReceiverBuffer {
     // only for RELIABLE_SEQUENCED channels) This also minimizes
     // the negative impact on the sequence number wrapping guessing
     // algorithm, which also uses _expectedSnMemo.
-    EmiNonWrappingSequenceNumberMemo _expectedSnMemo;
+    //
+    // Only the entries of the channels in _expectedSnKnown are valid.
+    EmiNonWrappingSequenceNumber _expectedSnMemo[NUM_CHANNELS];
+    EmiChannelSet _expectedSnKnown;
     
     Receiver &_receiver;
     
@@ -329,11 +424,30 @@ private:
         return headerLength + length;
     }
     
+    // The widest window of sequence numbers that a channel may buffer.
+    // No more messages than this could fit into the buffer anyway,
+    // and the limit keeps a message with a sequence number that is
+    // far ahead from making the ring huge.
+    inline size_t maxWindow() const {
+        return _size / bufferEntrySize(EMI_MESSAGE_HEADER_MIN_LENGTH, 1);
+    }
+    
     EmiNonWrappingSequenceNumber expectedSequenceNumber(const EmiMessageHeader& header) {
-        EmiNonWrappingSequenceNumberMemo::iterator cur = _expectedSnMemo.find(header.channelQualifier);
-        EmiNonWrappingSequenceNumberMemo::iterator end = _expectedSnMemo.end();
-        
-        return (end == cur ? _receiver.getOtherHostInitialSequenceNumber() : (*cur).second);
+        return (_expectedSnKnown.contains(header.channelQualifier) ?
+                _expectedSnMemo[header.channelQualifier] :
+                _receiver.getOtherHostInitialSequenceNumber());
+    }
+    
+    inline void setExpectedSequenceNumber(EmiChannelQualifier channelQualifier,
+                                          EmiNonWrappingSequenceNumber sequenceNumber) {
+        _expectedSnMemo[channelQualifier] = sequenceNumber;
+        _expectedSnKnown.insert(channelQualifier);
+    }
+    
+    inline Entry *findEntry(EmiChannelQualifier channelQualifier,
+                            EmiNonWrappingSequenceNumber sequenceNumber) const {
+        ReorderRing *ring = _channels[channelQualifier];
+        return ring ? ring->find(sequenceNumber) : NULL;
     }
     
     void bufferMessage(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
@@ -343,93 +457,96 @@ private:
                        size_t length) {
         size_t msgSize = EmiReceiverBuffer::bufferEntrySize(header.headerLength, header.length);
         
-        // Discard the message if it doesn't fit in the buffer
-        if (_bufferSize + msgSize <= _size) {
-            Entry *entry = new Entry(guessedNonWrappedSequenceNumber, header, buf, offset, length);
-            
-            bool wasInserted = _tree.insert(entry).second;
-            
-            // Only increment this._bufferSize if the message wasn't already in the buffer
-            if (wasInserted) {
-                _bufferSize += msgSize;
-                
-                _messageSets.gotMessage(entry->header.channelQualifier,
-                                        entry->guessedNonWrappedSequenceNumber,
-                                        entry->header.flags,
-                                        /*messageSize:*/entry->header.length);
-            }
-            else {
-                delete entry;
-            }
+        // Discard the message if it doesn't fit in the buffer, or if
+        // it is already in the buffer
+        if (_bufferSize + msgSize > _size ||
+            findEntry(header.channelQualifier, guessedNonWrappedSequenceNumber)) {
+            return;
+        }
+        
+        ReorderRing *&ring(_channels[header.channelQualifier]);
+        if (!ring) {
+            ring = new ReorderRing;
+        }
+        
+        Entry *entry = _arena.alloc();
+        if (!ring->insert(guessedNonWrappedSequenceNumber, entry, maxWindow())) {
+            // The message is too far ahead of the oldest buffered message
+            _arena.free(entry);
+            return;
         }
+        
+        entry->guessedNonWrappedSequenceNumber = guessedNonWrappedSequenceNumber;
+        entry->header = header;
+        entry->data = Binding::makePersistentData(Binding::extractData(buf)+offset, length);
+        
+        _bufferSize += msgSize;
+        
+        _messageSets.gotMessage(entry->header.channelQualifier,
+                                entry->guessedNonWrappedSequenceNumber,
+                                entry->header.flags,
+                                /*messageSize:*/entry->header.length);
     }
     
-    void remove(BufferTreeIter begin, BufferTreeIter end) {
-        BufferTreeIter iter = begin;
-        while (iter != end) {
-            Entry *entry = *iter;
-            
+    // Removes all buffered messages on the channel whose sequence
+    // numbers are <= sequenceNumber
+    void removeUpTo(EmiChannelQualifier channelQualifier,
+                    EmiNonWrappingSequenceNumber sequenceNumber) {
+        ReorderRing *ring = _channels[channelQualifier];
+        if (!ring) return;
+        
+        Entry *entry;
+        while ((entry = ring->popUpTo(sequenceNumber))) {
             _bufferSize -= EmiReceiverBuffer::bufferEntrySize(entry->header.headerLength,
                                                               entry->header.length);
             
-            delete entry;
-            
-            ++iter;
+            Binding::releasePersistentData(entry->data);
+            entry->data = PersistentData();
+            _arena.free(entry);
         }
-        
-        _tree.erase(begin, end);
     }
     
     // Processes a set of messages in a split that is known to be complete.
     // This method iterates through the messages and fills buf so that it
     // is a continuous buffer of the data of the messages.
     //
-    // iter must point to the first Entry of the message set.
-    //
-    // The return value is an iterator pointing to the first entry that is
-    // in the buffer that is not part of the message set. Note that the
-    // return value can be _tree.end() or an iterator to a message with a
-    // different channelQualifier.
-    BufferTreeIter processMessageSetData(EmiChannelQualifier channelQualifier,
-                                         EmiNonWrappingSequenceNumber largestSequenceNumberInSet,
-                                         BufferTreeIter iter,
-                                         uint8_t *buf, size_t bufSize) {
-        BufferTreeIter end = _tree.end();
-        Entry *entry = *iter;
+    // firstSequenceNumberInSet must be the sequence number of the first
+    // Entry of the message set.
+    void processMessageSetData(EmiChannelQualifier channelQualifier,
+                               EmiNonWrappingSequenceNumber firstSequenceNumberInSet,
+                               EmiNonWrappingSequenceNumber largestSequenceNumberInSet,
+                               uint8_t *buf, size_t bufSize) {
+        ReorderRing& ring(*_channels[channelQualifier]);
         size_t bufPos = 0;
         
-        // This loop increments iter until we are past the message set
-        // we just processed, and marks all messages we pass for removal.
-        do {
+        for (EmiNonWrappingSequenceNumber sn = firstSequenceNumberInSet;
+             sn <= largestSequenceNumberInSet;
+             sn++) {
+            Entry *entry = ring.find(sn);
+            if (!entry) continue;
+            
             size_t edlen = Binding::extractLength(entry->data);
             ASSERT(bufPos + edlen <= bufSize);
             memcpy(buf+bufPos, Binding::extractData(entry->data), edlen);
             bufPos += edlen;
-            
-            ++iter;
-        } while (iter != end &&
-                 (entry = *iter) &&
-                 entry->guessedNonWrappedSequenceNumber <= largestSequenceNumberInSet);
+        }
         
         ASSERT(bufPos == bufSize);
-        
-        return iter;
     }
     
     // This method iterates through the buffer and emits as many
     // complete messages as it can find, while still enforcing
     // strict message ordering (no skipped messages).
     //
-    // The search begins in iter.
+    // The search begins at sequenceNumber, which must be buffered.
     //
-    // The return value is an iterator that points to the message
-    // after the last one that was processed by processBuffer. Note
-    // that the return value can be _tree.end() or an iterator to a
-    // message with a different channelQualifier.
-    BufferTreeIter processBuffer(EmiChannelQualifier channelQualifier,
-                                 BufferTreeIter iter,
-                                 int64_t *largestProcessedMessageSet,
-                                 EmiNonWrappingSequenceNumber *largestProcessedSn) {
+    // The emitted messages are not removed from the buffer; that
+    // is up to the caller. They are all messages with sequence
+    // numbers <= *largestProcessedMessageSet.
+    void processBuffer(EmiChannelQualifier channelQualifier,
+                       EmiNonWrappingSequenceNumber sequenceNumber,
+                       int64_t *largestProcessedMessageSet,
+                       EmiNonWrappingSequenceNumber *largestProcessedSn) {
         
         if (largestProcessedMessageSet) {
             *largestProcessedMessageSet = -1;
@@ -438,14 +555,12 @@ private:
             *largestProcessedSn = -1;
         }
         
-        BufferTreeIter end = _tree.end();
+        Entry *entry = findEntry(channelQualifier, sequenceNumber);
         
-        if (iter == end) {
-            return iter;
+        if (!entry) {
+            return;
         }
         
-        Entry *entry = *iter;
-        
         if (entry->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
             // The first message is in the middle of a split.
             // That means that there is no complete message that
@@ -454,18 +569,15 @@ private:
             // This check is needed in order to ensure that we
             // don't invoke processMessageSetData with an
             // incomplete message set.
-            return iter;
+            return;
         }
         
-        EmiNonWrappingSequenceNumber expectedSequenceNumber = entry->guessedNonWrappedSequenceNumber;
-        
-        while (iter != end &&
-               (entry = *iter) &&
-               entry->header.channelQualifier == channelQualifier &&
-               entry->guessedNonWrappedSequenceNumber <= expectedSequenceNumber) {
-            
+        // Since all messages up to the last one of a processed
+        // set are consumed, the next message to process must
+        // have exactly the next sequence number.
+        while (entry) {
             // Search for a message set that contains entry->guessedNonWrappedSequenceNumber
-            typename DisjointMessageSets::MessageData messageData;
+            typename SplitMessageSets::MessageData messageData;
             messageData = _messageSets.getMessageData(channelQualifier,
                                                       entry->guessedNonWrappedSequenceNumber,
                                                       entry->header.flags,
@@ -477,7 +589,6 @@ private:
             // Update the expected sequence number to the largest sequence
             // number in the set, and enqueue an acknowledgment to the other
             // host that we have received all data up to that point.
-            expectedSequenceNumber = largestSequenceNumberInSet+1;
             if (largestProcessedSn) {
                 *largestProcessedSn = largestSequenceNumberInSet;
             }
@@ -499,8 +610,6 @@ private:
                                       Binding::castToTemporary(entry->data),
                                       /*offset:*/0,
                                       entry->header.length);
-                
-                ++iter;
             }
             else {
                 // The message set contains more than one message
@@ -508,11 +617,11 @@ private:
                 uint8_t *mergedDataBuf;
                 TemporaryData mergedData = Binding::makeTemporaryData(totalSizeOfSet, &mergedDataBuf);
                 
-                iter = processMessageSetData(channelQualifier,
-                                             largestSequenceNumberInSet,
-                                             iter,
-                                             /*buf:*/mergedDataBuf,
-                                             /*bufSize:*/Binding::extractLength(mergedData));
+                processMessageSetData(channelQualifier,
+                                      entry->guessedNonWrappedSequenceNumber,
+                                      largestSequenceNumberInSet,
+                                      /*buf:*/mergedDataBuf,
+                                      /*bufSize:*/Binding::extractLength(mergedData));
                 
                 _receiver.emitMessage(channelQualifier,
                                       mergedData,
@@ -523,9 +632,9 @@ private:
             if (largestProcessedMessageSet) {
                 *largestProcessedMessageSet = largestSequenceNumberInSet;
             }
+            
+            entry = findEntry(channelQualifier, largestSequenceNumberInSet+1);
         }
-        
-        return iter;
     }
     
     // This is works with RELIABLE_ORDERED channels.
@@ -535,50 +644,42 @@ private:
     // buffer.
     void flushBuffer(EmiChannelQualifier channelQualifier,
                      EmiNonWrappingSequenceNumber expectedSequenceNumber) {
-        if (_tree.empty()) return;
-        
-        Entry mockEntry;
-        mockEntry.guessedNonWrappedSequenceNumber = 0;
-        mockEntry.header.channelQualifier = channelQualifier;
-        
-        BufferTreeIter iter = _tree.lower_bound(&mockEntry);
-        
-        if (_tree.end() == iter) {
+        ReorderRing *ring = _channels[channelQualifier];
+        if (!ring || ring->empty()) {
             // We found nothing.
             return;
         }
         
-        Entry *foundEntry = *iter;
-        if (foundEntry->header.channelQualifier != channelQualifier ||
-            foundEntry->guessedNonWrappedSequenceNumber > expectedSequenceNumber) {
-            // The entry we found was either not in the expected channel qualifier,
-            // or it was newer than the newest permissible message to process.
+        EmiNonWrappingSequenceNumber first = ring->first();
+        if (first > expectedSequenceNumber) {
+            // The entry we found was newer than the newest
+            // permissible message to process.
             return;
         }
         
         int64_t largestProcessedMessageSet;
         EmiNonWrappingSequenceNumber largestProcessedSn;
-        BufferTreeIter end = processBuffer(channelQualifier,
-                                           iter,
-                                           &largestProcessedMessageSet,
-                                           &largestProcessedSn);
+        processBuffer(channelQualifier,
+                      first,
+                      &largestProcessedMessageSet,
+                      &largestProcessedSn);
         
         if (-1 != largestProcessedSn) {
             _receiver.enqueueAck(channelQualifier, largestProcessedSn & EMI_HEADER_SEQUENCE_NUMBER_MASK);
-            _expectedSnMemo[channelQualifier] = largestProcessedSn+1;
+            setExpectedSequenceNumber(channelQualifier, largestProcessedSn+1);
         }
         
         // We have now processed and emitted messages. The next
         // step is to remove those from the buffer data structure.
         //
         // To do this correctly, we need to remove data from both
-        // _messageSets and _tree.
+        // _messageSets and the reorder ring.
         
         if (-1 != largestProcessedMessageSet) {
             _messageSets.removeMessageAndOlderMessages(channelQualifier,
                                                        largestProcessedMessageSet);
+            removeUpTo(channelQualifier, largestProcessedMessageSet);
         }
-        remove(iter, end);
     }
     
     void processUnorderedMessage(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
@@ -592,24 +693,14 @@ private:
             
             _receiver.emitMessage(header.channelQualifier, data, offset, header.length);
             
-            // Remove older messages from _tree and _messageSets
+            // Remove older messages from the buffer and _messageSets
             _messageSets.removeMessageAndOlderMessages(header.channelQualifier,
                                                        guessedNonWrappedSequenceNumber);
-            
-            Entry mockEntry1;
-            mockEntry1.guessedNonWrappedSequenceNumber = 0;
-            mockEntry1.header.channelQualifier = header.channelQualifier;
-            
-            Entry mockEntry2;
-            mockEntry2.guessedNonWrappedSequenceNumber = guessedNonWrappedSequenceNumber;
-            mockEntry2.header.channelQualifier = header.channelQualifier;
-            
-            remove(_tree.lower_bound(&mockEntry1),
-                   _tree.upper_bound(&mockEntry2));
+            removeUpTo(header.channelQualifier, guessedNonWrappedSequenceNumber);
             
             // Enqueue ack if this is a reliable sequenced channel
             if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType) {
-                _expectedSnMemo[header.channelQualifier] = guessedNonWrappedSequenceNumber;
+                setExpectedSequenceNumber(header.channelQualifier, guessedNonWrappedSequenceNumber);
                 _receiver.enqueueAck(header.channelQualifier, header.sequenceNumber);
             }
         }
@@ -620,10 +711,7 @@ private:
             EmiNonWrappingSequenceNumber firstSequenceNumberInSet = _messageSets.getFirstSequenceNumberInSet(header.channelQualifier,
                                                                                                              guessedNonWrappedSequenceNumber);
             
-            Entry mockEntry1;
-            mockEntry1.guessedNonWrappedSequenceNumber = firstSequenceNumberInSet;
-            mockEntry1.header.channelQualifier = header.channelQualifier;
-            BufferTreeIter iter = _tree.find(&mockEntry1);
+            Entry *firstEntry = findEntry(header.channelQualifier, firstSequenceNumberInSet);
             
             // Enqueue ack if this is a reliable sequenced channel.
             // Note that this needs to be done before we flush _messageSets.
@@ -635,17 +723,17 @@ private:
             // a message group.
             if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType) {
                 EmiNonWrappingSequenceNumber sn = _messageSets.getLastSequenceNumberInSet(header.channelQualifier,
-                                                                                          _expectedSnMemo[header.channelQualifier]);
-                _expectedSnMemo[header.channelQualifier] = sn;
+                                                                                          expectedSequenceNumber(header));
+                setExpectedSequenceNumber(header.channelQualifier, sn);
                 _receiver.enqueueAck(header.channelQualifier, sn & EMI_HEADER_SEQUENCE_NUMBER_MASK);
             }
             
-            if (_tree.end() == iter) {
+            if (!firstEntry) {
                 // This happens when the receiver buffer is full. Fail.
                 return;
             }
             
-            if ((*iter)->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
+            if (firstEntry->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
                 // The message we found is not the first in the set.
                 // This means that the set is not complete. Fail.
                 //
@@ -657,38 +745,79 @@ private:
             
             int64_t largestProcessedMessageSet;
             
-            BufferTreeIter processEnd = processBuffer(header.channelQualifier,
-                                                      iter,
-                                                      &largestProcessedMessageSet,
-                                                      /*largestProcessedSn:*/NULL);
+            processBuffer(header.channelQualifier,
+                          firstSequenceNumberInSet,
+                          &largestProcessedMessageSet,
+                          /*largestProcessedSn:*/NULL);
             
-            // Remove processed and older messages from _tree and _messageSets
+            // Remove processed and older messages from the buffer and _messageSets
             if (-1 != largestProcessedMessageSet) {
                 _messageSets.removeMessageAndOlderMessages(header.channelQualifier,
                                                            largestProcessedMessageSet);
+                removeUpTo(header.channelQualifier, largestProcessedMessageSet);
+            }
+            else if (firstSequenceNumberInSet > 0) {
+                removeUpTo(header.channelQualifier, firstSequenceNumberInSet-1);
             }
-            
-            Entry mockEntry2;
-            mockEntry2.guessedNonWrappedSequenceNumber = 0;
-            mockEntry2.header.channelQualifier = header.channelQualifier;
-            BufferTreeIter removeFrom = _tree.lower_bound(&mockEntry2);
-            
-            remove(removeFrom, processEnd);
         }
     }
     
 public:
     
     EmiReceiverBuffer(size_t size, Receiver &receiver) :
-    _size(size), _bufferSize(0), _receiver(receiver) {}
+    _size(size), _bufferSize(0), _receiver(receiver) {
+        for (size_t i=0; i<NUM_CHANNELS; i++) {
+            _channels[i] = NULL;
+        }
+    }
     
     virtual ~EmiReceiverBuffer() {
-        remove(_tree.begin(), _tree.end());
+        for (size_t i=0; i<NUM_CHANNELS; i++) {
+            if (_channels[i]) {
+                removeUpTo(i, EMI_NON_WRAPPING_SEQUENCE_NUMBER_MAX);
+                delete _channels[i];
+            }
+        }
         
         _size = 0;
         _bufferSize = 0;
     }
     
+    // Writes the SACK blocks of a RELIABLE_ORDERED channel to buf,
+    // which must have room for EMI_SACK_MAX_BLOCKS blocks. A block
+    // is a [first, last] range of sequence numbers of messages that
+    // have been received out of order, and that are kept in the
+    // buffer until they can be processed. Returns the number of
+    // bytes that were written.
+    size_t writeSackBlocks(EmiChannelQualifier channelQualifier, uint8_t *buf) const {
+        ReorderRing *ring = _channels[channelQualifier];
+        if (!ring || ring->empty()) {
+            return 0;
+        }
+        
+        size_t pos = 0;
+        EmiNonWrappingSequenceNumber sn = ring->first();
+        EmiNonWrappingSequenceNumber end = ring->first()+ring->span();
+        while (sn < end && pos < EMI_SACK_MAX_BLOCKS*EMI_SACK_BLOCK_LENGTH) {
+            // The ring never starts or ends with a hole, so sn
+            // is the first message of a block here
+            EmiNonWrappingSequenceNumber first = sn;
+            while (sn < end && ring->find(sn)) {
+                sn++;
+            }
+            
+            EmiNetUtil::write24(buf+pos, first & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+            EmiNetUtil::write24(buf+pos+EMI_HEADER_SEQUENCE_NUMBER_LENGTH, (sn-1) & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+            pos += EMI_SACK_BLOCK_LENGTH;
+            
+            while (sn < end && !ring->find(sn)) {
+                sn++;
+            }
+        }
+        
+        return pos;
+    }
+    
 #define EMI_GOT_INVALID_MESSAGE(err) do { /* NSLog(err); */ return false; } while (1)
     bool gotMessage(EmiTimeInterval now,
                     const EmiMessageHeader& header,
@@ -727,8 +856,8 @@ public:
                 // For why we're doing this, refer to the comment
                 // above the declaration of _expectedSnMemo
                 
-                _expectedSnMemo[channelQualifier] = std::max(expectedSn,
-                                                             guessedNonWrappedSequenceNumber+1);
+                setExpectedSequenceNumber(channelQualifier,
+                                          std::max(expectedSn, guessedNonWrappedSequenceNumber+1));
             }
             
             int64_t snDiff = (int64_t)expectedSn - (int64_t)guessedNonWrappedSequenceNumber;
@@ -773,13 +902,33 @@ public:
             }
         }
         else if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType) {
-            if (header.flags & EMI_SACK_FLAG) EMI_GOT_INVALID_MESSAGE("SACK is not implemented");
-            
             if (header.flags & EMI_ACK_FLAG) {
                 EmiNonWrappingSequenceNumber nonWrappedAck = _receiver.guessSequenceNumberWrapping(channelQualifier, header.ack);
                 _receiver.deregisterReliableMessages(now, channelQualifier, nonWrappedAck);
             }
             
+            if (header.flags & EMI_SACK_FLAG) {
+                // A SACK message has no contents of its own; its data
+                // is the SACK blocks, and its sequence number is not
+                // used.
+                if (0 != header.length % EMI_SACK_BLOCK_LENGTH ||
+                    header.length > EMI_SACK_MAX_BLOCKS*EMI_SACK_BLOCK_LENGTH) {
+                    EMI_GOT_INVALID_MESSAGE("Invalid SACK message length");
+                }
+                
+                const uint8_t *blocks = Binding::extractData(data)+offset;
+                for (size_t pos=0; pos<header.length; pos+=EMI_SACK_BLOCK_LENGTH) {
+                    EmiNonWrappingSequenceNumber first, last;
+                    first = _receiver.guessSequenceNumberWrapping(channelQualifier,
+                                                                  EmiNetUtil::read24(blocks+pos));
+                    last  = _receiver.guessSequenceNumberWrapping(channelQualifier,
+                                                                  EmiNetUtil::read24(blocks+pos+EMI_HEADER_SEQUENCE_NUMBER_LENGTH));
+                    _receiver.deregisterReliableMessages(now, channelQualifier, first, last);
+                }
+                
+                return true;
+            }
+            
             if (-1 != header.sequenceNumber) {
                 ASSERT(0 != header.length);
                 
@@ -804,7 +953,7 @@ public:
                     // message split mechanism.
                     
                     EmiSequenceNumber newExpectedSn = static_cast<EmiSequenceNumber>(expectedSn+1);
-                    _expectedSnMemo[channelQualifier] = newExpectedSn;
+                    setExpectedSequenceNumber(channelQualifier, newExpectedSn);
                     
                     _receiver.emitMessage(channelQualifier, data, offset, header.length);
                     
@@ -817,6 +966,13 @@ public:
                     bufferMessage(guessedNonWrappedSequenceNumber,
                                   header, data, offset, header.length);
                     flushBuffer(channelQualifier, expectedSn);
+                    
+                    if (0 != seqDiff) {
+                        // The message arrived out of order. Tell the
+                        // other host which messages we have, so that
+                        // it doesn't retransmit them.
+                        _receiver.enqueueSack(channelQualifier);
+                    }
                 }
             }
         }
@@ -9,6 +9,8 @@
 #ifndef eminet_EmiRtoTimer_h
 #define eminet_EmiRtoTimer_h
 
+#include "EmiTimerWheel.h"
+
 // This class is separated from EmiConnTimers because its functionality
 // is shared between EmiConn and EmiP2PConn, while only EmiConn uses
 // EmiConnTimers. The class is also used by EmiLogicalConnection for
@@ -16,13 +18,13 @@
 template<class Binding, class Delegate>
 class EmiRtoTimer {
     
-    typedef typename Binding::Timer       Timer;
-    typedef typename Binding::TimerCookie TimerCookie;
+    typedef EmiWheelTimer<Binding> Timer;
+    typedef EmiTimerWheel<Binding> TimerWheel;
     
     EmiConnTime&           _time;
-    Timer                 *_rtoTimer;
+    Timer                  _rtoTimer;
     EmiTimeInterval        _rtoWhenRtoTimerWasScheduled;
-    Timer                 *_connectionTimer;
+    Timer                  _connectionTimer;
     const EmiTimeInterval  _timeBeforeConnectionWarning;
     const EmiTimeInterval  _connectionTimeout;
     const EmiTimeInterval  _initialConnectionTimeout;
@@ -60,9 +62,9 @@ private:
         EmiRtoTimer *ert = (EmiRtoTimer *)data;
         
         ert->_issuedConnectionWarning = true;
-        Binding::scheduleTimer(ert->_connectionTimer, connectionTimeoutCallback, ert,
-                               ert->getConnectionTimeout() - ert->_timeBeforeConnectionWarning,
-                               /*repeating:*/false, /*reschedule:*/true);
+        ert->_connectionTimer.schedule(connectionTimeoutCallback, ert,
+                                       ert->getConnectionTimeout() - ert->_timeBeforeConnectionWarning,
+                                       /*repeating:*/false, /*reschedule:*/true);
         
         ert->_delegate.connectionLost();
     }
@@ -72,14 +74,14 @@ private:
         
         if (_timeBeforeConnectionWarning >= 0 &&
             _timeBeforeConnectionWarning < connectionTimeout) {
-            Binding::scheduleTimer(_connectionTimer, connectionWarningCallback,
-                                   this, _timeBeforeConnectionWarning,
-                                   /*repeating:*/false, /*reschedule:*/true);
+            _connectionTimer.schedule(connectionWarningCallback,
+                                      this, _timeBeforeConnectionWarning,
+                                      /*repeating:*/false, /*reschedule:*/true);
         }
         else {
-            Binding::scheduleTimer(_connectionTimer, connectionTimeoutCallback,
-                                   this, connectionTimeout,
-                                   /*repeating:*/false, /*reschedule:*/true);
+            _connectionTimer.schedule(connectionTimeoutCallback,
+                                      this, connectionTimeout,
+                                      /*repeating:*/false, /*reschedule:*/true);
         }
         
         if (_issuedConnectionWarning) {
@@ -95,12 +97,12 @@ public:
                 EmiTimeInterval connectionTimeout,
                 EmiTimeInterval initialConnectionTimeout,
                 EmiConnTime& time,
-                const TimerCookie& timerCookie,
+                TimerWheel& timerWheel,
                 Delegate &delegate) :
     _time(time),
-    _rtoTimer(Binding::makeTimer(timerCookie)),
+    _rtoTimer(timerWheel),
     _rtoWhenRtoTimerWasScheduled(0),
-    _connectionTimer(Binding::makeTimer(timerCookie)),
+    _connectionTimer(timerWheel),
     _timeBeforeConnectionWarning(timeBeforeConnectionWarning),
     _connectionTimeout(connectionTimeout),
     _initialConnectionTimeout(initialConnectionTimeout),
@@ -110,18 +112,15 @@ public:
         resetConnectionTimeout();
     }
     
-    virtual ~EmiRtoTimer() {
-        Binding::freeTimer(_rtoTimer);
-        Binding::freeTimer(_connectionTimer);
-    }
+    virtual ~EmiRtoTimer() {}
     
     void deschedule() {
-        Binding::descheduleTimer(_rtoTimer);
-        Binding::descheduleTimer(_connectionTimer);
+        _rtoTimer.deschedule();
+        _connectionTimer.deschedule();
     }
     
     void forceResetRtoTimer() {
-        Binding::descheduleTimer(_rtoTimer);
+        _rtoTimer.deschedule();
         updateRtoTimeout();
     }
     
@@ -132,13 +131,13 @@ public:
             // the timeout was set, not when it fires. That's why we store
             // rto here.
             _rtoWhenRtoTimerWasScheduled = _time.getRto();
-            Binding::scheduleTimer(_rtoTimer, rtoTimeoutCallback,
-                                   this, _rtoWhenRtoTimerWasScheduled,
-                                   /*repeating:*/false, /*reschedule:*/false);
+            _rtoTimer.schedule(rtoTimeoutCallback,
+                               this, _rtoWhenRtoTimerWasScheduled,
+                               /*repeating:*/false, /*reschedule:*/false);
         }
         else {
             // The queue is empty. Clear the timer
-            Binding::descheduleTimer(_rtoTimer);
+            _rtoTimer.deschedule();
         }
     }
     
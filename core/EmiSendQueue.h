@@ -13,13 +13,12 @@
 #include "EmiNetUtil.h"
 #include "EmiNetRandom.h"
 #include "EmiPacketHeader.h"
-#include "EmiCongestionControl.h"
+#include "EmiChannelSet.h"
+#include "EmiPacketLog.h"
+#include "EmiLedbat.h"
 
 #include <arpa/inet.h>
 #include <deque>
-#include <map>
-#include <set>
-#include <vector>
 #include <algorithm>
 #include <cmath>
 
@@ -28,6 +27,88 @@ class EmiConnTime;
 template<class SockDelegate, class ConnDelegate>
 class EmiConn;
 
+// The purpose of EmiBytesSentTheLastNTicks is to increase the
+// precision of the congestion control algorithm: The congestion
+// control works by telling EmiSendQueue how many bytes it is
+// allowed to send per tick, but if this value is lower than
+// the MTU, EmiSendQueue will never be able to send large
+// packets.
+//
+// The most obvious hack is to simply not let the byter per
+// tick limit drop below the MTU, but that is not good enough,
+// because that would put a lower bound on the data send rate
+// at MTU/EMI_TICK_TIME, which for a MTU of 576 and tick time
+// of 10ms is more than 50KB/s.
+//
+// Because data rates far below 50KB/s are to be expected in
+// congested mobile data networks, we need a way to increase
+// the precision.
+//
+// We do this by keeping track of the number of bytes sent in
+// the last N ticks (where N is a reasonably small number, like
+// 50). The sending algorithm is allowed to send a packet if
+// the number of bytes sent in the last N ticks plus that packet's
+// size is lower than N * the number of bytes that can be sent
+// per tick.
+//
+// This reduces the minimum data rate to MTU/EMI_TICK_TIME/N,
+// which in a normal circumstance could be 576/0.01/50 ≈ 1KB/s
+//
+// EmiBytesSentTheLastNTicks is a helper class that counts the
+// amount of bytes sent in the last Num ticks.
+template<int Num>
+class EmiBytesSentTheLastNTicks {
+    size_t _buf[Num];
+    int    _idx;
+    size_t _sum;
+public:
+    EmiBytesSentTheLastNTicks() :
+    _idx(0),
+    _sum(0) {
+        memset(_buf, 0, Num*sizeof(size_t));
+    }
+    
+    inline int N() const {
+        return Num;
+    }
+    
+    inline void sendData(size_t size) {
+        _sum += size;
+        _buf[_idx] += size;
+    }
+    
+    inline size_t bytesSent() const {
+        return _sum;
+    }
+    
+    inline size_t bytesSentSinceLastTick() const {
+        return _buf[_idx];
+    }
+    
+    // Returns the number of bytes of a packet of at most bufLength
+    // bytes that may be sent now, when the congestion control allows
+    // tickAllowance bytes per tick. 0 means that nothing may be sent.
+    //
+    // The std::max(bufLength, ...) is there to ensure that we are
+    // allowed to send at least one full packet every Num ticks,
+    // regardless of what the congestion control algorithm says. A
+    // tick allowance of 0 means that the congestion window is full,
+    // which is not overridden.
+    inline size_t allowedSize(size_t bufLength, size_t tickAllowance) const {
+        size_t budget = std::max(bufLength, Num*tickAllowance);
+        if (0 == tickAllowance || _sum >= budget) {
+            return 0;
+        }
+        return std::min(budget-_sum, bufLength);
+    }
+    
+    inline void tick() {
+        _idx = (_idx+1)%Num;
+        _sum -= _buf[_idx];
+        _buf[_idx] = 0;
+    }
+};
+
 template<class SockDelegate, class ConnDelegate>
 class EmiSendQueue {
     
@@ -35,78 +116,11 @@ class EmiSendQueue {
     typedef typename Binding::Error          Error;
     typedef typename Binding::PersistentData PersistentData;
     typedef EmiMessage<Binding>              EM;
-    typedef EmiCongestionControl<Binding>    ECC;
+    typedef typename SockDelegate::CongestionControl ECC;
     
-    typedef std::map<EmiChannelQualifier, EmiSequenceNumber> SendQueueAcksMap;
-    typedef typename SendQueueAcksMap::iterator SendQueueAcksMapIter;
-    typedef std::set<EmiChannelQualifier> SendQueueAcksSet;
+    static const size_t NUM_CHANNELS = 1 << (8*sizeof(EmiChannelQualifier));
     typedef EmiConn<SockDelegate, ConnDelegate> EC;
     
-    // The purpose of BytesSentTheLastNTicks is to increase the
-    // precision of the congestion control algorithm: The congestion
-    // control works by telling EmiSendQueue how many bytes it is
-    // allowed to send per tick, but if this value is lower than
-    // the MTU, EmiSendQueue will never be able to send large
-    // packets.
-    //
-    // The most obvious hack is to simply not let the byter per
-    // tick limit drop below the MTU, but that is not good enough,
-    // because that would put a lower bound on the data send rate
-    // at MTU/EMI_TICK_TIME, which for a MTU of 576 and tick time
-    // of 10ms is more than 50KB/s.
-    //
-    // Because data rates far below 50KB/s are to be expected in
-    // congested mobile data networks, we need a way to increase
-    // the precision.
-    //
-    // We do this by keeping track of the number of bytes sent in
-    // the last N ticks (where N is a reasonably small number, like
-    // 50). The sending algorithm is allowed to send a packet if
-    // the number of bytes sent in the last N ticks plus that packet's
-    // size is lower than N * the number of bytes that can be sent
-    // per tick.
-    //
-    // This reduces the minimum data rate to MTU/EMI_TICK_TIME/N,
-    // which in a normal circumstance could be 576/0.01/50 ≈ 1KB/s
-    //
-    // BytesSentTheLastNTicks is a helper class that counts the
-    // amount of bytes sent in the last Num ticks.
-    template<int Num>
-    class BytesSentTheLastNTicks {
-        size_t _buf[Num];
-        int    _idx;
-        size_t _sum;
-    public:
-        BytesSentTheLastNTicks() :
-        _idx(0),
-        _sum(0) {
-            memset(_buf, 0, Num*sizeof(size_t));
-        }
-        
-        inline int N() const {
-            return Num;
-        }
-        
-        inline void sendData(size_t size) {
-            _sum += size;
-            _buf[_idx] += size;
-        }
-        
-        inline size_t bytesSent() const {
-            return _sum;
-        }
-        
-        inline size_t bytesSentSinceLastTick() const {
-            return _buf[_idx];
-        }
-        
-        inline void tick() {
-            _idx = (_idx+1)%Num;
-            _sum -= _buf[_idx];
-            _buf[_idx] = 0;
-        }
-    };
-    
     // The purpose of this class is to encapsulate the memory management
     // and priority aspects of the queue.
     class SendQueue {
@@ -133,13 +147,16 @@ class EmiSendQueue {
             int currentPriority() const {
                 int possibleResult = -1;
                 
-                for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
+                // Background messages don't take part in the
+                // interleaving; they are only picked when there
+                // is nothing else to send
+                for (int i=0; i<EMI_PRIORITY_BACKGROUND; i++) {
                     if (_prioIndices[i] >= _queue._queues[i].size()) {
                         // There are no more messages with this priority
                         continue;
                     }
                     
-                    if (i < EMI_NUMBER_OF_PRIORITIES-1 &&
+                    if (i < EMI_PRIORITY_BACKGROUND-1 &&
                         _prioIndices[i] > _prioIndices[i+1]*2+1) {
                         // We have sent more than twice as many messages of
                         // this priority compared to the next (lower) priority.
@@ -156,6 +173,11 @@ class EmiSendQueue {
                     return i;
                 }
                 
+                if (-1 == possibleResult &&
+                    _prioIndices[EMI_PRIORITY_BACKGROUND] < _queue._queues[EMI_PRIORITY_BACKGROUND].size()) {
+                    return EMI_PRIORITY_BACKGROUND;
+                }
+                
                 return possibleResult;
             }
             
@@ -257,6 +279,16 @@ class EmiSendQueue {
             return 0 == _queueSize;
         }
         
+        bool hasOnlyBackgroundMessages() const {
+            for (int i=0; i<EMI_PRIORITY_BACKGROUND; i++) {
+                if (!_queues[i].empty()) {
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+        
         void push(EM *msg) {
             size_t msgSize = msg->approximateSize();
             ASSERT(0 != msgSize); // The empty method requires this
@@ -276,17 +308,36 @@ class EmiSendQueue {
     EmiPacketSequenceNumber _rttResponseSequenceNumber;
     EmiTimeInterval _rttResponseRegisterTime;
     SendQueue _queue;
-    SendQueueAcksMap _acks;
+    // The ack to send for each channel. Only the entries of the
+    // channels in _pendingAcks are valid.
+    EmiSequenceNumber _acks[NUM_CHANNELS];
+    EmiChannelSet _pendingAcks;
     // This set is intended to ensure that only one ack is sent per channel per tick
-    SendQueueAcksSet _acksSentInThisTick;
+    EmiChannelSet _acksSentInThisTick;
+    // The channels to send SACK messages for. The SACK blocks are
+    // taken from the receiver buffer when the message is written.
+    EmiChannelSet _pendingSacks;
+    // The current MTU of the connection. It can change at runtime,
+    // but it is never below _baseMtu and never exceeds _bufCapacity.
     size_t _bufLength;
+    size_t _bufCapacity;
+    // The MTU that the connection falls back to when the path MTU
+    // shrinks. Messages are split to fit in it.
+    size_t _baseMtu;
     uint8_t *_buf;
-    // _otherBuf is a pointer into _buf, and should not be freed. Its length is _bufLength
+    // _otherBuf is a pointer into _buf, and should not be freed. Its length is _bufCapacity
     uint8_t *_otherBuf;
     bool _enqueueHeartbeat;
     bool _enqueuePacketAck; // This helps to make sure that we only send one packet ACK per tick
+    // The NAK and spurious NAK are sent in one packet each, and then
+    // forgotten
     EmiPacketSequenceNumber _enqueuedNak;
-    BytesSentTheLastNTicks<100> _bytesSentCounter;
+    EmiPacketSequenceNumber _enqueuedSpuriousNak;
+    EmiBytesSentTheLastNTicks<100> _bytesSentCounter;
+    // The reliable messages of the recently sent packets
+    EmiPacketLog _packetLog;
+    // Decides how much background priority data may be sent
+    EmiLedbat _ledbat;
     
 private:
     // Private copy constructor and assignment operator
@@ -298,8 +349,9 @@ private:
     }
     
     void sendDatagram(ECC& congestionControl,
+                      EmiPacketSequenceNumber sequenceNumber,
                       const uint8_t *buf, size_t bufSize) {
-        congestionControl.onDataSent(_packetSequenceNumber, bufSize);
+        congestionControl.onDataSent(sequenceNumber, bufSize);
         
         _conn.sendDatagram(buf, bufSize);
         
@@ -307,8 +359,8 @@ private:
     }
     
     void sendMessageInSeparatePacket(ECC& congestionControl, const EM *msg) {
-        const uint8_t *data = Binding::extractData(msg->data);
-        size_t dataLen = Binding::extractLength(msg->data);
+        const uint8_t *data = msg->getData();
+        size_t dataLen = msg->getDataLength();
         
         uint8_t packetBuf[128];
         size_t size = EM::writeControlPacketWithData(msg->flags,
@@ -320,7 +372,20 @@ private:
         ASSERT(0 != size); // size == 0 when the buffer was too small
         
         // Actually send the packet
-        sendDatagram(congestionControl, packetBuf, size);
+        sendDatagram(congestionControl, _packetSequenceNumber, packetBuf, size);
+    }
+    
+    // Forgets the NAK and spurious NAK that were sent in packetHeader
+    void sentNaks(const EmiPacketHeader& packetHeader) {
+        if (packetHeader.flags & EMI_NAK_PACKET_FLAG &&
+            packetHeader.nak == _enqueuedNak) {
+            _enqueuedNak = -1;
+        }
+        
+        if (packetHeader.extraFlags & EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG &&
+            packetHeader.spuriousNak == _enqueuedSpuriousNak) {
+            _enqueuedSpuriousNak = -1;
+        }
     }
     
     void fillPacketHeaderData(EmiTimeInterval now,
@@ -345,6 +410,11 @@ private:
             packetHeader.nak = _enqueuedNak;
         }
         
+        if (-1 != _enqueuedSpuriousNak) {
+            packetHeader.extraFlags |= EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG;
+            packetHeader.spuriousNak = _enqueuedSpuriousNak;
+        }
+        
         // Note that we only send RTT requests if a packet would be sent anyways.
         // This ensures that RTT data is sent only once per heartbeat if no data
         // is being transmitted.
@@ -390,28 +460,26 @@ private:
                       EmiConnTime& connTime,
                       EmiTimeInterval now,
                       bool ignoreCongestionControl = false) {
-        if (_queue.empty() && _acks.empty()) {
+        // Background messages that may not be sent now don't count,
+        // because the packet header would otherwise consume the packet
+        // ACK and RTT request without the packet being sent
+        bool noMessages = (_queue.empty() ||
+                           (_queue.hasOnlyBackgroundMessages() && !_ledbat.canSend()));
+        if (noMessages && _pendingAcks.empty() && _pendingSacks.empty()) {
             return 0;
         }
         
-        size_t allowedSize;
-        
-        if (ignoreCongestionControl) {
-            allowedSize = bufLength;
-        }
-        else {
-            // The std::min(..., bufLength) is there to ensure that
-            // we don't attempt to send more data than what fills
-            // in a packet.
-            //
-            // The std::max(bufLength, ...) is there to ensure that
-            // we are allowed to send at least one full packet every
-            // _bytesSentCounter.N() ticks, regardless of what the
-            // congestion control algorithm says.
-            allowedSize = std::min((std::max(bufLength,
-                                             _bytesSentCounter.N()*congestionControl.tickAllowance()) -
-                                    _bytesSentCounter.bytesSent()),
-                                   bufLength);
+        // The std::min(..., bufLength) in allowedSize is there to
+        // ensure that we don't attempt to send more data than what
+        // fills in a packet.
+        size_t allowedSize = (ignoreCongestionControl ?
+                              bufLength :
+                              _bytesSentCounter.allowedSize(bufLength, congestionControl.tickAllowance()));
+        if (0 == allowedSize && _pendingAcks.empty() && _pendingSacks.empty()) {
+            // Congestion control prevents us from sending. This must
+            // be checked before the packet header is written, for the
+            // same reason as above.
+            return 0;
         }
         
         EmiPacketHeader packetHeader;
@@ -423,37 +491,35 @@ private:
         
         size_t pos = packetHeaderLength;
         
+        _packetLog.beginPacket(packetHeader.sequenceNumber);
+        
+        bool hasReliableMessages = false;
+        
         /// Send the enqueued messages
-        SendQueueAcksMapIter noAck = _acks.end();
-        SendQueueIter        iter  = _queue.begin(); // Note: iter is used below this loop
+        SendQueueIter iter = _queue.begin(); // Note: iter is used below this loop
         while (!iter.isAtEnd()) {
             EM *msg = *iter;
-            // We need to increment iter here, because we might break
-            // out of the loop early, and there is code later on that
-            // relies on iter being after the last message that was
-            // saved to the packet to be sent.
-            ++iter;
             
-            SendQueueAcksMapIter curAck;
-            if (0 != _acksSentInThisTick.count(msg->channelQualifier)) {
-                // Only send an ack for a particular channel once per packet
-                curAck = noAck;
-            }
-            else {
-                curAck = _acks.find(msg->channelQualifier);
+            if (EMI_PRIORITY_BACKGROUND == msg->priority && !_ledbat.canSend()) {
+                // The background messages come last, so there is
+                // nothing more to send
+                _ledbat.markLimited();
+                break;
             }
             
-            bool hasAck = curAck != noAck;
+            // Only send an ack for a particular channel once per packet
+            bool hasAck = (!_acksSentInThisTick.contains(msg->channelQualifier) &&
+                           _pendingAcks.contains(msg->channelQualifier));
             
             size_t msgSize = EM::writeMsg(buf, /* buf */
                                           bufLength, /* bufSize */
                                           pos, /* offset */
                                           hasAck, /* hasAck */
-                                          hasAck && (*curAck).second, /* ack */
+                                          (hasAck ? _acks[msg->channelQualifier] : 0), /* ack */
                                           msg->channelQualifier,
                                           msg->nonWrappingSequenceNumber & EMI_HEADER_SEQUENCE_NUMBER_MASK,
-                                          Binding::extractData(msg->data),
-                                          Binding::extractLength(msg->data),
+                                          msg->getData(),
+                                          msg->getDataLength(),
                                           msg->flags);
             
             // msgSize is 0 if the message did not fit in the buffer
@@ -473,62 +539,110 @@ private:
             // garbage unless we increment pos.
             pos += msgSize;
             _acksSentInThisTick.insert(msg->channelQualifier);
-            _acks.erase(msg->channelQualifier);
+            _pendingAcks.erase(msg->channelQualifier);
+            
+            if (EMI_PRIORITY_BACKGROUND == msg->priority) {
+                _ledbat.sentData(msgSize);
+            }
+            
+            // The control channel -1 has the reliable ordered type
+            if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED <= EMI_CHANNEL_QUALIFIER_TYPE(msg->channelQualifier)) {
+                _packetLog.logMessage(packetHeader.sequenceNumber,
+                                      msg->channelQualifier,
+                                      msg->nonWrappingSequenceNumber);
+                hasReliableMessages = true;
+            }
+            
+            // iter must point past the last message that was saved
+            // to the packet, because the messages before it are
+            // erased from the queue below.
+            ++iter;
         }
         
-        /// Send ACK messages without data for the acks that are
-        /// enqueued but was not sent along with actual data.
-        SendQueueAcksMapIter ackIter = _acks.begin();
-        SendQueueAcksMapIter ackEnd = _acks.end();
-        std::vector<EmiChannelQualifier> acksToErase;
-        while (ackIter != ackEnd) {
-            EmiChannelQualifier cq = (*ackIter).first;
-            
-            if (0 == _acksSentInThisTick.count(cq)) {
-                EmiSequenceNumber sn = (*ackIter).second;
-                
-                size_t msgSize = EM::writeMsg(buf, /* buf */
-                                              bufLength, /* bufSize */
-                                              pos, /* offset */
-                                              true, /* hasAck */
-                                              sn, /* ack */
-                                              cq, /* channelQualifier */
-                                              0, /* sequenceNumber */
-                                              NULL, /* data */
-                                              0, /* dataLength */
-                                              0 /* flags */);
-                
-                if (pos+msgSize > allowedSize) {
-                    // The message got too big.
-                    break;
-                }
-                
-                // Do the actual side effects. Like the previous loop,
-                // we need to do all lasting side effects after the
-                // potential break above.
-                pos += msgSize;
-                _acksSentInThisTick.insert(cq);
-                // We can't _acks.erase(cq), because that invalidates ackIter
-                acksToErase.push_back(cq);
+        /// Send SACK messages. The ack of the channel is sent along
+        /// with them if it hasn't been sent yet.
+        for (int32_t cq = _pendingSacks.next(0); -1 != cq; cq = _pendingSacks.next(cq+1)) {
+            uint8_t blocks[EMI_SACK_MAX_BLOCKS*EMI_SACK_BLOCK_LENGTH];
+            size_t blocksLength = _conn.writeSackBlocks(cq, blocks);
+            if (0 == blocksLength) {
+                // The messages have been processed since the SACK
+                // was enqueued
+                _pendingSacks.erase(cq);
+                continue;
             }
             
-            ++ackIter;
+            bool hasAck = (!_acksSentInThisTick.contains(cq) &&
+                           _pendingAcks.contains(cq));
+            
+            size_t msgSize = EM::writeMsg(buf, /* buf */
+                                          bufLength, /* bufSize */
+                                          pos, /* offset */
+                                          hasAck, /* hasAck */
+                                          (hasAck ? _acks[cq] : 0), /* ack */
+                                          cq, /* channelQualifier */
+                                          0, /* sequenceNumber */
+                                          blocks, /* data */
+                                          blocksLength, /* dataLength */
+                                          EMI_SACK_FLAG /* flags */);
+            
+            // SACK and ACK messages are sent even when congestion
+            // control prevents data from being sent: The other host
+            // might be waiting for them to free up its own congestion
+            // window, and they are small.
+            if (0 == msgSize) {
+                // The message got too big.
+                break;
+            }
+            
+            pos += msgSize;
+            _pendingSacks.erase(cq);
+            if (hasAck) {
+                _acksSentInThisTick.insert(cq);
+                _pendingAcks.erase(cq);
+            }
         }
         
-        {
-            std::vector<EmiChannelQualifier>::iterator iter = acksToErase.begin();
-            std::vector<EmiChannelQualifier>::iterator end  = acksToErase.end();
-            while (iter != end) {
-                EmiChannelQualifier cq = *iter;
-                _acks.erase(cq);
-                ++iter;
+        /// Send ACK messages without data for the acks that are
+        /// enqueued but was not sent along with actual data.
+        for (int32_t cq = _pendingAcks.next(0); -1 != cq; cq = _pendingAcks.next(cq+1)) {
+            if (_acksSentInThisTick.contains(cq)) {
+                continue;
             }
+            
+            size_t msgSize = EM::writeMsg(buf, /* buf */
+                                          bufLength, /* bufSize */
+                                          pos, /* offset */
+                                          true, /* hasAck */
+                                          _acks[cq], /* ack */
+                                          cq, /* channelQualifier */
+                                          0, /* sequenceNumber */
+                                          NULL, /* data */
+                                          0, /* dataLength */
+                                          0 /* flags */);
+            
+            if (0 == msgSize) {
+                // The message got too big.
+                break;
+            }
+            
+            // Do the actual side effects. Like the previous loop,
+            // we need to do all lasting side effects after the
+            // potential break above.
+            pos += msgSize;
+            _acksSentInThisTick.insert(cq);
+            _pendingAcks.erase(cq);
         }
         
         if (packetHeaderLength != pos) {
             ASSERT(pos <= bufLength);
             
             _queue.eraseUntil(iter);
+            sentNaks(packetHeader);
+            
+            if (hasReliableMessages) {
+                // The packet is sent right after it is filled
+                _conn.sentReliableMessages();
+            }
             
             // Return non-zero to signify that a packet was written
             return pos;
@@ -549,7 +663,7 @@ private:
             return false;
         }
         else {
-            sendDatagram(congestionControl, _buf, packetSize);
+            sendDatagram(congestionControl, _packetSequenceNumber, _buf, packetSize);
             incrementSequenceNumber();
             
             return true;
@@ -558,7 +672,10 @@ private:
     
 public:
     
-    EmiSendQueue(EC& conn, size_t mtu) :
+    // mtu is the base MTU, which setMtu is never called with a
+    // smaller value than, and maxMtu is the largest MTU that setMtu
+    // will be called with
+    EmiSendQueue(EC& conn, size_t mtu, size_t maxMtu) :
     _conn(conn),
     _packetSequenceNumber(EmiNetRandom<Binding>::random() & EMI_PACKET_SEQUENCE_NUMBER_MASK),
     _rttResponseSequenceNumber(-1),
@@ -566,10 +683,15 @@ public:
     _enqueueHeartbeat(false),
     _enqueuePacketAck(false),
     _enqueuedNak(-1),
-    _bytesSentCounter() {
+    _enqueuedSpuriousNak(-1),
+    _bytesSentCounter(),
+    _packetLog(),
+    _ledbat() {
         _bufLength = mtu;
-        _buf = (uint8_t *)malloc(_bufLength*2);
-        _otherBuf = _buf+_bufLength;
+        _bufCapacity = std::max(mtu, maxMtu);
+        _baseMtu = mtu;
+        _buf = (uint8_t *)malloc(_bufCapacity*2);
+        _otherBuf = _buf+_bufCapacity;
     }
     virtual ~EmiSendQueue() {
         _queue.clear();
@@ -578,6 +700,7 @@ public:
         
         if (NULL != _buf) {
             _bufLength = 0;
+            _bufCapacity = 0;
             free(_buf);
             _buf = NULL;
         }
@@ -587,10 +710,21 @@ public:
         _enqueueHeartbeat = true;
     }
     
+    // Returns true if there are messages or acks that have not been
+    // sent yet, for example because the congestion control algorithm
+    // held them back
+    bool hasPendingData() const {
+        return !_queue.empty() || !_pendingAcks.empty() || !_pendingSacks.empty();
+    }
+    
     void enqueueNak(EmiPacketSequenceNumber nak) {
         _enqueuedNak = nak;
     }
     
+    void enqueueSpuriousNak(EmiPacketSequenceNumber nak) {
+        _enqueuedSpuriousNak = nak;
+    }
+    
     // Returns the number of bytes sent
     size_t sendHeartbeat(ECC& congestionControl,
                          EmiConnTime& connTime,
@@ -603,13 +737,64 @@ public:
         EmiPacketHeader::write(buf, sizeof(buf), ph, &packetLength);
         
         if (_conn.isOpen()) {
-            sendDatagram(congestionControl, buf, packetLength);
+            sendDatagram(congestionControl, _packetSequenceNumber, buf, packetLength);
             incrementSequenceNumber();
+            sentNaks(ph);
         }
         
         return packetLength;
     }
     
+    // Sends a packet without messages that is padded to size bytes,
+    // and that carries an RTT request. Returns the sequence number
+    // of the packet, or -1 if it was not sent.
+    //
+    // The probes are congestion controlled like other packets.
+    // Otherwise, they could use up the whole allowance of a slow
+    // connection, and keep the messages from being sent.
+    EmiPacketSequenceNumber sendPathMtuProbe(ECC& congestionControl, size_t size) {
+        ASSERT(size <= _bufCapacity);
+        
+        if (_bytesSentCounter.allowedSize(size, congestionControl.tickAllowance()) < size) {
+            return -1;
+        }
+        
+        EmiPacketHeader ph;
+        ph.flags = EMI_SEQUENCE_NUMBER_PACKET_FLAG | EMI_RTT_REQUEST_PACKET_FLAG;
+        ph.sequenceNumber = _packetSequenceNumber;
+        
+        size_t headerLength;
+        if (!EmiPacketHeader::write(_buf, _bufCapacity, ph, &headerLength) ||
+            headerLength > size) {
+            return -1;
+        }
+        EmiPacketHeader::addFillerBytes(_buf, headerLength, size-headerLength);
+        
+        EmiPacketSequenceNumber sequenceNumber = _packetSequenceNumber;
+        sendDatagram(congestionControl, _packetSequenceNumber, _buf, size);
+        incrementSequenceNumber();
+        
+        return sequenceNumber;
+    }
+    
+    // Invokes delegate.lostMessage(now, channelQualifier, sequenceNumber)
+    // for each reliable message that was sent in the packet. The loss
+    // also makes the background messages back off.
+    template<class Delegate>
+    inline void packetLost(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, Delegate& delegate) {
+        _ledbat.onLoss(now);
+        _packetLog.packetLost(now, sequenceNumber, delegate);
+    }
+    
+    inline void onRto(EmiTimeInterval now) {
+        _ledbat.onLoss(now);
+    }
+    
+    inline void setMtu(size_t mtu) {
+        ASSERT(_baseMtu <= mtu && mtu <= _bufCapacity);
+        _bufLength = mtu;
+    }
+    
     // Returns true if something has been sent since the last tick
     bool tick(ECC& congestionControl,
               EmiConnTime& connTime,
@@ -618,14 +803,22 @@ public:
         
         _acksSentInThisTick.clear();
         
+        _ledbat.tick(now, connTime.getQueuingDelay(), connTime.getRtt());
+        
         // Send packets until we can't send any more packets,
         // either because of congestion control, or because there
         // is nothing more to send.
         bool packetWasSent;
         do {
-            if (0 == (_packetSequenceNumber % EMI_PACKET_PAIR_INTERVAL)) {
+            // The second packet of a pair ignores congestion control,
+            // so a pair is only sent when the first packet may carry
+            // data. Otherwise, a packet with only ACKs could let
+            // data past a full congestion window.
+            if (0 == (_packetSequenceNumber % EMI_PACKET_PAIR_INTERVAL) &&
+                0 != _bytesSentCounter.allowedSize(_bufLength, congestionControl.tickAllowance())) {
                 /// Send a packet pair, for link capacity estimation
                 
+                EmiPacketSequenceNumber firstSequenceNumber = _packetSequenceNumber;
                 size_t firstPacketSize = fillPacket(_buf, _bufLength,
                                                     congestionControl, connTime,
                                                     now);
@@ -651,7 +844,7 @@ public:
                 if (0 == secondPacketSize) {
                     // There was no data to send for the second packet. Don't
                     // send a packet pair.
-                    sendDatagram(congestionControl, _buf, firstPacketSize);
+                    sendDatagram(congestionControl, firstSequenceNumber, _buf, firstPacketSize);
                 }
                 else {
                     // Increment the sequence number, to account for the second packet
@@ -670,8 +863,10 @@ public:
                                                         biggestPacketSize-smallestPacketSize);
                     }
                     
-                    sendDatagram(congestionControl, _buf,      biggestPacketSize);
-                    sendDatagram(congestionControl, _otherBuf, biggestPacketSize);
+                    sendDatagram(congestionControl, firstSequenceNumber,
+                                 _buf, biggestPacketSize);
+                    sendDatagram(congestionControl, (firstSequenceNumber+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK,
+                                 _otherBuf, biggestPacketSize);
                 }
                 
                 return true;
@@ -682,8 +877,10 @@ public:
             }
         } while (packetWasSent);
         
-        if (0 == _bytesSentCounter.bytesSentSinceLastTick() && _enqueueHeartbeat) {
-            // Send heartbeat
+        if (0 == _bytesSentCounter.bytesSentSinceLastTick() &&
+            (_enqueueHeartbeat || -1 != _enqueuedNak || -1 != _enqueuedSpuriousNak)) {
+            // Send heartbeat. This is also done when there is nothing
+            // else to carry an enqueued NAK or spurious NAK.
             size_t heartbeatSize = sendHeartbeat(congestionControl, connTime, now);
             _bytesSentCounter.sendData(heartbeatSize);
             _enqueueHeartbeat = false;
@@ -697,17 +894,37 @@ public:
     
     // Returns true if at least 1 ack is now enqueued
     bool enqueueAck(EmiChannelQualifier channelQualifier, EmiSequenceNumber sequenceNumber) {
-        SendQueueAcksMapIter ackCur = _acks.find(channelQualifier);
-        SendQueueAcksMapIter ackEnd = _acks.end();
-        
-        if (ackCur == ackEnd) {
+        if (!_pendingAcks.contains(channelQualifier)) {
             _acks[channelQualifier] = sequenceNumber;
+            _pendingAcks.insert(channelQualifier);
         }
         else {
-            _acks[channelQualifier] = EmiNetUtil::cyclicMax<EMI_HEADER_SEQUENCE_NUMBER_LENGTH>((*ackCur).second, sequenceNumber);
+            _acks[channelQualifier] = EmiNetUtil::cyclicMax<EMI_HEADER_SEQUENCE_NUMBER_LENGTH>(_acks[channelQualifier], sequenceNumber);
         }
         
-        return !_acks.empty();
+        return true;
+    }
+    
+    // SACK messages are only sent for RELIABLE_ORDERED channels
+    inline void enqueueSack(EmiChannelQualifier channelQualifier) {
+        _pendingSacks.insert(channelQualifier);
+    }
+    
+    // mss is short for maximum segment size. _bufLength is the MTU
+    // of the connection.
+    inline size_t mss() const {
+        return _bufLength - EMI_PACKET_HEADER_MAX_LENGTH - EMI_UDP_HEADER_SIZE;
+    }
+    
+    // The largest amount of data that a message can have and still
+    // fit in a packet of its own. Longer messages must be split.
+    //
+    // This is based on the base MTU rather than the current MTU,
+    // because a message can't be split again once it is enqueued,
+    // and it must still fit in a packet if the path MTU shrinks. A
+    // larger path MTU lets more messages share a packet.
+    inline size_t maximalMessageLength() const {
+        return _baseMtu - EMI_PACKET_HEADER_MAX_LENGTH - EMI_UDP_HEADER_SIZE - EM::maximalHeaderSize();
     }
     
     inline EmiPacketSequenceNumber lastSentSequenceNumber() const {
@@ -737,10 +954,7 @@ public:
             // This can be useful for debugging/stress testing.
             static const bool FORCE_ONE_MESSAGE_PER_PACKET = false;
             
-            // _bufLength is the MTU of the EmiSocket.
-            // mss is short for maximum segment size.
-            size_t mss = _bufLength - EMI_PACKET_HEADER_MAX_LENGTH - EMI_UDP_HEADER_SIZE;
-            if (_queue.sizeInBytes() + msgSize >= mss ||
+            if (_queue.sizeInBytes() + msgSize >= mss() ||
                 EMI_PRIORITY_IMMEDIATE == msg->priority ||
                 FORCE_ONE_MESSAGE_PER_PACKET) {
                 flush(congestionControl, connTime, now);
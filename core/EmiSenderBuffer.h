@@ -10,61 +10,33 @@
 #define eminet_EmiSenderBuffer_h
 
 #include "EmiMessage.h"
+#include "EmiListLink.h"
+#include "EmiSequenceRing.h"
 #include "EmiNetUtil.h"
 
-#include <set>
-#include <vector>
+#include <algorithm>
+#include <cstring>
 
 template<class Binding>
 class EmiSenderBuffer {
     typedef typename Binding::Error Error;
     typedef EmiMessage<Binding>     EM;
     
-    struct NextMsgTreeCmp {
-        inline bool operator()(const EM *a, const EM *b) const {
-            EmiTimeInterval art = a->registrationTime;
-            EmiTimeInterval brt = b->registrationTime;
-            
-            if (art != brt) return art < brt;
-            else {
-                int32_t acq = a->channelQualifier;
-                int32_t bcq = b->channelQualifier;
-                
-                if (acq != bcq) return acq < bcq;
-                else {
-                    return a->nonWrappingSequenceNumber < b->nonWrappingSequenceNumber;
-                }
-            }
-        }
-    };
-    
-    struct SendBufferCmp {
-        inline bool operator()(const EM *a, const EM *b) const {
-            int32_t acq = a->channelQualifier;
-            int32_t bcq = b->channelQualifier;
-            
-            if (acq != bcq) return acq < bcq;
-            else {
-                return a->nonWrappingSequenceNumber < b->nonWrappingSequenceNumber;
-            }
-        }
-    };
+    // The reliable messages of one channel, indexed by their
+    // (contiguous) sequence numbers
+    typedef EmiSequenceRing<EM> ChannelRing;
     
-    typedef std::vector<EM *> EmiMessageVector;
-    typedef std::set<EM *, NextMsgTreeCmp>      NextMsgTree;
-    typedef std::set<EM *, SendBufferCmp>       SendBuffer;
-    typedef typename EmiMessageVector::iterator EmiMessageVectorIter;
-    typedef typename NextMsgTree::iterator      NextMsgTreeIter;
-    typedef typename SendBuffer::iterator       SendBufferIter;
+    // One for each EmiChannelQualifier, plus index 0 for the
+    // special control message channel -1
+    static const size_t NUM_CHANNELS = (1 << (8*sizeof(EmiChannelQualifier)))+1;
     
     // Buffer max size
     size_t _size;
     
-    // Contains at most one message per channel. It is sorted by regTime
-    NextMsgTree _nextMsgTree;
-    // contains all messages in the reliable buffer. It is sorted by
-    // channelQualifier and sequenceNumber
-    SendBuffer _sendBuffer;
+    // The rings are allocated when a channel is first used
+    ChannelRing *_channels[NUM_CHANNELS];
+    // Contains all messages in the buffer, sorted by registrationTime
+    EmiListLink _retransmissionList;
     size_t _sendBufferSize;
     
 private:
@@ -72,18 +44,13 @@ private:
     inline EmiSenderBuffer(const EmiSenderBuffer& other);
     inline EmiSenderBuffer& operator=(const EmiSenderBuffer& other);
     
-    EM *messageSearch(EM *messageStub) {
-        SendBufferIter iter = _sendBuffer.lower_bound(messageStub);
-        SendBufferIter end  = _sendBuffer.end();
-        
-        // We need to look at both *iter and *(++iter), and of course
-        // also guard for if we reach end. That's what this loop does.
-        for (int i=0; iter != end && i<2; i++) {
-            if (messageStub->channelQualifier == (*iter)->channelQualifier) return *iter;
-            ++iter;
-        }
-        
-        return NULL;
+    inline static EM *messageForLink(EmiListLink *link) {
+        return static_cast<EM *>(link);
+    }
+    
+    inline static size_t channelIndex(int32_t channelQualifier) {
+        ASSERT(channelQualifier >= -1 && channelQualifier < (int32_t)NUM_CHANNELS-1);
+        return channelQualifier+1;
     }
     
     size_t messageSize(size_t dataSize, size_t numMessages = 1) {
@@ -92,13 +59,20 @@ private:
     
 public:
     
-    EmiSenderBuffer(size_t size) : _size(size), _sendBufferSize(0) {}
+    EmiSenderBuffer(size_t size) : _size(size), _sendBufferSize(0) {
+        for (size_t i=0; i<NUM_CHANNELS; i++) {
+            _channels[i] = NULL;
+        }
+    }
     virtual ~EmiSenderBuffer() {
-        SendBufferIter iter = _sendBuffer.begin();
-        SendBufferIter end  = _sendBuffer.end();
-        while (iter != end) {
-            (*iter)->release();
-            ++iter;
+        while (!_retransmissionList.isEmpty()) {
+            EM *msg = messageForLink(_retransmissionList.next);
+            msg->EmiListLink::unlink();
+            msg->release();
+        }
+        
+        for (size_t i=0; i<NUM_CHANNELS; i++) {
+            delete _channels[i];
         }
     }
     
@@ -108,24 +82,22 @@ public:
     
     // Returns false if the buffer didn't have space for the message
     bool registerReliableMessage(EM *message, Error& err, EmiTimeInterval now) {
-        size_t msgSize = messageSize(Binding::extractLength(message->data));
+        size_t msgSize = messageSize(message->getDataLength());
         
         if (_sendBufferSize+msgSize > _size) {
             err = Binding::makeError("com.emilir.eminet.sendbufferoverflow", 0);
             return false;
         }
         
-        message->registrationTime = now;
-        
-        // Check if there already is a message with this channel qualifier in the buffer
-        if (NULL == messageSearch(message)) {
-            // Only add to _nextMsgTree if there wasn't already a message for that connection id
-            // and channel id in the system.
-            _nextMsgTree.insert(message);
+        ChannelRing *&ring(_channels[channelIndex(message->channelQualifier)]);
+        if (!ring) {
+            ring = new ChannelRing;
         }
         
-        bool wasInserted = _sendBuffer.insert(message).second;
-        if (wasInserted) {
+        if (ring->insert(message->nonWrappingSequenceNumber, message)) {
+            message->registrationTime = now;
+            _retransmissionList.pushBack(message);
+            
             message->retain();
             _sendBufferSize += msgSize;
         }
@@ -140,112 +112,136 @@ public:
     // is a special control message channel.
     void deregisterReliableMessages(int32_t channelQualifier,
                                     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
-        EM msgStub;
-        msgStub.channelQualifier          = channelQualifier;
-        msgStub.nonWrappingSequenceNumber = nonWrappingSequenceNumber;
-        
-        SendBufferIter begin = _sendBuffer.begin();
-        SendBufferIter iter  = _sendBuffer.lower_bound(&msgStub);
+        ChannelRing *ring = _channels[channelIndex(channelQualifier)];
+        if (!ring) return;
         
-        if (iter == _sendBuffer.end()) return;
-        
-        EmiMessageVector toBeRemoved;
-        do {
-            EM *msg = *iter;
-            
-            if (channelQualifier != msg->channelQualifier) {
-                break;
-            }
-            if (msg->nonWrappingSequenceNumber > nonWrappingSequenceNumber) {
-                // This can happen because we used lower_bound.
-                // It should not happen more than once, though.
-                //
-                // We do not continue; here, because that would
-                // iterate the loop without decrementing iter,
-                // resulting in an infinite loop.
-            }
-            else {
-                toBeRemoved.push_back(msg);
-            }
-            
-            if (iter == begin) break;
-            
-            --iter;
-        } while (1);
-        
-        bool wasInReliableTree = false;
-        
-        EmiMessageVectorIter viter = toBeRemoved.begin();
-        EmiMessageVectorIter vend = toBeRemoved.end();
-        while (viter != vend) {
-            EM *msg = *viter;
-            
-            bool wasRemovedFromSendBuffer = (0 != _sendBuffer.erase(msg));
-            ASSERT(wasRemovedFromSendBuffer);
-            
-            _sendBufferSize -= messageSize(Binding::extractLength(msg->data));
-            
-            bool wasRemovedFromNextMsgTree = 0 != _nextMsgTree.erase(msg);
-            wasInReliableTree = wasRemovedFromNextMsgTree || wasInReliableTree;
-            
+        EM *msg;
+        while ((msg = ring->popUpTo(nonWrappingSequenceNumber))) {
+            msg->EmiListLink::unlink();
+            _sendBufferSize -= messageSize(msg->getDataLength());
             msg->release();
-            
-            ++viter;
         }
-        
-        if (wasInReliableTree) {
-            EM *newMsg = messageSearch(&msgStub);
-            if (newMsg) _nextMsgTree.insert(newMsg);
+    }
+    
+    // Deregisters the messages on the particular channelQualifier
+    // whose sequenceNumber is in [first, last]. This is used for
+    // selective acks, so there may be older messages left.
+    void deregisterReliableMessages(int32_t channelQualifier,
+                                    EmiNonWrappingSequenceNumber first,
+                                    EmiNonWrappingSequenceNumber last) {
+        ChannelRing *ring = _channels[channelIndex(channelQualifier)];
+        if (!ring || ring->empty()) return;
+        
+        // Don't look at more sequence numbers than the ring spans,
+        // even if the range is bogus
+        EmiNonWrappingSequenceNumber end = std::min(last+1, ring->first()+ring->span());
+        for (EmiNonWrappingSequenceNumber sn = std::max(first, ring->first()); sn < end; sn++) {
+            EM *msg = ring->erase(sn);
+            if (msg) {
+                msg->EmiListLink::unlink();
+                _sendBufferSize -= messageSize(msg->getDataLength());
+                msg->release();
+            }
         }
     }
     
     bool empty() const {
-        return _nextMsgTree.empty();
+        return _retransmissionList.isEmpty();
     }
     
+    // Schedules the message with the given sequence number for
+    // retransmission right away, if it is still in the buffer, by
+    // invoking delegate.eachCurrentMessageIteration with it. The
+    // message is moved to the back of the retransmission list, like
+    // eachCurrentMessage does.
     template<class Delegate>
-    void eachCurrentMessage(EmiTimeInterval now, EmiTimeInterval rto,
-                            Delegate& delegate) {
-        NextMsgTreeIter iter = _nextMsgTree.begin();
-        NextMsgTreeIter end = _nextMsgTree.end();
+    void retransmitMessage(EmiTimeInterval now,
+                           int32_t channelQualifier,
+                           EmiNonWrappingSequenceNumber nonWrappingSequenceNumber,
+                           Delegate& delegate) {
+        ChannelRing *ring = _channels[channelIndex(channelQualifier)];
+        if (!ring) return;
         
-        EmiMessageVector toBePushedToTheEnd;
+        EM *msg = ring->find(nonWrappingSequenceNumber);
+        if (!msg) return;
         
-        while (iter != end) {
-            EM *msg = *iter;
-            
-            if (rto > now-msg->registrationTime) {
-                // This message was sent less than RTO ago
+        msg->EmiListLink::unlink();
+        msg->registrationTime = now;
+        _retransmissionList.pushBack(msg);
+        
+        delegate.eachCurrentMessageIteration(now, msg);
+    }
+    
+    // Like retransmitMessage, but for the message that was sent
+    // most recently. Does nothing if the buffer is empty.
+    template<class Delegate>
+    void retransmitNewestMessage(EmiTimeInterval now, Delegate& delegate) {
+        if (_retransmissionList.isEmpty()) return;
+        
+        EM *msg = messageForLink(_retransmissionList.prev);
+        msg->EmiListLink::unlink();
+        msg->registrationTime = now;
+        _retransmissionList.pushBack(msg);
+        
+        delegate.eachCurrentMessageIteration(now, msg);
+    }
+    
+    // Invokes delegate.eachCurrentMessageIteration for each message
+    // that is due for retransmission, and moves it to the back of the
+    // retransmission list.
+    //
+    // A message is due if it was sent at least rto ago. When a channel
+    // has a message that is due, the messages after it on the channel
+    // that were sent at least one RTT (plus a tick, for the ack to be
+    // sent) ago are due as well: they would have been acked or
+    // selectively acked by now if they had arrived, so
+    // they are probably lost too. This way a burst of lost messages is
+    // retransmitted in one go rather than one RTO at a time. rtt is -1
+    // if it is not known yet.
+    template<class Delegate>
+    void eachCurrentMessage(EmiTimeInterval now, EmiTimeInterval rto,
+                            EmiTimeInterval rtt, Delegate& delegate) {
+        // Move the messages that are due to a separate list first,
+        // so that messages that are put back at the end of
+        // _retransmissionList aren't visited again.
+        EmiListLink due;
+        bool expiredChannels[NUM_CHANNELS];
+        memset(expiredChannels, 0, sizeof(expiredChannels));
+        
+        EmiTimeInterval minAge = (-1 == rtt ? rto : std::min(rto, rtt+EMI_TICK_TIME));
+        
+        EmiListLink *link = _retransmissionList.next;
+        while (link != &_retransmissionList) {
+            EM *msg = messageForLink(link);
+            link = link->next;
+            
+            EmiTimeInterval age = now-msg->registrationTime;
+            bool& channelExpired(expiredChannels[channelIndex(msg->channelQualifier)]);
+            
+            if (age >= rto) {
+                channelExpired = true;
+            }
+            else if (minAge > age) {
+                // This message was sent too recently to be due, and
+                // so were all messages after it
                 break;
             }
+            else if (!channelExpired) {
+                continue;
+            }
             
-            // Since we're iterating _nextMsgTree, we
-            // can't modify it here. Do it later.
-            toBePushedToTheEnd.push_back(msg);
-            
-            delegate.eachCurrentMessageIteration(now, msg);
-            
-            ++iter;
+            msg->EmiListLink::unlink();
+            due.pushBack(msg);
         }
         
-        EmiMessageVectorIter viter = toBePushedToTheEnd.begin();
-        EmiMessageVectorIter vend  = toBePushedToTheEnd.end();
-        while (viter != vend) {
-            EM *msg = *viter;
-            
-            // We want to update msg->registrationTime, but because
-            // _nextMsgTree's ordering depends on it, we can't change
-            // it while the object is in _nextMsgTree
-            
-            bool wasRemovedFromNextMsgTree = 0 != _nextMsgTree.erase(msg);
-            ASSERT(wasRemovedFromNextMsgTree);
+        while (!due.isEmpty()) {
+            EM *msg = messageForLink(due.next);
             
+            msg->EmiListLink::unlink();
             msg->registrationTime = now;
+            _retransmissionList.pushBack(msg);
             
-            bool wasInserted = _nextMsgTree.insert(msg).second;
-            ASSERT(wasInserted);
-            
-            ++viter;
+            delegate.eachCurrentMessageIteration(now, msg);
         }
     }
 };
@@ -0,0 +1,166 @@
+//
+//  EmiSequenceRing.h
+//  eminet
+//
+
+#ifndef eminet_EmiSequenceRing_h
+#define eminet_EmiSequenceRing_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+
+#include <algorithm>
+#include <cstring>
+
+// A window of pointers indexed by (non-wrapping) sequence number.
+// The element with sequence number n is stored at n & (capacity-1),
+// and the window covers [first(), first()+span()), possibly with
+// holes. The element at first() is always present. The ring grows
+// as needed; it never allocates when the window stays within its
+// capacity.
+//
+// The ring does not own its elements.
+template<class T>
+class EmiSequenceRing {
+    static const size_t MIN_CAPACITY = 16;
+
+    // Private copy constructor and assignment operator
+    inline EmiSequenceRing(const EmiSequenceRing& other);
+    inline EmiSequenceRing& operator=(const EmiSequenceRing& other);
+
+    T      **_slots;
+    // Always a power of two
+    size_t   _capacity;
+    EmiNonWrappingSequenceNumber _base;
+    size_t   _span;
+
+    inline T *&slot(EmiNonWrappingSequenceNumber sequenceNumber) const {
+        return _slots[sequenceNumber & (_capacity-1)];
+    }
+
+    void grow(size_t span) {
+        size_t newCapacity = _capacity;
+        while (newCapacity < span) {
+            newCapacity *= 2;
+        }
+
+        T **newSlots = new T*[newCapacity];
+        memset(newSlots, 0, newCapacity*sizeof(T *));
+        for (size_t i=0; i<_span; i++) {
+            EmiNonWrappingSequenceNumber sn = _base+i;
+            newSlots[sn & (newCapacity-1)] = slot(sn);
+        }
+
+        delete [] _slots;
+        _slots = newSlots;
+        _capacity = newCapacity;
+    }
+
+    inline void skipHoles() {
+        while (_span && !slot(_base)) {
+            _base++;
+            _span--;
+        }
+    }
+
+public:
+    EmiSequenceRing() :
+    _slots(new T*[MIN_CAPACITY]),
+    _capacity(MIN_CAPACITY),
+    _base(0),
+    _span(0) {
+        memset(_slots, 0, _capacity*sizeof(T *));
+    }
+
+    virtual ~EmiSequenceRing() {
+        delete [] _slots;
+    }
+
+    inline bool empty() const {
+        return 0 == _span;
+    }
+
+    inline size_t span() const {
+        return _span;
+    }
+
+    // The sequence number of the oldest element. Must not be
+    // called when the ring is empty.
+    inline EmiNonWrappingSequenceNumber first() const {
+        ASSERT(_span);
+        return _base;
+    }
+
+    inline T *find(EmiNonWrappingSequenceNumber sequenceNumber) const {
+        if (sequenceNumber < _base || sequenceNumber-_base >= _span) {
+            return NULL;
+        }
+        return slot(sequenceNumber);
+    }
+
+    // Returns false, and does not insert elem, if there already is
+    // an element with that sequence number, or if inserting it would
+    // make the window wider than maxSpan.
+    bool insert(EmiNonWrappingSequenceNumber sequenceNumber, T *elem,
+                size_t maxSpan = (size_t)-1) {
+        ASSERT(elem);
+
+        if (0 == _span) {
+            _base = sequenceNumber;
+            _span = 1;
+        }
+        else if (sequenceNumber >= _base && sequenceNumber-_base < _span) {
+            if (slot(sequenceNumber)) {
+                return false;
+            }
+        }
+        else {
+            EmiNonWrappingSequenceNumber newBase = std::min(_base, sequenceNumber);
+            EmiNonWrappingSequenceNumber newEnd  = std::max(_base+_span, sequenceNumber+1);
+            if (newEnd-newBase > maxSpan) {
+                return false;
+            }
+
+            size_t newSpan = newEnd-newBase;
+            if (newSpan > _capacity) {
+                grow(newSpan);
+            }
+            _base = newBase;
+            _span = newSpan;
+        }
+
+        slot(sequenceNumber) = elem;
+        return true;
+    }
+
+    // Removes and returns the element with the given sequence number,
+    // or returns NULL if there is none.
+    T *erase(EmiNonWrappingSequenceNumber sequenceNumber) {
+        T *elem = find(sequenceNumber);
+        if (elem) {
+            slot(sequenceNumber) = NULL;
+            skipHoles();
+        }
+        
+        return elem;
+    }
+    
+    // Removes and returns the oldest element if its sequence number
+    // is <= sequenceNumber, otherwise returns NULL.
+    T *popUpTo(EmiNonWrappingSequenceNumber sequenceNumber) {
+        if (0 == _span || _base > sequenceNumber) {
+            return NULL;
+        }
+
+        T *&first(slot(_base));
+        T *elem = first;
+        first = NULL;
+        _base++;
+        _span--;
+        skipHoles();
+
+        return elem;
+    }
+};
+
+#endif
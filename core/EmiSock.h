@@ -13,13 +13,14 @@
 #include "EmiSendQueue.h"
 #include "EmiSockConfig.h"
 #include "EmiConnParams.h"
-#include "EmiAddressCmp.h"
+#include "EmiTimerWheel.h"
+#include "EmiEndpointKey.h"
+#include "EmiFlatHashMap.h"
 #include "EmiUdpSocket.h"
 #include "EmiNetUtil.h"
 #include "EmiNetRandom.h"
 #include "EmiMessageHandler.h"
 
-#include <map>
 #include <set>
 #include <cstdlib>
 #include <netinet/in.h>
@@ -62,6 +63,10 @@
 // 3) SockDelegate::connectionGotMessage must invoke EmiConn::onMessage
 //    in the EmiConn thread, preferably asynchronously (or the
 //    performance gain will be lost).
+// 4) If SockDelegate::connectionsShareThread returns true, the
+//    timers of all connections of an EmiSock are driven by one
+//    EmiTimerWheel. The EmiSock and all of its connections must then
+//    be accessed from the same thread.
 template<class SockDelegate, class ConnDelegate>
 class EmiSock {
     typedef typename SockDelegate::Binding     Binding;
@@ -70,26 +75,13 @@ class EmiSock {
     typedef typename Binding::SocketHandle     SocketHandle;
     typedef typename SockDelegate::ConnectionOpenedCallbackCookie  ConnectionOpenedCallbackCookie;
     
-    struct AddressKey {
-    public:
-        explicit AddressKey(const sockaddr_storage& address_) :
-        address(address_) {}
-        
-        sockaddr_storage address;
-        
-        inline bool operator<(const AddressKey& rhs) const {
-            return 0 > EmiAddressCmp::compare(address, rhs.address);
-        }
-    };
-    
     typedef EmiConnParams<Binding>                  ECP;
     typedef EmiConn<SockDelegate, ConnDelegate>     EC;
     typedef EmiMessage<Binding>                     EM;
     typedef EmiUdpSocket<Binding>                   EUS;
     typedef EmiMessageHandler<EC, EmiSock, Binding> EMH;
     
-    typedef std::map<AddressKey, EC*>              ServerConnectionMap;
-    typedef typename ServerConnectionMap::iterator ServerConnectionMapIter;
+    typedef EmiFlatHashMap<EmiEndpointKey, EC*>    ServerConnectionMap;
     
     // For makeServerConnection
     friend class EmiMessageHandler<EC, EmiSock, Binding>;
@@ -103,6 +95,20 @@ private:
     EUS                  *_serverSocket;
     ServerConnectionMap   _serverConns;
     SockDelegate          _delegate;
+    // Created lazily by connectionTimerWheel
+    EmiTimerWheel<Binding> *_timerWheel;
+    
+    // Returns the timer wheel that the connections of this socket
+    // share, or NULL if the binding runs the connections on other
+    // threads than the socket, in which case each connection gets a
+    // wheel of its own.
+    EmiTimerWheel<Binding> *connectionTimerWheel() {
+        if (!_timerWheel && _delegate.connectionsShareThread()) {
+            _timerWheel = new EmiTimerWheel<Binding>(_delegate.getTimerCookie());
+        }
+        
+        return _timerWheel;
+    }
     
     // SockDelegate::connectionOpened will be called on the cookie iff this function returns true.
     bool connectHelper(EmiTimeInterval now, const sockaddr_storage& remoteAddress,
@@ -112,7 +118,8 @@ private:
         sockaddr_storage bindAddress(config.address);
         EmiNetUtil::addrSetPort(bindAddress, 0); // Bind to a random free port number
         
-        EC *ec(_delegate.makeConnection(ECP(remoteAddress,
+        EC *ec(_delegate.makeConnection(ECP(connectionTimerWheel(),
+                                            remoteAddress,
                                             p2pCookie, p2pCookieLength,
                                             sharedSecret, sharedSecretLength)));
         if (!ec->open(now, bindAddress, callbackCookie, err)) {
@@ -139,8 +146,8 @@ private:
         
         ASSERT(sock->_serverSocket == socket);
         
-        ServerConnectionMapIter cur(sock->_serverConns.find(AddressKey(remoteAddress)));
-        EC *conn = (sock->_serverConns.end() == cur ? NULL : (*cur).second);
+        EC **connPtr = sock->_serverConns.find(EmiEndpointKey(remoteAddress));
+        EC *conn = (connPtr ? *connPtr : NULL);
         
         if (conn) {
             // The purpose of connectionGotMessage is to give the bindings
@@ -162,9 +169,10 @@ private:
     }
     
     EC *makeServerConnection(const sockaddr_storage& remoteAddress, uint16_t inboundPort) {
-        EC *conn = _delegate.makeConnection(ECP(_serverSocket, remoteAddress, inboundPort));
-        ASSERT(0 == _serverConns.count(AddressKey(remoteAddress)));
-        _serverConns.insert(std::make_pair(AddressKey(remoteAddress), conn));
+        EC *conn = _delegate.makeConnection(ECP(connectionTimerWheel(),
+                                                    _serverSocket, remoteAddress, inboundPort));
+        bool inserted = _serverConns.insert(EmiEndpointKey(remoteAddress), conn);
+        ASSERT(inserted);
         _delegate.gotServerConnection(*conn);
         
         return conn;
@@ -183,35 +191,36 @@ public:
     config(config_),
     _messageHandler(*this),
     _delegate(delegate),
-    _serverSocket(NULL) {}
+    _serverSocket(NULL),
+    _serverConns(EmiNetRandom<Binding>::random()),
+    _timerWheel(NULL) {}
     
     virtual ~EmiSock() {
         /// EmiSock should not be deleted before all open connections are closed,
         /// but just to be sure, we close all remaining connections.
         
         size_t numConns = _serverConns.size();
-        ServerConnectionMapIter iter = _serverConns.begin();
-        ServerConnectionMapIter end  = _serverConns.end();
-        while (iter != end) {
-            // This will remove the connection from _conns
-            (*iter).second->forceClose();
+        while (!_serverConns.empty()) {
+            // This will remove the connection from _conns. Note that
+            // the argument-less forceClose would only schedule the
+            // close, and then this loop would never terminate.
+            _serverConns.begin().value()->forceClose(EMI_REASON_THIS_HOST_CLOSED);
             
             // We do this check to make sure we don't enter an infinite loop.
             // It shouldn't be required.
             size_t newNumConns = _serverConns.size();
             ASSERT(newNumConns < numConns);
             numConns = newNumConns;
-            
-            // We can't increment iter, it has been
-            // invalidated because the connection was
-            // removed from _conns
-            iter = _serverConns.begin();
         }
         
         /// Close the server socket
         if (_serverSocket) {
             delete _serverSocket;
         }
+        
+        if (_timerWheel) {
+            _timerWheel->release();
+        }
     }
     
     SockDelegate& getDelegate() {
@@ -222,6 +231,12 @@ public:
         return _delegate;
     }
     
+    // Returns the port that the server socket is bound to, or 0
+    // if the socket does not accept connections or isn't open.
+    uint16_t getServerPort() const {
+        return _serverSocket ? _serverSocket->getLocalPort() : 0;
+    }
+    
     bool open(Error& err) {
         if (!_serverSocket && config.acceptConnections) {
             sockaddr_storage ss(config.address);
@@ -269,7 +284,7 @@ public:
     void deregisterServerConnection(EC *conn) {
         ASSERT(EMI_CONNECTION_TYPE_SERVER == conn->getType());
         
-        _serverConns.erase(AddressKey(conn->getRemoteAddress()));
+        _serverConns.erase(EmiEndpointKey(conn->getRemoteAddress()));
     }
 };
 
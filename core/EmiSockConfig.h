@@ -18,6 +18,7 @@ class EmiSockConfig {
 public:
     EmiSockConfig() :
     mtu(EMI_MINIMAL_MTU),
+    maxMtu(EMI_MINIMAL_MTU),
     heartbeatFrequency(EMI_DEFAULT_HEARTBEAT_FREQUENCY),
     connectionTimeout(EMI_DEFAULT_CONNECTION_TIMEOUT),
     initialConnectionTimeout(EMI_DEFAULT_CONNECTION_TIMEOUT),
@@ -31,6 +32,9 @@ public:
     }
     
     size_t mtu;
+    // If maxMtu is larger than mtu, path MTU discovery is used to
+    // find out how large packets can be sent without fragmentation.
+    size_t maxMtu;
     float heartbeatFrequency;
     EmiTimeInterval connectionTimeout;
     EmiTimeInterval initialConnectionTimeout;
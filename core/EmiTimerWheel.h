@@ -0,0 +1,501 @@
+//
+//  EmiTimerWheel.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2026-10-18.
+//  Copyright (c) 2026 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiTimerWheel_h
+#define eminet_EmiTimerWheel_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+#include "EmiListLink.h"
+
+#include <stdint.h>
+#include <cmath>
+
+template<class Binding>
+class EmiTimerWheel;
+
+// A timer that is driven by an EmiTimerWheel. Unlike Binding
+// timers, these are meant to be embedded directly in the objects
+// that own them, so scheduling and descheduling them doesn't
+// allocate anything.
+//
+// The interface mirrors Binding::scheduleTimer and
+// Binding::descheduleTimer.
+template<class Binding>
+class EmiWheelTimer : private EmiListLink {
+    friend class EmiTimerWheel<Binding>;
+
+public:
+    typedef void (Callback)(EmiTimeInterval now, EmiWheelTimer *timer, void *data);
+
+private:
+    // Private copy constructor and assignment operator
+    inline EmiWheelTimer(const EmiWheelTimer& other);
+    inline EmiWheelTimer& operator=(const EmiWheelTimer& other);
+
+    EmiTimerWheel<Binding>& _wheel;
+    Callback               *_callback;
+    void                   *_data;
+    EmiTimeInterval         _interval;
+    // The tick at which the timer expires
+    uint64_t                _expiry;
+    // The slot that the timer was most recently linked into
+    uint8_t                 _level;
+    uint8_t                 _slot;
+    bool                    _repeating;
+    bool                    _active;
+    // False only for the wheel's own tick timer, which must not
+    // keep the wheel alive
+    const bool              _retainsWheel;
+
+    EmiWheelTimer(EmiTimerWheel<Binding>& wheel, bool retainsWheel) :
+    _wheel(wheel),
+    _callback(NULL),
+    _data(NULL),
+    _interval(0),
+    _expiry(0),
+    _level(0),
+    _slot(0),
+    _repeating(false),
+    _active(false),
+    _retainsWheel(retainsWheel) {}
+
+public:
+    explicit EmiWheelTimer(EmiTimerWheel<Binding>& wheel) :
+    _wheel(wheel),
+    _callback(NULL),
+    _data(NULL),
+    _interval(0),
+    _expiry(0),
+    _level(0),
+    _slot(0),
+    _repeating(false),
+    _active(false),
+    _retainsWheel(true) {
+        _wheel.retain();
+    }
+
+    virtual ~EmiWheelTimer() {
+        deschedule();
+        if (_retainsWheel) {
+            _wheel.release();
+        }
+    }
+
+    inline void schedule(Callback *callback, void *data, EmiTimeInterval interval,
+                         bool repeating, bool reschedule) {
+        if (_active && !reschedule) {
+            return;
+        }
+
+        _wheel.schedule(this, callback, data, interval, repeating);
+    }
+
+    inline void deschedule() {
+        if (_active) {
+            _wheel.deschedule(this);
+        }
+    }
+
+    inline bool isActive() const {
+        return _active;
+    }
+};
+
+// Something that wants to be ticked by an EmiTimerWheel at the next
+// EMI_TICK_TIME boundary. See EmiTimerWheel::scheduleTick.
+//
+// Like EmiWheelTimer, these are meant to be embedded in the objects
+// that own them.
+template<class Binding>
+class EmiWheelTick : private EmiListLink {
+    friend class EmiTimerWheel<Binding>;
+
+public:
+    typedef void (Callback)(EmiTimeInterval now, void *data);
+
+private:
+    // Private copy constructor and assignment operator
+    inline EmiWheelTick(const EmiWheelTick& other);
+    inline EmiWheelTick& operator=(const EmiWheelTick& other);
+
+    Callback *_callback;
+    void     *_data;
+
+public:
+    EmiWheelTick(Callback *callback, void *data) :
+    _callback(callback),
+    _data(data) {}
+
+    virtual ~EmiWheelTick() {
+        deschedule();
+    }
+
+    inline bool isScheduled() const {
+        return !isEmpty();
+    }
+
+    inline void deschedule() {
+        EmiListLink::unlink();
+    }
+};
+
+// A hierarchical timing wheel. It keeps track of any number of
+// EmiWheelTimers using one Binding timer, which is scheduled to
+// fire when the next timer expires.
+//
+// Time is divided into ticks of 1ms. Level 0 of the wheel has one
+// slot per tick, and each higher level has slots that are
+// SLOTS times longer than the one below it. A timer is put in the
+// lowest level that can hold it, and it is moved (cascaded) down
+// to lower levels as its expiry approaches. Scheduling and
+// descheduling a timer are thus O(1), and each timer is cascaded
+// at most LEVELS-1 times. A bitmap of non-empty slots for each
+// level is used to find the next expiry without scanning.
+//
+// A wheel, and all timers that use it, must be accessed in a
+// strictly sequenced manner; it has the same thread safety rules
+// as the Binding timers that it uses.
+//
+// The wheel also keeps a list of EmiWheelTicks that have work to do
+// (typically connections that have something to send). They are all
+// ticked back to back at the next EMI_TICK_TIME boundary, from one
+// wheel timer, so that the packets that they send can be batched
+// together and so that there is only one wakeup per tick for all
+// connections that share the wheel.
+//
+// Wheels are reference counted. Each timer holds a reference to
+// its wheel, so it is safe to release a wheel that still has
+// timers.
+template<class Binding>
+class EmiTimerWheel {
+    friend class EmiWheelTimer<Binding>;
+
+    typedef typename Binding::Timer       BindingTimer;
+    typedef typename Binding::TimerCookie TimerCookie;
+    typedef EmiWheelTimer<Binding>        WT;
+    typedef EmiWheelTick<Binding>         WTick;
+
+    static const uint64_t TICKS_PER_SECOND = 1000;
+    static const size_t   LEVEL_BITS       = 6;
+    static const size_t   SLOTS            = 1 << LEVEL_BITS;
+    static const size_t   LEVELS           = 4;
+    // Timers that expire further away than this are put in the
+    // last slot of the top level, and they are put back in the
+    // top level each time they are cascaded, until they fit.
+    static const uint64_t MAX_TICKS        = 1ULL << (LEVEL_BITS*LEVELS);
+    static const uint64_t NOT_ARMED        = ~0ULL;
+
+    size_t            _refCount;
+    BindingTimer     *_bindingTimer;
+    EmiTimeInterval   _epoch;
+    // All timers that expire at or before this tick have fired
+    uint64_t          _currentTick;
+    // The tick that _bindingTimer is scheduled for
+    uint64_t          _armedTick;
+    size_t            _numTimers;
+    uint64_t          _occupied[LEVELS];
+    EmiListLink _slots[LEVELS][SLOTS];
+    // The EmiWheelTicks that are to be ticked at the next tick
+    EmiListLink _ticks;
+    WT                _tickTimer;
+
+    // Private copy constructor and assignment operator
+    inline EmiTimerWheel(const EmiTimerWheel& other);
+    inline EmiTimerWheel& operator=(const EmiTimerWheel& other);
+
+    virtual ~EmiTimerWheel() {
+        _tickTimer.deschedule();
+        ASSERT(_ticks.isEmpty());
+        ASSERT(0 == _numTimers);
+        Binding::freeTimer(_bindingTimer);
+    }
+
+    inline uint64_t tickForTime(EmiTimeInterval time) const {
+        EmiTimeInterval ticks = (time-_epoch)*TICKS_PER_SECOND;
+        // The epsilon makes sure that a timer isn't considered
+        // to be not yet due just because of rounding errors.
+        return ticks <= 0 ? 0 : (uint64_t)(ticks + 1e-6);
+    }
+
+    inline static uint64_t intervalTicks(EmiTimeInterval interval) {
+        uint64_t ticks = (uint64_t)ceil(interval*TICKS_PER_SECOND);
+        return ticks ? ticks : 1;
+    }
+
+    // When a slot is cascaded, the timers that expire at the
+    // current tick are put in the level 0 slot that is about to be
+    // expired. Otherwise, overdue timers are put in the next slot.
+    void link(WT *timer, bool cascading = false) {
+        uint64_t expiry = timer->_expiry;
+        if (expiry < _currentTick || (expiry == _currentTick && !cascading)) {
+            expiry = _currentTick+1;
+        }
+
+        uint64_t delta = expiry-_currentTick;
+        if (delta >= MAX_TICKS) {
+            expiry = _currentTick+MAX_TICKS-1;
+            delta = MAX_TICKS-1;
+        }
+
+        size_t level = 0;
+        while (delta >= (1ULL << (LEVEL_BITS*(level+1)))) {
+            level++;
+        }
+        size_t slot = (expiry >> (LEVEL_BITS*level)) & (SLOTS-1);
+
+        timer->_level = level;
+        timer->_slot = slot;
+        _slots[level][slot].pushBack(timer);
+        _occupied[level] |= (1ULL << slot);
+    }
+
+    void unlink(WT *timer) {
+        timer->EmiListLink::unlink();
+
+        // If the timer was not actually in this slot but in a list
+        // of timers that are being fired or cascaded, the slot might
+        // still be empty, and then clearing the bit is correct too.
+        if (_slots[timer->_level][timer->_slot].isEmpty()) {
+            _occupied[timer->_level] &= ~(1ULL << timer->_slot);
+        }
+    }
+
+    // Returns the next tick at which a timer expires or has to be
+    // cascaded to a lower level, or NOT_ARMED if there are no timers.
+    uint64_t nextEventTick() const {
+        uint64_t next = NOT_ARMED;
+
+        for (size_t level=0; level<LEVELS; level++) {
+            uint64_t occupied = _occupied[level];
+            if (!occupied) {
+                continue;
+            }
+
+            size_t shift = LEVEL_BITS*level;
+            uint64_t block = _currentTick >> shift;
+            size_t idx = block & (SLOTS-1);
+
+            uint64_t later = (idx+1 < SLOTS ? occupied & (~0ULL << (idx+1)) : 0);
+            uint64_t tick;
+            if (later) {
+                tick = (block + (__builtin_ctzll(later) - idx)) << shift;
+            }
+            else {
+                // The slot is not reached until the next rotation
+                tick = ((block | (SLOTS-1)) + 1 + __builtin_ctzll(occupied)) << shift;
+            }
+
+            if (tick < next) {
+                next = tick;
+            }
+        }
+
+        return next;
+    }
+
+    void arm(EmiTimeInterval now) {
+        uint64_t next = nextEventTick();
+        if (next >= _armedTick) {
+            return;
+        }
+
+        EmiTimeInterval delay = _epoch + (EmiTimeInterval)next/TICKS_PER_SECOND - now;
+        Binding::scheduleTimer(_bindingTimer, bindingTimerCallback, this,
+                               delay < 0 ? 0 : delay,
+                               /*repeating:*/false, /*reschedule:*/true);
+        _armedTick = next;
+    }
+
+    void cascade(size_t level, size_t slot) {
+        EmiListLink pending;
+        _slots[level][slot].moveTo(pending);
+        _occupied[level] &= ~(1ULL << slot);
+
+        while (!pending.isEmpty()) {
+            WT *timer = static_cast<WT *>(pending.next);
+            timer->EmiListLink::unlink();
+            link(timer, /*cascading:*/true);
+        }
+    }
+
+    void expire(EmiTimeInterval now, size_t slot) {
+        EmiListLink pending;
+        _slots[0][slot].moveTo(pending);
+        _occupied[0] &= ~(1ULL << slot);
+
+        // Timers that are still in pending might be descheduled
+        // or destroyed by the callbacks; this is fine, because they
+        // unlink themselves from pending in that case.
+        while (!pending.isEmpty()) {
+            WT *timer = static_cast<WT *>(pending.next);
+            timer->EmiListLink::unlink();
+
+            if (timer->_repeating) {
+                timer->_expiry = _currentTick+intervalTicks(timer->_interval);
+                link(timer);
+            }
+            else {
+                timer->_active = false;
+                _numTimers--;
+            }
+
+            timer->_callback(now, timer, timer->_data);
+        }
+    }
+
+    void advance(EmiTimeInterval now, uint64_t targetTick) {
+        while (_numTimers) {
+            uint64_t next = nextEventTick();
+            if (next > targetTick) {
+                break;
+            }
+            _currentTick = next;
+
+            // Cascade higher levels first, because they might
+            // cascade timers into the lower level slots that are
+            // due at this tick.
+            for (size_t level=LEVELS-1; level>0; level--) {
+                size_t shift = LEVEL_BITS*level;
+                if (0 == (next & ((1ULL << shift)-1))) {
+                    cascade(level, (next >> shift) & (SLOTS-1));
+                }
+            }
+
+            expire(now, next & (SLOTS-1));
+        }
+
+        if (targetTick > _currentTick) {
+            _currentTick = targetTick;
+        }
+    }
+
+    static void bindingTimerCallback(EmiTimeInterval now, BindingTimer *bindingTimer, void *data) {
+        EmiTimerWheel *wheel = (EmiTimerWheel *)data;
+
+        // The callbacks might release the last timer of the wheel
+        wheel->retain();
+
+        wheel->_armedTick = NOT_ARMED;
+        wheel->advance(now, wheel->tickForTime(now));
+
+        // Timers that were scheduled by the callbacks might have
+        // armed the Binding timer for a tick that has passed now
+        wheel->_armedTick = NOT_ARMED;
+        if (wheel->_numTimers) {
+            wheel->arm(now);
+        }
+        else {
+            Binding::descheduleTimer(wheel->_bindingTimer);
+        }
+
+        wheel->release();
+    }
+
+    static void tickTimerCallback(EmiTimeInterval now, WT *timer, void *data) {
+        EmiTimerWheel *wheel = (EmiTimerWheel *)data;
+
+        // Ticks that are scheduled by the callbacks end up in
+        // _ticks and are ticked at the next tick boundary.
+        EmiListLink pending;
+        wheel->_ticks.moveTo(pending);
+
+        while (!pending.isEmpty()) {
+            WTick *tick = static_cast<WTick *>(pending.next);
+            tick->EmiListLink::unlink();
+            tick->_callback(now, tick->_data);
+        }
+    }
+
+    void schedule(WT *timer, typename WT::Callback *callback, void *data,
+                  EmiTimeInterval interval, bool repeating) {
+        EmiTimeInterval now = Binding::now();
+
+        if (timer->_active) {
+            unlink(timer);
+        }
+        else {
+            timer->_active = true;
+            if (0 == _numTimers++) {
+                // The wheel has been idle, so there is nothing
+                // to fire between _currentTick and now.
+                uint64_t nowTick = tickForTime(now);
+                if (nowTick > _currentTick) {
+                    _currentTick = nowTick;
+                }
+            }
+        }
+
+        timer->_callback = callback;
+        timer->_data = data;
+        timer->_interval = interval;
+        timer->_repeating = repeating;
+        timer->_expiry = (uint64_t)ceil((now+interval-_epoch)*TICKS_PER_SECOND - 1e-6);
+
+        link(timer);
+        arm(now);
+    }
+
+    void deschedule(WT *timer) {
+        unlink(timer);
+        timer->_active = false;
+
+        if (0 == --_numTimers) {
+            Binding::descheduleTimer(_bindingTimer);
+            _armedTick = NOT_ARMED;
+        }
+    }
+
+public:
+
+    // The wheel is created with a reference count of 1
+    explicit EmiTimerWheel(const TimerCookie& timerCookie) :
+    _refCount(1),
+    _bindingTimer(Binding::makeTimer(timerCookie)),
+    _epoch(Binding::now()),
+    _currentTick(0),
+    _armedTick(NOT_ARMED),
+    _numTimers(0),
+    _ticks(),
+    _tickTimer(*this, /*retainsWheel:*/false) {
+        for (size_t i=0; i<LEVELS; i++) {
+            _occupied[i] = 0;
+        }
+    }
+
+    // Makes sure that tick is ticked at the next EMI_TICK_TIME
+    // boundary. Does nothing if it is already scheduled.
+    void scheduleTick(WTick *tick) {
+        if (tick->isScheduled()) {
+            return;
+        }
+
+        _ticks.pushBack(tick);
+
+        if (!_tickTimer.isActive()) {
+            EmiTimeInterval now = Binding::now();
+            EmiTimeInterval sinceEpoch = now-_epoch;
+            EmiTimeInterval nextTick = (floor(sinceEpoch/EMI_TICK_TIME)+1)*EMI_TICK_TIME;
+            _tickTimer.schedule(tickTimerCallback, this, nextTick-sinceEpoch,
+                                /*repeating:*/false, /*reschedule:*/false);
+        }
+    }
+
+    inline void retain() {
+        _refCount++;
+    }
+
+    inline void release() {
+        ASSERT(_refCount > 0);
+        if (0 == --_refCount) {
+            delete this;
+        }
+    }
+};
+
+#endif
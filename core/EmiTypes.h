@@ -23,7 +23,14 @@
 
 #define EMI_UDP_HEADER_SIZE           (8)
 #define EMI_MESSAGE_HEADER_MIN_LENGTH (4)
-#define EMI_PACKET_HEADER_MAX_LENGTH  (21)
+// 1 byte of flags, 1 byte of extra flags, 3 bytes each of sequence
+// number, ACK, NAK, RTT response and spurious NAK, 4 bytes each of
+// link capacity and arrival rate and 1 byte of RTT response delay
+#define EMI_PACKET_HEADER_MAX_LENGTH  (26)
+// The maximal number of [first, last] sequence number ranges in a
+// SACK message
+#define EMI_SACK_MAX_BLOCKS           (4)
+#define EMI_SACK_BLOCK_LENGTH         (2*EMI_HEADER_SEQUENCE_NUMBER_LENGTH)
 
 #define EMI_MIN_CONGESTION_WINDOW         ((size_t)(1024))
 #define EMI_MAX_CONGESTION_WINDOW         ((size_t)(1024*1024*10))
@@ -36,6 +43,19 @@
 #define EMI_MIN_RTO          (0.1)
 #define EMI_MAX_RTO          (20.0)
 #define EMI_INIT_RTO         (1.0)
+// The tail loss probe timeout before the RTT is known. It is shorter
+// than EMI_INIT_RTO, so that a lost tail doesn't stall a new
+// connection for a whole initial RTO.
+#define EMI_INIT_PTO         (0.25)
+// The base RTT, which the queuing delay is measured against, is the
+// minimal RTT of the last two intervals of this length
+#define EMI_BASE_RTT_INTERVAL   (60.0)
+// Background priority messages back off when the queuing delay
+// exceeds this (the target of LEDBAT, RFC 6817)
+#define EMI_LEDBAT_TARGET_DELAY (0.1)
+#define EMI_LEDBAT_GAIN         (1.0)
+#define EMI_LEDBAT_INITIAL_RATE (2*EMI_MINIMAL_MTU/EMI_MIN_RTO)
+#define EMI_LEDBAT_MIN_RATE     (EMI_MINIMAL_MTU)
 
 #define EMI_IS_VALID_CHANNEL_QUALIFIER(cq)  (0 == ((cq) & 0x20))
 #define EMI_CHANNEL_QUALIFIER_TYPE(cq)      ((EmiChannelType) (((cq) & 0xc0) >> 6))
@@ -54,7 +74,11 @@ typedef enum {
     EMI_PRIORITY_HIGH        = 1,
     EMI_PRIORITY_MEDIUM      = 2,
     EMI_PRIORITY_LOW         = 3,
-    EMI_NUMBER_OF_PRIORITIES = 4
+    // Background messages are sent only when there are no other
+    // messages to send, and they back off when the queuing delay
+    // of the connection grows. See EmiLedbat.
+    EMI_PRIORITY_BACKGROUND  = 4,
+    EMI_NUMBER_OF_PRIORITIES = 5
 } EmiPriority;
 
 typedef enum {
@@ -106,6 +130,11 @@ typedef uint8_t  EmiPacketFlags;
 typedef double   EmiTimeInterval;
 
 typedef enum {
+    // Only used on SYN and SYN-RST messages. It tells the other host
+    // that this host understands SACK messages and the spurious NAK
+    // extra packet flag. Hosts that don't know about it ignore it,
+    // and those features are only used if the other host sets it.
+    EMI_EXTENSIONS_FLAG      = 0x80,
     EMI_SPLIT_NOT_FIRST_FLAG = 0x40, // This flag means that this is a split message, and it's not the first part
     EMI_SPLIT_NOT_LAST_FLAG  = 0x20, // This flag means that this is a split message, and it's not the last part
     EMI_PRX_FLAG             = 0x10,
@@ -128,7 +157,8 @@ typedef enum {
 
 typedef enum {
     EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x01,
-    EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x02
+    EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x02,
+    EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG  = 0x04
 } EmiPacketExtraFlags;
 
 #endif
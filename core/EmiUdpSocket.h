@@ -18,6 +18,14 @@
 // The purpose of this class is to encapsulate opening one UDP socket
 // per network interface, to be able to tell which the receiver address
 // of each datagram is.
+//
+// Bindings that can get the receiver address of each datagram from
+// the OS (IP_PKTINFO) can instead opt in to using one socket that is
+// bound to the any address. This is done by returning true from
+// Binding::packetInfoEnabled. Such bindings report the receiver
+// address of the datagram that is being dispatched through
+// Binding::extractInboundAddress, and they send with a given source
+// address through Binding::sendDataFrom.
 template<class Binding>
 class EmiUdpSocket {
 private:
@@ -44,12 +52,17 @@ private:
     
     SocketVector  _sockets;
     uint16_t      _localPort;
+    // True if _sockets contains exactly one socket, which is bound
+    // to the any address and uses packet info to tell the receiver
+    // address of each datagram.
+    bool          _packetInfo;
     OnMessage    *_callback;
     void         *_userData;
     
     EmiUdpSocket(OnMessage *callback, void *userData) :
     _sockets(),
     _localPort(0),
+    _packetInfo(false),
     _callback(callback),
     _userData(userData) {}
     
@@ -62,14 +75,70 @@ private:
                           size_t len) {
         EmiUdpSocket *eus((EmiUdpSocket *)userData);
         
-        sockaddr_storage inboundAddress;
-        Binding::extractLocalAddress(sock, inboundAddress);
+        if (eus->_packetInfo) {
+            sockaddr_storage inboundAddress;
+            Binding::extractInboundAddress(sock, inboundAddress);
+            
+            eus->_callback(eus, eus->_userData, now, inboundAddress, remoteAddress, data, offset, len);
+            return;
+        }
+        
+        const sockaddr_storage *inboundAddress = eus->cachedLocalAddress(sock);
+        if (inboundAddress) {
+            eus->_callback(eus, eus->_userData, now, *inboundAddress, remoteAddress, data, offset, len);
+        }
+        else {
+            sockaddr_storage localAddress;
+            Binding::extractLocalAddress(sock, localAddress);
+            
+            eus->_callback(eus, eus->_userData, now, localAddress, remoteAddress, data, offset, len);
+        }
+    }
+    
+    // The local address of each socket is looked up once, when it
+    // is opened. This avoids asking the OS for it for every
+    // received datagram.
+    //
+    // Returns NULL if sock is not (yet) in _sockets, which can
+    // happen if a datagram arrives while init is still running.
+    const sockaddr_storage *cachedLocalAddress(SocketHandle *sock) const {
+        typename SocketVector::const_iterator iter(_sockets.begin());
+        typename SocketVector::const_iterator  end(_sockets.end());
+        while (iter != end) {
+            if ((*iter).second == sock) {
+                return &(*iter).first;
+            }
+            
+            ++iter;
+        }
+        
+        return NULL;
+    }
+    
+    template<class SocketCookie>
+    bool initPacketInfo(SocketCookie socketCookie, const sockaddr_storage& address, Error& err) {
+        SocketHandle *handle = Binding::openSocket(socketCookie, onMessage, this, address, err);
+        if (!handle) {
+            return false;
+        }
+        
+        sockaddr_storage localAddr;
+        Binding::extractLocalAddress(handle, localAddr);
+        
+        _sockets.push_back(std::make_pair(localAddr, handle));
+        _localPort = EmiNetUtil::addrPortH(localAddr);
+        ASSERT(0 != _localPort);
         
-        eus->_callback(eus, eus->_userData, now, inboundAddress, remoteAddress, data, offset, len);
+        return true;
     }
     
     template<class SocketCookie>
     bool init(SocketCookie socketCookie, const sockaddr_storage& address, Error& err) {
+        if (EmiNetUtil::isAnyAddr(address) && Binding::packetInfoEnabled(socketCookie)) {
+            _packetInfo = true;
+            return initPacketInfo(socketCookie, address, err);
+        }
+        
         NetworkInterfaces ni;
         
         if (!Binding::getNetworkInterfaces(ni, err)) {
@@ -166,6 +235,19 @@ public:
                   size_t size) {
         uint16_t fromAddrPort(EmiNetUtil::addrPortH(fromAddress));
         
+        if (_packetInfo) {
+            // There is only one socket. If no specific source
+            // address is requested, the OS picks one.
+            SocketHandle* sh(_sockets.front().second);
+            if (0 == fromAddrPort || EmiNetUtil::isAnyAddr(fromAddress)) {
+                Binding::sendData(sh, toAddress, data, size);
+            }
+            else {
+                Binding::sendDataFrom(sh, fromAddress, toAddress, data, size);
+            }
+            return;
+        }
+        
         SocketVectorIter iter(_sockets.begin());
         SocketVectorIter  end(_sockets.end());
         while (iter != end) {
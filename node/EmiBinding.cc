@@ -50,6 +50,10 @@ void EmiBinding::randomBytes(uint8_t *buf, size_t bufSize) {
     ASSERT(RAND_bytes(buf, bufSize));
 }
 
+EmiTimeInterval EmiBinding::now() {
+    return EmiNodeUtil::now();
+}
+
 static void close_cb(uv_handle_t* handle) {
     free(handle);
 }
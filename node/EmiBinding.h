@@ -67,6 +67,9 @@ public:
                          uint8_t *buf, size_t bufLen);
     static void randomBytes(uint8_t *buf, size_t bufSize);
     
+    // Returns the current time in the same time base as the now
+    // parameter of timer callbacks
+    static EmiTimeInterval now();
     static Timer *makeTimer(void *timerCookie);
     static void freeTimer(Timer *timer);
     static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
@@ -97,6 +100,23 @@ public:
                          const sockaddr_storage& address,
                          const uint8_t *data,
                          size_t size);
+    
+    // libuv does not expose IP_PKTINFO, so EmiUdpSocket opens one
+    // socket per network interface. The packet info functions are
+    // never called.
+    inline static bool packetInfoEnabled(EmiObjectWrap *jsObj) {
+        return false;
+    }
+    inline static void extractInboundAddress(uv_udp_t *socket, sockaddr_storage& address) {
+        extractLocalAddress(socket, address);
+    }
+    inline static void sendDataFrom(uv_udp_t *socket,
+                                    const sockaddr_storage& fromAddress,
+                                    const sockaddr_storage& toAddress,
+                                    const uint8_t *data,
+                                    size_t size) {
+        sendData(socket, toAddress, data, size);
+    }
 };
 
 #endif
@@ -18,6 +18,8 @@ class EmiSock;
 template<class SockDelegate, class ConnDelegate>
 class EmiConn;
 template<class Binding>
+class EmiCongestionControl;
+template<class Binding>
 class EmiConnParams;
 template<class Binding>
 class EmiUdpSocket;
@@ -34,6 +36,7 @@ public:
     
     typedef EmiBinding                 Binding;
     typedef v8::Persistent<v8::Object> ConnectionOpenedCallbackCookie;
+    typedef EmiCongestionControl<EmiBinding> CongestionControl;
     
     EmiSockDelegate(EmiSocket& es);
     
@@ -58,6 +61,9 @@ public:
     inline const EmiSocket& getEmiSocket() const { return _es; }
     
     inline EmiObjectWrap *getSocketCookie() { return (EmiObjectWrap *)&_es; }
+    inline void *getTimerCookie() { return NULL; }
+    // Everything runs on the node thread
+    inline bool connectionsShareThread() const { return true; }
 };
 
 #endif
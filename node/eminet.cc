@@ -30,6 +30,7 @@ void InitAll(Handle<Object> target) {
     X(PRIORITY_HIGH,      EMI_PRIORITY_HIGH);
     X(PRIORITY_MEDIUM,    EMI_PRIORITY_MEDIUM);
     X(PRIORITY_LOW,       EMI_PRIORITY_LOW);
+    X(PRIORITY_BACKGROUND, EMI_PRIORITY_BACKGROUND);
     
     // EmiChannelType
     X(UNRELIABLE,           EMI_CHANNEL_TYPE_UNRELIABLE);
@@ -0,0 +1,81 @@
+#include "EmiPosixBinding.h"
+
+#include "../core/EmiNetUtil.h"
+
+#include <cerrno>
+#include <cstring>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+
+EmiPosixTemporaryData EmiPosixBinding::makeTemporaryData(size_t size, uint8_t **outData) {
+    EmiPosixBuffer *buf = EmiPosixBuffer::make(size);
+    *outData = buf->data();
+    
+    EmiPosixTemporaryData data(buf);
+    buf->release();
+    return data;
+}
+
+void EmiPosixBinding::hmacHash(const uint8_t *key, size_t keyLength,
+                               const uint8_t *data, size_t dataLength,
+                               uint8_t *buf, size_t bufLen) {
+    unsigned int bufLenInt = bufLen;
+    ASSERT(HMAC(EVP_sha256(), key, keyLength, data, dataLength, buf, &bufLenInt));
+}
+
+void EmiPosixBinding::randomBytes(uint8_t *buf, size_t bufSize) {
+    ASSERT(RAND_bytes(buf, bufSize));
+}
+
+bool EmiPosixBinding::getNetworkInterfaces(NetworkInterfaces& ni, Error& err) {
+    int ret = getifaddrs(&ni.first);
+    if (-1 == ret) {
+        err = makeError("com.emilir.eminet.networkifaces", errno);
+        return false;
+    }
+    
+    ni.second = ni.first;
+    return true;
+}
+
+bool EmiPosixBinding::nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr) {
+    ifaddrs *ifa;
+    
+    while ((ifa = ni.second)) {
+        ni.second = ifa->ifa_next;
+        
+        if (!ifa->ifa_addr) {
+            // Interfaces without an address, for instance tunnels
+            // that are down. Continue the search.
+            continue;
+        }
+        
+        int family = ifa->ifa_addr->sa_family;
+        if (AF_INET == family) {
+            memcpy(&addr, ifa->ifa_addr, sizeof(sockaddr_in));
+        }
+        else if (AF_INET6 == family) {
+            memcpy(&addr, ifa->ifa_addr, sizeof(sockaddr_in6));
+        }
+        else {
+            // Some other address family that we don't support or care about. Continue the search.
+            continue;
+        }
+        
+        name = ifa->ifa_name;
+        return true;
+    }
+    
+    return false;
+}
+
+void EmiPosixBinding::freeNetworkInterfaces(const NetworkInterfaces& ni) {
+    freeifaddrs(ni.first);
+}
+
+void EmiPosixBinding::extractLocalAddress(EmiPosixUdpHandle *socket, sockaddr_storage& address) {
+    socklen_t len = sizeof(sockaddr_storage);
+    if (socket->closed || -1 == getsockname(socket->fd, (sockaddr *)&address, &len)) {
+        EmiNetUtil::anyAddr(0, AF_INET, &address);
+    }
+}
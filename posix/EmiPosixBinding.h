@@ -0,0 +1,128 @@
+#ifndef eminet_EmiPosixBinding_h
+#define eminet_EmiPosixBinding_h
+
+#include "EmiPosixError.h"
+#include "EmiPosixBuffer.h"
+#include "EmiPosixEventLoop.h"
+
+#include "../core/EmiTypes.h"
+
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <utility>
+
+// Binding for running the EmiNet core directly from C++ on
+// Linux, without node or Cocoa. Sockets and timers are driven
+// by an EmiPosixEventLoop, which is used as both the socket
+// cookie and the timer cookie.
+//
+// PersistentData is a pointer to a reference counted buffer
+// (NULL means no data). TemporaryData is a scoped handle to
+// such a buffer.
+class EmiPosixBinding {
+private:
+    inline EmiPosixBinding();
+    
+public:
+    
+    typedef EmiPosixError         Error;
+    typedef EmiPosixUdpHandle        SocketHandle;
+    typedef EmiPosixTemporaryData TemporaryData;
+    typedef EmiPosixBuffer*       PersistentData;
+    typedef EmiPosixTimer         Timer;
+    typedef EmiPosixEventLoop*    TimerCookie;
+    typedef EmiPosixTimerCb       TimerCb;
+    typedef EmiPosixOnMessage     EmiOnMessage;
+    
+    inline static EmiPosixError makeError(const char *domain, int32_t code) {
+        return EmiPosixError(domain, code);
+    }
+    
+    inline static EmiPosixBuffer *makePersistentData(const uint8_t *data, size_t length) {
+        return EmiPosixBuffer::make(data, length);
+    }
+    static EmiPosixTemporaryData makeTemporaryData(size_t size, uint8_t **outData);
+    inline static void releasePersistentData(EmiPosixBuffer *buf) {
+        if (buf) buf->release();
+    }
+    inline static EmiPosixTemporaryData castToTemporary(EmiPosixBuffer *buf) {
+        return EmiPosixTemporaryData(buf);
+    }
+    
+    inline static const uint8_t *extractData(const EmiPosixBuffer *buf) {
+        return buf ? buf->data() : NULL;
+    }
+    inline static size_t extractLength(const EmiPosixBuffer *buf) {
+        return buf ? buf->length() : 0;
+    }
+    inline static const uint8_t *extractData(const EmiPosixTemporaryData& data) {
+        return extractData(data.buffer());
+    }
+    inline static size_t extractLength(const EmiPosixTemporaryData& data) {
+        return extractLength(data.buffer());
+    }
+    
+    static const size_t HMAC_HASH_SIZE = 32;
+    static void hmacHash(const uint8_t *key, size_t keyLength,
+                         const uint8_t *data, size_t dataLength,
+                         uint8_t *buf, size_t bufLen);
+    static void randomBytes(uint8_t *buf, size_t bufSize);
+    
+    // Returns the current time in the same time base as the now
+    // parameter of timer callbacks
+    inline static EmiTimeInterval now() {
+        return EmiPosixEventLoop::now();
+    }
+    inline static Timer *makeTimer(EmiPosixEventLoop *timerCookie) {
+        return timerCookie->makeTimer();
+    }
+    inline static void freeTimer(Timer *timer) {
+        timer->loop->freeTimer(timer);
+    }
+    inline static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                                     bool repeating, bool reschedule) {
+        timer->loop->scheduleTimer(timer, timerCb, data, interval, repeating, reschedule);
+    }
+    inline static void descheduleTimer(Timer *timer) {
+        timer->loop->descheduleTimer(timer);
+    }
+    
+    typedef std::pair<ifaddrs*, ifaddrs*> NetworkInterfaces;
+    static bool getNetworkInterfaces(NetworkInterfaces& ni, Error& err);
+    static bool nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr);
+    static void freeNetworkInterfaces(const NetworkInterfaces& ni);
+    
+    inline static void closeSocket(EmiPosixUdpHandle *socket) {
+        socket->loop->closeSocket(socket);
+    }
+    inline static EmiPosixUdpHandle *openSocket(EmiPosixEventLoop *socketCookie,
+                                             EmiOnMessage *callback,
+                                             void *userData,
+                                             const sockaddr_storage& address,
+                                             Error& err) {
+        return socketCookie->openSocket(address, callback, userData, err);
+    }
+    static void extractLocalAddress(EmiPosixUdpHandle *socket, sockaddr_storage& address);
+    inline static void sendData(EmiPosixUdpHandle *socket,
+                                const sockaddr_storage& address,
+                                const uint8_t *data,
+                                size_t size) {
+        socket->loop->sendData(socket, address, data, size);
+    }
+    
+    inline static bool packetInfoEnabled(EmiPosixEventLoop *socketCookie) {
+        return socketCookie->getPacketInfo();
+    }
+    inline static void extractInboundAddress(EmiPosixUdpHandle *socket, sockaddr_storage& address) {
+        address = socket->inboundAddress;
+    }
+    inline static void sendDataFrom(EmiPosixUdpHandle *socket,
+                                    const sockaddr_storage& fromAddress,
+                                    const sockaddr_storage& toAddress,
+                                    const uint8_t *data,
+                                    size_t size) {
+        socket->loop->sendData(socket, toAddress, data, size, &fromAddress);
+    }
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef eminet_EmiPosixBuffer_h
+#define eminet_EmiPosixBuffer_h
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+// A reference counted, immutable-length byte buffer. The
+// buffer header and the bytes are allocated in one chunk.
+//
+// EmiPosixBuffer objects are not thread safe; like the rest
+// of EmiNet, they are meant to be accessed by one thread at a
+// time.
+class EmiPosixBuffer {
+private:
+    size_t _refCount;
+    size_t _length;
+    
+    // Private copy constructor and assignment operator
+    inline EmiPosixBuffer(const EmiPosixBuffer& other);
+    inline EmiPosixBuffer& operator=(const EmiPosixBuffer& other);
+    
+    explicit EmiPosixBuffer(size_t length) :
+    _refCount(1), _length(length) {}
+    
+public:
+    // Returns a buffer with a reference count of 1
+    static EmiPosixBuffer *make(size_t length) {
+        void *mem = malloc(sizeof(EmiPosixBuffer)+length);
+        if (!mem) {
+            throw std::bad_alloc();
+        }
+        return new (mem) EmiPosixBuffer(length);
+    }
+    
+    static EmiPosixBuffer *make(const uint8_t *data, size_t length) {
+        EmiPosixBuffer *buf = make(length);
+        if (length) {
+            memcpy(buf->data(), data, length);
+        }
+        return buf;
+    }
+    
+    inline void retain() {
+        ++_refCount;
+    }
+    
+    inline void release() {
+        if (0 == --_refCount) {
+            this->~EmiPosixBuffer();
+            free(this);
+        }
+    }
+    
+    inline size_t refCount() const { return _refCount; }
+    inline size_t length() const { return _length; }
+    
+    inline uint8_t *data() {
+        return reinterpret_cast<uint8_t *>(this+1);
+    }
+    inline const uint8_t *data() const {
+        return reinterpret_cast<const uint8_t *>(this+1);
+    }
+};
+
+// Scoped handle to an EmiPosixBuffer. This is the TemporaryData
+// type of EmiPosixBinding: it keeps the buffer alive for as long
+// as the handle lives.
+class EmiPosixTemporaryData {
+private:
+    EmiPosixBuffer *_buf;
+    
+public:
+    EmiPosixTemporaryData() : _buf(NULL) {}
+    
+    // Retains buf
+    explicit EmiPosixTemporaryData(EmiPosixBuffer *buf) : _buf(buf) {
+        if (_buf) _buf->retain();
+    }
+    
+    EmiPosixTemporaryData(const EmiPosixTemporaryData& other) : _buf(other._buf) {
+        if (_buf) _buf->retain();
+    }
+    
+    EmiPosixTemporaryData& operator=(const EmiPosixTemporaryData& other) {
+        if (other._buf) other._buf->retain();
+        if (_buf) _buf->release();
+        _buf = other._buf;
+        return *this;
+    }
+    
+    ~EmiPosixTemporaryData() {
+        if (_buf) _buf->release();
+    }
+    
+    inline EmiPosixBuffer *buffer() const { return _buf; }
+};
+
+#endif
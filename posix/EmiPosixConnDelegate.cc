@@ -0,0 +1,62 @@
+#include "EmiPosixConnDelegate.h"
+
+#include "EmiPosixSocket.h"
+#include "EmiPosixConnection.h"
+
+EmiPosixConnDelegate::EmiPosixConnDelegate(EmiPosixConnection& conn) : _conn(conn) {}
+
+void EmiPosixConnDelegate::invalidate() {
+    if (EMI_CONNECTION_TYPE_SERVER == _conn._conn.getType()) {
+        _conn._es._sock.deregisterServerConnection(&_conn._conn);
+    }
+    
+    _conn.invalidated();
+}
+
+void EmiPosixConnDelegate::emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                                             EmiSequenceNumber packetsLost) {
+    if (_conn._handler) {
+        _conn._handler->emiConnPacketLoss(_conn, channelQualifier, packetsLost);
+    }
+}
+
+void EmiPosixConnDelegate::emiConnMessage(EmiChannelQualifier channelQualifier,
+                                          const EmiPosixTemporaryData& data,
+                                          size_t offset,
+                                          size_t size) {
+    if (_conn._handler) {
+        _conn._handler->emiConnMessage(_conn, channelQualifier, data, offset, size);
+    }
+}
+
+void EmiPosixConnDelegate::emiConnLost() {
+    if (_conn._handler) {
+        _conn._handler->emiConnLost(_conn);
+    }
+}
+
+void EmiPosixConnDelegate::emiConnRegained() {
+    if (_conn._handler) {
+        _conn._handler->emiConnRegained(_conn);
+    }
+}
+
+void EmiPosixConnDelegate::emiConnDisconnect(EmiDisconnectReason reason) {
+    if (_conn._handler) {
+        _conn._handler->emiConnDisconnect(_conn, reason);
+    }
+}
+
+void EmiPosixConnDelegate::emiNatPunchthroughFinished(bool success) {
+    if (_conn._handler) {
+        _conn._handler->emiNatPunchthroughFinished(_conn, success);
+    }
+}
+
+EmiPosixEventLoop *EmiPosixConnDelegate::getSocketCookie() {
+    return &_conn._loop;
+}
+
+EmiPosixEventLoop *EmiPosixConnDelegate::getTimerCookie() {
+    return &_conn._loop;
+}
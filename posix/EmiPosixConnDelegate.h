@@ -0,0 +1,37 @@
+#ifndef eminet_EmiPosixConnDelegate_h
+#define eminet_EmiPosixConnDelegate_h
+
+#include "EmiPosixBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiPosixConnection;
+
+class EmiPosixConnDelegate {
+    EmiPosixConnection& _conn;
+    
+public:
+    EmiPosixConnDelegate(EmiPosixConnection& conn);
+    
+    void invalidate();
+    
+    void emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                           EmiSequenceNumber packetsLost);
+    void emiConnMessage(EmiChannelQualifier channelQualifier,
+                        const EmiPosixTemporaryData& data,
+                        size_t offset,
+                        size_t size);
+    
+    void emiConnLost();
+    void emiConnRegained();
+    void emiConnDisconnect(EmiDisconnectReason reason);
+    void emiNatPunchthroughFinished(bool success);
+    
+    inline EmiPosixConnection& getConnection() { return _conn; }
+    inline const EmiPosixConnection& getConnection() const { return _conn; }
+    
+    EmiPosixEventLoop *getSocketCookie();
+    EmiPosixEventLoop *getTimerCookie();
+};
+
+#endif
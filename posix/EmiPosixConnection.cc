@@ -0,0 +1,57 @@
+#include "EmiPosixConnection.h"
+
+#include "EmiPosixSocket.h"
+
+EmiPosixConnection::EmiPosixConnection(EmiPosixSocket& es, const ECP& params) :
+_es(es),
+_loop(es.getLoop()),
+_handler(NULL),
+_refCount(1),
+_conn(EmiPosixConnDelegate(*this), es.getSock().config, params) {}
+
+EmiPosixConnection::~EmiPosixConnection() {}
+
+void EmiPosixConnection::releaseTimeoutCallback(EmiTimeInterval now, EmiPosixTimer *timer, void *data) {
+    EmiPosixConnection *conn = (EmiPosixConnection *)data;
+    EmiPosixBinding::freeTimer(timer);
+    conn->release();
+}
+
+void EmiPosixConnection::invalidated() {
+    // invalidate is invoked from deep within EmiConn, so we
+    // can't deallocate the connection right away.
+    EmiPosixTimer *timer = EmiPosixBinding::makeTimer(&_loop);
+    EmiPosixBinding::scheduleTimer(timer, releaseTimeoutCallback, this,
+                                   /*interval:*/0, /*repeating:*/false, /*reschedule:*/true);
+}
+
+void EmiPosixConnection::release() {
+    if (0 == --_refCount) {
+        delete this;
+    }
+}
+
+bool EmiPosixConnection::send(const uint8_t *data, size_t size,
+                              EmiChannelQualifier channelQualifier,
+                              EmiPriority priority,
+                              EmiPosixError& err) {
+    return _conn.send(EmiPosixEventLoop::now(),
+                      EmiPosixBinding::makePersistentData(data, size),
+                      channelQualifier, priority, err);
+}
+
+bool EmiPosixConnection::send(EmiPosixBuffer *buf,
+                              EmiChannelQualifier channelQualifier,
+                              EmiPriority priority,
+                              EmiPosixError& err) {
+    buf->retain();
+    return _conn.send(EmiPosixEventLoop::now(), buf, channelQualifier, priority, err);
+}
+
+bool EmiPosixConnection::close(EmiPosixError& err) {
+    return _conn.close(EmiPosixEventLoop::now(), err);
+}
+
+void EmiPosixConnection::forceClose() {
+    _conn.forceClose();
+}
@@ -0,0 +1,95 @@
+#ifndef eminet_EmiPosixConnection_h
+#define eminet_EmiPosixConnection_h
+
+#include "EmiPosixBinding.h"
+#include "EmiPosixSockDelegate.h"
+#include "EmiPosixConnDelegate.h"
+
+#include "../core/EmiConn.h"
+
+class EmiPosixSocket;
+class EmiPosixConnection;
+
+class EmiPosixConnectionHandler {
+public:
+    virtual ~EmiPosixConnectionHandler() {}
+    
+    // data is only guaranteed to be valid for the duration of the
+    // call. To hold on to it, retain data.buffer().
+    virtual void emiConnMessage(EmiPosixConnection& conn,
+                                EmiChannelQualifier channelQualifier,
+                                const EmiPosixTemporaryData& data,
+                                size_t offset,
+                                size_t size) = 0;
+    
+    virtual void emiConnPacketLoss(EmiPosixConnection& conn,
+                                   EmiChannelQualifier channelQualifier,
+                                   EmiSequenceNumber packetsLost) {}
+    virtual void emiConnLost(EmiPosixConnection& conn) {}
+    virtual void emiConnRegained(EmiPosixConnection& conn) {}
+    virtual void emiConnDisconnect(EmiPosixConnection& conn, EmiDisconnectReason reason) {}
+    virtual void emiNatPunchthroughFinished(EmiPosixConnection& conn, bool success) {}
+};
+
+// The C++ counterpart of EmiConnection in the node and
+// Objective-C bindings.
+//
+// EmiPosixConnection objects are reference counted. The
+// library holds one reference for as long as the connection
+// is open; it is released on the event loop iteration after
+// the connection is closed. Users that want to keep a pointer
+// to the connection beyond that must retain it.
+class EmiPosixConnection {
+    typedef EmiConn<EmiPosixSockDelegate, EmiPosixConnDelegate> EC;
+    typedef EmiConnParams<EmiPosixBinding>                      ECP;
+    
+    friend class EmiPosixConnDelegate;
+    friend class EmiPosixSockDelegate;
+    friend class EmiPosixSocket;
+    
+private:
+    EmiPosixSocket&            _es;
+    EmiPosixEventLoop&         _loop;
+    EmiPosixConnectionHandler *_handler;
+    size_t                     _refCount;
+    EC                         _conn;
+    
+    // Private copy constructor and assignment operator
+    inline EmiPosixConnection(const EmiPosixConnection& other);
+    inline EmiPosixConnection& operator=(const EmiPosixConnection& other);
+    
+    EmiPosixConnection(EmiPosixSocket& es, const ECP& params);
+    virtual ~EmiPosixConnection();
+    
+    static void releaseTimeoutCallback(EmiTimeInterval now, EmiPosixTimer *timer, void *data);
+    // Invoked by EmiPosixConnDelegate::invalidate
+    void invalidated();
+    
+public:
+    inline void retain() { ++_refCount; }
+    void release();
+    
+    // Copies data. Returns false if the message could not be
+    // enqueued, for instance because the connection is closed.
+    bool send(const uint8_t *data, size_t size,
+              EmiChannelQualifier channelQualifier,
+              EmiPriority priority,
+              EmiPosixError& err);
+    // Sends a buffer without copying it. This retains buf.
+    bool send(EmiPosixBuffer *buf,
+              EmiChannelQualifier channelQualifier,
+              EmiPriority priority,
+              EmiPosixError& err);
+    
+    bool close(EmiPosixError& err);
+    void forceClose();
+    
+    inline void setHandler(EmiPosixConnectionHandler *handler) { _handler = handler; }
+    inline EmiPosixConnectionHandler *getHandler() const { return _handler; }
+    
+    inline EmiPosixSocket& getSocket() { return _es; }
+    inline EC& getConn() { return _conn; }
+    inline const EC& getConn() const { return _conn; }
+};
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef eminet_EmiPosixError_h
+#define eminet_EmiPosixError_h
+
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+
+class EmiPosixError {
+public:
+    std::string domain;
+    int32_t code;
+    
+    EmiPosixError() : domain(""), code(0) {}
+    EmiPosixError(const std::string& domain_, int32_t code_) :
+    domain(domain_), code(code_) {}
+    
+    void format(const char *desc, char *buf, size_t bufSize) const {
+        snprintf(buf, bufSize, "%s: %s (%d)", desc, domain.c_str(), code);
+    }
+};
+
+#endif
@@ -0,0 +1,697 @@
+#include "EmiPosixEventLoop.h"
+
+#include "../core/EmiNetUtil.h"
+#include "../core/EmiAddressCmp.h"
+
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+static const int EMI_POSIX_MAX_EPOLL_EVENTS = 64;
+
+EmiPosixEventLoop::EmiPosixEventLoop(size_t maxDatagramSize) :
+_maxDatagramSize(maxDatagramSize),
+_udpOffload(false),
+_packetInfo(false),
+_reusePort(false),
+_pathMtuProbing(false),
+_epollFd(epoll_create1(EPOLL_CLOEXEC)),
+_wakeFd(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)),
+_stopped(false),
+_timers(),
+_timerSeq(0),
+_openSockets(0),
+_closedSockets(),
+_dirtySockets() {
+    ASSERT(-1 != _epollFd);
+    ASSERT(-1 != _wakeFd);
+    
+    // The wakeup eventfd is the only epoll entry without a socket
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    int ret = epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event);
+    ASSERT(-1 != ret);
+}
+
+EmiPosixEventLoop::~EmiPosixEventLoop() {
+    flush();
+    freeClosedSockets();
+    close(_wakeFd);
+    close(_epollFd);
+}
+
+EmiTimeInterval EmiPosixEventLoop::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+void EmiPosixEventLoop::run() {
+    while (!__atomic_load_n(&_stopped, __ATOMIC_ACQUIRE) && runOnce(true));
+    __atomic_store_n(&_stopped, false, __ATOMIC_RELEASE);
+}
+
+bool EmiPosixEventLoop::runOnce(bool block) {
+    // Datagrams might have been sent from outside of the loop
+    // since the last iteration.
+    flush();
+    
+    if (!isAlive()) {
+        return false;
+    }
+    
+    int timeout = 0;
+    if (block) {
+        if (_timers.empty()) {
+            timeout = -1;
+        }
+        else {
+            EmiTimeInterval delay = (*_timers.begin())->deadline - now();
+            timeout = (delay <= 0 ? 0 : (int)ceil(delay*1000));
+        }
+    }
+    
+    epoll_event events[EMI_POSIX_MAX_EPOLL_EVENTS];
+    int numEvents = epoll_wait(_epollFd, events, EMI_POSIX_MAX_EPOLL_EVENTS, timeout);
+    if (-1 == numEvents) {
+        ASSERT(EINTR == errno);
+        numEvents = 0;
+    }
+    
+    for (int i=0; i<numEvents; i++) {
+        EmiPosixUdpHandle *socket = (EmiPosixUdpHandle *)events[i].data.ptr;
+        if (!socket) {
+            // The eventfd is non-blocking, so EAGAIN only means that
+            // another thread has already reset it
+            uint64_t count;
+            if (-1 == read(_wakeFd, &count, sizeof(count))) {
+                ASSERT(EAGAIN == errno || EINTR == errno);
+            }
+            continue;
+        }
+        if (!socket->closed) {
+            readSocket(socket);
+        }
+    }
+    
+    fireTimers();
+    flush();
+    freeClosedSockets();
+    
+    return isAlive();
+}
+
+void EmiPosixEventLoop::stop() {
+    __atomic_store_n(&_stopped, true, __ATOMIC_RELEASE);
+    
+    // Wake up the loop in case it is blocked in epoll_wait on
+    // another thread
+    uint64_t one = 1;
+    if (-1 == write(_wakeFd, &one, sizeof(one))) {
+        // EAGAIN means that the counter is saturated, so the
+        // loop will wake up anyway
+        ASSERT(EAGAIN == errno || EINTR == errno);
+    }
+}
+
+bool EmiPosixEventLoop::isAlive() const {
+    return !_timers.empty() || 0 != _openSockets;
+}
+
+void EmiPosixEventLoop::fireTimers() {
+    EmiTimeInterval rightNow = now();
+    // Only fire timers that were scheduled before this point,
+    // otherwise a timer that reschedules itself with a zero
+    // interval would keep the loop here forever.
+    uint64_t seqLimit = _timerSeq;
+    
+    while (!_timers.empty()) {
+        EmiPosixTimer *timer = *_timers.begin();
+        if (timer->deadline > rightNow || timer->seq >= seqLimit) {
+            break;
+        }
+        
+        _timers.erase(_timers.begin());
+        if (timer->repeating) {
+            timer->deadline += timer->interval;
+            if (timer->deadline < rightNow) {
+                timer->deadline = rightNow;
+            }
+            timer->seq = _timerSeq++;
+            _timers.insert(timer);
+        }
+        else {
+            timer->active = false;
+        }
+        
+        // Note that the callback is allowed to free the timer
+        timer->callback(rightNow, timer, timer->data);
+    }
+}
+
+EmiPosixTimer *EmiPosixEventLoop::makeTimer() {
+    EmiPosixTimer *timer = new EmiPosixTimer;
+    timer->loop = this;
+    timer->callback = NULL;
+    timer->data = NULL;
+    timer->deadline = 0;
+    timer->interval = 0;
+    timer->seq = 0;
+    timer->repeating = false;
+    timer->active = false;
+    return timer;
+}
+
+void EmiPosixEventLoop::freeTimer(EmiPosixTimer *timer) {
+    descheduleTimer(timer);
+    delete timer;
+}
+
+void EmiPosixEventLoop::scheduleTimer(EmiPosixTimer *timer, EmiPosixTimerCb *timerCb, void *data,
+                                      EmiTimeInterval interval, bool repeating, bool reschedule) {
+    if (!reschedule && timer->active) {
+        // We were told not to re-schedule the timer.
+        // The timer is already active, so do nothing.
+        return;
+    }
+    
+    descheduleTimer(timer);
+    
+    timer->callback = timerCb;
+    timer->data = data;
+    timer->interval = interval;
+    timer->repeating = repeating;
+    timer->deadline = now()+interval;
+    timer->seq = _timerSeq++;
+    timer->active = true;
+    _timers.insert(timer);
+}
+
+void EmiPosixEventLoop::descheduleTimer(EmiPosixTimer *timer) {
+    if (timer->active) {
+        _timers.erase(timer);
+        timer->active = false;
+    }
+}
+
+EmiPosixUdpHandle *EmiPosixEventLoop::openSocket(const sockaddr_storage& address,
+                                              EmiPosixOnMessage *callback,
+                                              void *userData,
+                                              EmiPosixError& err) {
+    int fd = socket(address.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (-1 == fd) {
+        err = EmiPosixError("com.emilir.eminet.socket", errno);
+        return NULL;
+    }
+    
+    if (_reusePort) {
+        int on = 1;
+        if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+            err = EmiPosixError("com.emilir.eminet.reuseport", errno);
+            close(fd);
+            return NULL;
+        }
+    }
+    
+    if (_pathMtuProbing) {
+        int ret;
+        if (AF_INET6 == address.ss_family) {
+            int val = IPV6_PMTUDISC_PROBE;
+            ret = setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+        }
+        else {
+            int val = IP_PMTUDISC_PROBE;
+            ret = setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+        }
+        
+        if (-1 == ret) {
+            err = EmiPosixError("com.emilir.eminet.pmtudisc", errno);
+            close(fd);
+            return NULL;
+        }
+    }
+    
+    if (-1 == bind(fd, (const sockaddr *)&address, EmiNetUtil::addrSize(address))) {
+        err = EmiPosixError("com.emilir.eminet.bind", errno);
+        close(fd);
+        return NULL;
+    }
+    
+    EmiPosixUdpHandle *socket = new EmiPosixUdpHandle;
+    socket->loop = this;
+    socket->fd = fd;
+    socket->callback = callback;
+    socket->userData = userData;
+    socket->recvRing = NULL;
+    socket->sendBatch = NULL;
+    socket->dirty = false;
+    socket->gso = _udpOffload;
+    socket->gro = false;
+    socket->packetInfo = false;
+    socket->closed = false;
+    
+    if (_udpOffload) {
+        int on = 1;
+        socket->gro = (0 == setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)));
+    }
+    
+    if (_packetInfo && EmiNetUtil::isAnyAddr(address)) {
+        int on = 1;
+        int ret;
+        if (AF_INET6 == address.ss_family) {
+            ret = setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+        }
+        else {
+            ret = setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+        }
+        
+        socklen_t len = sizeof(sockaddr_storage);
+        if (-1 == ret ||
+            -1 == getsockname(fd, (sockaddr *)&socket->inboundAddress, &len)) {
+            err = EmiPosixError("com.emilir.eminet.pktinfo", errno);
+            close(fd);
+            delete socket;
+            return NULL;
+        }
+        
+        socket->packetInfo = true;
+    }
+    
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = socket;
+    if (-1 == epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event)) {
+        err = EmiPosixError("com.emilir.eminet.epoll", errno);
+        close(fd);
+        delete socket;
+        return NULL;
+    }
+    
+    _openSockets++;
+    
+    return socket;
+}
+
+void EmiPosixEventLoop::closeSocket(EmiPosixUdpHandle *socket) {
+    if (socket->closed) {
+        return;
+    }
+    
+    flushSocket(socket);
+    
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, socket->fd, NULL);
+    close(socket->fd);
+    socket->fd = -1;
+    socket->closed = true;
+    
+    _openSockets--;
+    _closedSockets.push_back(socket);
+}
+
+void EmiPosixEventLoop::freeClosedSockets() {
+    std::vector<EmiPosixUdpHandle*>::iterator iter = _closedSockets.begin();
+    std::vector<EmiPosixUdpHandle*>::iterator end  = _closedSockets.end();
+    while (iter != end) {
+        EmiPosixUdpHandle *socket = *iter;
+        if (socket->recvRing) {
+            for (size_t i=0; i<EmiPosixRecvRing::NUM_SLOTS; i++) {
+                socket->recvRing->slots[i]->release();
+            }
+            delete socket->recvRing;
+        }
+        delete socket->sendBatch;
+        delete socket;
+        ++iter;
+    }
+    _closedSockets.clear();
+}
+
+size_t EmiPosixEventLoop::fillRecvRing(EmiPosixUdpHandle *socket, size_t maxDatagrams) {
+    EmiPosixRecvRing *ring = socket->recvRing;
+    // With GRO, the kernel can coalesce several datagrams into one
+    size_t slotSize = (socket->gro ? MAX_UDP_PAYLOAD_SIZE : _maxDatagramSize);
+    
+    if (!ring) {
+        ring = socket->recvRing = new EmiPosixRecvRing;
+        for (size_t i=0; i<EmiPosixRecvRing::NUM_SLOTS; i++) {
+            ring->slots[i] = EmiPosixBuffer::make(slotSize);
+        }
+    }
+    
+    size_t num = std::min(maxDatagrams, EmiPosixRecvRing::NUM_SLOTS);
+    for (size_t i=0; i<num; i++) {
+        if (1 != ring->slots[i]->refCount()) {
+            // Somebody has retained the buffer; we can't overwrite it
+            ring->slots[i]->release();
+            ring->slots[i] = EmiPosixBuffer::make(slotSize);
+        }
+        
+        ring->iovs[i].iov_base = ring->slots[i]->data();
+        ring->iovs[i].iov_len = ring->slots[i]->length();
+        
+        msghdr& hdr(ring->msgs[i].msg_hdr);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &ring->addrs[i];
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_iov = &ring->iovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = ring->controls[i];
+        hdr.msg_controllen = EmiPosixRecvRing::CONTROL_SIZE;
+    }
+    
+    int ret;
+    do {
+        ret = recvmmsg(socket->fd, ring->msgs, num, /*flags:*/0, /*timeout:*/NULL);
+    } while (-1 == ret && EINTR == errno);
+    
+    // EAGAIN means that the socket is drained. Other errors
+    // (for instance ICMP port unreachable reported through
+    // ECONNREFUSED) are not fatal for a connectionless socket.
+    return -1 == ret ? 0 : ret;
+}
+
+void EmiPosixEventLoop::readSocket(EmiPosixUdpHandle *socket) {
+    size_t read = 0;
+    while (read < MAX_READS_PER_WAKEUP && !socket->closed) {
+        size_t received = fillRecvRing(socket, MAX_READS_PER_WAKEUP-read);
+        if (0 == received) {
+            break;
+        }
+        read += received;
+        
+        EmiTimeInterval rightNow = now();
+        EmiPosixRecvRing *ring = socket->recvRing;
+        for (size_t i=0; i<received && !socket->closed; i++) {
+            size_t len = ring->msgs[i].msg_len;
+            if (0 == len || (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                continue;
+            }
+            
+            // If the kernel has coalesced several datagrams into
+            // one buffer, split them up again.
+            size_t segmentSize = len;
+            msghdr& hdr(ring->msgs[i].msg_hdr);
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type) {
+                    int gsoSize;
+                    memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+                    if (gsoSize > 0) {
+                        segmentSize = gsoSize;
+                    }
+                }
+                else if (IPPROTO_IP == cmsg->cmsg_level && IP_PKTINFO == cmsg->cmsg_type) {
+                    in_pktinfo info;
+                    memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+                    ((sockaddr_in *)&socket->inboundAddress)->sin_addr = info.ipi_addr;
+                }
+                else if (IPPROTO_IPV6 == cmsg->cmsg_level && IPV6_PKTINFO == cmsg->cmsg_type) {
+                    in6_pktinfo info;
+                    memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+                    ((sockaddr_in6 *)&socket->inboundAddress)->sin6_addr = info.ipi6_addr;
+                }
+            }
+            
+            EmiPosixTemporaryData data(ring->slots[i]);
+            for (size_t offset=0; offset<len && !socket->closed; offset += segmentSize) {
+                socket->callback(socket, socket->userData, rightNow, ring->addrs[i],
+                                 data, offset, std::min(segmentSize, len-offset));
+            }
+        }
+        
+        if (received < EmiPosixRecvRing::NUM_SLOTS) {
+            // The socket is drained
+            break;
+        }
+    }
+}
+
+void EmiPosixEventLoop::sendData(EmiPosixUdpHandle *socket,
+                                 const sockaddr_storage& address,
+                                 const uint8_t *data,
+                                 size_t size,
+                                 const sockaddr_storage *source) {
+    if (socket->closed) {
+        return;
+    }
+    
+    if (size > EmiPosixSendBatch::ARENA_SIZE) {
+        // Too large to be batched. This can't happen for packets
+        // that EmiNet itself produces, but make sure it works.
+        flushSocket(socket);
+        
+        mmsghdr msg;
+        iovec iov;
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (void *)data;
+        iov.iov_len = size;
+        msg.msg_hdr.msg_name = (void *)&address;
+        msg.msg_hdr.msg_namelen = EmiNetUtil::addrSize(address);
+        msg.msg_hdr.msg_iov = &iov;
+        msg.msg_hdr.msg_iovlen = 1;
+        sendMessages(socket, &msg, 1);
+        return;
+    }
+    
+    EmiPosixSendBatch *batch = socket->sendBatch;
+    if (!batch) {
+        batch = socket->sendBatch = new EmiPosixSendBatch;
+        batch->count = 0;
+        batch->arenaUsed = 0;
+    }
+    
+    if (EmiPosixSendBatch::MAX_DATAGRAMS == batch->count ||
+        batch->arenaUsed+size > EmiPosixSendBatch::ARENA_SIZE) {
+        flushSocket(socket);
+    }
+    
+    size_t idx = batch->count++;
+    uint8_t *buf = batch->arena+batch->arenaUsed;
+    memcpy(buf, data, size);
+    batch->arenaUsed += size;
+    
+    memcpy(&batch->addrs[idx], &address, sizeof(sockaddr_storage));
+    if (source && socket->packetInfo) {
+        memcpy(&batch->sources[idx], source, sizeof(sockaddr_storage));
+    }
+    else {
+        batch->sources[idx].ss_family = AF_UNSPEC;
+    }
+    batch->iovs[idx].iov_base = buf;
+    batch->iovs[idx].iov_len = size;
+    
+    if (!socket->dirty) {
+        socket->dirty = true;
+        _dirtySockets.push_back(socket);
+    }
+}
+
+void EmiPosixEventLoop::setSendControl(msghdr& hdr,
+                                       uint8_t *control,
+                                       const sockaddr_storage& source,
+                                       size_t segmentSize) {
+    size_t len = 0;
+    if (AF_INET == source.ss_family) {
+        len += CMSG_SPACE(sizeof(in_pktinfo));
+    }
+    else if (AF_INET6 == source.ss_family) {
+        len += CMSG_SPACE(sizeof(in6_pktinfo));
+    }
+    if (segmentSize) {
+        len += CMSG_SPACE(sizeof(uint16_t));
+    }
+    
+    if (0 == len) {
+        hdr.msg_control = NULL;
+        hdr.msg_controllen = 0;
+        return;
+    }
+    
+    ASSERT(len <= EmiPosixSendBatch::CONTROL_SIZE);
+    memset(control, 0, len);
+    hdr.msg_control = control;
+    hdr.msg_controllen = len;
+    
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (AF_INET == source.ss_family) {
+        in_pktinfo info;
+        memset(&info, 0, sizeof(info));
+        info.ipi_spec_dst = ((const sockaddr_in *)&source)->sin_addr;
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+        memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+    }
+    else if (AF_INET6 == source.ss_family) {
+        in6_pktinfo info;
+        memset(&info, 0, sizeof(info));
+        info.ipi6_addr = ((const sockaddr_in6 *)&source)->sin6_addr;
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+        memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+    }
+    
+    if (segmentSize) {
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gsoSize = segmentSize;
+        memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+    }
+}
+
+bool EmiPosixEventLoop::isSegmented(const msghdr& hdr) {
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR((msghdr *)&hdr, cmsg)) {
+        if (SOL_UDP == cmsg->cmsg_level && UDP_SEGMENT == cmsg->cmsg_type) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EmiPosixEventLoop::flushSocket(EmiPosixUdpHandle *socket) {
+    EmiPosixSendBatch *batch = socket->sendBatch;
+    if (!batch || 0 == batch->count) {
+        return;
+    }
+    
+    size_t numMsgs = 0;
+    size_t first = 0;
+    while (first < batch->count) {
+        size_t segmentSize = batch->iovs[first].iov_len;
+        size_t totalSize = segmentSize;
+        size_t end = first+1;
+        
+        if (socket->gso) {
+            while (end < batch->count &&
+                   end-first < MAX_GSO_SEGMENTS &&
+                   batch->iovs[end].iov_len <= segmentSize &&
+                   totalSize+batch->iovs[end].iov_len <= MAX_UDP_PAYLOAD_SIZE &&
+                   0 == EmiAddressCmp::compare(batch->addrs[first], batch->addrs[end]) &&
+                   0 == EmiAddressCmp::compare(batch->sources[first], batch->sources[end])) {
+                size_t size = batch->iovs[end].iov_len;
+                totalSize += size;
+                end++;
+                
+                if (size < segmentSize) {
+                    // Only the last segment may be smaller than the others
+                    break;
+                }
+            }
+        }
+        
+        iovec& iov(batch->msgIovs[numMsgs]);
+        iov.iov_base = batch->iovs[first].iov_base;
+        iov.iov_len = totalSize;
+        
+        msghdr& hdr(batch->msgs[numMsgs].msg_hdr);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &batch->addrs[first];
+        hdr.msg_namelen = EmiNetUtil::addrSize(batch->addrs[first]);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        setSendControl(hdr, batch->msgControls[numMsgs],
+                       batch->sources[first], (end-first > 1 ? segmentSize : 0));
+        
+        batch->msgFirstDatagram[numMsgs] = first;
+        numMsgs++;
+        first = end;
+    }
+    batch->msgFirstDatagram[numMsgs] = batch->count;
+    
+    sendMessages(socket, batch->msgs, numMsgs);
+    
+    batch->count = 0;
+    batch->arenaUsed = 0;
+}
+
+void EmiPosixEventLoop::sendMessages(EmiPosixUdpHandle *socket, mmsghdr *msgs, size_t count) {
+    size_t sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(socket->fd, msgs+sent, count-sent, /*flags:*/0);
+        if (-1 == ret) {
+            if (EINTR == errno) {
+                continue;
+            }
+            else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                // The socket send buffer is full. Drop the rest
+                // of the batch; EmiNet treats this just like it
+                // would treat packets that are lost in the network.
+                break;
+            }
+            else if (isSegmented(msgs[sent].msg_hdr) &&
+                     (EIO == errno || EINVAL == errno || EOPNOTSUPP == errno || ENOPROTOOPT == errno)) {
+                // The kernel or the network device does not support
+                // UDP_SEGMENT. Stop using it for this socket and send
+                // the datagrams of this message one by one.
+                EmiPosixSendBatch *batch = socket->sendBatch;
+                size_t msgIdx = msgs+sent-batch->msgs;
+                socket->gso = false;
+                sendDatagramsIndividually(socket,
+                                          batch->msgFirstDatagram[msgIdx],
+                                          batch->msgFirstDatagram[msgIdx+1]);
+            }
+            else if (isSegmented(msgs[sent].msg_hdr) && EMSGSIZE == errno) {
+                // The segment size is larger than the path MTU. This
+                // happens when a path MTU probe is batched with
+                // smaller datagrams. Send them one by one, so that
+                // only the probe is lost.
+                EmiPosixSendBatch *batch = socket->sendBatch;
+                size_t msgIdx = msgs+sent-batch->msgs;
+                sendDatagramsIndividually(socket,
+                                          batch->msgFirstDatagram[msgIdx],
+                                          batch->msgFirstDatagram[msgIdx+1]);
+            }
+            
+            // Other send errors (for instance ECONNREFUSED caused by
+            // an ICMP message for an earlier datagram) only concern
+            // the first datagram. Skip it and send the rest.
+            ret = 1;
+        }
+        sent += ret;
+    }
+}
+
+void EmiPosixEventLoop::sendDatagramsIndividually(EmiPosixUdpHandle *socket, size_t first, size_t end) {
+    EmiPosixSendBatch *batch = socket->sendBatch;
+    
+    mmsghdr msgs[EmiPosixSendBatch::MAX_DATAGRAMS];
+    uint8_t controls[EmiPosixSendBatch::MAX_DATAGRAMS][EmiPosixSendBatch::CONTROL_SIZE];
+    for (size_t i=first; i<end; i++) {
+        msghdr& hdr(msgs[i-first].msg_hdr);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &batch->addrs[i];
+        hdr.msg_namelen = EmiNetUtil::addrSize(batch->addrs[i]);
+        hdr.msg_iov = &batch->iovs[i];
+        hdr.msg_iovlen = 1;
+        setSendControl(hdr, controls[i-first], batch->sources[i], /*segmentSize:*/0);
+    }
+    
+    sendMessages(socket, msgs, end-first);
+}
+
+void EmiPosixEventLoop::flush() {
+    // flushSocket doesn't add sockets to _dirtySockets, so it
+    // is safe to iterate over it here.
+    std::vector<EmiPosixUdpHandle*>::iterator iter = _dirtySockets.begin();
+    std::vector<EmiPosixUdpHandle*>::iterator end  = _dirtySockets.end();
+    while (iter != end) {
+        EmiPosixUdpHandle *socket = *iter;
+        socket->dirty = false;
+        if (!socket->closed) {
+            flushSocket(socket);
+        }
+        ++iter;
+    }
+    _dirtySockets.clear();
+}
@@ -0,0 +1,268 @@
+#ifndef eminet_EmiPosixEventLoop_h
+#define eminet_EmiPosixEventLoop_h
+
+#include "EmiPosixBuffer.h"
+#include "EmiPosixError.h"
+
+#include "../core/EmiTypes.h"
+
+#include <set>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+class EmiPosixEventLoop;
+struct EmiPosixTimer;
+struct EmiPosixUdpHandle;
+
+typedef void (EmiPosixTimerCb)(EmiTimeInterval now, EmiPosixTimer *timer, void *data);
+typedef void (EmiPosixOnMessage)(EmiPosixUdpHandle *socket,
+                                 void *userData,
+                                 EmiTimeInterval now,
+                                 const sockaddr_storage& address,
+                                 const EmiPosixTemporaryData& data,
+                                 size_t offset,
+                                 size_t len);
+
+struct EmiPosixTimer {
+    EmiPosixEventLoop *loop;
+    EmiPosixTimerCb   *callback;
+    void              *data;
+    EmiTimeInterval    deadline;
+    EmiTimeInterval    interval;
+    // Monotonically increasing number that is assigned when the
+    // timer is scheduled. It breaks ties between timers with the
+    // same deadline, and it is used to avoid firing timers that
+    // were scheduled during the current loop iteration.
+    uint64_t           seq;
+    bool               repeating;
+    bool               active;
+};
+
+// Fixed ring of receive buffers that a socket is drained into
+// with recvmmsg. A slot's buffer is reused for the next batch
+// unless it has been retained during the dispatch of the
+// datagram it contained, in which case it is replaced.
+struct EmiPosixRecvRing {
+    static const size_t NUM_SLOTS = 32;
+    static const size_t CONTROL_SIZE = 64;
+    
+    EmiPosixBuffer  *slots[NUM_SLOTS];
+    mmsghdr          msgs[NUM_SLOTS];
+    iovec            iovs[NUM_SLOTS];
+    sockaddr_storage addrs[NUM_SLOTS];
+    uint8_t          controls[NUM_SLOTS][CONTROL_SIZE];
+};
+
+// Datagrams that have been sent on a socket but not yet handed
+// to the kernel. They are copied into one contiguous arena and
+// sent with a single sendmmsg call when the batch is flushed.
+//
+// When UDP offload is enabled, runs of consecutive datagrams
+// to the same address that have the same size (except for the
+// last one, which may be smaller) are sent as one message with
+// the UDP_SEGMENT option, and the kernel or the network device
+// splits them up again. This works without copying because the
+// datagrams of a run are adjacent in the arena.
+struct EmiPosixSendBatch {
+    static const size_t MAX_DATAGRAMS = 64;
+    static const size_t ARENA_SIZE    = 64*1024;
+    static const size_t CONTROL_SIZE  = 64;
+    
+    // One entry per datagram. A source address with the family
+    // AF_UNSPEC means that the OS picks the source address.
+    iovec            iovs[MAX_DATAGRAMS];
+    sockaddr_storage addrs[MAX_DATAGRAMS];
+    sockaddr_storage sources[MAX_DATAGRAMS];
+    // One entry per message that is handed to sendmmsg. Without
+    // UDP offload, there is one message per datagram.
+    mmsghdr          msgs[MAX_DATAGRAMS];
+    iovec            msgIovs[MAX_DATAGRAMS];
+    size_t           msgFirstDatagram[MAX_DATAGRAMS+1];
+    uint8_t          msgControls[MAX_DATAGRAMS][CONTROL_SIZE];
+    
+    size_t           count;
+    size_t           arenaUsed;
+    uint8_t          arena[ARENA_SIZE];
+};
+
+struct EmiPosixUdpHandle {
+    EmiPosixEventLoop *loop;
+    int                fd;
+    EmiPosixOnMessage *callback;
+    void              *userData;
+    // Allocated the first time the socket becomes readable
+    EmiPosixRecvRing  *recvRing;
+    // Allocated the first time something is sent on the socket
+    EmiPosixSendBatch *sendBatch;
+    // True if the socket is in the loop's list of sockets with
+    // pending outbound datagrams.
+    bool               dirty;
+    // True if batches are sent with UDP_SEGMENT. This is turned
+    // off if the kernel turns out to not support it.
+    bool               gso;
+    // True if the socket has UDP_GRO turned on
+    bool               gro;
+    // True if the socket is bound to the any address and reports
+    // the receiver address of each datagram (IP_PKTINFO).
+    bool               packetInfo;
+    // For packetInfo sockets, this is the local address that the
+    // datagram that is currently being dispatched was sent to.
+    sockaddr_storage   inboundAddress;
+    bool               closed;
+};
+
+// A minimal single threaded event loop built on epoll and
+// CLOCK_MONOTONIC. It plays the role that libuv plays for the
+// node binding and that GCD plays for the Objective-C binding.
+//
+// An EmiPosixEventLoop is used as both the socket cookie and
+// the timer cookie of EmiPosixBinding. Everything that is bound
+// to one loop must only be touched from the thread that runs it.
+class EmiPosixEventLoop {
+private:
+    struct TimerCmp {
+        inline bool operator()(const EmiPosixTimer *a, const EmiPosixTimer *b) const {
+            if (a->deadline != b->deadline) {
+                return a->deadline < b->deadline;
+            }
+            return a->seq < b->seq;
+        }
+    };
+    typedef std::set<EmiPosixTimer*, TimerCmp> TimerSet;
+    
+    size_t   _maxDatagramSize;
+    bool     _udpOffload;
+    bool     _packetInfo;
+    bool     _reusePort;
+    bool     _pathMtuProbing;
+    int      _epollFd;
+    // eventfd that is used to wake up the loop from stop
+    int      _wakeFd;
+    // Accessed atomically, because stop may be called from
+    // another thread.
+    bool     _stopped;
+    TimerSet _timers;
+    uint64_t _timerSeq;
+    size_t   _openSockets;
+    // Sockets that have been closed during the current loop
+    // iteration. They are freed when the iteration is done,
+    // because there might still be pending epoll events that
+    // point to them.
+    std::vector<EmiPosixUdpHandle*> _closedSockets;
+    // Sockets that have outbound datagrams that have not been
+    // flushed yet.
+    std::vector<EmiPosixUdpHandle*> _dirtySockets;
+    
+    // Private copy constructor and assignment operator
+    inline EmiPosixEventLoop(const EmiPosixEventLoop& other);
+    inline EmiPosixEventLoop& operator=(const EmiPosixEventLoop& other);
+    
+    void fireTimers();
+    void readSocket(EmiPosixUdpHandle *socket);
+    // Returns the number of datagrams that were received
+    size_t fillRecvRing(EmiPosixUdpHandle *socket, size_t maxDatagrams);
+    void freeClosedSockets();
+    void flushSocket(EmiPosixUdpHandle *socket);
+    // Sets up the control messages of an outbound message: the
+    // source address (unless its family is AF_UNSPEC) and the
+    // UDP_SEGMENT size (unless segmentSize is 0).
+    static void setSendControl(msghdr& hdr,
+                               uint8_t *control,
+                               const sockaddr_storage& source,
+                               size_t segmentSize);
+    static bool isSegmented(const msghdr& hdr);
+    void sendMessages(EmiPosixUdpHandle *socket, mmsghdr *msgs, size_t count);
+    void sendDatagramsIndividually(EmiPosixUdpHandle *socket, size_t first, size_t end);
+    
+public:
+    // The size of each receive buffer slot. Larger datagrams are
+    // discarded. It should be at least as large as the largest
+    // mtu in the EmiSockConfigs of the sockets on the loop and
+    // their remote hosts.
+    static const size_t DEFAULT_MAX_DATAGRAM_SIZE = 2048;
+    // The largest number of datagrams that the kernel accepts in
+    // one UDP_SEGMENT send, and the largest UDP payload size.
+    static const size_t MAX_GSO_SEGMENTS = 64;
+    static const size_t MAX_UDP_PAYLOAD_SIZE = 65507;
+    // The maximum number of datagrams that are read from one
+    // socket before the loop moves on to other sockets and timers.
+    static const size_t MAX_READS_PER_WAKEUP = 64;
+    
+    explicit EmiPosixEventLoop(size_t maxDatagramSize = DEFAULT_MAX_DATAGRAM_SIZE);
+    virtual ~EmiPosixEventLoop();
+    
+    static EmiTimeInterval now();
+    
+    // Runs the loop until stop() is called or until there are
+    // no open sockets and no scheduled timers left.
+    void run();
+    // Runs one loop iteration. If block is true, this waits for
+    // the next socket event or timer. Returns false when there
+    // is nothing left for the loop to wait for.
+    bool runOnce(bool block = true);
+    // Makes run return after the current loop iteration. Unlike
+    // everything else, this may be called from any thread.
+    void stop();
+    // Sends all batched outbound datagrams
+    void flush();
+    
+    // UDP offload means UDP_SEGMENT (GSO) for outbound batches and
+    // UDP_GRO for inbound datagrams. It only affects sockets that
+    // are opened after it is turned on, and it requires Linux
+    // 4.18 or 5.0, respectively. It is off by default, because
+    // with GRO each receive buffer slot has to be large enough to
+    // hold 64KB of coalesced datagrams.
+    inline void setUdpOffload(bool enabled) { _udpOffload = enabled; }
+    inline bool getUdpOffload() const { return _udpOffload; }
+    
+    // When packet info is on, EmiNet sockets that are bound to the
+    // any address use one socket with IP_PKTINFO/IPV6_RECVPKTINFO
+    // instead of one socket per network interface. It only affects
+    // sockets that are opened after it is turned on.
+    inline void setPacketInfo(bool enabled) { _packetInfo = enabled; }
+    inline bool getPacketInfo() const { return _packetInfo; }
+    
+    // Sets SO_REUSEPORT on sockets that are opened after this is
+    // turned on. See EmiPosixShardedSocket.
+    inline void setReusePort(bool enabled) { _reusePort = enabled; }
+    inline bool getReusePort() const { return _reusePort; }
+    
+    // When path MTU probing is on, datagrams are sent with the don't
+    // fragment bit set, and the kernel doesn't limit their size to
+    // its own path MTU estimate (IP_PMTUDISC_PROBE). This is needed
+    // for EmiSockConfig::maxMtu to work. It only affects sockets that
+    // are opened after it is turned on.
+    inline void setPathMtuProbing(bool enabled) { _pathMtuProbing = enabled; }
+    inline bool getPathMtuProbing() const { return _pathMtuProbing; }
+    
+    bool isAlive() const;
+    
+    EmiPosixTimer *makeTimer();
+    void freeTimer(EmiPosixTimer *timer);
+    void scheduleTimer(EmiPosixTimer *timer, EmiPosixTimerCb *timerCb, void *data,
+                       EmiTimeInterval interval, bool repeating, bool reschedule);
+    void descheduleTimer(EmiPosixTimer *timer);
+    
+    EmiPosixUdpHandle *openSocket(const sockaddr_storage& address,
+                               EmiPosixOnMessage *callback,
+                               void *userData,
+                               EmiPosixError& err);
+    void closeSocket(EmiPosixUdpHandle *socket);
+    // Datagrams are not sent immediately; they are batched up
+    // and sent at the end of the current loop iteration, or when
+    // flush is called. This makes it possible to send all packets
+    // that the connections of a socket produce in one tick with
+    // one system call.
+    //
+    // source is only used for packetInfo sockets. If it is not
+    // NULL, the datagram is sent from that local address.
+    void sendData(EmiPosixUdpHandle *socket,
+                  const sockaddr_storage& address,
+                  const uint8_t *data,
+                  size_t size,
+                  const sockaddr_storage *source = NULL);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "EmiPosixShardedSocket.h"
+
+#include <unistd.h>
+
+EmiPosixShardedSocket::EmiPosixShardedSocket(size_t numShards,
+                                             const EmiSockConfig& sc,
+                                             EmiPosixSocketHandler *handler) :
+_shards(),
+_config(sc),
+_handler(handler) {
+    ASSERT(sc.acceptConnections);
+
+    if (0 == numShards) {
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numShards = (numCpus > 0 ? numCpus : 1);
+    }
+
+    _shards.resize(numShards);
+    for (size_t i=0; i<numShards; i++) {
+        Shard& shard(_shards[i]);
+        shard.loop = new EmiPosixEventLoop;
+        shard.loop->setReusePort(true);
+        shard.socket = NULL;
+        shard.running = false;
+    }
+}
+
+EmiPosixShardedSocket::~EmiPosixShardedSocket() {
+    stop();
+
+    for (size_t i=0; i<_shards.size(); i++) {
+        // The socket closes its connections through the loop,
+        // so it has to go first.
+        delete _shards[i].socket;
+        delete _shards[i].loop;
+    }
+}
+
+void *EmiPosixShardedSocket::runShard(void *loop) {
+    ((EmiPosixEventLoop *)loop)->run();
+    return NULL;
+}
+
+bool EmiPosixShardedSocket::open(EmiPosixError& err) {
+    // Bind all shards before any of them starts receiving, so that
+    // the kernel's steering doesn't change once connections have
+    // been set up.
+    EmiSockConfig sc(_config);
+    for (size_t i=0; i<_shards.size(); i++) {
+        Shard& shard(_shards[i]);
+        if (shard.socket) {
+            continue;
+        }
+
+        shard.socket = new EmiPosixSocket(*shard.loop, sc, _handler);
+        if (!shard.socket->open(err)) {
+            return false;
+        }
+
+        if (0 == sc.port) {
+            sc.port = shard.socket->getSock().getServerPort();
+        }
+    }
+
+    for (size_t i=0; i<_shards.size(); i++) {
+        Shard& shard(_shards[i]);
+        if (shard.running) {
+            continue;
+        }
+
+        int ret = pthread_create(&shard.thread, /*attr:*/NULL, runShard, shard.loop);
+        if (0 != ret) {
+            err = EmiPosixError("com.emilir.eminet.thread", ret);
+            return false;
+        }
+        shard.running = true;
+    }
+
+    return true;
+}
+
+void EmiPosixShardedSocket::stop() {
+    for (size_t i=0; i<_shards.size(); i++) {
+        if (_shards[i].running) {
+            _shards[i].loop->stop();
+        }
+    }
+
+    for (size_t i=0; i<_shards.size(); i++) {
+        Shard& shard(_shards[i]);
+        if (shard.running) {
+            pthread_join(shard.thread, /*retval:*/NULL);
+            shard.running = false;
+        }
+    }
+}
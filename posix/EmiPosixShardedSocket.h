@@ -0,0 +1,69 @@
+#ifndef eminet_EmiPosixShardedSocket_h
+#define eminet_EmiPosixShardedSocket_h
+
+#include "EmiPosixSocket.h"
+
+#include <pthread.h>
+#include <vector>
+
+// A server socket that is split up into several shards, each of
+// which is an EmiPosixSocket with its own EmiPosixEventLoop that
+// runs on its own thread. This makes it possible to use more than
+// one core for the connections of one port, which a single
+// EmiSock can't do since it must be accessed sequentially.
+//
+// All shards are bound to the same port with SO_REUSEPORT. The
+// kernel picks the shard of each inbound datagram by hashing its
+// source and destination addresses, so all datagrams from a given
+// remote endpoint go to the same shard for as long as the set of
+// shards is the same, which it is from open until stop.
+//
+// handler is invoked on the thread of the shard that got the
+// connection. A connection, and the EmiPosixSocket that it belongs
+// to, must only be touched from that thread (use getLoop on the
+// socket to find out which loop it is).
+class EmiPosixShardedSocket {
+private:
+    struct Shard {
+        EmiPosixEventLoop *loop;
+        EmiPosixSocket    *socket;
+        pthread_t          thread;
+        bool               running;
+    };
+
+    std::vector<Shard>     _shards;
+    EmiSockConfig          _config;
+    EmiPosixSocketHandler *_handler;
+
+    // Private copy constructor and assignment operator
+    inline EmiPosixShardedSocket(const EmiPosixShardedSocket& other);
+    inline EmiPosixShardedSocket& operator=(const EmiPosixShardedSocket& other);
+
+    static void *runShard(void *loop);
+
+public:
+    // If numShards is 0, one shard per online CPU is created.
+    // sc.acceptConnections must be set.
+    EmiPosixShardedSocket(size_t numShards,
+                          const EmiSockConfig& sc,
+                          EmiPosixSocketHandler *handler);
+    // Stops the shards if they are running
+    virtual ~EmiPosixShardedSocket();
+
+    // Binds all shards and starts their threads. If config.port
+    // is 0, the first shard picks a port and the others use it.
+    bool open(EmiPosixError& err);
+    // Stops the loops of all shards and waits for their threads
+    // to finish.
+    void stop();
+
+    inline size_t getNumShards() const { return _shards.size(); }
+    // The socket of a shard may only be touched from other
+    // threads than its own when the shards are not running.
+    inline EmiPosixSocket& getShard(size_t idx) { return *_shards[idx].socket; }
+    inline uint16_t getPort() const {
+        return _shards.empty() ? 0 : _shards[0].socket->getSock().getServerPort();
+    }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "EmiPosixSockDelegate.h"
+
+#include "EmiPosixSocket.h"
+#include "EmiPosixConnection.h"
+
+EmiPosixSockDelegate::EmiPosixSockDelegate(EmiPosixSocket& es) : _es(es) {}
+
+EmiPosixSockDelegate::EC *EmiPosixSockDelegate::makeConnection(const EmiConnParams<EmiPosixBinding>& params) {
+    EmiPosixConnection *conn = new EmiPosixConnection(_es, params);
+    
+    if (EMI_CONNECTION_TYPE_SERVER != params.type) {
+        // This is a connection that is being set up by EmiPosixSocket::connect
+        _es._connecting = conn;
+    }
+    
+    return &conn->_conn;
+}
+
+void EmiPosixSockDelegate::gotServerConnection(EC& conn) {
+    EmiPosixConnection& ec(conn.getDelegate().getConnection());
+    
+    if (_es._handler) {
+        _es._handler->gotConnection(_es, ec);
+    }
+}
+
+void EmiPosixSockDelegate::connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                            bool error,
+                                            EmiDisconnectReason reason,
+                                            EC& conn) {
+    if (cookie.callback) {
+        cookie.callback(error ? NULL : &conn.getDelegate().getConnection(),
+                        error, reason, cookie.userData);
+    }
+}
+
+void EmiPosixSockDelegate::connectionGotMessage(EC *conn,
+                                                EmiUdpSocket<EmiPosixBinding> *socket,
+                                                EmiTimeInterval now,
+                                                const sockaddr_storage& inboundAddress,
+                                                const sockaddr_storage& remoteAddress,
+                                                const EmiPosixBinding::TemporaryData& data,
+                                                size_t offset,
+                                                size_t len) {
+    // The server socket and its connections share one event
+    // loop, so there is no need to hop to another thread here.
+    conn->onMessage(now, socket,
+                    inboundAddress, remoteAddress,
+                    data, offset, len);
+}
+
+EmiPosixEventLoop *EmiPosixSockDelegate::getSocketCookie() {
+    return &_es._loop;
+}
+
+EmiPosixEventLoop *EmiPosixSockDelegate::getTimerCookie() {
+    return &_es._loop;
+}
@@ -0,0 +1,83 @@
+#ifndef eminet_EmiPosixSockDelegate_h
+#define eminet_EmiPosixSockDelegate_h
+
+#include "EmiPosixBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiPosixSocket;
+class EmiPosixConnection;
+class EmiPosixSockDelegate;
+class EmiPosixConnDelegate;
+template<class SockDelegate, class ConnDelegate>
+class EmiConn;
+template<class Binding>
+class EmiCongestionControl;
+template<class Binding>
+class EmiBbrCongestionControl;
+template<class Binding>
+class EmiConnParams;
+template<class Binding>
+class EmiUdpSocket;
+
+// Invoked when a connection that was initiated with
+// EmiPosixSocket::connect has been established or has failed.
+// conn is NULL iff error is true.
+typedef void (EmiPosixConnectCallback)(EmiPosixConnection *conn,
+                                       bool error,
+                                       EmiDisconnectReason reason,
+                                       void *userData);
+
+struct EmiPosixConnectCookie {
+    EmiPosixConnectCallback *callback;
+    void *userData;
+    
+    EmiPosixConnectCookie() : callback(NULL), userData(NULL) {}
+    EmiPosixConnectCookie(EmiPosixConnectCallback *callback_, void *userData_) :
+    callback(callback_), userData(userData_) {}
+};
+
+class EmiPosixSockDelegate {
+    typedef EmiConn<EmiPosixSockDelegate, EmiPosixConnDelegate> EC;
+    
+    EmiPosixSocket& _es;
+    
+public:
+    
+    typedef EmiPosixBinding       Binding;
+    typedef EmiPosixConnectCookie ConnectionOpenedCallbackCookie;
+#if EMI_POSIX_BBR
+    typedef EmiBbrCongestionControl<EmiPosixBinding> CongestionControl;
+#else
+    typedef EmiCongestionControl<EmiPosixBinding> CongestionControl;
+#endif
+    
+    EmiPosixSockDelegate(EmiPosixSocket& es);
+    
+    EC *makeConnection(const EmiConnParams<EmiPosixBinding>& params);
+    void gotServerConnection(EC& conn);
+    
+    static void connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                 bool error,
+                                 EmiDisconnectReason reason,
+                                 EC& ec);
+    
+    void connectionGotMessage(EC *conn,
+                              EmiUdpSocket<EmiPosixBinding> *socket,
+                              EmiTimeInterval now,
+                              const sockaddr_storage& inboundAddress,
+                              const sockaddr_storage& remoteAddress,
+                              const EmiPosixBinding::TemporaryData& data,
+                              size_t offset,
+                              size_t len);
+    
+    inline EmiPosixSocket& getEmiSocket() { return _es; }
+    inline const EmiPosixSocket& getEmiSocket() const { return _es; }
+    
+    EmiPosixEventLoop *getSocketCookie();
+    EmiPosixEventLoop *getTimerCookie();
+    // Everything that belongs to a socket runs on its loop
+    inline bool connectionsShareThread() const { return true; }
+};
+
+#endif
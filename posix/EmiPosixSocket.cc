@@ -0,0 +1,51 @@
+#include "EmiPosixSocket.h"
+
+#include "EmiPosixConnection.h"
+
+EmiPosixSocket::EmiPosixSocket(EmiPosixEventLoop& loop,
+                               const EmiSockConfig& sc,
+                               EmiPosixSocketHandler *handler) :
+_loop(loop),
+_handler(handler),
+_sock(sc, EmiPosixSockDelegate(*this)),
+_connecting(NULL) {}
+
+EmiPosixSocket::~EmiPosixSocket() {}
+
+bool EmiPosixSocket::open(EmiPosixError& err) {
+    return _sock.open(err);
+}
+
+bool EmiPosixSocket::connect(const sockaddr_storage& remoteAddress,
+                             EmiPosixConnectCallback *callback,
+                             void *userData,
+                             EmiPosixError& err) {
+    return connect(remoteAddress,
+                   /*p2pCookie:*/NULL, /*p2pCookieLength:*/0,
+                   /*sharedSecret:*/NULL, /*sharedSecretLength:*/0,
+                   callback, userData, err);
+}
+
+bool EmiPosixSocket::connect(const sockaddr_storage& remoteAddress,
+                             const uint8_t *p2pCookie, size_t p2pCookieLength,
+                             const uint8_t *sharedSecret, size_t sharedSecretLength,
+                             EmiPosixConnectCallback *callback,
+                             void *userData,
+                             EmiPosixError& err) {
+    _connecting = NULL;
+    
+    bool success = _sock.connect(EmiPosixEventLoop::now(), remoteAddress,
+                                 p2pCookie, p2pCookieLength,
+                                 sharedSecret, sharedSecretLength,
+                                 EmiPosixConnectCookie(callback, userData), err);
+    
+    if (!success && _connecting) {
+        // The connection was never opened, so it will not be
+        // invalidated. Release the reference that the library
+        // holds on to it.
+        _connecting->release();
+    }
+    _connecting = NULL;
+    
+    return success;
+}
@@ -0,0 +1,74 @@
+#ifndef eminet_EmiPosixSocket_h
+#define eminet_EmiPosixSocket_h
+
+#include "EmiPosixBinding.h"
+#include "EmiPosixSockDelegate.h"
+#include "EmiPosixConnDelegate.h"
+
+#include "../core/EmiSock.h"
+#include "../core/EmiConn.h"
+
+class EmiPosixSocket;
+class EmiPosixConnection;
+
+class EmiPosixSocketHandler {
+public:
+    virtual ~EmiPosixSocketHandler() {}
+    
+    // Invoked when a remote host has connected to the socket.
+    // This is a good place to set the connection's handler.
+    virtual void gotConnection(EmiPosixSocket& socket, EmiPosixConnection& conn) = 0;
+};
+
+// The C++ counterpart of EmiSocket in the node and Objective-C
+// bindings. All EmiPosixSocket methods, and all methods of the
+// connections that it creates, must be invoked from the thread
+// that runs the socket's event loop.
+class EmiPosixSocket {
+    typedef EmiSock<EmiPosixSockDelegate, EmiPosixConnDelegate> EmiS;
+    
+    friend class EmiPosixSockDelegate;
+    friend class EmiPosixConnDelegate;
+    
+private:
+    EmiPosixEventLoop&     _loop;
+    EmiPosixSocketHandler *_handler;
+    EmiS                   _sock;
+    // The connection that EmiSock is currently setting up
+    // on behalf of connect. It is released if connect fails.
+    EmiPosixConnection    *_connecting;
+    
+    // Private copy constructor and assignment operator
+    inline EmiPosixSocket(const EmiPosixSocket& other);
+    inline EmiPosixSocket& operator=(const EmiPosixSocket& other);
+    
+public:
+    EmiPosixSocket(EmiPosixEventLoop& loop,
+                   const EmiSockConfig& sc,
+                   EmiPosixSocketHandler *handler);
+    virtual ~EmiPosixSocket();
+    
+    // Binds the server socket if config.acceptConnections is set.
+    bool open(EmiPosixError& err);
+    
+    // callback will be invoked iff this method returns true.
+    bool connect(const sockaddr_storage& remoteAddress,
+                 EmiPosixConnectCallback *callback,
+                 void *userData,
+                 EmiPosixError& err);
+    bool connect(const sockaddr_storage& remoteAddress,
+                 const uint8_t *p2pCookie, size_t p2pCookieLength,
+                 const uint8_t *sharedSecret, size_t sharedSecretLength,
+                 EmiPosixConnectCallback *callback,
+                 void *userData,
+                 EmiPosixError& err);
+    
+    inline void setHandler(EmiPosixSocketHandler *handler) { _handler = handler; }
+    inline EmiPosixSocketHandler *getHandler() const { return _handler; }
+    
+    inline EmiPosixEventLoop& getLoop() { return _loop; }
+    inline EmiS& getSock() { return _sock; }
+    inline const EmiS& getSock() const { return _sock; }
+};
+
+#endif
@@ -0,0 +1,116 @@
+//
+//  EmiBbrCongestionControlTest.cc
+//  eminet
+//
+//  Checks that the allowance that EmiSendQueue computes from the
+//  tick allowance of the congestion control stops the sending once
+//  the congestion window is full, and doesn't wrap around when more
+//  bytes than the budget have been sent.
+//
+
+#include "../../core/EmiBbrCongestionControl.h"
+#include "../../core/EmiSendQueue.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+static const size_t MTU = EMI_MINIMAL_MTU;
+
+class TestBinding {
+public:
+    static EmiTimeInterval currentTime;
+
+    inline static EmiTimeInterval now() {
+        return currentTime;
+    }
+
+    static void randomBytes(void *buf, size_t bufSize) {
+        for (size_t i=0; i<bufSize; i++) {
+            ((uint8_t *)buf)[i] = rand();
+        }
+    }
+};
+
+EmiTimeInterval TestBinding::currentTime = 1;
+
+typedef EmiBbrCongestionControl<TestBinding> Bbr;
+typedef EmiBytesSentTheLastNTicks<100>       Counter;
+
+// Sends packets the way EmiSendQueue does for the given number of
+// ticks, without any ACKs arriving, and returns the number of bytes
+// that were sent
+static size_t sendForTicks(Bbr& bbr, Counter& counter,
+                           EmiPacketSequenceNumber& sn, int ticks) {
+    size_t sent = 0;
+    for (int i=0; i<ticks; i++) {
+        size_t allowedSize;
+        while (0 != (allowedSize = counter.allowedSize(MTU, bbr.tickAllowance()))) {
+            bbr.onDataSent(sn, allowedSize);
+            counter.sendData(allowedSize);
+            sent += allowedSize;
+            sn = (sn+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        }
+
+        counter.tick();
+        TestBinding::currentTime += EMI_TICK_TIME;
+    }
+    return sent;
+}
+
+static void testFullCongestionWindow() {
+    Bbr bbr;
+    Counter counter;
+    EmiPacketSequenceNumber sn = 0;
+
+    // The initial congestion window is sent in the first tick, and
+    // at most one packet more than it
+    size_t initialWindow = bbr.tickAllowance();
+    ASSERT(0 != initialWindow);
+    size_t sent = sendForTicks(bbr, counter, sn, 1);
+    ASSERT(initialWindow <= sent && sent < initialWindow+MTU);
+    ASSERT(0 == bbr.tickAllowance());
+
+    // Nothing is sent as long as the window stays full, not even the
+    // one packet per counter.N() ticks that the counter otherwise
+    // allows, and not when far more bytes than the budget of a zero
+    // allowance have been sent in the last ticks
+    ASSERT(0 == counter.allowedSize(MTU, bbr.tickAllowance()));
+    ASSERT(0 == sendForTicks(bbr, counter, sn, 10*counter.N()));
+    ASSERT(0 == counter.bytesSent());
+}
+
+static void testAllowance() {
+    Counter counter;
+
+    // At least one full packet is allowed every N ticks, however
+    // low the allowance is
+    ASSERT(MTU == counter.allowedSize(MTU, 1));
+    counter.sendData(MTU);
+    ASSERT(0 == counter.allowedSize(MTU, 1));
+    for (int i=0; i<counter.N()-1; i++) {
+        counter.tick();
+        ASSERT(0 == counter.allowedSize(MTU, 1));
+    }
+    counter.tick();
+    ASSERT(MTU == counter.allowedSize(MTU, 1));
+
+    // The packet pair and the heartbeats are sent past the budget. That
+    // must not let anything more be sent.
+    counter.sendData(3*MTU);
+    ASSERT(0 == counter.allowedSize(MTU, 1));
+    ASSERT(0 == counter.allowedSize(MTU, 2*MTU/counter.N()));
+
+    // The rest of the budget limits the size of the packet
+    ASSERT(counter.N()*20-3*MTU == counter.allowedSize(MTU, 20));
+    ASSERT(MTU == counter.allowedSize(MTU, 40));
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testAllowance();
+    testFullCongestionWindow();
+
+    printf("EmiBbrCongestionControlTest: OK\n");
+    return 0;
+}
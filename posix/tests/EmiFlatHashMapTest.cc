@@ -0,0 +1,165 @@
+//
+//  EmiFlatHashMapTest.cc
+//  eminet
+//
+//  Runs random inserts, erases and lookups against EmiFlatHashMap
+//  and std::map side by side, and checks that they always agree.
+//
+
+#include "../../core/EmiEndpointKey.h"
+#include "../../core/EmiFlatHashMap.h"
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+// A key with a deliberately bad hash function, so that there are
+// long probe sequences that wrap around the end of the table, and
+// an occasional hash of 0, which the map has to remap.
+class CollidingKey {
+    uint32_t _value;
+
+public:
+    CollidingKey() : _value(0) {}
+    explicit CollidingKey(uint32_t value) : _value(value) {}
+
+    inline bool operator==(const CollidingKey& other) const {
+        return _value == other._value;
+    }
+
+    inline uint64_t hash(uint64_t seed) const {
+        return (_value % 7)*12345 + (_value % 3 ? seed : 0);
+    }
+};
+
+typedef EmiFlatHashMap<CollidingKey, int> CollidingMap;
+typedef std::map<uint32_t, int>           ReferenceMap;
+
+static void checkSameContents(CollidingMap& map, const ReferenceMap& ref) {
+    ASSERT(map.size() == ref.size());
+    ASSERT(map.empty() == ref.empty());
+
+    size_t count = 0;
+    for (CollidingMap::iterator it = map.begin(); it != map.end(); ++it) {
+        count++;
+    }
+    ASSERT(count == ref.size());
+
+    for (ReferenceMap::const_iterator it = ref.begin(); it != ref.end(); ++it) {
+        int *value = map.find(CollidingKey(it->first));
+        ASSERT(value && *value == it->second);
+    }
+}
+
+static void testRandomOperations() {
+    CollidingMap map(3);
+    ReferenceMap ref;
+
+    for (int i=0; i<500000; i++) {
+        // Vary the size of the key space, so that the map both
+        // grows and is emptied
+        uint32_t keySpace = (i/100000 % 2 ? 50 : 5000);
+        uint32_t key = rand() % keySpace;
+
+        switch (rand() % 3) {
+            case 0: {
+                bool inserted = map.insert(CollidingKey(key), i);
+                ASSERT(inserted == ref.insert(std::make_pair(key, i)).second);
+                break;
+            }
+            case 1: {
+                ASSERT(map.erase(CollidingKey(key)) == !!ref.erase(key));
+                break;
+            }
+            default: {
+                int *value = map.find(CollidingKey(key));
+                ReferenceMap::iterator it = ref.find(key);
+                ASSERT(!!value == (it != ref.end()));
+                ASSERT(!value || *value == it->second);
+                ASSERT(map.contains(CollidingKey(key)) == !!value);
+                break;
+            }
+        }
+
+        ASSERT(map.size() == ref.size());
+        if (0 == i % 10000) {
+            checkSameContents(map, ref);
+        }
+    }
+
+    checkSameContents(map, ref);
+
+    // Modifying the values through the iterators
+    for (CollidingMap::iterator it = map.begin(); it != map.end(); ++it) {
+        it.value() = -1;
+    }
+    for (ReferenceMap::iterator it = ref.begin(); it != ref.end(); ++it) {
+        it->second = -1;
+    }
+    checkSameContents(map, ref);
+
+    for (ReferenceMap::iterator it = ref.begin(); it != ref.end(); ++it) {
+        ASSERT(map.erase(CollidingKey(it->first)));
+    }
+    ASSERT(map.empty());
+    ASSERT(map.begin() == map.end());
+    ASSERT(!map.erase(CollidingKey(1)));
+}
+
+static EmiEndpointKey makeKey(int family, const char *ip, uint16_t port) {
+    sockaddr_storage address;
+    memset(&address, 0, sizeof(address));
+    address.ss_family = family;
+    if (AF_INET == family) {
+        sockaddr_in& in((sockaddr_in&)address);
+        in.sin_port = htons(port);
+        ASSERT(1 == inet_pton(AF_INET, ip, &in.sin_addr));
+    }
+    else {
+        sockaddr_in6& in6((sockaddr_in6&)address);
+        in6.sin6_port = htons(port);
+        ASSERT(1 == inet_pton(AF_INET6, ip, &in6.sin6_addr));
+    }
+    return EmiEndpointKey(address);
+}
+
+static void testEndpointKeys() {
+    EmiFlatHashMap<EmiEndpointKey, int> map(0x1234567890abcdefULL);
+
+    EmiEndpointKey a = makeKey(AF_INET, "10.0.0.1", 5000);
+    EmiEndpointKey b = makeKey(AF_INET, "10.0.0.1", 5001);
+    EmiEndpointKey c = makeKey(AF_INET6, "::1", 5000);
+    EmiEndpointKey d = makeKey(AF_INET6, "::ffff:10.0.0.1", 5000);
+
+    ASSERT(a == makeKey(AF_INET, "10.0.0.1", 5000));
+    ASSERT(a.hash(7) == makeKey(AF_INET, "10.0.0.1", 5000).hash(7));
+    ASSERT(!(a == b) && !(a == c) && !(a == d) && !(c == d));
+
+    ASSERT(map.insert(a, 1));
+    ASSERT(map.insert(b, 2));
+    ASSERT(map.insert(c, 3));
+    ASSERT(map.insert(d, 4));
+    ASSERT(!map.insert(makeKey(AF_INET, "10.0.0.1", 5000), 5));
+
+    ASSERT(4 == map.size());
+    ASSERT(1 == *map.find(a));
+    ASSERT(2 == *map.find(b));
+    ASSERT(3 == *map.find(c));
+    ASSERT(4 == *map.find(d));
+    ASSERT(!map.find(makeKey(AF_INET, "10.0.0.2", 5000)));
+
+    ASSERT(map.erase(b));
+    ASSERT(!map.find(b));
+    ASSERT(1 == *map.find(a));
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testRandomOperations();
+    testEndpointKeys();
+
+    printf("EmiFlatHashMapTest: OK\n");
+    return 0;
+}
@@ -0,0 +1,217 @@
+//
+//  EmiLossListTest.cc
+//  eminet
+//
+
+#include "../../core/EmiLossList.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <vector>
+
+static const EmiTimeInterval RTT = 0.05;
+// Much less than the smallest reordering delay, so that only the
+// reordering threshold decides when losses are NAKed
+static const EmiTimeInterval PACKET_INTERVAL = 0.0001;
+
+static void testInOrder() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+
+    for (EmiPacketSequenceNumber sn=0; sn<10000; sn++) {
+        now += PACKET_INTERVAL;
+        ASSERT(-1 == list.gotPacket(now, sn));
+        ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    }
+}
+
+static void testSingleLoss() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+
+    for (EmiPacketSequenceNumber sn=0; sn<5; sn++) {
+        now += PACKET_INTERVAL;
+        ASSERT(-1 == list.gotPacket(now, sn));
+    }
+
+    // Packet 5 is lost. It is not NAKed until the initial reordering
+    // threshold of 3 packets newer than it have arrived.
+    for (EmiPacketSequenceNumber sn=6; sn<8; sn++) {
+        now += PACKET_INTERVAL;
+        ASSERT(-1 == list.gotPacket(now, sn));
+        ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    }
+    now += PACKET_INTERVAL;
+    ASSERT(-1 == list.gotPacket(now, 8));
+    ASSERT(5 == list.calculateNak(now, RTT, RTT));
+    ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+
+    // When it arrives after all, the NAK was spurious, but only
+    // the first time
+    ASSERT(5 == list.gotPacket(now, 5));
+    ASSERT(-1 == list.gotPacket(now, 5));
+}
+
+static void testReorderingDelay() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+
+    ASSERT(-1 == list.gotPacket(now, 0));
+    ASSERT(-1 == list.gotPacket(now, 2));
+    ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+
+    // Even if no more packets arrive, a loss is NAKed once the
+    // reordering delay, at least RTT/4, has passed
+    now += RTT/8;
+    ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    now += RTT/4;
+    ASSERT(1 == list.calculateNak(now, RTT, RTT));
+}
+
+static void testReordering() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+
+    // Packets that are swapped with their neighbours are not NAKed
+    for (EmiPacketSequenceNumber sn=0; sn<1000; sn+=2) {
+        now += PACKET_INTERVAL;
+        ASSERT(-1 == list.gotPacket(now, sn+1));
+        ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+        ASSERT(-1 == list.gotPacket(now, sn));
+        ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    }
+}
+
+static void testAdaptiveThreshold() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+    EmiPacketSequenceNumber sn = 0;
+
+    for (; sn<10; sn++) {
+        now += PACKET_INTERVAL;
+        list.gotPacket(now, sn);
+    }
+
+    // Packet 10 arrives 10 packets late, after it has been NAKed
+    bool naked = false;
+    for (sn=11; sn<21; sn++) {
+        now += PACKET_INTERVAL;
+        list.gotPacket(now, sn);
+        if (10 == list.calculateNak(now, RTT, RTT)) {
+            naked = true;
+        }
+    }
+    ASSERT(naked);
+    ASSERT(10 == list.gotPacket(now, 10));
+
+    // Now a loss isn't NAKed until 11 newer packets have arrived
+    for (sn=22; sn<32; sn++) {
+        now += PACKET_INTERVAL;
+        list.gotPacket(now, sn);
+        ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    }
+    now += PACKET_INTERVAL;
+    list.gotPacket(now, 32);
+    ASSERT(21 == list.calculateNak(now, RTT, RTT));
+}
+
+static void testWraparound() {
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+
+    EmiNonWrappingPacketSequenceNumber first = EMI_PACKET_SEQUENCE_NUMBER_MASK-5;
+    for (EmiNonWrappingPacketSequenceNumber sn=first; sn<first+20; sn++) {
+        now += PACKET_INTERVAL;
+        // Packet 2 after the wraparound is lost
+        if (EMI_PACKET_SEQUENCE_NUMBER_MASK+1+2 == sn) {
+            continue;
+        }
+        ASSERT(-1 == list.gotPacket(now, sn & EMI_PACKET_SEQUENCE_NUMBER_MASK));
+    }
+
+    ASSERT(2 == list.calculateNak(now, RTT, RTT));
+    ASSERT(-1 == list.calculateNak(now, RTT, RTT));
+    ASSERT(2 == list.gotPacket(now, 2));
+}
+
+// Sends a long stream, across the 24 bit wraparound, with random
+// losses and reordering, and checks that NAKs are only sent for
+// packets that are missing, that spurious NAKs are reported exactly
+// for the NAKed packets that arrive, and that almost all lost
+// packets are NAKed.
+static void testRandomStream() {
+    static const EmiNonWrappingPacketSequenceNumber FIRST = EMI_PACKET_SEQUENCE_NUMBER_MASK-50000;
+    static const size_t NUM_PACKETS = 200000;
+
+    // The order in which the packets arrive; -1 means lost
+    std::vector<EmiNonWrappingPacketSequenceNumber> arrivals;
+    std::set<EmiNonWrappingPacketSequenceNumber> lost;
+    for (size_t i=0; i<NUM_PACKETS; i++) {
+        if (0 == rand() % 50) {
+            lost.insert(FIRST+i);
+        }
+        else {
+            arrivals.push_back(FIRST+i);
+        }
+    }
+    for (size_t i=0; i<arrivals.size(); i++) {
+        if (0 == rand() % 20) {
+            // Delay the packet by up to 8 positions
+            size_t to = std::min(i + 1 + rand() % 8, arrivals.size()-1);
+            EmiNonWrappingPacketSequenceNumber sn = arrivals[i];
+            arrivals.erase(arrivals.begin()+i);
+            arrivals.insert(arrivals.begin()+to, sn);
+        }
+    }
+
+    EmiLossList list;
+    EmiTimeInterval now = 1;
+    EmiNonWrappingPacketSequenceNumber newest = -1;
+    std::set<EmiNonWrappingPacketSequenceNumber> received;
+    std::set<EmiNonWrappingPacketSequenceNumber> naked;
+    size_t nakedLost = 0;
+
+    for (size_t i=0; i<arrivals.size(); i++) {
+        EmiNonWrappingPacketSequenceNumber sn = arrivals[i];
+        now += PACKET_INTERVAL;
+
+        EmiPacketSequenceNumber spurious = list.gotPacket(now, sn & EMI_PACKET_SEQUENCE_NUMBER_MASK);
+        if (naked.count(sn)) {
+            ASSERT(spurious == (sn & EMI_PACKET_SEQUENCE_NUMBER_MASK));
+            naked.erase(sn);
+        }
+        else {
+            ASSERT(-1 == spurious);
+        }
+        received.insert(sn);
+        newest = std::max(newest, sn);
+
+        EmiPacketSequenceNumber nak = list.calculateNak(now, RTT, RTT);
+        if (-1 != nak) {
+            EmiNonWrappingPacketSequenceNumber nakSn =
+                newest - ((newest-nak) & EMI_PACKET_SEQUENCE_NUMBER_MASK);
+            ASSERT(!received.count(nakSn));
+            if (naked.insert(nakSn).second && lost.count(nakSn)) {
+                nakedLost++;
+            }
+        }
+    }
+
+    ASSERT(nakedLost >= lost.size()*95/100);
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testInOrder();
+    testSingleLoss();
+    testReorderingDelay();
+    testReordering();
+    testAdaptiveThreshold();
+    testWraparound();
+    testRandomStream();
+
+    printf("EmiLossListTest: OK\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+//
+//  EmiPacketHeaderTest.cc
+//  eminet
+//
+//  Writes packet headers with random combinations of fields, with
+//  and without a spurious NAK and filler bytes, and checks that they
+//  parse back to the same header.
+//
+
+#include "../../core/EmiPacketHeader.h"
+#include "../../core/EmiNetUtil.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static EmiPacketSequenceNumber randomSequenceNumber() {
+    return rand() & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+}
+
+static void checkSameHeader(const EmiPacketHeader& a, const EmiPacketHeader& b) {
+    EmiPacketFlags flags = a.flags;
+    ASSERT(flags == b.flags);
+    ASSERT(a.extraFlags == b.extraFlags);
+    ASSERT(!(flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG) || a.sequenceNumber == b.sequenceNumber);
+    ASSERT(!(flags & EMI_ACK_PACKET_FLAG) || a.ack == b.ack);
+    ASSERT(!(flags & EMI_NAK_PACKET_FLAG) || a.nak == b.nak);
+    ASSERT(!(flags & EMI_LINK_CAPACITY_PACKET_FLAG) || a.linkCapacity == b.linkCapacity);
+    ASSERT(!(flags & EMI_ARRIVAL_RATE_PACKET_FLAG) || a.arrivalRate == b.arrivalRate);
+    ASSERT(!(flags & EMI_RTT_RESPONSE_PACKET_FLAG) || (a.rttResponse == b.rttResponse &&
+                                                       a.rttResponseDelay == b.rttResponseDelay));
+    ASSERT(!(a.extraFlags & EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG) || a.spuriousNak == b.spuriousNak);
+}
+
+static void testRoundTrip() {
+    for (int i=0; i<100000; i++) {
+        EmiPacketHeader header;
+        header.flags = rand() & ~EMI_EXTRA_FLAGS_PACKET_FLAG & 0xff;
+        header.extraFlags = (rand() % 2 ? EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG : 0);
+        header.sequenceNumber = randomSequenceNumber();
+        header.ack = randomSequenceNumber();
+        header.nak = randomSequenceNumber();
+        header.linkCapacity = (rand() % 100000)/7.0f;
+        header.arrivalRate = (rand() % 100000)/3.0f;
+        header.rttResponse = randomSequenceNumber();
+        header.rttResponseDelay = rand() % (EMI_PACKET_HEADER_MAX_RESPONSE_DELAY+1);
+        header.spuriousNak = randomSequenceNumber();
+
+        uint8_t buf[128];
+        size_t length;
+        ASSERT(EmiPacketHeader::write(buf, sizeof(buf), header, &length));
+
+        // The write doesn't fit in a smaller buffer
+        uint8_t small[128];
+        ASSERT(!EmiPacketHeader::write(small, length-1, header, NULL));
+
+        uint16_t fillerSize = (rand() % 4 ? rand() % 4 : rand() % 64);
+        EmiPacketHeader::addFillerBytes(buf, length, fillerSize);
+
+        EmiPacketHeader parsed;
+        size_t parsedLength;
+        ASSERT(EmiPacketHeader::parse(buf, length+fillerSize, &parsed, &parsedLength));
+        ASSERT(length+fillerSize == parsedLength);
+
+        // The flags of the parsed header include
+        // EMI_EXTRA_FLAGS_PACKET_FLAG when there are extra flags
+        // or filler, but the filler flags are not exposed
+        ASSERT(!!(parsed.flags & EMI_EXTRA_FLAGS_PACKET_FLAG) ==
+               (0 != header.extraFlags || 0 != fillerSize));
+        parsed.flags &= ~EMI_EXTRA_FLAGS_PACKET_FLAG;
+        checkSameHeader(header, parsed);
+
+        // A truncated header does not parse
+        ASSERT(!EmiPacketHeader::parse(buf, parsedLength-1, &parsed, NULL));
+    }
+}
+
+static void testSpuriousNak() {
+    EmiPacketHeader header;
+    header.flags = EMI_SEQUENCE_NUMBER_PACKET_FLAG | EMI_NAK_PACKET_FLAG;
+    header.sequenceNumber = 0x123456;
+    header.nak = 0x111111;
+
+    // Without a spurious NAK, the header has no extra flags byte
+    uint8_t buf[64];
+    size_t length;
+    ASSERT(EmiPacketHeader::write(buf, sizeof(buf), header, &length));
+    ASSERT(1+2*EMI_PACKET_SEQUENCE_NUMBER_LENGTH == length);
+
+    EmiPacketHeader parsed;
+    ASSERT(EmiPacketHeader::parse(buf, length, &parsed, NULL));
+    ASSERT(0 == parsed.extraFlags);
+    ASSERT(!(parsed.flags & EMI_EXTRA_FLAGS_PACKET_FLAG));
+
+    // With one, it is written after the other fields
+    header.extraFlags = EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG;
+    header.spuriousNak = 0xabcdef;
+    ASSERT(EmiPacketHeader::write(buf, sizeof(buf), header, &length));
+    ASSERT(2+3*EMI_PACKET_SEQUENCE_NUMBER_LENGTH == length);
+    ASSERT(EMI_EXTRA_FLAGS_PACKET_FLAG & buf[0]);
+    ASSERT(EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG == buf[1]);
+    ASSERT(0xabcdef == EmiNetUtil::read24(buf+length-EMI_PACKET_SEQUENCE_NUMBER_LENGTH));
+
+    ASSERT(EmiPacketHeader::parse(buf, length, &parsed, NULL));
+    ASSERT(EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG == parsed.extraFlags);
+    ASSERT(0xabcdef == parsed.spuriousNak);
+    ASSERT(0x111111 == parsed.nak);
+}
+
+// The header with every optional field is the largest one, which
+// EMI_PACKET_HEADER_MAX_LENGTH must account for
+static void testMaxLength() {
+    EmiPacketHeader header;
+    header.flags = 0xff & ~EMI_EXTRA_FLAGS_PACKET_FLAG;
+    header.extraFlags = EMI_SPURIOUS_NAK_EXTRA_PACKET_FLAG;
+    header.sequenceNumber = EMI_PACKET_SEQUENCE_NUMBER_MASK;
+    header.ack = EMI_PACKET_SEQUENCE_NUMBER_MASK;
+    header.nak = EMI_PACKET_SEQUENCE_NUMBER_MASK;
+    header.linkCapacity = 1e9f;
+    header.arrivalRate = 1e9f;
+    header.rttResponse = EMI_PACKET_SEQUENCE_NUMBER_MASK;
+    header.rttResponseDelay = EMI_PACKET_HEADER_MAX_RESPONSE_DELAY;
+    header.spuriousNak = EMI_PACKET_SEQUENCE_NUMBER_MASK;
+
+    uint8_t buf[128];
+    size_t length;
+    ASSERT(EmiPacketHeader::write(buf, sizeof(buf), header, &length));
+    ASSERT(EMI_PACKET_HEADER_MAX_LENGTH == length);
+    ASSERT(EmiPacketHeader::write(buf, EMI_PACKET_HEADER_MAX_LENGTH, header, NULL));
+
+    EmiPacketHeader parsed;
+    ASSERT(EmiPacketHeader::parse(buf, length, &parsed, NULL));
+    parsed.flags &= ~EMI_EXTRA_FLAGS_PACKET_FLAG;
+    checkSameHeader(header, parsed);
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testSpuriousNak();
+    testMaxLength();
+    testRoundTrip();
+
+    printf("EmiPacketHeaderTest: OK\n");
+    return 0;
+}
@@ -0,0 +1,382 @@
+//
+//  EmiReceiverBufferTest.cc
+//  eminet
+//
+//  Feeds the parts of split messages to
+//  EmiReceiverBuffer::SplitMessageSets in random order, with losses,
+//  duplicates and removals, and checks every answer against a naive
+//  model that keeps all received parts in a std::map.
+//
+//  Also sends the SACK blocks of a receiver buffer that has messages
+//  out of order to another receiver buffer in a SACK message.
+//
+
+#include "../EmiPosixBinding.h"
+#include "../../core/EmiMessage.h"
+#include "../../core/EmiReceiverBuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+struct TestSockDelegate {
+    typedef EmiPosixBinding Binding;
+};
+
+typedef std::pair<EmiNonWrappingSequenceNumber, EmiNonWrappingSequenceNumber> SnRange;
+
+// Records what the receiver buffer tells its connection. Sequence
+// numbers are unwrapped relative to the initial sequence number.
+class TestReceiver {
+public:
+    EmiSequenceNumber initialSequenceNumber;
+    // The payloads of the emitted messages
+    std::vector<uint8_t> emitted;
+    std::vector<SnRange> deregistered;
+    bool sackEnqueued;
+
+    explicit TestReceiver(EmiSequenceNumber initialSequenceNumber_) :
+    initialSequenceNumber(initialSequenceNumber_),
+    emitted(),
+    deregistered(),
+    sackEnqueued(false) {}
+
+    EmiNonWrappingSequenceNumber guessSequenceNumberWrapping(EmiChannelQualifier cq, EmiSequenceNumber sn) {
+        return initialSequenceNumber + ((sn-initialSequenceNumber) & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+    }
+
+    void emitMessage(EmiChannelQualifier cq, const EmiPosixTemporaryData& data, size_t offset, size_t size) {
+        ASSERT(1 == size);
+        emitted.push_back(EmiPosixBinding::extractData(data)[offset]);
+    }
+
+    void deregisterReliableMessages(EmiTimeInterval now, int32_t cq,
+                                    EmiNonWrappingSequenceNumber first,
+                                    EmiNonWrappingSequenceNumber last) {
+        deregistered.push_back(std::make_pair(first, last));
+    }
+
+    void deregisterReliableMessages(EmiTimeInterval now, int32_t cq,
+                                    EmiNonWrappingSequenceNumber sn) {
+        ASSERT(0 && "Unexpected ack");
+    }
+
+    void enqueueSack(EmiChannelQualifier cq) { sackEnqueued = true; }
+    void enqueueAck(EmiChannelQualifier cq, EmiSequenceNumber sn) {}
+    void emitPacketLoss(EmiChannelQualifier cq, EmiSequenceNumber packetsLost) {}
+    void gotReliableSequencedAck(EmiTimeInterval now, EmiChannelQualifier cq, EmiSequenceNumber ack) {}
+    EmiSequenceNumber getOtherHostInitialSequenceNumber() const { return initialSequenceNumber; }
+    bool isClosed() const { return false; }
+};
+
+typedef EmiReceiverBuffer<TestSockDelegate, TestReceiver> ReceiverBuffer;
+typedef ReceiverBuffer::SplitMessageSets SplitMessageSets;
+
+struct Part {
+    EmiNonWrappingSequenceNumber sn;
+    EmiMessageFlags flags;
+    size_t size;
+};
+
+// The run of sn is the parts around sn that are linked together by
+// parts that are not the last one in their split.
+class SplitsModel {
+    std::map<EmiNonWrappingSequenceNumber, Part> _parts;
+
+    inline bool linksForward(EmiNonWrappingSequenceNumber sn) const {
+        std::map<EmiNonWrappingSequenceNumber, Part>::const_iterator it = _parts.find(sn);
+        return it != _parts.end() && (it->second.flags & EMI_SPLIT_NOT_LAST_FLAG);
+    }
+
+public:
+    inline bool has(EmiNonWrappingSequenceNumber sn) const {
+        return !!_parts.count(sn);
+    }
+
+    void gotMessage(const Part& part) {
+        if (!(part.flags & (EMI_SPLIT_NOT_FIRST_FLAG | EMI_SPLIT_NOT_LAST_FLAG))) {
+            return;
+        }
+        _parts.insert(std::make_pair(part.sn, part));
+    }
+
+    EmiNonWrappingSequenceNumber firstInSet(EmiNonWrappingSequenceNumber sn) const {
+        if (!has(sn) && !linksForward(sn-1)) {
+            return sn;
+        }
+        while (linksForward(sn-1)) {
+            sn--;
+        }
+        return sn;
+    }
+
+    EmiNonWrappingSequenceNumber lastInSet(EmiNonWrappingSequenceNumber sn) const {
+        if (!has(sn)) {
+            return linksForward(sn-1) ? sn-1 : sn;
+        }
+        while (linksForward(sn) && has(sn+1)) {
+            sn++;
+        }
+        return sn;
+    }
+
+    SplitMessageSets::MessageData getMessageData(const Part& part) const {
+        if (!(part.flags & (EMI_SPLIT_NOT_FIRST_FLAG | EMI_SPLIT_NOT_LAST_FLAG))) {
+            return std::make_pair(true, std::make_pair(part.sn, part.size));
+        }
+
+        EmiNonWrappingSequenceNumber first = firstInSet(part.sn);
+        EmiNonWrappingSequenceNumber last = lastInSet(part.sn);
+        size_t size = 0;
+        for (EmiNonWrappingSequenceNumber sn=first; sn<=last; sn++) {
+            size += _parts.find(sn)->second.size;
+        }
+
+        bool complete = (!(_parts.find(first)->second.flags & EMI_SPLIT_NOT_FIRST_FLAG) &&
+                         !(_parts.find(last)->second.flags & EMI_SPLIT_NOT_LAST_FLAG));
+        return std::make_pair(complete, std::make_pair(last, size));
+    }
+
+    void removeMessageAndOlderMessages(EmiNonWrappingSequenceNumber sn) {
+        EmiNonWrappingSequenceNumber last = lastInSet(sn);
+        _parts.erase(_parts.begin(), _parts.upper_bound(last));
+    }
+};
+
+// Returns the parts of numSplits split messages of random lengths,
+// in order. Splits of length 1 are ordinary messages.
+static std::vector<Part> makeParts(EmiNonWrappingSequenceNumber firstSn, int numSplits) {
+    std::vector<Part> parts;
+    EmiNonWrappingSequenceNumber sn = firstSn;
+
+    for (int i=0; i<numSplits; i++) {
+        int length = 1 + rand() % 6;
+        for (int j=0; j<length; j++) {
+            Part part;
+            part.sn = sn++;
+            part.flags = ((j > 0        ? EMI_SPLIT_NOT_FIRST_FLAG : 0) |
+                          (j < length-1 ? EMI_SPLIT_NOT_LAST_FLAG  : 0));
+            part.size = 1 + rand() % 1000;
+            parts.push_back(part);
+        }
+    }
+
+    return parts;
+}
+
+static void checkSame(SplitMessageSets& sets, EmiChannelQualifier cq,
+                      const SplitsModel& model, const std::vector<Part>& parts) {
+    for (size_t i=0; i<parts.size(); i++) {
+        const Part& part(parts[i]);
+        ASSERT(sets.getFirstSequenceNumberInSet(cq, part.sn) == model.firstInSet(part.sn));
+        ASSERT(sets.getLastSequenceNumberInSet(cq, part.sn) == model.lastInSet(part.sn));
+
+        if (model.has(part.sn)) {
+            ASSERT(sets.getMessageData(cq, part.sn, part.flags, part.size) ==
+                   model.getMessageData(part));
+        }
+    }
+
+    EmiNonWrappingSequenceNumber after = parts.back().sn+1;
+    ASSERT(sets.getFirstSequenceNumberInSet(cq, after) == model.firstInSet(after));
+    ASSERT(sets.getLastSequenceNumberInSet(cq, after) == model.lastInSet(after));
+}
+
+// Removes a random complete split, together with everything before
+// it, the way the receiver buffer does once it has delivered it.
+// Returns the sequence number after the removed split, or 0 if there
+// was no complete split.
+static EmiNonWrappingSequenceNumber removeRandomCompleteSplit(SplitMessageSets& sets,
+                                                              EmiChannelQualifier cq,
+                                                              SplitsModel& model,
+                                                              const std::vector<Part>& parts) {
+    std::vector<const Part *> candidates;
+    for (size_t i=0; i<parts.size(); i++) {
+        if (model.has(parts[i].sn) && model.getMessageData(parts[i]).first) {
+            candidates.push_back(&parts[i]);
+        }
+    }
+
+    if (candidates.empty()) {
+        return 0;
+    }
+
+    const Part& part(*candidates[rand() % candidates.size()]);
+    EmiNonWrappingSequenceNumber end = model.lastInSet(part.sn)+1;
+    sets.removeMessageAndOlderMessages(cq, part.sn);
+    model.removeMessageAndOlderMessages(part.sn);
+    return end;
+}
+
+static void testRandomArrivals() {
+    static const EmiChannelQualifier CHANNELS[] = { 3, 200 };
+    static const size_t NUM_CHANNELS = sizeof(CHANNELS)/sizeof(CHANNELS[0]);
+
+    for (int trial=0; trial<10000; trial++) {
+        SplitMessageSets sets;
+        SplitsModel models[NUM_CHANNELS];
+        std::vector<Part> parts[NUM_CHANNELS];
+        std::vector<std::pair<size_t, Part> > arrivals;
+
+        for (size_t c=0; c<NUM_CHANNELS; c++) {
+            EmiNonWrappingSequenceNumber firstSn = (EmiNonWrappingSequenceNumber)rand()*(rand() % 100);
+            parts[c] = makeParts(firstSn, 1 + rand() % 8);
+
+            for (size_t i=0; i<parts[c].size(); i++) {
+                // Lose some parts, and duplicate some
+                int copies = (0 == rand() % 5 ? 0 : (0 == rand() % 10 ? 2 : 1));
+                for (int j=0; j<copies; j++) {
+                    arrivals.push_back(std::make_pair(c, parts[c][i]));
+                }
+            }
+        }
+
+        if (trial % 2) {
+            std::random_shuffle(arrivals.begin(), arrivals.end());
+        }
+        else {
+            // Mostly in order, with some local reordering
+            for (size_t i=1; i<arrivals.size(); i++) {
+                if (0 == rand() % 3) {
+                    std::swap(arrivals[i-1], arrivals[i]);
+                }
+            }
+        }
+
+        // Parts that have been removed are never given to the sets
+        // again; the receiver buffer drops them before that
+        std::vector<EmiNonWrappingSequenceNumber> removedUpTo(NUM_CHANNELS, 0);
+
+        for (size_t i=0; i<arrivals.size(); i++) {
+            size_t c = arrivals[i].first;
+            const Part& part(arrivals[i].second);
+            if (part.sn < removedUpTo[c]) {
+                continue;
+            }
+
+            sets.gotMessage(CHANNELS[c], part.sn, part.flags, part.size);
+            models[c].gotMessage(part);
+
+            if (0 == rand() % 4) {
+                removedUpTo[c] = std::max(removedUpTo[c],
+                                          removeRandomCompleteSplit(sets, CHANNELS[c],
+                                                                    models[c], parts[c]));
+            }
+
+            for (size_t d=0; d<NUM_CHANNELS; d++) {
+                checkSame(sets, CHANNELS[d], models[d], parts[d]);
+            }
+        }
+    }
+}
+
+// Parses the first message of buf and gives it to receiverBuffer
+static void receiveMessage(ReceiverBuffer& receiverBuffer, const uint8_t *buf, size_t length) {
+    uint8_t *data;
+    EmiPosixTemporaryData temporaryData(EmiPosixBinding::makeTemporaryData(length, &data));
+    memcpy(data, buf, length);
+
+    EmiMessageHeader header;
+    size_t offset = 0;
+    size_t dataOffset;
+    ASSERT(EmiMessageHeader::parseNextMessage(data, length, &offset, &dataOffset, &header));
+    ASSERT(offset == length);
+    ASSERT(receiverBuffer.gotMessage(0, header, temporaryData, dataOffset));
+}
+
+static void testSackRoundTrip() {
+    static const EmiChannelQualifier CQ = EMI_CHANNEL_QUALIFIER_DEFAULT;
+
+    for (int trial=0; trial<1000; trial++) {
+        // Start near the 24 bit wraparound half of the time
+        EmiSequenceNumber initialSn = (trial % 2 ?
+                                       EMI_HEADER_SEQUENCE_NUMBER_MASK-rand() % 40 :
+                                       rand() % 1000);
+        TestReceiver receiver(initialSn);
+        ReceiverBuffer receiverBuffer(1 << 20, receiver);
+
+        // Messages with random sequence numbers arrive in random
+        // order; the ones after the first gap are buffered
+        std::vector<EmiNonWrappingSequenceNumber> sns;
+        for (EmiNonWrappingSequenceNumber sn=initialSn; sn<initialSn+60; sn++) {
+            if (rand() % 3) {
+                sns.push_back(sn);
+            }
+        }
+        std::random_shuffle(sns.begin(), sns.end());
+
+        for (size_t i=0; i<sns.size(); i++) {
+            uint8_t buf[64];
+            uint8_t payload = (uint8_t)sns[i];
+            size_t length = EmiMessage<EmiPosixBinding>::writeMsg(buf, sizeof(buf), 0, false, 0, CQ,
+                                                                  sns[i] & EMI_HEADER_SEQUENCE_NUMBER_MASK,
+                                                                  &payload, 1, 0);
+            ASSERT(length);
+            receiveMessage(receiverBuffer, buf, length);
+        }
+
+        std::set<EmiNonWrappingSequenceNumber> received(sns.begin(), sns.end());
+        EmiNonWrappingSequenceNumber expected = initialSn;
+        while (received.count(expected)) {
+            expected++;
+        }
+        ASSERT(receiver.emitted.size() == expected-initialSn);
+        for (size_t i=0; i<receiver.emitted.size(); i++) {
+            ASSERT(receiver.emitted[i] == (uint8_t)(initialSn+i));
+        }
+
+        std::vector<SnRange> expectedBlocks;
+        for (std::set<EmiNonWrappingSequenceNumber>::iterator it = received.upper_bound(expected);
+             it != received.end(); ++it) {
+            if (!expectedBlocks.empty() && expectedBlocks.back().second+1 == *it) {
+                expectedBlocks.back().second = *it;
+            }
+            else if (expectedBlocks.size() < EMI_SACK_MAX_BLOCKS) {
+                expectedBlocks.push_back(std::make_pair(*it, *it));
+            }
+            else {
+                break;
+            }
+        }
+        ASSERT(expectedBlocks.empty() || receiver.sackEnqueued);
+
+        uint8_t blocks[EMI_SACK_MAX_BLOCKS*EMI_SACK_BLOCK_LENGTH];
+        size_t blocksLength = receiverBuffer.writeSackBlocks(CQ, blocks);
+        ASSERT(blocksLength == expectedBlocks.size()*EMI_SACK_BLOCK_LENGTH);
+        if (0 == blocksLength) {
+            continue;
+        }
+
+        // The SACK message is sent to the other host, which
+        // deregisters the messages in the blocks
+        uint8_t buf[128];
+        size_t length = EmiMessage<EmiPosixBinding>::writeMsg(buf, sizeof(buf), 0, false, 0, CQ, 0,
+                                                              blocks, blocksLength, EMI_SACK_FLAG);
+        ASSERT(length);
+
+        EmiMessageHeader header;
+        ASSERT(EmiMessageHeader::parse(buf, length, header));
+        ASSERT(EMI_SACK_FLAG == header.flags);
+        ASSERT(CQ == header.channelQualifier);
+        ASSERT(blocksLength == header.length);
+
+        TestReceiver sender(initialSn);
+        ReceiverBuffer senderReceiverBuffer(1 << 20, sender);
+        receiveMessage(senderReceiverBuffer, buf, length);
+        ASSERT(sender.deregistered == expectedBlocks);
+        ASSERT(sender.emitted.empty());
+    }
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testRandomArrivals();
+    testSackRoundTrip();
+
+    printf("EmiReceiverBufferTest: OK\n");
+    return 0;
+}
@@ -0,0 +1,153 @@
+//
+//  EmiSequenceRingTest.cc
+//  eminet
+//
+//  Runs random inserts, erases and pops against EmiSequenceRing and
+//  a std::map based model of it side by side, and checks that they
+//  always agree.
+//
+
+#include "../../core/EmiSequenceRing.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+typedef EmiSequenceRing<int>                        Ring;
+typedef std::map<EmiNonWrappingSequenceNumber, int *> Model;
+
+// The model keeps the end of the window separately, because the
+// ring does not shrink its window when the newest element is erased
+struct RingModel {
+    Model elems;
+    EmiNonWrappingSequenceNumber end;
+
+    RingModel() : elems(), end(0) {}
+
+    inline EmiNonWrappingSequenceNumber first() const {
+        return elems.begin()->first;
+    }
+
+    bool insert(EmiNonWrappingSequenceNumber sn, int *elem, size_t maxSpan) {
+        if (elems.empty()) {
+            end = sn+1;
+        }
+        else if (sn >= first() && sn < end) {
+            if (elems.count(sn)) {
+                return false;
+            }
+        }
+        else {
+            EmiNonWrappingSequenceNumber newBase = std::min(first(), sn);
+            EmiNonWrappingSequenceNumber newEnd  = std::max(end, sn+1);
+            if (newEnd-newBase > maxSpan) {
+                return false;
+            }
+            end = newEnd;
+        }
+
+        elems[sn] = elem;
+        return true;
+    }
+};
+
+static void checkSame(const Ring& ring, const RingModel& model,
+                      EmiNonWrappingSequenceNumber lo, EmiNonWrappingSequenceNumber hi) {
+    ASSERT(ring.empty() == model.elems.empty());
+    if (ring.empty()) {
+        ASSERT(0 == ring.span());
+        return;
+    }
+
+    ASSERT(ring.first() == model.first());
+    ASSERT(ring.span() == model.end-model.first());
+
+    for (EmiNonWrappingSequenceNumber sn=lo; sn<hi; sn++) {
+        Model::const_iterator it = model.elems.find(sn);
+        ASSERT(ring.find(sn) == (it == model.elems.end() ? NULL : it->second));
+    }
+}
+
+static void testRandomOperations() {
+    static int values[256];
+
+    for (int trial=0; trial<200; trial++) {
+        Ring ring;
+        RingModel model;
+
+        // Windows that both fit in the initial capacity and that
+        // make the ring grow, starting at arbitrary sequence numbers
+        EmiNonWrappingSequenceNumber base = (EmiNonWrappingSequenceNumber)rand()*(rand() % 1000);
+        EmiNonWrappingSequenceNumber range = (trial % 2 ? 12 : 200);
+
+        for (int op=0; op<2000; op++) {
+            EmiNonWrappingSequenceNumber sn = base + rand() % range;
+            int *elem = &values[rand() % 256];
+
+            switch (rand() % 4) {
+                case 0:
+                case 1: {
+                    size_t maxSpan = (rand() % 2 ? (size_t)-1 : 1+rand() % range);
+                    ASSERT(ring.insert(sn, elem, maxSpan) == model.insert(sn, elem, maxSpan));
+                    break;
+                }
+                case 2: {
+                    Model::iterator it = model.elems.find(sn);
+                    int *expected = (it == model.elems.end() ? NULL : it->second);
+                    if (it != model.elems.end()) {
+                        model.elems.erase(it);
+                    }
+                    ASSERT(ring.erase(sn) == expected);
+                    break;
+                }
+                default: {
+                    int *expected = NULL;
+                    if (!model.elems.empty() && model.first() <= sn) {
+                        expected = model.elems.begin()->second;
+                        model.elems.erase(model.elems.begin());
+                    }
+                    ASSERT(ring.popUpTo(sn) == expected);
+                    break;
+                }
+            }
+
+            // Slide the window forward now and then
+            if (0 == rand() % 100) {
+                base += rand() % range;
+            }
+
+            checkSame(ring, model, base-range, base+2*range);
+        }
+    }
+}
+
+static void testInOrder() {
+    static int values[1000];
+    Ring ring;
+
+    // The usual pattern: elements are added at the end and
+    // popped from the front, with the window staying narrow
+    for (EmiNonWrappingSequenceNumber sn=0; sn<1000; sn++) {
+        ASSERT(ring.insert(sn, &values[sn], 16));
+        if (sn >= 10) {
+            ASSERT(ring.popUpTo(sn-10) == &values[sn-10]);
+            ASSERT(!ring.popUpTo(sn-10));
+            ASSERT(sn-9 == ring.first());
+            ASSERT(10 == ring.span());
+        }
+    }
+
+    // A gap wider than maxSpan is refused
+    ASSERT(!ring.insert(1000+16, &values[0], 16));
+    ASSERT(ring.insert(990+15, &values[0], 16));
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testInOrder();
+    testRandomOperations();
+
+    printf("EmiSequenceRingTest: OK\n");
+    return 0;
+}
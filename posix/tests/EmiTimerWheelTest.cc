@@ -0,0 +1,256 @@
+//
+//  EmiTimerWheelTest.cc
+//  eminet
+//
+//  Schedules a large number of random timers on an EmiTimerWheel
+//  that is driven by a fake Binding with a manual clock, and checks
+//  that every timer fires exactly once, never early and at most one
+//  tick late.
+//
+
+#include "../../core/EmiTimerWheel.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct TestTimer;
+typedef void (TestTimerCb)(EmiTimeInterval now, TestTimer *timer, void *data);
+
+struct TestTimer {
+    bool             active;
+    EmiTimeInterval  deadline;
+    TestTimerCb     *callback;
+    void            *data;
+};
+
+// A Binding whose time only moves when the test says so. There is
+// only one Binding timer per wheel, and the tests only use one
+// wheel at a time, so it is kept in gBindingTimer.
+static EmiTimeInterval gNow = 100.0;
+static TestTimer *gBindingTimer = NULL;
+// How late the test fires the Binding timer
+static EmiTimeInterval gLateness = 0;
+
+class TestBinding {
+public:
+    typedef TestTimer Timer;
+    typedef int       TimerCookie;
+
+    static EmiTimeInterval now() {
+        return gNow;
+    }
+
+    static Timer *makeTimer(const TimerCookie&) {
+        Timer *timer = new Timer;
+        timer->active = false;
+        gBindingTimer = timer;
+        return timer;
+    }
+
+    static void freeTimer(Timer *timer) {
+        if (gBindingTimer == timer) {
+            gBindingTimer = NULL;
+        }
+        delete timer;
+    }
+
+    static void scheduleTimer(Timer *timer, TestTimerCb *callback, void *data,
+                              EmiTimeInterval interval, bool repeating, bool reschedule) {
+        ASSERT(!repeating);
+        if (timer->active && !reschedule) {
+            return;
+        }
+        timer->active = true;
+        timer->deadline = gNow+interval;
+        timer->callback = callback;
+        timer->data = data;
+    }
+
+    static void descheduleTimer(Timer *timer) {
+        timer->active = false;
+    }
+};
+
+typedef EmiTimerWheel<TestBinding> Wheel;
+typedef EmiWheelTimer<TestBinding> WT;
+typedef EmiWheelTick<TestBinding>  WTick;
+
+// The wheel rounds expiries up to whole ticks
+static const EmiTimeInterval MAX_LATENESS = 0.001 + 1e-6;
+
+struct Record {
+    WT              *timer;
+    EmiTimeInterval  due;
+    bool             cancelled;
+    int              fired;
+};
+
+static void checkFire(EmiTimeInterval now, Record *rec) {
+    ASSERT(!rec->cancelled);
+    ASSERT(now >= rec->due - 1e-9);
+    ASSERT(now <= rec->due + MAX_LATENESS + gLateness);
+    rec->fired++;
+}
+
+static void recordCallback(EmiTimeInterval now, WT *timer, void *data) {
+    Record *rec = (Record *)data;
+    ASSERT(rec->timer == timer);
+    ASSERT(!timer->isActive());
+    checkFire(now, rec);
+}
+
+// Fires the Binding timer at its deadline plus some lateness.
+// Returns false when there is nothing more to fire.
+static bool fireBindingTimer(EmiTimeInterval lateness) {
+    if (!gBindingTimer || !gBindingTimer->active) {
+        return false;
+    }
+    ASSERT(gBindingTimer->deadline >= gNow - 1e-9);
+    gLateness = lateness;
+    gNow = gBindingTimer->deadline + lateness;
+    gBindingTimer->active = false;
+    gBindingTimer->callback(gNow, gBindingTimer, gBindingTimer->data);
+    return true;
+}
+
+static EmiTimeInterval randomInterval() {
+    switch (rand() % 4) {
+        case 0:  return (rand() % 1000)/1000000.0;     // Less than a tick
+        case 1:  return (rand() % 1000)/1000.0;        // Up to a second
+        case 2:  return (rand() % 100000)/1000.0*50;   // Up to ~80 minutes
+        default: return (rand() % 64)/1000.0;          // Level 0
+    }
+}
+
+static void testRandomTimers() {
+    Wheel *wheel = new Wheel(0);
+    std::vector<Record *> recs;
+
+    for (int i=0; i<20000; i++) {
+        Record *rec = new Record;
+        rec->timer = new WT(*wheel);
+        rec->cancelled = false;
+        rec->fired = 0;
+        EmiTimeInterval interval = randomInterval();
+        rec->due = gNow+interval;
+        rec->timer->schedule(recordCallback, rec, interval, /*repeating:*/false, /*reschedule:*/true);
+        recs.push_back(rec);
+    }
+
+    for (size_t i=0; i<recs.size(); i+=7) {
+        recs[i]->timer->deschedule();
+        ASSERT(!recs[i]->timer->isActive());
+        recs[i]->cancelled = true;
+    }
+
+    // Reschedule timers that have not fired yet, and schedule
+    // without reschedule (which must not move an active timer),
+    // while the wheel is running.
+    while (fireBindingTimer((rand() % 3)*0.0003)) {
+        if (0 == rand() % 50) {
+            Record *rec = recs[rand() % recs.size()];
+            if (!rec->cancelled && !rec->fired) {
+                EmiTimeInterval interval = (rand() % 500)/1000.0;
+                rec->due = gNow+interval;
+                rec->timer->schedule(recordCallback, rec, interval, false, /*reschedule:*/true);
+                rec->timer->schedule(recordCallback, rec, interval+10, false, /*reschedule:*/false);
+            }
+        }
+    }
+
+    for (size_t i=0; i<recs.size(); i++) {
+        ASSERT(recs[i]->fired == (recs[i]->cancelled ? 0 : 1));
+        delete recs[i]->timer;
+        delete recs[i];
+    }
+
+    wheel->release();
+    ASSERT(NULL == gBindingTimer);
+}
+
+static void repeatingCallback(EmiTimeInterval now, WT *timer, void *data) {
+    Record *rec = (Record *)data;
+    ASSERT(timer->isActive());
+    checkFire(now, rec);
+    rec->due += 0.010;
+    if (10 == rec->fired) {
+        timer->deschedule();
+    }
+}
+
+static void testRepeatingTimer() {
+    Wheel *wheel = new Wheel(0);
+
+    Record rec;
+    rec.timer = new WT(*wheel);
+    rec.cancelled = false;
+    rec.fired = 0;
+    rec.due = gNow+0.010;
+    rec.timer->schedule(repeatingCallback, &rec, 0.010, /*repeating:*/true, /*reschedule:*/true);
+
+    while (fireBindingTimer(0)) {}
+    ASSERT(10 == rec.fired);
+    ASSERT(!rec.timer->isActive());
+
+    // The wheel is released before the timer, which keeps it alive
+    wheel->release();
+    ASSERT(NULL != gBindingTimer);
+    delete rec.timer;
+    ASSERT(NULL == gBindingTimer);
+}
+
+struct TickRecord {
+    int             ticks;
+    EmiTimeInterval scheduledAt;
+};
+
+static void tickCallback(EmiTimeInterval now, void *data) {
+    TickRecord *rec = (TickRecord *)data;
+    ASSERT(now > rec->scheduledAt);
+    ASSERT(now <= rec->scheduledAt + EMI_TICK_TIME + MAX_LATENESS + gLateness);
+    rec->ticks++;
+}
+
+static void testTicks() {
+    Wheel *wheel = new Wheel(0);
+
+    TickRecord recA = { 0, 0 };
+    TickRecord recB = { 0, 0 };
+    WTick a(tickCallback, &recA);
+    WTick b(tickCallback, &recB);
+
+    gNow += EMI_TICK_TIME/3;
+    recA.scheduledAt = recB.scheduledAt = gNow;
+    wheel->scheduleTick(&a);
+    wheel->scheduleTick(&a);
+    wheel->scheduleTick(&b);
+    ASSERT(a.isScheduled() && b.isScheduled());
+
+    // Both are ticked by the same wakeup, and only once
+    ASSERT(fireBindingTimer(0));
+    ASSERT(1 == recA.ticks && 1 == recB.ticks);
+    ASSERT(!a.isScheduled() && !b.isScheduled());
+    ASSERT(!fireBindingTimer(0));
+
+    // A descheduled tick is not ticked
+    recA.scheduledAt = recB.scheduledAt = gNow;
+    wheel->scheduleTick(&a);
+    wheel->scheduleTick(&b);
+    b.deschedule();
+    ASSERT(fireBindingTimer(0));
+    ASSERT(2 == recA.ticks && 1 == recB.ticks);
+
+    wheel->release();
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    testRandomTimers();
+    testRepeatingTimer();
+    testTicks();
+
+    printf("EmiTimerWheelTest: OK\n");
+    return 0;
+}